@@ -19,6 +19,7 @@
 #include "common.h"
 #include "observation.h"
 #include "constants.h"
+#include "linear_algebra.h"
 
 /** \addtogroup amb_kf
  * \{ */
@@ -38,8 +39,9 @@ typedef struct {
   /** The variance to use for the prediction update step (diffusion). */
   double amb_drift_var;
   /** The observation decorrelation matrix. Takes raw measurements and
-   * decorrelates them. */
-  double decor_mtx[MAX_OBS_DIM * MAX_OBS_DIM];
+   * decorrelates them. Upper unit triangular, packed by rows (see
+   * matrix_pack_upper()). */
+  double decor_mtx[MATRIX_PACKED_SIZE(MAX_OBS_DIM)];
   /** The observation matrix for decorrelated measurements. */
   double decor_obs_mtx[MAX_STATE_DIM * MAX_OBS_DIM];
   /** The diagonal of the decorrelated observation covariance (for cholesky it's
@@ -52,8 +54,9 @@ typedef struct {
   /** The current state estimate. */
   double state_mean[MAX_STATE_DIM];
   /** The upper unit triangular U matrix of the UDU decomposition of the
-   * covariance of the current state estimate. Stored dense. */
-  double state_cov_U[MAX_STATE_DIM * MAX_STATE_DIM];
+   * covariance of the current state estimate. Packed by rows (see
+   * matrix_pack_upper()). */
+  double state_cov_U[MATRIX_PACKED_SIZE(MAX_STATE_DIM)];
   /** The diagonal D matrix of the UDU decomposition of the covariance of the current
    * state estimate. Stored as a vector. */
   double state_cov_D[MAX_STATE_DIM];
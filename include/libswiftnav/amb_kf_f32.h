@@ -0,0 +1,61 @@
+/*
+ * Copyright (C) 2014 Swift Navigation Inc.
+ * Contact: Ian Horn <ian@swift-nav.com>
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#ifndef LIBSWIFTNAV_AMB_KF_F32_H
+#define LIBSWIFTNAV_AMB_KF_F32_H
+
+#include "common.h"
+#include "amb_kf.h"
+
+/** \addtogroup amb_kf
+ * \{ */
+
+/** Mixed precision version of `nkf_t`, see nkf_update_f32().
+ * The matrices are single precision. The ambiguities themselves, and what
+ * they are differenced against, are in the millions of cycles, where a float
+ * can't even resolve a cycle, so they stay double. */
+typedef struct {
+  /** The dimension of the state vector. */
+  u32 state_dim;
+  /** The dimension of the observation vector. */
+  u32 obs_dim;
+  /** The variance to use for the prediction update step (diffusion). */
+  float amb_drift_var;
+  /** The observation decorrelation matrix, packed by rows. */
+  float decor_mtx[MATRIX_PACKED_SIZE(MAX_OBS_DIM)];
+  /** The observation matrix for decorrelated measurements. */
+  float decor_obs_mtx[MAX_STATE_DIM * MAX_OBS_DIM];
+  /** The diagonal of the decorrelated observation covariance. */
+  float decor_obs_cov[MAX_OBS_DIM];
+  /** A basis for the left nullspace of the DD line of sight vectors.
+   * Applied to the raw carrier phases, so kept in double. */
+  double null_basis_Q[(MAX_STATE_DIM - 3) * MAX_OBS_DIM];
+  /** The current state estimate. */
+  double state_mean[MAX_STATE_DIM];
+  /** The U matrix of the UDU decomposition of the state covariance, packed by
+   * rows. */
+  float state_cov_U[MATRIX_PACKED_SIZE(MAX_STATE_DIM)];
+  /** The D matrix of the UDU decomposition of the state covariance. */
+  float state_cov_D[MAX_STATE_DIM];
+  /** A moving average of the log of the weighted sum of squares innovations. */
+  double l_sos_avg;
+} nkf_f32_t;
+
+/** \} */
+
+void nkf_matrices_to_f32(const nkf_t *kf, nkf_f32_t *kf_f32);
+void nkf_state_to_f32(const nkf_t *kf, nkf_f32_t *kf_f32);
+void nkf_to_f32(const nkf_t *kf, nkf_f32_t *kf_f32);
+void nkf_state_from_f32(const nkf_f32_t *kf_f32, nkf_t *kf);
+bool nkf_update_f32(nkf_f32_t *kf, const double *measurements);
+
+#endif /* LIBSWIFTNAV_AMB_KF_F32_H */
@@ -13,21 +13,34 @@
 #ifndef LIBSWIFTNAV_AMBIGUITY_TEST_H
 #define LIBSWIFTNAV_AMBIGUITY_TEST_H
 
-#include "memory_pool.h"
+#include "hypothesis_store.h"
+#include "lambda.h"
+#include "linear_algebra.h"
 #include "sats_management.h"
 
 #define MAX_HYPOTHESES 1000
-
-typedef struct {
-  s32 N[MAX_CHANNELS-1];
-  float ll;
-} hypothesis_t;
+/** Default for `ambiguity_test_t.inclusion_budget`. */
+#define DEFAULT_INCLUSION_BUDGET 10000
 
 typedef struct {
   u32 res_dim;
   u8 null_space_dim;
   double null_projector[(MAX_CHANNELS-4) * (MAX_CHANNELS-1)];
-  double half_res_cov_inv[(2*MAX_CHANNELS - 5) * (2*MAX_CHANNELS - 5)];
+  /** Half the inverse residual covariance, packed by rows
+   * (see matrix_pack_upper()). */
+  double half_res_cov_inv[MATRIX_PACKED_SIZE(2*MAX_CHANNELS - 5)];
+  /** Upper triangular R with R' R = P' half_res_cov_inv P, where P takes
+   * element `chol_perm[j]` of a residual to element j. Pivoted so that the
+   * leading rows carry the most weight, see get_quadratic_term_bounded().
+   * Packed by rows. */
+  double half_res_cov_inv_chol[MATRIX_PACKED_SIZE(2*MAX_CHANNELS - 5)];
+  u8 chol_perm[2*MAX_CHANNELS - 5];
+  /* What the matrices were last built from, see update_ambiguity_test(). */
+  u32 generation;  /**< Incremented by every init_residual_matrices(). */
+  u8 num_dds;
+  double DE_mtx[(MAX_CHANNELS-1) * 3];
+  double phase_var;  /**< Negative if not built by update_ambiguity_test(). */
+  double code_var;
 } residual_mtxs_t;
 
 typedef struct {
@@ -39,10 +52,18 @@ typedef struct {
 
 typedef struct {
   u8 num_dds;
-  memory_pool_t *pool;
+  hypothesis_store_t *pool;
   residual_mtxs_t res_mtxs;
+  /** Most candidate hypotheses a single ambiguity_sat_inclusion() may
+   * generate, i.e. new satellite search points times existing hypotheses
+   * expanded. Bounds the work inclusion adds to an epoch; callers may change
+   * it between epochs. */
+  u32 inclusion_budget;
+  u32 cache_generation;  /**< `res_mtxs.generation` of the pool cache. */
+  s32 cache_ref[MAX_CHANNELS-1];  /**< Reference hypothesis of the cache. */
   sats_management_t sats;
   unanimous_amb_check_t amb_check;
+  u32 amb_check_version;  /**< `pool->version` `amb_check` is valid for. */
 } ambiguity_test_t;
 
 typedef s64 z_t;
@@ -60,8 +81,9 @@ typedef struct {
   z_t *zimage;           /* Current point in V1 being tested. */
   u8 new_dim;            /* Dimension of new satellite space V2. */
   u8 old_dim;            /* Dimension of old satellite space. */
-  z_t *itr_lower_bounds;
+  z_t *itr_lower_bounds; /* Bounding box of the itr ellipsoid. */
   z_t *itr_upper_bounds;
+  lambda_enum_t *itr_search; /* Points of V2 inside the search ellipsoid. */
   z_t *box_lower_bounds;
   z_t *box_upper_bounds;
 } intersection_count_t; 
@@ -71,6 +93,14 @@ typedef struct {
   u8 ndxs_of_old_in_new[MAX_CHANNELS-1];
   u8 ndxs_of_added_in_new[MAX_CHANNELS-1];
   z_t *Z_new_inv;
+  /* Float solution prior over the old then added ambiguities, used to rank
+   * hypotheses when the pool fills up. prior_cov_inv is NULL if unknown. */
+  const double *prior_mean;
+  const double *prior_cov_inv;
+  /* Only hypotheses with a log likelihood above expand_min_ll, and the first
+   * *expand_num_at of those exactly at it, are expanded, see add_sats(). */
+  float expand_min_ll;
+  u32 *expand_num_at;
 } generate_hypothesis_state_t2;
 
 s8 get_single_hypothesis(ambiguity_test_t *amb_test, s32 *hyp_N);
@@ -81,7 +111,7 @@ void destroy_ambiguity_test(ambiguity_test_t *amb_test);
 s8 sats_match(const ambiguity_test_t *amb_test, const u8 num_sdiffs, const sdiff_t *sdiffs);
 u8 ambiguity_update_reference(ambiguity_test_t *amb_test, const u8 num_sdiffs, const sdiff_t *sdiffs, sdiff_t *sdiffs_with_ref_first);
 void update_ambiguity_test(double ref_ecef[3], double phase_var, double code_var,
-                           ambiguity_test_t *amb_test, u8 state_dim, sdiff_t *sdiffs,
+                           double de_tolerance, ambiguity_test_t *amb_test, u8 state_dim, sdiff_t *sdiffs,
                            u8 changed_sats);
 void update_unanimous_ambiguities(ambiguity_test_t *amb_test);
 u32 ambiguity_test_n_hypotheses(ambiguity_test_t *amb_test);
@@ -89,6 +119,7 @@ u8 ambiguity_test_pool_contains(ambiguity_test_t *amb_test, double *ambs);
 double ambiguity_test_pool_ll(ambiguity_test_t *amb_test, u8 num_ambs, double *ambs);
 double ambiguity_test_pool_prob(ambiguity_test_t *amb_test, u8 num_ambs, double *ambs);
 void ambiguity_test_MLE_ambs(ambiguity_test_t *amb_test, s32 *ambs);
+double ambiguity_test_MLE_ratio(ambiguity_test_t *amb_test);
 void test_ambiguities(ambiguity_test_t *amb_test, double *ambiguity_dd_measurements);
 u8 ambiguity_update_sats(ambiguity_test_t *amb_test, const u8 num_sdiffs,
                          const sdiff_t *sdiffs, const sats_management_t *float_sats,
@@ -99,10 +130,6 @@ u8 ambiguity_iar_can_solve(ambiguity_test_t *ambiguity_test);
 s8 make_ambiguity_dd_measurements_and_sdiffs(ambiguity_test_t *amb_test, u8 num_sdiffs, sdiff_t *sdiffs,
                                                double *ambiguity_dd_measurements, sdiff_t *amb_sdiffs);
 u8 ambiguity_sat_projection(ambiguity_test_t *amb_test, const u8 num_dds_in_intersection, const u8 *dd_intersection_ndxs);
-// TODO(dsk) delete
-u8 ambiguity_sat_inclusion_old(ambiguity_test_t *amb_test, u8 num_dds_in_intersection,
-                               sats_management_t *float_sats, double *float_mean,
-                               double *float_cov_U, double *float_cov_D);
 u8 ambiguity_sat_inclusion(ambiguity_test_t *amb_test, const u8 num_dds_in_intersection,
                             const sats_management_t *float_sats, const double *float_mean,
                             const double *float_cov_U, const double *float_cov_D);
@@ -111,25 +138,24 @@ z_t float_to_decor(const double *addible_float_cov,
                    u8 num_addible_dds,
                    u8 num_dds_to_add,
                    z_t *lower_bounds, z_t *upper_bounds,
-                   z_t *Z, z_t *Z_inv);
-// TODO(dsk) delete
-s8 determine_sats_addition(ambiguity_test_t *amb_test,
-                           double *float_N_cov, u8 num_float_dds, double *float_N_mean,
-                           z_t *lower_bounds, z_t *upper_bounds, u8 *num_dds_to_add,
-                           z_t *Z_inv);
-// TODO(dsk) delete
-void add_sats_old(ambiguity_test_t *amb_test,
-                  gnss_signal_t ref_sid,
-                  u32 num_added_dds, gnss_signal_t *added_sids,
-                  z_t *lower_bounds, z_t *upper_bounds,
-                  z_t *Z_inv);
+                   z_t *Z, z_t *Z_inv, lambda_enum_t *search);
 void init_residual_matrices(residual_mtxs_t *res_mtxs, u8 num_dds, double *DE_mtx, double *obs_cov);
+void init_residual_matrices_from_vars(residual_mtxs_t *res_mtxs, u8 num_dds,
+                                      double *DE_mtx, double phase_var,
+                                      double code_var);
 void assign_residual_covariance_inverse(u8 num_dds, double *obs_cov, double *q, double *r_cov_inv);
+void assign_residual_covariance_inverse_from_vars(u8 num_dds, double phase_var,
+                                                  double code_var,
+                                                  const double *q,
+                                                  double *r_cov_inv);
 void assign_r_vec(residual_mtxs_t *res_mtxs, u8 num_dds, double *dd_measurements, double *r_vec);
 void assign_r_mean(residual_mtxs_t *res_mtxs, u8 num_dds, double *hypothesis, double *r_mean);
 double get_quadratic_term(residual_mtxs_t *res_mtxs, u8 num_dds, double *hypothesis, double *r_vec);
+double get_quadratic_term_bounded(const residual_mtxs_t *res_mtxs, u8 num_dds,
+                                  const double *hypothesis,
+                                  const double *r_vec, double bound);
 
-void print_hyp(void *arg, element_t *elem);
+void print_hyp(u8 num_dds, const s32 *N, float ll);
 void print_intersection_state(intersection_count_t *x);
 
 
@@ -94,6 +94,18 @@
 /** The variance with which to add new sats to the Kalman Filter.
  * TODO deprecate in lieu of amb_init_var once we do some tuning. */
 #define DEFAULT_NEW_INT_VAR     1e25
+/** The default largest change in any element of the DE matrix for which the
+ * IAR hypothesis test keeps its residual matrices, and with them its cached
+ * likelihood terms, rather than rebuilding them. DE rows are differences of
+ * unit line of sight vectors, so matrices kept for a stale DE leak up to
+ * sqrt(3) * 3e-5 * |b| of a baseline b into the carrier phase residuals. That
+ * is under a tenth of the sqrt(DEFAULT_PHASE_VAR_TEST) carrier phase
+ * deviation for baselines up to about 40 m, shifting the log likelihood ratio
+ * of hypotheses a cycle apart by a few percent of their separation. Lines of
+ * sight turn by about 1e-4 per second, so the matrices are rebuilt every few
+ * tenths of a second. Use a smaller value, or zero to rebuild on any change,
+ * for long baselines. */
+#define DEFAULT_DE_TOLERANCE    3e-5
 
 /* \} */
 
@@ -32,6 +32,7 @@ typedef struct {
   double vel_init_var;
   double amb_init_var;
   double new_int_var;
+  double de_tolerance;
 } dgnss_settings_t;
 
 typedef struct {
@@ -39,6 +40,37 @@ typedef struct {
   ambiguities_t float_ambs;
 } ambiguity_state_t;
 
+/** Number of buffers backing the published DGNSS state snapshot.
+ * Each concurrently held reader reference pins one buffer; with fewer than
+ * DGNSS_SNAPSHOT_SLOTS - 1 readers holding snapshots the publisher is always
+ * able to publish a new epoch. */
+#define DGNSS_SNAPSHOT_SLOTS 4
+
+/** Read-only view of the float filter and IAR state at the end of an epoch.
+ * Published by dgnss_update() for monitoring / telemetry threads, see
+ * dgnss_snapshot_acquire(). */
+typedef struct {
+  /** Number of dgnss_update() epochs published so far. */
+  u32 epoch;
+  /** Number of sats in the float filter (including the reference). */
+  u8 kf_num_sats;
+  gnss_signal_t kf_sids[MAX_CHANNELS];
+  double kf_mean[MAX_STATE_DIM];
+  /** UDU factors of the float filter covariance, U packed by rows as in
+   * `nkf_t`. The reader reconstructs the covariance with
+   * dgnss_snapshot_kf_cov(). */
+  double kf_cov_U[MATRIX_PACKED_SIZE(MAX_STATE_DIM)];
+  double kf_cov_D[MAX_STATE_DIM];
+  /** Number of sats in the IAR hypothesis test (including the reference). */
+  u8 iar_num_sats;
+  gnss_signal_t iar_sids[MAX_CHANNELS];
+  u32 iar_num_hyps;
+  /** Maximum likelihood ambiguity vector, valid if iar_num_hyps > 0. */
+  s32 iar_mle_ambs[MAX_CHANNELS-1];
+  /** Ambiguities on which every hypothesis agrees. */
+  unanimous_amb_check_t iar_amb_check;
+} dgnss_snapshot_t;
+
 extern dgnss_settings_t dgnss_settings;
 
 void dgnss_set_settings(double phase_var_test, double code_var_test,
@@ -90,4 +122,9 @@ u8 get_amb_kf_sids(gnss_signal_t *sids);
 u8 get_amb_test_sids(gnss_signal_t *sids);
 u8 dgnss_iar_MLE_ambs(s32 *ambs);
 
+const dgnss_snapshot_t *dgnss_snapshot_acquire(void);
+void dgnss_snapshot_release(const dgnss_snapshot_t *snapshot);
+void dgnss_snapshot_read(dgnss_snapshot_t *snapshot);
+u8 dgnss_snapshot_kf_cov(const dgnss_snapshot_t *snapshot, double *cov);
+
 #endif /* LIBSWIFTNAV_DGNSS_MANAGEMENT_H */
@@ -0,0 +1,252 @@
+/*
+ * Copyright (C) 2015 Swift Navigation Inc.
+ * Contact: Ian Horn <ian@swift-nav.com>
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#ifndef LIBSWIFTNAV_HYPOTHESIS_STORE_H
+#define LIBSWIFTNAV_HYPOTHESIS_STORE_H
+
+#include <math.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "common.h"
+#include "constants.h"
+
+/** \addtogroup hypothesis_store
+ * \{ */
+
+/** Maximum length of a stored ambiguity vector. */
+#define HYPOTHESIS_STORE_MAX_DDS (MAX_CHANNELS - 1)
+
+/** Integer transform of the ambiguity vectors,
+ * `N'[i] = N[src[i]] - N[sub]`, where an index of -1 stands for zero.
+ * This covers reordering the ambiguities and changing which one they are
+ * differenced against, and is closed under composition. */
+typedef struct {
+  s8 src[HYPOTHESIS_STORE_MAX_DDS];
+  s8 sub;
+  /** Column bases and bounds of the store once the remap is applied. */
+  s32 base[HYPOTHESIS_STORE_MAX_DDS];
+  s32 lo[HYPOTHESIS_STORE_MAX_DDS];
+  s32 hi[HYPOTHESIS_STORE_MAX_DDS];
+} hypothesis_store_remap_t;
+
+/** Aggregates over the log likelihoods of a store, in the units of its `ll`
+ * column, i.e. without `ll_offset` applied. Kept by whoever last passed over
+ * the likelihoods, see hypothesis_store_stats(). */
+typedef struct {
+  u32 version;     /**< Store `version` they were gathered at. */
+  u32 mle;         /**< Index of the most likely hypothesis. */
+  float max_ll;    /**< Its log likelihood. */
+  float second_ll; /**< Next largest log likelihood, -INFINITY if none. */
+  double sum;      /**< Sum of `exp(ll[i] - max_ll)` over all hypotheses. */
+} hypothesis_store_stats_t;
+
+/** Set of integer ambiguity hypotheses, stored as columns.
+ * Hypothesis `i` is the ambiguity vector in row `i` of `N` together with its
+ * log likelihood `ll[i]`. Hypotheses are always packed at the front of the
+ * buffers so that loops over the set are linear scans of contiguous memory.
+ *
+ * The ambiguities of a pool are nearly always within a few cycles of each
+ * other, so each is stored as its difference from a per-column base in a
+ * signed integer of just `width` bytes. The store widens the encoding when
+ * a value doesn't fit, and starts again at one byte whenever it is emptied.
+ */
+typedef struct {
+  u32 max_hyps;  /**< Maximum number of hypotheses the buffers can hold. */
+  u32 num_hyps;  /**< Number of hypotheses currently stored. */
+  u8 num_dds;    /**< Length of the ambiguity vectors. */
+  /** Dense `num_hyps x num_dds` encoded ambiguity matrix, row-major, see
+   * hypothesis_store_get(). */
+  u8 *N;
+  u32 N_size;    /**< Size of the `N` buffer in bytes. */
+  u8 width;      /**< Bytes per stored ambiguity, 1, 2 or 4. */
+  /** Value each column is stored relative to, zero when `width` is 4. */
+  s32 base[HYPOTHESIS_STORE_MAX_DDS];
+  /** Bounds on the values in each column, valid if `num_hyps > 0`. They
+   * may be loose after hypotheses are removed. */
+  s32 lo[HYPOTHESIS_STORE_MAX_DDS];
+  s32 hi[HYPOTHESIS_STORE_MAX_DDS];
+  /** Log likelihoods, `max_hyps` long. */
+  float *ll;
+  /** Optional per-hypothesis cache, `max_hyps` long or NULL. Its meaning is
+   * up to the owner of the store; the store only keeps it aligned with the
+   * hypotheses through compaction and clears `cache_valid` whenever the
+   * ambiguity vectors are added to or rewritten. */
+  double *cache;
+  u8 cache_valid; /**< Non-zero if `cache` is up to date. */
+  /** Open addressing hash table over the ambiguity vectors. Each slot holds
+   * a hypothesis index plus one, or zero if empty. */
+  u32 *index;
+  u32 index_size; /**< Number of slots, a power of two > `max_hyps`. */
+  /** Log likelihood common to all hypotheses; the log likelihood of
+   * hypothesis `i` is `ll[i] - ll_offset`. Keeping the normalization here
+   * saves rewriting every `ll` each time it changes. */
+  double ll_offset;
+  /** Incremented whenever the set of hypotheses or their ambiguity vectors
+   * change, but not when only likelihoods do. */
+  u32 version;
+  /** Likelihood aggregates, current if `stats.version == version`. Code
+   * that writes `ll` directly must leave them stale or regather them. */
+  hypothesis_store_stats_t stats;
+  /** Non-zero if `remap` is still to be applied to every row, see
+   * hypothesis_store_remap(). */
+  u8 remap_pending;
+  hypothesis_store_remap_t remap;
+  /** Optional second set of `N`, `ll` and `cache` buffers of the same sizes,
+   * or NULL. With them hypothesis_store_product() builds its output on the
+   * side and leaves the store untouched if it fails. */
+  u8 *scratch_N;
+  float *scratch_ll;
+  double *scratch_cache;
+} hypothesis_store_t;
+
+/** Decode an encoded ambiguity vector.
+ *
+ * \param data    Encoded row, `num_dds * width` bytes.
+ * \param width   Bytes per element.
+ * \param base    Column bases.
+ * \param num_dds Length of the ambiguity vector.
+ * \param N       Output ambiguity vector.
+ */
+static inline void hypothesis_store_decode(const u8 *data, u8 width,
+                                           const s32 *base, u8 num_dds,
+                                           s32 *N)
+{
+  switch (width) {
+  case 1:
+    for (u8 k = 0; k < num_dds; k++) {
+      N[k] = base[k] + ((const s8 *)data)[k];
+    }
+    break;
+  case 2:
+    for (u8 k = 0; k < num_dds; k++) {
+      s16 d;
+      memcpy(&d, &data[k * sizeof(s16)], sizeof(s16));
+      N[k] = base[k] + d;
+    }
+    break;
+  default:
+    memcpy(N, data, num_dds * sizeof(s32));
+    break;
+  }
+}
+
+/** Get the ambiguity vector of hypothesis `i`.
+ * Any pending remap is not applied, see hypothesis_store_flush(). */
+static inline void hypothesis_store_get(const hypothesis_store_t *store,
+                                        u32 i, s32 *N)
+{
+  u32 row_size = store->num_dds * store->width;
+  hypothesis_store_decode(&store->N[i * row_size], store->width, store->base,
+                          store->num_dds, N);
+}
+
+/** Get the log likelihood of hypothesis `i`, including the offset. */
+static inline double hypothesis_store_ll(const hypothesis_store_t *store, u32 i)
+{
+  return store->ll[i] - store->ll_offset;
+}
+
+/** Get the number of hypotheses that fit in the store at its current
+ * encoding width. */
+static inline u32 hypothesis_store_capacity(const hypothesis_store_t *store)
+{
+  if (store->num_dds == 0) {
+    return store->max_hyps;
+  }
+  return MIN(store->max_hyps, store->N_size / (store->num_dds * store->width));
+}
+
+/** Copy hypothesis `src` over hypothesis `dst`, for use when compacting the
+ * store in place. Does not update the index, see hypothesis_store_truncate().
+ */
+static inline void hypothesis_store_move(hypothesis_store_t *store,
+                                         u32 dst, u32 src)
+{
+  u32 row_size = store->num_dds * store->width;
+  memcpy(&store->N[dst * row_size], &store->N[src * row_size], row_size);
+  store->ll[dst] = store->ll[src];
+  if (store->cache) {
+    store->cache[dst] = store->cache[src];
+  }
+}
+
+/** Start gathering likelihood aggregates, see hypothesis_store_stats_add().
+ */
+static inline void hypothesis_store_stats_reset(hypothesis_store_stats_t *stats)
+{
+  stats->mle = 0;
+  stats->max_ll = -INFINITY;
+  stats->second_ll = -INFINITY;
+  stats->sum = 0;
+}
+
+/** Fold the log likelihood of hypothesis `i` into the aggregates, for use
+ * by passes that already visit every likelihood. Once all have been added,
+ * hand them to hypothesis_store_stats_commit().
+ *
+ * \param stats Aggregates being gathered.
+ * \param i     Index of the hypothesis.
+ * \param ll    Its stored log likelihood, `ll[i]`.
+ */
+static inline void hypothesis_store_stats_add(hypothesis_store_stats_t *stats,
+                                              u32 i, float ll)
+{
+  if (ll > stats->max_ll) {
+    stats->sum = stats->sum * exp(stats->max_ll - ll) + 1;
+    stats->second_ll = stats->max_ll;
+    stats->max_ll = ll;
+    stats->mle = i;
+  } else {
+    stats->sum += exp(ll - stats->max_ll);
+    stats->second_ll = MAX(stats->second_ll, ll);
+  }
+}
+
+/** \} */
+
+void hypothesis_store_init(hypothesis_store_t *store, u32 max_hyps,
+                           void *N_buff, u32 N_size, float *ll_buff,
+                           double *cache_buff, u32 *index_buff,
+                           u32 index_size);
+void hypothesis_store_set_scratch(hypothesis_store_t *store, void *N_buff,
+                                  float *ll_buff, double *cache_buff);
+void hypothesis_store_clear(hypothesis_store_t *store, u8 num_dds);
+s32 hypothesis_store_add(hypothesis_store_t *store, const s32 *N, float ll);
+s32 hypothesis_store_find(hypothesis_store_t *store, const s32 *N);
+s8 hypothesis_store_set(hypothesis_store_t *store, u32 i, const s32 *N);
+void hypothesis_store_remap(hypothesis_store_t *store, const s8 *src, s8 sub);
+void hypothesis_store_remap_row(hypothesis_store_t *store, u32 i, s32 *N);
+void hypothesis_store_remap_applied(hypothesis_store_t *store);
+void hypothesis_store_flush(hypothesis_store_t *store);
+void hypothesis_store_reindex(hypothesis_store_t *store);
+u32 hypothesis_store_compact(hypothesis_store_t *store, const u8 *keep);
+void hypothesis_store_truncate(hypothesis_store_t *store, u32 num_hyps);
+void hypothesis_store_normalize(hypothesis_store_t *store);
+void hypothesis_store_stats_commit(hypothesis_store_t *store,
+                                   const hypothesis_store_stats_t *stats);
+const hypothesis_store_stats_t *hypothesis_store_stats(hypothesis_store_t *store);
+float hypothesis_store_most_likely_ll(const hypothesis_store_t *store,
+                                      u32 num_hyps, u32 *num_at);
+void hypothesis_store_keep_most_likely(hypothesis_store_t *store, u32 num_hyps);
+double hypothesis_store_top_prob(const hypothesis_store_t *store, u32 num_hyps);
+u32 hypothesis_store_project(hypothesis_store_t *store,
+                             u8 num_ndxs, const u8 *ndxs);
+s32 hypothesis_store_product(hypothesis_store_t *store, u8 new_num_dds,
+                             void *x0, size_t x_size, u32 max_xs,
+                             s8 (*init)(void *x, const s32 *N, float ll),
+                             s8 (*next)(void *x, u32 n),
+                             void (*prod)(void *x, u32 n, const s32 *N,
+                                          s32 *new_N),
+                             double (*score)(void *x, const s32 *new_N));
+
+#endif /* LIBSWIFTNAV_HYPOTHESIS_STORE_H */
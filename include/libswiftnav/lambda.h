@@ -15,9 +15,65 @@
 #define LIBSWIFTNAV_LAMBDA_H
 
 #include "common.h"
+#include "constants.h"
+
+/** Largest dimension of a problem solved with a lambda_workspace_t. */
+#define LAMBDA_MAX_DIM (MAX_CHANNELS - 1)
+/** Largest dimension of a lambda_enum_t search. */
+#define LAMBDA_ENUM_MAX_DIM LAMBDA_MAX_DIM
+
+/** Scratch space of the LAMBDA reduction and search, see
+ * lambda_solution_ws(). It holds nothing between calls, so a workspace per
+ * thread is all it takes to solve problems concurrently. Matrices are
+ * column-major with leading dimension n. */
+typedef struct {
+  double L[LAMBDA_MAX_DIM * LAMBDA_MAX_DIM]; /**< Qz = L'*diag(D)*L */
+  double D[LAMBDA_MAX_DIM];
+  double Z[LAMBDA_MAX_DIM * LAMBDA_MAX_DIM]; /**< Decorrelating transform. */
+  double zs[LAMBDA_MAX_DIM];                 /**< Decorrelated float mean. */
+  double A[LAMBDA_MAX_DIM * LAMBDA_MAX_DIM]; /**< Factorization scratch. */
+  /* Search state. */
+  double S[LAMBDA_MAX_DIM * LAMBDA_MAX_DIM];
+  double dist[LAMBDA_MAX_DIM];
+  double zb[LAMBDA_MAX_DIM];
+  double z[LAMBDA_MAX_DIM];
+  double step[LAMBDA_MAX_DIM];
+} lambda_workspace_t;
+
+/** State of an enumeration of the integer points inside a confidence
+ * ellipsoid of decorrelated ambiguities, see lambda_enum_init(). Matrices are
+ * column-major, as in the rest of lambda.c. */
+typedef struct {
+  int n;                   /**< Dimension. */
+  double chi2;             /**< Squared radius of the ellipsoid. */
+  double L[LAMBDA_ENUM_MAX_DIM * LAMBDA_ENUM_MAX_DIM]; /**< Qz = L'*diag(D)*L */
+  double D[LAMBDA_ENUM_MAX_DIM];
+  double zs[LAMBDA_ENUM_MAX_DIM];  /**< Centre, the decorrelated float mean. */
+  /* Search state, see lambda_enum_next(). */
+  int k;
+  int done;
+  double dist[LAMBDA_ENUM_MAX_DIM];
+  double zb[LAMBDA_ENUM_MAX_DIM];
+  double z[LAMBDA_ENUM_MAX_DIM];
+  double step[LAMBDA_ENUM_MAX_DIM];
+  double S[LAMBDA_ENUM_MAX_DIM * LAMBDA_ENUM_MAX_DIM];
+} lambda_enum_t;
 
 int lambda_reduction(int n, const double *Q, double *Z);
+int lambda_reduction_ws(lambda_workspace_t *ws, int n, const double *Q,
+                        double *Z);
+int lambda_enum_init(lambda_enum_t *e, int n, const double *a,
+                     const double *Q, double chi2, double *Z);
+void lambda_enum_reset(lambda_enum_t *e);
+int lambda_enum_next(lambda_enum_t *e, double *z);
+double lambda_enum_volume(const lambda_enum_t *e);
+double lambda_enum_bound(const lambda_enum_t *e);
 int lambda_solution(int n, int m, const double *a, const double *Q, double *F,
                     double *s);
+int lambda_solution_ws(lambda_workspace_t *ws, int n, int m, const double *a,
+                       const double *Q, double *F, double *s);
+int lambda_solution_batch(lambda_workspace_t *ws, int num, int n, int m,
+                          const double *a, const double *Q, double *F,
+                          double *s, int *info);
 
 #endif /* LIBSWIFTNAV_LAMBDA_H */
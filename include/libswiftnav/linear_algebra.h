@@ -34,6 +34,13 @@
     printf(">\n");                                 \
   }
 
+/** Number of elements of an `n` x `n` upper triangular or symmetric matrix
+ * packed by rows, see matrix_pack_upper(). */
+#define MATRIX_PACKED_SIZE(n) ((n) * ((n) + 1) / 2)
+/** Index of element (`i`, `j`), `i <= j`, of an `n` x `n` matrix packed by
+ * rows. */
+#define MATRIX_PACKED_NDX(n, i, j) ((i) * (2 * (n) - (i) - 1) / 2 + (j))
+
 void dmtx_printf(double *mtx, u32 m, u32 n);
 void dmtx_printi(s32 *mtx, u32 m, u32 n);
 void submatrix(u32 new_rows, u32 new_cols, u32 old_cols, const double *old,
@@ -58,6 +65,16 @@ void matrix_triu(u32 n, double *M);
 void matrix_eye(u32 n, double *M);
 void matrix_udu(u32 n, double *M, double *U, double *D);
 void matrix_reconstruct_udu(const u32 n, const double *U, const double *D, double *M);
+void matrix_pack_upper(u32 n, const double *M, double *P);
+void matrix_unpack_upper(u32 n, const double *P, double *M);
+void matrix_eye_packed(u32 n, double *P);
+void matrix_udu_packed(u32 n, double *M, double *U, double *D);
+void matrix_reconstruct_udu_packed(const u32 n, const double *U,
+                                   const double *D, double *M);
+void matrix_udu_rank_one_packed(u32 n, double *U, double *D, double c,
+                                double *a);
+void matrix_mwgs_udu_packed(u32 n, u32 m, double *W, const double *D_W,
+                            double *U, double *D);
 void matrix_add_sc(u32 n, u32 m, const double *a,
                    const double *b, double gamma, double *c);
 void matrix_transpose(u32 n, u32 m, const double *a, double *b);
@@ -18,33 +18,40 @@
 #include "common.h"
 
 /* Type for elements of the memory pool, unfortunately typedef doesn't enforce
- * type safety and an opaque struct definition wouldn't be compatible with the
- * flexible member array in node_t. */
+ * type safety and an opaque struct definition wouldn't be compatible with
+ * pointer arithmetic over the elements. */
 typedef u8 element_t;
 
 typedef struct _memory_pool memory_pool_t;
 
-struct node;
-
-typedef struct {
-  struct node *next;
-} memory_pool_node_hdr_t;
-
-typedef struct node {
-  memory_pool_node_hdr_t hdr;
-  /* C99 "flexible member array" (see C99 std. ch. 6.7.2.1),
-   * Allows us to get a pointer to the top of the unknown size element. */
-  element_t elem[];
-} node_t;
-
 struct _memory_pool {
   u32 n_elements;
   size_t element_size;
-  node_t *pool;
-  node_t *free_nodes_head;
-  node_t *allocated_nodes_head;
+  /** Buffer of `n_elements` contiguous elements. */
+  element_t *pool;
+  /** The allocated elements are the last `n_allocated` of the buffer, in
+   * collection order. */
+  u32 n_allocated;
 };
 
+/** Runs the tasks of a parallel memory pool operation, for example on a thread
+ * pool. Must call `task(task_arg, i)` exactly once for each `i` in
+ * `[0, n_tasks)`, in any order and on any threads, and only return once all
+ * have completed. */
+typedef struct {
+  void (*run)(void *arg, u32 n_tasks,
+              void (*task)(void *task_arg, u32 i), void *task_arg);
+  void *arg;
+} memory_pool_executor_t;
+
+/** Continuation state of a resumable memory pool operation, see
+ * memory_pool_cursor_init(). */
+typedef struct {
+  /** Number of elements not yet visited. */
+  u32 n_remaining;
+  /** Number of elements kept so far by memory_pool_filter_resume(). */
+  u32 n_kept;
+} memory_pool_cursor_t;
 
 memory_pool_t *memory_pool_new(u32 n_elements, size_t element_size);
 s8 memory_pool_init(memory_pool_t *new_pool, u32 n_elements,
@@ -72,17 +79,153 @@ float memory_pool_ffold(memory_pool_t *pool, float x0,
 s32 memory_pool_ifold(memory_pool_t *pool, s32 x0,
                       s32 (*f)(s32 x, element_t *elem));
 
+void memory_pool_cursor_init(memory_pool_t *pool, memory_pool_cursor_t *cursor);
+s32 memory_pool_map_resume(memory_pool_t *pool, memory_pool_cursor_t *cursor,
+                           u32 max_elems, void *arg,
+                           void (*f)(void *arg, element_t *elem));
+s32 memory_pool_fold_resume(memory_pool_t *pool, memory_pool_cursor_t *cursor,
+                            u32 max_elems, void *x,
+                            void (*f)(void *x, element_t *elem));
+s32 memory_pool_filter_resume(memory_pool_t *pool, memory_pool_cursor_t *cursor,
+                              u32 max_elems, void *arg,
+                              s8 (*f)(void *arg, element_t *elem));
+
 void memory_pool_sort(memory_pool_t *pool, void *arg,
                       s32 (*cmp)(void *arg, element_t *a, element_t *b));
 void memory_pool_group_by(memory_pool_t *pool, void *arg,
                           s32 (*cmp)(void *arg, element_t *a, element_t *b),
                           void *x0, size_t x_size,
                           void (*agg)(element_t *new, void *x, u32 n, element_t *elem));
+size_t memory_pool_group_by_hash_scratch_size(u32 n, size_t x_size);
+s32 memory_pool_group_by_hash(memory_pool_t *pool, void *arg,
+                              u32 (*hash)(void *arg, element_t *elem),
+                              s32 (*cmp)(void *arg, element_t *a, element_t *b),
+                              void *x0, size_t x_size,
+                              void (*agg)(element_t *new, void *x, u32 n, element_t *elem),
+                              void *scratch, size_t scratch_size);
 s32 memory_pool_product(memory_pool_t *pool, void *xs, u32 max_xs, size_t x_size,
                         void (*prod)(element_t *new, void *x, u32 n_xs, u32 n, element_t *elem));
 s32 memory_pool_product_generator(memory_pool_t *pool, void *x0, u32 n_xs, size_t x_size,
                                   s8 (*init)(void *x, element_t *elem),
                                   s8 (*next)(void *x, u32 n),
                                   void (*prod)(element_t *new, void *x, u32 n, element_t *elem));
+
+void memory_pool_run_serial(void *arg, u32 n_tasks,
+                            void (*task)(void *task_arg, u32 i),
+                            void *task_arg);
+s32 memory_pool_map_parallel(memory_pool_t *pool,
+                             const memory_pool_executor_t *exec, void *arg,
+                             void (*f)(void *arg, element_t *elem));
+s32 memory_pool_fold_parallel(memory_pool_t *pool,
+                              const memory_pool_executor_t *exec,
+                              void *x0, size_t x_size,
+                              void (*f)(void *x, element_t *elem),
+                              void (*combine)(void *x, const void *y));
+s32 memory_pool_filter_parallel(memory_pool_t *pool,
+                                const memory_pool_executor_t *exec, void *arg,
+                                s8 (*f)(void *arg, element_t *elem));
+s32 memory_pool_product_generator_parallel(memory_pool_t *pool,
+                                           const memory_pool_executor_t *exec,
+                                           void *x0, u32 max_xs, size_t x_size,
+                                           s8 (*init)(void *x, element_t *elem),
+                                           s8 (*next)(void *x, u32 n),
+                                           void (*prod)(element_t *new, void *x, u32 n, element_t *elem));
+
+/** First element of a collection, the collection being the contiguous
+ * elements up to memory_pool_end(). */
+static inline element_t *memory_pool_begin(memory_pool_t *pool)
+{
+  return pool->pool + pool->element_size * (pool->n_elements - pool->n_allocated);
+}
+
+/** One past the last element of a collection. */
+static inline element_t *memory_pool_end(memory_pool_t *pool)
+{
+  return pool->pool + pool->element_size * pool->n_elements;
+}
+
+/** Loop over the elements of a collection of `type` elements, in collection
+ * order, with `elem` pointing to each in turn. The loop body is compiled
+ * in place, so unlike memory_pool_map() or memory_pool_fold() there is no
+ * call per element and the body can be vectorized, e.g.
+ *
+ * ~~~
+ * double sum = 0;
+ * MEMORY_POOL_FOR_EACH(hyp_t, hyp, pool) {
+ *   sum += hyp->p;
+ * }
+ * ~~~
+ *
+ * The pool's element size must be `sizeof(type)`, see MEMORY_POOL_DEFINE().
+ */
+#define MEMORY_POOL_FOR_EACH(type, elem, pool)                        \
+  for (type *elem = (type *)memory_pool_begin(pool),                  \
+            *elem##_end_ = (type *)memory_pool_end(pool);             \
+       elem < elem##_end_; elem++)
+
+/** Filter a collection of `type` elements, as memory_pool_filter(), keeping
+ * the elements for which the expression following `pool` is true. The
+ * expression is compiled in place with `elem` pointing to the element, e.g.
+ *
+ * ~~~
+ * MEMORY_POOL_FILTER(hyp_t, hyp, pool, hyp->p > threshold);
+ * ~~~
+ *
+ * The kept elements are compacted towards the end of the collection, so the
+ * expression is evaluated on the elements in reverse collection order.
+ * The pool's element size must be `sizeof(type)`, see MEMORY_POOL_DEFINE().
+ */
+#define MEMORY_POOL_FILTER(type, elem, pool, ...)                     \
+  do {                                                                \
+    type *elem##_first_ = (type *)memory_pool_begin(pool);            \
+    type *elem##_end_ = (type *)memory_pool_end(pool);                \
+    type *elem##_dst_ = elem##_end_;                                  \
+    for (type *elem = elem##_end_; elem != elem##_first_;) {          \
+      elem--;                                                         \
+      if (__VA_ARGS__) {                                              \
+        elem##_dst_--;                                                \
+        if (elem##_dst_ != elem)                                      \
+          *elem##_dst_ = *elem;                                       \
+      }                                                               \
+    }                                                                 \
+    (pool)->n_allocated = elem##_end_ - elem##_dst_;                  \
+  } while (0)
+
+/** Define inlineable functions for memory pools of `type` elements, prefixed
+ * with `name`:
+ *
+ * - `name_init()`, as memory_pool_init() with an element size of
+ *   `sizeof(type)`.
+ * - `name_add()`, as memory_pool_add().
+ * - `name_begin()` and `name_end()`, bounding the collection as an array of
+ *   `type`.
+ *
+ * Together with MEMORY_POOL_FOR_EACH() and MEMORY_POOL_FILTER() these let hot
+ * loops over a pool compile to plain array loops, while the pool can still be
+ * used with all the generic memory pool functions.
+ */
+#define MEMORY_POOL_DEFINE(name, type)                                \
+static inline s8 name##_init(memory_pool_t *pool, u32 n_elements,     \
+                             type *buff)                              \
+{                                                                     \
+  return memory_pool_init(pool, n_elements, sizeof(type), buff);      \
+}                                                                     \
+static inline type *name##_begin(memory_pool_t *pool)                 \
+{                                                                     \
+  return (type *)memory_pool_begin(pool);                             \
+}                                                                     \
+static inline type *name##_end(memory_pool_t *pool)                   \
+{                                                                     \
+  return (type *)memory_pool_end(pool);                               \
+}                                                                     \
+static inline type *name##_add(memory_pool_t *pool)                   \
+{                                                                     \
+  if (pool->n_allocated == pool->n_elements) {                        \
+    return NULL;                                                      \
+  }                                                                   \
+  pool->n_allocated++;                                                \
+  return name##_begin(pool);                                          \
+}
+
 #endif /* LIBSWIFTNAV_MEMORY_POOL_H */
 
@@ -18,6 +18,7 @@ from linear_algebra import *
 from gpstime_c cimport *
 from observation_c cimport *
 from dgnss_management_c cimport *
+from linear_algebra_c cimport *
 
 
 def filter_update(KalmanFilter kf, obs):
@@ -33,7 +34,7 @@ def filter_update(KalmanFilter kf, obs):
   amb_kf_c.nkf_update(&(kf.kf), <double *> &obs_[0])
 
   memcpy(&state_mean_[0], kf.kf.state_mean, kf.state_dim * sizeof(double))
-  memcpy(&state_cov_U_[0,0], kf.kf.state_cov_U, kf.state_dim * kf.state_dim * sizeof(double))
+  matrix_unpack_upper(kf.state_dim, kf.kf.state_cov_U, &state_cov_U_[0,0])
   memcpy(&state_cov_D_[0], kf.kf.state_cov_D, kf.state_dim * sizeof(double))
 
   return state_mean_, UDU_decomposition(state_cov_U_, state_cov_D_)
@@ -141,14 +142,14 @@ cdef class KalmanFilter:
     def __get__(self):
       print 11
       cdef np.ndarray[np.double_t, ndim=2, mode="c"] decor_mtx = \
-        np.empty((self.obs_dim/2, self.obs_dim/2), dtype=np.double)
+        np.empty((self.obs_dim, self.obs_dim), dtype=np.double)
       print 12
-      memcpy(&decor_mtx[0,0], self.kf.decor_mtx, self.obs_dim * self.obs_dim * sizeof(double) / 4)
+      matrix_unpack_upper(self.obs_dim, self.kf.decor_mtx, &decor_mtx[0,0])
       print 13
       return decor_mtx
     def __set__(self, np.ndarray[np.double_t, ndim=2, mode="c"] decor_mtx):
       print 14
-      memcpy(self.kf.decor_mtx, &decor_mtx[0,0], self.obs_dim * self.obs_dim * sizeof(double) / 4)
+      matrix_pack_upper(self.obs_dim, &decor_mtx[0,0], self.kf.decor_mtx)
       print 15
 
   property decor_obs_mtx:
@@ -205,11 +206,11 @@ cdef class KalmanFilter:
       cdef np.ndarray[np.double_t, ndim=2, mode="c"] state_cov_U = \
         np.empty((self.state_dim, self.state_dim), dtype=np.double)
       print 29
-      memcpy(&state_cov_U[0,0], self.kf.state_cov_U, self.state_dim * self.state_dim * sizeof(double))
+      matrix_unpack_upper(self.state_dim, self.kf.state_cov_U, &state_cov_U[0,0])
       print 30
       return state_cov_U
     def __set__(self, np.ndarray[np.double_t, ndim=2, mode="c"] state_cov_U):
-      memcpy(self.kf.state_cov_U, &state_cov_U[0,0], self.state_dim * self.state_dim * sizeof(double))
+      matrix_pack_upper(self.state_dim, &state_cov_U[0,0], self.kf.state_cov_U)
 
   property state_cov_D:
     def __get__(self):
@@ -8,23 +8,24 @@
 # WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
 
 cimport ambiguity_test_c
-cimport memory_pool_c
+cimport hypothesis_store_c
+from constants_c cimport MAX_CHANNELS
 import numpy as np
 cimport numpy as np
 from common cimport *
 
-cdef hypothesis_to_tuple(u8 num_dds, ambiguity_test_c.hypothesis_t *h):
-  ambs = [ h.N[i] for i in range(num_dds) ]
-  return (h.ll, ambs)
+cdef hypothesis_to_tuple(hypothesis_store_c.hypothesis_store_t *pool, u32 n):
+  cdef s32 N[MAX_CHANNELS-1]
+  hypothesis_store_c.hypothesis_store_get(pool, n, N)
+  ambs = [ N[i] for i in range(pool.num_dds) ]
+  return (hypothesis_store_c.hypothesis_store_ll(pool, n), ambs)
 
 cdef class AmbiguityTest:
 
   def __iter__(self):
-    cdef memory_pool_c.node_t *currp = self.test.pool.allocated_nodes_head
-    while currp is not NULL:
-      yield hypothesis_to_tuple(self.test.sats.num_sats - 1,
-              <ambiguity_test_c.hypothesis_t *>currp.elem)
-      currp = currp.hdr.next
+    hypothesis_store_c.hypothesis_store_flush(self.test.pool)
+    for n in range(self.test.pool.num_hyps):
+      yield hypothesis_to_tuple(self.test.pool, n)
 
 
 def get_phase_obs_null_basis(DE):
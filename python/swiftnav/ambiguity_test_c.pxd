@@ -9,16 +9,12 @@
 
 
 from common cimport *
-cimport memory_pool_c
+cimport hypothesis_store_c
 cimport sats_management_c
 from constants_c cimport MAX_CHANNELS
 
 cdef extern from "libswiftnav/ambiguity_test.h":
 
-  ctypedef struct hypothesis_t:
-    s32 N[MAX_CHANNELS-1]
-    float ll
-
   ctypedef struct residual_mtxs_t:
     u32 res_dim
     u8 null_space_dim
@@ -27,7 +23,7 @@ cdef extern from "libswiftnav/ambiguity_test.h":
 
   ctypedef struct ambiguity_test_t:
     u8 num_dds
-    memory_pool_c.memory_pool_t *pool
+    hypothesis_store_c.hypothesis_store_t *pool
     sats_management_c.sats_management_t sats
     residual_mtxs_t res_mtxs
 
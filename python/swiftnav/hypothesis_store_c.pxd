@@ -0,0 +1,31 @@
+# Copyright (C) 2015 Swift Navigation Inc.
+#
+# This source is subject to the license found in the file 'LICENSE' which must
+# be be distributed together with this source. All other rights reserved.
+#
+# THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+# EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+# WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+
+from common cimport *
+
+cdef extern from "libswiftnav/hypothesis_store.h":
+
+  ctypedef struct hypothesis_store_t:
+    u32 max_hyps
+    u32 num_hyps
+    u8 num_dds
+    u8 *N
+    u32 N_size
+    u8 width
+    float *ll
+    double *cache
+    u8 cache_valid
+    u32 *index
+    u32 index_size
+    double ll_offset
+    u32 version
+
+  void hypothesis_store_get(const hypothesis_store_t *store, u32 i, s32 *N)
+  double hypothesis_store_ll(const hypothesis_store_t *store, u32 i)
+  void hypothesis_store_flush(hypothesis_store_t *store)
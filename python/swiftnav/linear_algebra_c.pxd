@@ -14,4 +14,6 @@ cdef extern from "libswiftnav/linear_algebra.h":
   void matrix_eye(u32 n, double *M)
   void matrix_udu(u32 n, double *M, double *U, double *D)
   void matrix_reconstruct_udu(u32 n, double *U, double *D, double *M)
+  void matrix_pack_upper(u32 n, const double *M, double *P)
+  void matrix_unpack_upper(u32 n, const double *P, double *M)
 
@@ -13,13 +13,8 @@ cdef extern from "libswiftnav/memory_pool.h":
 
   ctypedef u8 element_t
 
-  ctypedef struct memory_pool_node_hdr_t:
-    node_t *next
-
-  ctypedef struct node_t:
-    memory_pool_node_hdr_t hdr
-    element_t elem[0]
-
   ctypedef struct memory_pool_t:
-    node_t *allocated_nodes_head
-
+    u32 n_elements
+    size_t element_size
+    element_t *pool
+    u32 n_allocated
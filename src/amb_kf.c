@@ -40,6 +40,58 @@
  * Preliminary integer ambiguity estimation with a Kalman Filter.
  * \{ */
 
+/* Index of the first nonzero element of `h`, or `n` if there is none.
+ * The lower rows of the decorrelated observation matrix are upper unit
+ * triangular, so most rows start with a run of zeros which the measurement
+ * update can skip. */
+static u32 first_nonzero(u32 n, const double *h)
+{
+  u32 first = 0;
+  while (first < n && h[first] == 0) {
+    first++;
+  }
+  return first;
+}
+
+/* As compute_innovation_terms(), for h zero before index `first`. Then f and
+ * g are too, and only their elements from `first` on are written. */
+static double innovation_terms_from(u32 state_dim, u32 first, const double *h,
+                                    double R, const double *U,
+                                    const double *D, double *f, double *g)
+{
+  /*  f = U^T * h, accumulated along the packed rows of U. */
+  memcpy(&f[first], &h[first], (state_dim - first) * sizeof(double));
+  for (u32 i=first; i<state_dim; i++) {
+    if (h[i] == 0) {
+      continue;
+    }
+    const double *U_i = &U[MATRIX_PACKED_NDX(state_dim, i, i)];
+    for (u32 j=i+1; j<state_dim; j++) {
+      f[j] += h[i] * U_i[j - i];
+    }
+  }
+
+  /*  g = diag(D) * f.
+      alpha = f * g + R = f^T * diag(D) * f + R. */
+  double alpha = R;
+  for (u32 j=first; j<state_dim; j++) {
+    g[j] = D[j] * f[j];
+    alpha += f[j] * g[j];
+  }
+  return alpha;
+}
+
+/* h * x, for h zero before index `first`. */
+static double predict_obs_from(u32 state_dim, u32 first, const double *h,
+                               const double *x)
+{
+  double predicted_obs = 0;
+  for (u32 j=first; j<state_dim; j++) {
+    predicted_obs += h[j] * x[j];
+  }
+  return predicted_obs;
+}
+
 /** Calculation of vectors needed for the innovation scaling.
  * We compute two vectors needed to make the Bierman update,
  * as well as the variance of the innovation.
@@ -47,7 +99,7 @@
  * \param state_dim The dimension of the KF state.
  * \param h         A row of the observation matrix.
  * \param R         The variance of the observation.
- * \param U         KF state covariance U (not packed form)
+ * \param U         KF state covariance U (packed by rows)
  * \param D         KF state covariance D (stored as a vector)
  * \param f         U^T * h.
  * \param g         diag(D) * f.
@@ -57,43 +109,19 @@ double compute_innovation_terms(u32 state_dim, const double *h,
                                 double R, const double *U,
                                 const double *D, double *f, double *g)
 {
-  memcpy(f, h, state_dim * sizeof(double));
-  /*  f = U^T * h. */
-  cblas_dtrmv(CblasRowMajor, CblasUpper, CblasTrans, CblasUnit,
-              /* ^ CBLAS_ORDER, CBLAS_UPLO, CBLAS_TRANSPOSE transA, CBLAS_DIAG. */
-              state_dim, U,     /* int N, double *A. */
-              state_dim, f, 1); /*  int lda, double *X, int incX. */
-
-
-  /*  g = diag(D) * f.
-      alpha = f * g + R = f^T * diag(D) * f + R. */
-  double alpha = R;
-  for (u32 i=0; i<state_dim; i++) {
-    g[i] = D[i] * f[i];
-    alpha += f[i] * g[i];
-  }
-  return alpha;
+  u32 first = first_nonzero(state_dim, h);
+  memset(f, 0, first * sizeof(double));
+  memset(g, 0, first * sizeof(double));
+  return innovation_terms_from(state_dim, first, h, R, U, D, f, g);
 }
 
-
-/** In place updating of the state cov and k vec using a scalar observation
- * This is from section 10.2.1 of Gibbs [1], with some extra logic for handling
- * singular matrices, dictating that zeros from cov_D dominate in a particular
- * potential 0 / 0.
- * We also make it more robust, by multiplying k by k_scalar <=  1.
- *
- * \param kf        The KF to update
- * \param R         The measurement variance
- * \param f         U^T * h
- * \param g         diag(D) * f
- * \param alpha     The innovation variance
- * \param k_scalar  A scalar to multiply the Kalman gain by (softens outliers).
- *                  Must be between 0 and 1 inclusive.
- * \param innov     The difference between the actual and predicted observation
- */
-void update_kf_state(nkf_t *kf, double R, const double *f, const double *g,
-                     double alpha, double k_scalar,
-                     double innov)
+/* As update_kf_state(), for f and g zero before index `first`. Then the
+ * columns of U and D before `first` are unchanged, as k is still zero when
+ * they're reached, so the update starts at column `first`. */
+static void update_kf_state_from(nkf_t *kf, u32 first, double R,
+                                 const double *f, const double *g,
+                                 double alpha, double k_scalar,
+                                 double innov)
 {
   DEBUG_ENTRY();
   if (kf->state_dim == 0) {
@@ -111,69 +139,50 @@ void update_kf_state(nkf_t *kf, double R, const double *f, const double *g,
   double *D = kf->state_cov_D;
   double k[state_dim];
 
-  double U_bar[state_dim * state_dim];
-  double D_bar[state_dim];
-
-  memset(U_bar, 0, state_dim * state_dim * sizeof(double));
-  memset(D_bar, 0,             state_dim * sizeof(double));
-  memset(k,     0,             state_dim * sizeof(double));
+  memset(k, 0, state_dim * sizeof(double));
 
   /* K is inversely proportional to alpha, so we scale alpha to scale K.
    * Solving for an R that would give the properly scaled alpha and thus the
    * correct K, we get the following: */
   R += alpha * (1 - k_scalar) / k_scalar;
-  double gamma = R  + g[0] * f[0];
-  if (D[0] == 0 || R == 0) {
-    /*  This is just an expansion of the other branch with the proper
-     *  0 `div` 0 definitions. */
-    D_bar[0] = 0;
-  }
-  else {
-    D_bar[0] = D[0] * R / gamma;
+  if (R == 0) {
+    /* The 0 `div` 0 definitions below zero D from the first column on. */
+    first = 0;
   }
-  k[0] = g[0];
-  U_bar[0] = 1;
-  if (DEBUG) {
-    printf("gamma[0] = %f\n", gamma);
-    printf("D_bar[0] = %f\n", D_bar[0]);
-    VEC_PRINTF(k, state_dim);
-    printf("U_bar[:,0] = {");
-    for (u32 i=0; i < state_dim; i++) {
-      printf("%f, ", U_bar[i*state_dim]);
-    }
-    printf("}\n");
-  }
-  for (u32 j=1; j<state_dim; j++) {
+
+  /* U and D are updated in place: column j of the new U only depends on
+   * column j of the old one, and k from the columns before it. */
+  double gamma = R;
+  for (u32 j=first; j<state_dim; j++) {
     double gamma_prev = gamma;
     gamma += g[j] * f[j];
     if (D[j] == 0 || gamma_prev == 0) {
       /* This is just an expansion of the other branch with the proper
        * 0 `div` 0 definitions. */
-      D_bar[j] = 0;
+      D[j] = 0;
     }
     else {
-      D_bar[j] = D[j] * gamma_prev / gamma;
+      D[j] = D[j] * gamma_prev / gamma;
     }
     double f_over_gamma = f[j] / gamma_prev;
     for (u32 i=0; i<=j; i++) {
-      if (k[i] == 0) {
-      /* This is just an expansion of the other branch with the proper
-       * 0 `div` 0 definitions. */
-        U_bar[i*state_dim + j] = U[i*state_dim + j];
-      }
-      else {
+      u32 ij = MATRIX_PACKED_NDX(state_dim, i, j);
+      double U_ij = U[ij];
+      /* If k[i] is zero, this is just an expansion of the other branch with
+       * the proper 0 `div` 0 definitions, and U[ij] is unchanged. */
+      if (k[i] != 0) {
         /*  U_bar[:,j] = U[:,j] - f[j]/gamma[j-1] * k. */
-        U_bar[i*state_dim + j] = U[i*state_dim + j] - f_over_gamma * k[i];
+        U[ij] = U_ij - f_over_gamma * k[i];
       }
-      k[i] += g[j] * U[i*state_dim + j]; /*  k = k + g[j] * U[:,j]. */
+      k[i] += g[j] * U_ij; /*  k = k + g[j] * U[:,j]. */
     }
     if (DEBUG) {
       printf("gamma[%"PRIu32"] = %f\n", j, gamma);
-      printf("D_bar[%"PRIu32"] = %f\n", j, D_bar[j]);
+      printf("D_bar[%"PRIu32"] = %f\n", j, D[j]);
       VEC_PRINTF(k, state_dim);
       printf("U_bar[:,%"PRIu32"] = {", j);
-      for (u32 i=0; i < state_dim; i++) {
-        printf("%f, ", U_bar[i*state_dim + j]);
+      for (u32 i=0; i <= j; i++) {
+        printf("%f, ", U[MATRIX_PACKED_NDX(state_dim, i, j)]);
       }
       printf("}\n");
     }
@@ -181,21 +190,41 @@ void update_kf_state(nkf_t *kf, double R, const double *f, const double *g,
   for (u32 i=0; i<state_dim; i++) {
     k[i] /= alpha;
   }
-  memcpy(U, U_bar, state_dim * state_dim * sizeof(double));
-  memcpy(D, D_bar,             state_dim * sizeof(double));
 
   /* Update the KF mean, scaled by some heuristic term for robustness */
   for (u32 j=0; j<kf->state_dim; j++) {
       kf->state_mean[j] += k[j] * k_scalar * innov;
   }
   if (DEBUG) {
-    MAT_PRINTF(U, state_dim, state_dim);
+    VEC_PRINTF(U, MATRIX_PACKED_SIZE(state_dim));
     VEC_PRINTF(D, state_dim);
   }
 
   DEBUG_EXIT();
 }
 
+/** In place updating of the state cov and k vec using a scalar observation
+ * This is from section 10.2.1 of Gibbs [1], with some extra logic for handling
+ * singular matrices, dictating that zeros from cov_D dominate in a particular
+ * potential 0 / 0.
+ * We also make it more robust, by multiplying k by k_scalar <=  1.
+ *
+ * \param kf        The KF to update
+ * \param R         The measurement variance
+ * \param f         U^T * h
+ * \param g         diag(D) * f
+ * \param alpha     The innovation variance
+ * \param k_scalar  A scalar to multiply the Kalman gain by (softens outliers).
+ *                  Must be between 0 and 1 inclusive.
+ * \param innov     The difference between the actual and predicted observation
+ */
+void update_kf_state(nkf_t *kf, double R, const double *f, const double *g,
+                     double alpha, double k_scalar,
+                     double innov)
+{
+  update_kf_state_from(kf, 0, R, f, g, alpha, k_scalar, innov);
+}
+
 /** Get the weighted sum of squared innovations.
  * It's a normalized error metric. High is bad.
  * More precisely, we square the difference between the predicted observations
@@ -220,28 +249,21 @@ double get_sos_innov(const nkf_t *kf, const double *decor_obs)
     return 0;
   }
 
-  double predicted_obs[kf->obs_dim];
-  matrix_multiply(kf->obs_dim, kf->state_dim, 1,
-                  kf->decor_obs_mtx, kf->state_mean, predicted_obs);
-  double hu[kf->obs_dim * kf->state_dim];
-  /* TODO use the fact that U is unit triangular to save a ton of time */
-  matrix_multiply(kf->obs_dim, kf->state_dim, kf->state_dim,
-                  kf->decor_obs_mtx, kf->state_cov_U, hu);
-  /* (H * U * D * U^T * H^T)_ii = (HU * D * HU^T)_ii
-   *                            = Sum_kl (HU_ik * D_kl * HU^T_li)
-   *                            = Sum_kl (HU_ik * D_kl * HU_il)
-   *                            = Sum_k (HU_ik * D_kk * HU_ik) */
+  /* (H * U * D * U^T * H^T)_ii + R_ii = f^T * D * f + R_ii, with
+   * f = U^T * h for row h of H, which is alpha of the Bierman update. */
+  u32 n = kf->state_dim;
+  double f[MAX_STATE_DIM];
+  double g[MAX_STATE_DIM];
   double sos = 0;
-  for (u8 i=0; i < kf->obs_dim; i++) {
-    double hph_r_ii = kf->decor_obs_cov[i];
-    for (u8 k=0; k < kf->state_dim; k++) {
-      hph_r_ii += hu[i * kf->state_dim + k] *
-                  hu[i * kf->state_dim + k] *
-                  kf->state_cov_D[k];
-    }
-    sos += (predicted_obs[i] - decor_obs[i]) *
-           (predicted_obs[i] - decor_obs[i]) /
-           hph_r_ii;
+  for (u32 i=0; i < kf->obs_dim; i++) {
+    const double *h = &kf->decor_obs_mtx[i * n];
+    u32 first = first_nonzero(n, h);
+    double hph_r_ii = innovation_terms_from(n, first, h, kf->decor_obs_cov[i],
+                                            kf->state_cov_U, kf->state_cov_D,
+                                            f, g);
+    double innov = decor_obs[i] - predict_obs_from(n, first, h,
+                                                   kf->state_mean);
+    sos += innov * innov / hph_r_ii;
   }
   return sos;
 }
@@ -290,6 +312,11 @@ bool outlier_check(nkf_t *kf, const double *decor_obs, double *k_scalar)
  * Changes are: -Scaling the kalman gain to deal with outliers.
  *              -Some minor tweaks to handle singular matrices.
  *
+ * The outlier check needs the innovations of all the observations against the
+ * prior state before the gain scale is known, so it is a pass of its own. Both
+ * it and the sequential updates skip the leading zeros of each row of the
+ * observation matrix, and U and D are updated in place.
+ *
  * \param kf        Kalman filter to be updated.
  * \param decor_obs Decorrelated observation vector to be incorporated.
  * \return          Whether we think the observations were bad. (true = bad).
@@ -301,25 +328,27 @@ static bool incorporate_obs(nkf_t *kf, double *decor_obs)
   double k_scalar;
   bool is_outlier = outlier_check(kf, decor_obs, &k_scalar);
 
+  u32 n = kf->state_dim;
   for (u32 i=0; i<kf->obs_dim; i++) {
-    double *h = &kf->decor_obs_mtx[kf->state_dim * i]; /* vector of length kf->state_dim. */
+    const double *h = &kf->decor_obs_mtx[n * i]; /* vector of length n. */
     double R = kf->decor_obs_cov[i]; /* scalar. */
+    /* Skip the leading zeros of h, and so of f and g. */
+    u32 first = first_nonzero(n, h);
 
-    double f[kf->state_dim];
-    double g[kf->state_dim];
+    double f[MAX_STATE_DIM];
+    double g[MAX_STATE_DIM];
+    memset(f, 0, first * sizeof(double));
+    memset(g, 0, first * sizeof(double));
 
-    double alpha = compute_innovation_terms(kf->state_dim, h, R,
-                                            kf->state_cov_U, kf->state_cov_D,
-                                            f, g);
-    double predicted_obs = 0;
-    /* TODO take advantage of sparsity of h. */
-    for (u32 j=0; j<kf->state_dim; j++) {
-      predicted_obs += h[j] * kf->state_mean[j];
-    }
-    double obs_minus_predicted_obs = decor_obs[i] - predicted_obs;
+    double alpha = innovation_terms_from(n, first, h, R,
+                                         kf->state_cov_U, kf->state_cov_D,
+                                         f, g);
+    double obs_minus_predicted_obs =
+      decor_obs[i] - predict_obs_from(n, first, h, kf->state_mean);
 
     /* updates kf state. */
-    update_kf_state(kf, R, f, g, alpha, k_scalar, obs_minus_predicted_obs);
+    update_kf_state_from(kf, first, R, f, g, alpha, k_scalar,
+                         obs_minus_predicted_obs);
   }
   DEBUG_EXIT();
   return is_outlier;
@@ -349,17 +378,21 @@ static void make_residual_measurements(const nkf_t *kf, const double *measuremen
  * This should be += (I + 1 * 1^T)*var instead of I*var, but it's
  * unlikely to be significant.
  *
+ * The variance is added to the UDU factors directly, as one rank one update
+ * per unit vector. The update for e_i only touches the first i columns of U.
+ *
  * \param kf The KF to be updated.
  */
 static void diffuse_state(nkf_t *kf)
 {
-  double cov[kf->state_dim * kf->state_dim];
-  matrix_reconstruct_udu(kf->state_dim, kf->state_cov_U, kf->state_cov_D, cov);
+  double e[MAX_STATE_DIM];
   for (u8 i=0; i< kf->state_dim; i++) {
+    memset(e, 0, kf->state_dim * sizeof(double));
+    e[i] = 1;
     /* TODO make this a tunable parameter defined at the right time. */
-    cov[i*kf->state_dim + i] += kf->amb_drift_var;
+    matrix_udu_rank_one_packed(kf->state_dim, kf->state_cov_U, kf->state_cov_D,
+                               kf->amb_drift_var, e);
   }
-  matrix_udu(kf->state_dim, cov, kf->state_cov_U, kf->state_cov_D);
 }
 
 /** In place updating of the KF state mean and covariance.
@@ -380,8 +413,8 @@ bool nkf_update(nkf_t *kf, const double *measurements)
   make_residual_measurements(kf, measurements, resid_measurements);
 
   /* Replaces residual measurements by their decorrelated version. */
-  cblas_dtrmv(CblasRowMajor, CblasUpper, CblasNoTrans, CblasUnit, /*  Order, Uplo, TransA, Diag. */
-              kf->obs_dim, kf->decor_mtx, kf->obs_dim, /*  N, A, lda. */
+  cblas_dtpmv(CblasRowMajor, CblasUpper, CblasNoTrans, CblasUnit, /*  Order, Uplo, TransA, Diag. */
+              kf->obs_dim, kf->decor_mtx, /*  N, Ap. */
               resid_measurements, 1); /*  X, incX. */
 
   /*  Prediction update */
@@ -390,7 +423,7 @@ bool nkf_update(nkf_t *kf, const double *measurements)
   bool is_bad_measurement = incorporate_obs(kf, resid_measurements);
 
   if (DEBUG) {
-    MAT_PRINTF(kf->state_cov_U, kf->state_dim, kf->state_dim);
+    VEC_PRINTF(kf->state_cov_U, MATRIX_PACKED_SIZE(kf->state_dim));
     VEC_PRINTF(kf->state_cov_D, kf->state_dim);
     VEC_PRINTF(kf->state_mean, kf->state_dim);
   }
@@ -410,7 +443,7 @@ static void initialize_state(nkf_t *kf, double *dd_measurements, double init_var
     /*  Sigma begins as a diagonal. */
     kf->state_cov_D[i] = init_var;
   }
-  matrix_eye(num_dds, kf->state_cov_U);
+  matrix_eye_packed(num_dds, kf->state_cov_U);
 }
 
 static void QR_part1(integer m, integer n, double *A, double *tau)
@@ -468,114 +501,36 @@ void assign_phase_obs_null_basis(u8 num_dds, double *DE_mtx, double *q)
   memcpy(q, &A[3*num_dds], CLAMP_DIFF(num_dds, 3) * num_dds * sizeof(double));
 }
 
-/* TODO this could be made more efficient, if it matters. */
-static void assign_dd_obs_cov(u8 num_dds, double phase_var, double code_var,
-                              double *dd_obs_cov)
+/* UDU' decomposition of alpha * I + beta * v * v^T, returning U^-1 rather
+ * than U. Factoring from the last row, each pivot leaves a Schur complement
+ * of the same form with a smaller beta, so that for i < k
+ *   U_ik = v_i * w_k,  w_k = beta_k * v_k / D_k,  D_k = alpha + beta_k * v_k^2
+ *   beta_(k-1) = alpha * beta_k / D_k
+ * and, with p_l = 1 - v_l * w_l, for i < j
+ *   (U^-1)_ij = -v_i * w_j * p_(i+1) * ... * p_(j-1).
+ * U_inv is written as a block of a matrix with row stride `ld`. */
+static void udu_inv_rank_one(u8 n, double alpha, double beta, const double *v,
+                             double *U_inv, u32 ld, double *D)
 {
-  for (u8 i = 0; i < num_dds; i++) {
-    for (u8 j = 0; j < num_dds; j++) {
-      if (i == j) {
-        dd_obs_cov[i*2*num_dds + j] = 2 * phase_var;
-        dd_obs_cov[(i+num_dds)*2*num_dds + num_dds + j] = 2 * code_var;
-      }
-      else {
-        dd_obs_cov[i*2*num_dds + j] = phase_var;
-        dd_obs_cov[(i+num_dds)*2*num_dds + num_dds + j] = code_var;
-      }
+  double w[MAX_CHANNELS-1];
+  for (s8 k = n-1; k >= 0; k--) {
+    D[k] = alpha + beta * v[k] * v[k];
+    w[k] = beta * v[k] / D[k];
+    beta = alpha * beta / D[k];
+  }
+  for (u8 j = 0; j < n; j++) {
+    for (u8 i = j+1; i < n; i++) {
+      U_inv[i*ld + j] = 0;
     }
-    memset(&dd_obs_cov[i*2*num_dds + num_dds], 0, num_dds * sizeof(double));
-    memset(&dd_obs_cov[(i+num_dds)*2*num_dds], 0, num_dds * sizeof(double));
-  }
-}
-
-/* TODO make this more efficient (e.g. via pages 3/6.2-3/2014 of ian's notebook). */
-static void assign_residual_obs_cov(u8 num_dds, double phase_var, double code_var,
-                                    double *q, double *r_cov)
-{
-  double dd_obs_cov[4 * num_dds * num_dds];
-  assign_dd_obs_cov(num_dds, phase_var, code_var, dd_obs_cov);
-  integer nullspace_dim = CLAMP_DIFF(num_dds, 3);
-  integer dd_dim = 2*num_dds;
-  integer res_dim = num_dds + nullspace_dim;
-  double q_tilde[res_dim * dd_dim];
-  memset(q_tilde, 0, res_dim * dd_dim * sizeof(double));
-
-  for (u8 i=0; i<nullspace_dim; i++) {
-    memcpy(&q_tilde[i*dd_dim], &q[i*num_dds], num_dds * sizeof(double));
-  }
-  for (u8 i=0; i<num_dds; i++) {
-    q_tilde[(i+nullspace_dim)*dd_dim + i] = 1;
-    q_tilde[(i+nullspace_dim)*dd_dim + i+num_dds] = 1 / GPS_L1_LAMBDA_NO_VAC;
-  }
-
-  /* TODO make more efficient via the structure of q_tilde, and its relation to
-   * the I + 1*1^T structure of the obs cov mtx. */
-  double QC[res_dim * dd_dim];
-  cblas_dsymm(CblasRowMajor, CblasRight, CblasUpper, /* CBLAS_ORDER, CBLAS_SIDE, CBLAS_UPLO. */
-              res_dim, dd_dim,                       /* int M, int N. */
-              1, dd_obs_cov, dd_dim,                 /* double alpha, double *A, int lda. */
-              q_tilde, dd_dim,                       /* double *B, int ldb. */
-              0, QC, dd_dim);                        /* double beta, double *C, int ldc. */
-
-  /* TODO make more efficient via the structure of q_tilde, and its relation to
-   * the I + 1*1^T structure of the obs cov mtx. */
-  cblas_dgemm(CblasRowMajor, CblasNoTrans, CblasTrans, /*  CBLAS_ORDER, CBLAS_TRANSPOSE transA, cBLAS_TRANSPOSE transB. */
-              res_dim, res_dim, dd_dim,                /* int M, int N, int K. */
-              1, QC, dd_dim,                           /* double alpha, double *A, int lda. */
-              q_tilde, dd_dim,                         /* double *B, int ldb. */
-              0, r_cov, res_dim);                      /* beta, double *C, int ldc. */
-}
-
-/*  In place inversion of U. */
-static void invert_U(u8 res_dim, double *U)
-{
-  char uplo = 'U'; /* upper triangular. */
-  char diag = 'U'; /* unit triangular. */
-  integer dim = res_dim;
-  integer lda = res_dim;
-  integer info;
-  dtrtri_(&uplo, &diag,
-          &dim, U, &lda, &info);
-}
-
-static void assign_simple_sig(u8 num_dds, double var, double *simple_cov)
-{
-  for (u8 i = 0; i < num_dds; i++) {
-    for (u8 j = 0; j < num_dds; j++) {
-      if (i == j) {
-        simple_cov[i*num_dds + j] = 2 * var;
-      }
-      else {
-        simple_cov[i*num_dds + j] = var;
-      }
+    U_inv[j*ld + j] = 1;
+    double p = 1;
+    for (s8 i = j-1; i >= 0; i--) {
+      U_inv[i*ld + j] = -v[i] * w[j] * p;
+      p *= 1 - v[i] * w[i];
     }
   }
 }
 
-/* From get_kf_matrices:
- * U^-1 * y == y'
- *           = U^-1 * H * x
- *          == H' * x
- *
- * H = ( Q )
- *     ( I )
- * where Q's rows form a basis for the left null space for DE
- */
-static void assign_H_prime(u8 res_dim, u8 constraint_dim, u8 num_dds,
-                           double *Q, double *U_inv, double *H_prime)
-{
-  /*  set the H_prime variable to equal H. */
-  memcpy(H_prime, Q, constraint_dim * num_dds * sizeof(double));
-  matrix_eye(num_dds, &H_prime[constraint_dim * num_dds]);
-
-  /*  multiply H_prime by U_inv to make it the actual H_prime. */
-  cblas_dtrmm(CblasRowMajor, CblasLeft, CblasUpper, CblasNoTrans, CblasUnit,
-              /* ^ CBLAS_ORDER, CBLAS_SIDE, CBLAS_UPLO, CBLAS_TRANSPOSE, CBLAS_DIAG. */
-              res_dim, num_dds,  /* M, N. */
-              1, U_inv, res_dim, /* alpha, A, lda. */
-              H_prime, num_dds); /* B, ldb. */
-}
-
 /* REQUIRES num_sdiffs > 0 */
 /* y = H * x
  * Var[y] = Sig = U * D * U^T
@@ -586,7 +541,7 @@ static void assign_H_prime(u8 res_dim, u8 constraint_dim, u8 num_dds,
  *
  * H = ( Q )
  *     ( I )
- * where Q's rows form a basis for the left null space for DE
+ * where Q's rows form an orthonormal basis for the left null space for DE
  *
  * Sig = Q~ * Sig_v * Q~^T
  *   where    Q~ = ( Q   0        )
@@ -595,7 +550,21 @@ static void assign_H_prime(u8 res_dim, u8 constraint_dim, u8 num_dds,
  *                 ( 0                 D*D^T * var_rho )
  *     and D*D^T = 1*1^T + I
  *
- * This function constructs D, U^-1, and H'
+ * Writing s = var_phi + var_rho / lambda^2, c = var_rho / lambda^2 and
+ * a = Q * 1, this is
+ *   Sig = ( var_phi * (I + a*a^T)   var_phi * (Q + a*1^T) )
+ *         ( ...                     s * (I + 1*1^T)       )
+ * The lower right block and the Schur complement of it,
+ * var_phi * c / s * (I + a*a^T), are both identity plus rank one, and
+ * Sig_12 * Sig_22^-1 = var_phi / s * Q. So with U_1, D_1 and U_2, D_2 from
+ * the two diagonal blocks
+ *   U^-1 = ( U_1^-1   -var_phi / s * U_1^-1 * Q )
+ *          ( 0         U_2^-1                   )
+ *   H'   = ( c / s * U_1^-1 * Q )
+ *          ( U_2^-1             )
+ * all without a dense factorization.
+ *
+ * This function constructs D, U^-1 (packed by rows), and H'
  */
 static void get_kf_matrices(u8 num_sdiffs, sdiff_t *sdiffs_with_ref_first,
                             double ref_ecef[3],
@@ -610,31 +579,52 @@ static void get_kf_matrices(u8 num_sdiffs, sdiff_t *sdiffs_with_ref_first,
   u8 constraint_dim = CLAMP_DIFF(num_dds, 3);
   u8 res_dim = num_dds + constraint_dim;
 
-  double Sig[res_dim * res_dim];
+  double c = code_var / (GPS_L1_LAMBDA_NO_VAC * GPS_L1_LAMBDA_NO_VAC);
+  double s = phase_var + c;
+
+  double U_inv_full[res_dim * res_dim];
+  memset(U_inv_full, 0, sizeof(U_inv_full));
+  double ones[MAX_CHANNELS-1];
+  for (u8 i = 0; i < num_dds; i++) {
+    ones[i] = 1;
+  }
+  u32 off = constraint_dim * res_dim + constraint_dim;
+  udu_inv_rank_one(num_dds, s, s, ones, &U_inv_full[off], res_dim,
+                   &D[constraint_dim]);
+  for (u8 i = 0; i < num_dds; i++) {
+    memcpy(&H_prime[(constraint_dim + i) * num_dds],
+           &U_inv_full[off + i*res_dim], num_dds * sizeof(double));
+  }
 
-  /* assign Sig and H. */
   if (constraint_dim > 0) {
     double DE[num_dds * 3];
     assign_de_mtx(num_sdiffs, sdiffs_with_ref_first, ref_ecef, DE);
     assign_phase_obs_null_basis(num_dds, DE, null_basis_Q);
-    assign_residual_obs_cov(num_dds, phase_var, code_var, null_basis_Q, Sig);
-    /* TODO U seems to have that fancy blockwise structure we love so much. Use it. */
-    matrix_udu(res_dim, Sig, U_inv, D); /* U_inv holds U after this. */
-    invert_U(res_dim, U_inv);
-    /* TODO this also has fancy structure. */
-    assign_H_prime(res_dim, constraint_dim, num_dds, null_basis_Q, U_inv, H_prime);
-  }
-  else {
-    assign_simple_sig(num_dds,
-                      phase_var + code_var / (GPS_L1_LAMBDA_NO_VAC * GPS_L1_LAMBDA_NO_VAC),
-                      Sig);
-    matrix_udu(res_dim, Sig, U_inv, D); /* U_inv holds U after this. */
-    invert_U(res_dim, U_inv);
 
-    /* H = I in this case, so H' = U^-1 * H = U^-1. */
-    memcpy(H_prime, U_inv, num_dds * num_dds * sizeof(double));
+    double a[MAX_CHANNELS-4];
+    for (u8 i = 0; i < constraint_dim; i++) {
+      a[i] = 0;
+      for (u8 j = 0; j < num_dds; j++) {
+        a[i] += null_basis_Q[i*num_dds + j];
+      }
+    }
+    double gamma = phase_var * c / s;
+    udu_inv_rank_one(constraint_dim, gamma, gamma, a, U_inv_full, res_dim, D);
+
+    for (u8 i = 0; i < constraint_dim; i++) {
+      for (u8 j = 0; j < num_dds; j++) {
+        /* U_1^-1 is unit upper triangular. */
+        double UQ = null_basis_Q[i*num_dds + j];
+        for (u8 k = i+1; k < constraint_dim; k++) {
+          UQ += U_inv_full[i*res_dim + k] * null_basis_Q[k*num_dds + j];
+        }
+        U_inv_full[i*res_dim + constraint_dim + j] = -phase_var / s * UQ;
+        H_prime[i*num_dds + j] = c / s * UQ;
+      }
+    }
   }
 
+  matrix_pack_upper(res_dim, U_inv_full, U_inv);
 }
 
 
@@ -783,10 +773,44 @@ void rebase_covariance_udu(double *state_cov_U, double *state_cov_D, u8 num_sats
   assert(num_sats > 1);
   u8 state_dim = num_sats - 1;
 
-  double state_cov[state_dim * state_dim];
-  matrix_reconstruct_udu(state_dim, state_cov_U, state_cov_D, state_cov);
-  rebase_covariance_sigma(state_cov, num_sats, old_sids, new_sids);
-  matrix_udu(state_dim, state_cov, state_cov_U, state_cov_D);
+  gnss_signal_t old_ref = old_sids[0];
+  gnss_signal_t new_ref = new_sids[0];
+
+  if (sid_is_equal(old_ref, new_ref)) {
+    /* Nothing needs to be done; same basis. */
+    return;
+  }
+
+  /* The rebase matrix T of assign_state_rebase_mtx() has rows e_k - e_r,
+   * where k and r are the old indices of the row's sat and of the new
+   * reference, except for the old reference's row, -e_r. So T * U is just
+   * differences of rows of U, and T * U * D * (T * U)^T is refactored from
+   * that without reconstructing the covariance. */
+  s32 r = find_index_of_signal(state_dim, new_ref, &old_sids[1]);
+  assert(r != -1);
+
+  double W[MAX_STATE_DIM * MAX_STATE_DIM];
+  for (u8 i=0; i<state_dim; i++) {
+    s32 k = -1;
+    if (!sid_is_equal(new_sids[1+i], old_ref)) {
+      k = find_index_of_signal(state_dim, new_sids[1+i], &old_sids[1]);
+      assert(k != -1);
+    }
+    for (s32 j=0; j<state_dim; j++) {
+      double w = 0;
+      if (j >= r) {
+        w -= state_cov_U[MATRIX_PACKED_NDX(state_dim, r, j)];
+      }
+      if (k != -1 && j >= k) {
+        w += state_cov_U[MATRIX_PACKED_NDX(state_dim, k, j)];
+      }
+      W[i*state_dim + j] = w;
+    }
+  }
+
+  double D_W[MAX_STATE_DIM];
+  memcpy(D_W, state_cov_D, state_dim * sizeof(double));
+  matrix_mwgs_udu_packed(state_dim, state_dim, W, D_W, state_cov_U, state_cov_D);
 }
 
 
@@ -804,25 +828,27 @@ void nkf_state_projection(nkf_t *kf,
                                     u8 *ndx_of_new_sat_in_old)
 {
   u8 old_state_dim = num_old_non_ref_sats;
-  double old_cov[old_state_dim * old_state_dim];
-  matrix_reconstruct_udu(old_state_dim, kf->state_cov_U, kf->state_cov_D, old_cov);
-
   u8 new_state_dim = num_new_non_ref_sats;
-  double new_cov[new_state_dim * new_state_dim];
-  double new_mean[new_state_dim];
+  double new_mean[MAX_STATE_DIM];
 
+  /* The projected covariance is S * U * D * (S * U)^T, with S selecting the
+   * kept states, so refactor it from the selected rows of U. */
+  double W[MAX_STATE_DIM * MAX_STATE_DIM];
   for (u8 i=0; i<num_new_non_ref_sats; i++) {
     u8 ndxi = ndx_of_new_sat_in_old[i];
     new_mean[i] = kf->state_mean[ndxi];
-    for (u8 j=0; j<num_new_non_ref_sats; j++) {
-      u8 ndxj = ndx_of_new_sat_in_old[j];
-      new_cov[i*new_state_dim + j] = old_cov[ndxi*old_state_dim + ndxj];
+    for (u8 j=0; j<old_state_dim; j++) {
+      W[i*old_state_dim + j] = j < ndxi ? 0 :
+        kf->state_cov_U[MATRIX_PACKED_NDX(old_state_dim, ndxi, j)];
     }
   }
 
   /* Put it all back into the kf. */
+  double D_W[MAX_STATE_DIM];
+  memcpy(D_W, kf->state_cov_D, old_state_dim * sizeof(double));
   memcpy(kf->state_mean, new_mean, new_state_dim * sizeof(double));
-  matrix_udu(new_state_dim, new_cov, kf->state_cov_U, kf->state_cov_D);
+  matrix_mwgs_udu_packed(new_state_dim, old_state_dim, W, D_W,
+                         kf->state_cov_U, kf->state_cov_D);
   /* NOTE: IT DOESN'T UPDATE THE OBSERVATION OR TRANSITION MATRICES, JUST THE STATE. */
 }
 
@@ -854,30 +880,47 @@ void nkf_state_inclusion(nkf_t *kf,
                          double int_init_var)
 {
   u8 old_state_dim = num_old_non_ref_sats;
-  double old_cov[old_state_dim * old_state_dim];
-  matrix_reconstruct_udu(old_state_dim, kf->state_cov_U, kf->state_cov_D, old_cov);
-
   u8 new_state_dim = num_new_non_ref_sats;
-  double new_cov[new_state_dim * new_state_dim];
-  memset(new_cov, 0, new_state_dim * new_state_dim * sizeof(double));
-  double new_mean[new_state_dim];
-  /* Initialize the ambiguity means/vars, including estimates for new sats. */
-  memcpy(new_mean, init_amb_est, new_state_dim * sizeof(double));
+
+  /* The new covariance is W * D_W * W^T, where the old sats' rows and
+   * columns of W hold the old U, and the new sats' have just a one on the
+   * diagonal, with variance int_init_var in D_W. */
+  double W[MAX_STATE_DIM * MAX_STATE_DIM];
+  double D_W[MAX_STATE_DIM];
+  matrix_eye(new_state_dim, W);
   for (u8 i=0; i<num_new_non_ref_sats; i++) {
-    new_cov[i*new_state_dim + i] = int_init_var;
+    D_W[i] = int_init_var;
   }
 
+  double new_mean[MAX_STATE_DIM];
+  /* Initialize the ambiguity means/vars, including estimates for new sats. */
+  memcpy(new_mean, init_amb_est, new_state_dim * sizeof(double));
+
   /* Overwrite the ambiguity means/covars for the sats we were already tracking
    */
+  bool in_order = true;
   for (u8 i=0; i<num_old_non_ref_sats; i++) {
     u8 ndxi = ndx_of_old_sat_in_new[i];
     new_mean[ndxi] = kf->state_mean[i];
-    for (u8 j=0;j<num_old_non_ref_sats; j++) {
+    D_W[ndxi] = kf->state_cov_D[i];
+    for (u8 j=i; j<num_old_non_ref_sats; j++) {
       u8 ndxj = ndx_of_old_sat_in_new[j];
-      new_cov[ndxi*new_state_dim + ndxj] = old_cov[i*old_state_dim + j];
+      W[ndxi*new_state_dim + ndxj] =
+        kf->state_cov_U[MATRIX_PACKED_NDX(old_state_dim, i, j)];
+    }
+    if (i > 0 && ndxi < ndx_of_old_sat_in_new[i-1]) {
+      in_order = false;
     }
   }
-  matrix_udu(new_state_dim, new_cov, kf->state_cov_U, kf->state_cov_D);
+
+  if (in_order) {
+    /* W is still upper unit triangular, so it's already the factor. */
+    matrix_pack_upper(new_state_dim, W, kf->state_cov_U);
+    memcpy(kf->state_cov_D, D_W, new_state_dim * sizeof(double));
+  } else {
+    matrix_mwgs_udu_packed(new_state_dim, new_state_dim, W, D_W,
+                           kf->state_cov_U, kf->state_cov_D);
+  }
   memcpy(kf->state_mean, new_mean, new_state_dim * sizeof(double));
 }
 
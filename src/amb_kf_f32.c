@@ -0,0 +1,351 @@
+/*
+ * Copyright (C) 2014 Swift Navigation Inc.
+ * Contact: Ian Horn <ian@swift-nav.com>
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+/*
+ * A mixed precision version of the Bierman-Thornton filter of amb_kf.c, for
+ * targets with a single precision FPU only. The covariance factors and the
+ * observation matrices are floats. What needs double precision is:
+ *  - the state mean and the raw measurements, which are in the millions of
+ *    cycles. The innovations against the prior state are formed in double,
+ *    after which everything left is small, so the measurement update works
+ *    on a float correction to the mean, added on at the end.
+ *  - the scalar recurrences of the Bierman and Agee-Turner updates, whose
+ *    errors would otherwise compound over the state dimension.
+ */
+
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+
+#include "common.h"
+#include "linear_algebra.h"
+#include "amb_kf.h"
+#include "amb_kf_f32.h"
+#include "filter_utils.h"
+
+/** \addtogroup amb_kf
+ * \{ */
+
+/** Converts the model of a filter, i.e. everything set_nkf_matrices() sets,
+ * to its mixed precision version. As the geometry changes every epoch, this
+ * is done every time the matrices are.
+ *
+ * \param kf     The filter to convert.
+ * \param kf_f32 The mixed precision filter to update.
+ */
+void nkf_matrices_to_f32(const nkf_t *kf, nkf_f32_t *kf_f32)
+{
+  u32 n = kf->state_dim;
+  u32 m = kf->obs_dim;
+  kf_f32->state_dim = n;
+  kf_f32->obs_dim = m;
+  kf_f32->amb_drift_var = kf->amb_drift_var;
+  for (u32 i=0; i<MATRIX_PACKED_SIZE(m); i++) {
+    kf_f32->decor_mtx[i] = kf->decor_mtx[i];
+  }
+  for (u32 i=0; i<m*n; i++) {
+    kf_f32->decor_obs_mtx[i] = kf->decor_obs_mtx[i];
+  }
+  for (u32 i=0; i<m; i++) {
+    kf_f32->decor_obs_cov[i] = kf->decor_obs_cov[i];
+  }
+  memcpy(kf_f32->null_basis_Q, kf->null_basis_Q,
+         CLAMP_DIFF(n, 3) * n * sizeof(double));
+}
+
+/** Converts the state of a filter, i.e. everything nkf_update() updates, to
+ * its mixed precision version. Only needed when the state was changed other
+ * than by nkf_update_f32(), e.g. by set_nkf() or rebase_nkf().
+ *
+ * \param kf     The filter to convert.
+ * \param kf_f32 The mixed precision filter to update.
+ */
+void nkf_state_to_f32(const nkf_t *kf, nkf_f32_t *kf_f32)
+{
+  u32 n = kf->state_dim;
+  kf_f32->state_dim = n;
+  memcpy(kf_f32->state_mean, kf->state_mean, n * sizeof(double));
+  for (u32 i=0; i<MATRIX_PACKED_SIZE(n); i++) {
+    kf_f32->state_cov_U[i] = kf->state_cov_U[i];
+  }
+  for (u32 i=0; i<n; i++) {
+    kf_f32->state_cov_D[i] = kf->state_cov_D[i];
+  }
+  kf_f32->l_sos_avg = kf->l_sos_avg;
+}
+
+/** Converts a filter to its mixed precision version.
+ *
+ * \param kf     The filter to convert.
+ * \param kf_f32 The mixed precision filter to write.
+ */
+void nkf_to_f32(const nkf_t *kf, nkf_f32_t *kf_f32)
+{
+  nkf_matrices_to_f32(kf, kf_f32);
+  nkf_state_to_f32(kf, kf_f32);
+}
+
+/** Copies the state of a mixed precision filter, i.e. everything
+ * nkf_update_f32() updates, back to the double precision filter. This is
+ * exact. The model matrices are left alone, so they keep their precision.
+ *
+ * \param kf_f32 The mixed precision filter.
+ * \param kf     The filter to update, with the same state dimension.
+ */
+void nkf_state_from_f32(const nkf_f32_t *kf_f32, nkf_t *kf)
+{
+  u32 n = kf_f32->state_dim;
+  assert(kf->state_dim == n);
+  memcpy(kf->state_mean, kf_f32->state_mean, n * sizeof(double));
+  for (u32 i=0; i<MATRIX_PACKED_SIZE(n); i++) {
+    kf->state_cov_U[i] = kf_f32->state_cov_U[i];
+  }
+  for (u32 i=0; i<n; i++) {
+    kf->state_cov_D[i] = kf_f32->state_cov_D[i];
+  }
+  kf->l_sos_avg = kf_f32->l_sos_avg;
+}
+
+/* Decorrelated innovations of the measurements against the prior state mean.
+ * With the observation matrix H = [Q; I], these are U_decor (z - H x), which
+ * is formed in double as Q (phi - x) and the ambiguity measurements minus x,
+ * as both differences cancel the large ambiguity values. */
+static void prior_innovations(const nkf_f32_t *kf, const double *measurements,
+                              float *innov)
+{
+  u32 n = kf->state_dim;
+  u32 m = kf->obs_dim;
+  u32 constraint_dim = CLAMP_DIFF(n, 3);
+
+  double phi_minus_x[MAX_STATE_DIM];
+  for (u32 j=0; j<n; j++) {
+    phi_minus_x[j] = measurements[j] - kf->state_mean[j];
+  }
+  for (u32 i=0; i<constraint_dim; i++) {
+    double r = 0;
+    for (u32 j=0; j<n; j++) {
+      r += kf->null_basis_Q[i*n + j] * phi_minus_x[j];
+    }
+    innov[i] = r;
+  }
+  for (u32 i=0; i<n; i++) {
+    innov[constraint_dim + i] =
+      simple_amb_measurement(measurements[i], measurements[i + n]) -
+      kf->state_mean[i];
+  }
+
+  /* Decorrelate in place. The decorrelation matrix is upper unit triangular,
+   * so each element only depends on those after it. */
+  for (u32 i=0; i<m; i++) {
+    const float *D_i = &kf->decor_mtx[MATRIX_PACKED_NDX(m, i, i)];
+    float e = innov[i];
+    for (u32 j=i+1; j<m; j++) {
+      e += D_i[j - i] * innov[j];
+    }
+    innov[i] = e;
+  }
+}
+
+/* As in amb_kf.c, the index of the first nonzero element of `h`. */
+static u32 first_nonzero_f32(u32 n, const float *h)
+{
+  u32 first = 0;
+  while (first < n && h[first] == 0) {
+    first++;
+  }
+  return first;
+}
+
+/* f = U' h and g = diag(D) f for h zero before `first`, see
+ * compute_innovation_terms(). Returns the innovation variance. */
+static double innovation_terms_f32(u32 n, u32 first, const float *h, float R,
+                                   const float *U, const float *D,
+                                   float *f, float *g)
+{
+  memcpy(&f[first], &h[first], (n - first) * sizeof(float));
+  for (u32 i=first; i<n; i++) {
+    if (h[i] == 0) {
+      continue;
+    }
+    const float *U_i = &U[MATRIX_PACKED_NDX(n, i, i)];
+    for (u32 j=i+1; j<n; j++) {
+      f[j] += h[i] * U_i[j - i];
+    }
+  }
+  double alpha = R;
+  for (u32 j=first; j<n; j++) {
+    g[j] = D[j] * f[j];
+    alpha += (double)f[j] * g[j];
+  }
+  return alpha;
+}
+
+/* The Bierman update of update_kf_state(), applied to the covariance factors
+ * and to a correction `dx` of the state mean. */
+static void update_state_f32(nkf_f32_t *kf, u32 first, double R,
+                             const float *f, const float *g, double alpha,
+                             double k_scalar, float innov, float *dx)
+{
+  if (k_scalar == 0) {
+    return;
+  }
+  u32 n = kf->state_dim;
+  float *U = kf->state_cov_U;
+  float *D = kf->state_cov_D;
+  float k[MAX_STATE_DIM];
+  memset(k, 0, n * sizeof(float));
+
+  R += alpha * (1 - k_scalar) / k_scalar;
+  if (R == 0) {
+    first = 0;
+  }
+
+  double gamma = R;
+  for (u32 j=first; j<n; j++) {
+    double gamma_prev = gamma;
+    gamma += (double)g[j] * f[j];
+    if (D[j] == 0 || gamma_prev == 0) {
+      D[j] = 0;
+    } else {
+      D[j] = D[j] * (gamma_prev / gamma);
+    }
+    float f_over_gamma = f[j] / gamma_prev;
+    for (u32 i=0; i<=j; i++) {
+      u32 ij = MATRIX_PACKED_NDX(n, i, j);
+      float U_ij = U[ij];
+      if (k[i] != 0) {
+        U[ij] = U_ij - f_over_gamma * k[i];
+      }
+      k[i] += g[j] * U_ij;
+    }
+  }
+
+  float scale = k_scalar * innov / alpha;
+  for (u32 j=0; j<n; j++) {
+    dx[j] += k[j] * scale;
+  }
+}
+
+/* The prediction update, see diffuse_state(). Each is an Agee-Turner update
+ * as in matrix_udu_rank_one_packed(), for the unit vector e_l, so it starts
+ * at column l. */
+static void diffuse_state_f32(nkf_f32_t *kf)
+{
+  u32 n = kf->state_dim;
+  float *U = kf->state_cov_U;
+  float *D = kf->state_cov_D;
+  float a[MAX_STATE_DIM];
+  for (u32 l=0; l<n; l++) {
+    memset(a, 0, n * sizeof(float));
+    a[l] = 1;
+    double c = kf->amb_drift_var;
+    for (u32 j=l+1; j-- > 0 && c > 0;) {
+      float a_j = a[j];
+      double d = D[j] + c * a_j * a_j;
+      float b = 0;
+      if (d > 0) {
+        b = c * a_j / d;
+        c *= D[j] / d;
+      }
+      D[j] = d;
+      for (u32 i=0; i<j; i++) {
+        float *u = &U[MATRIX_PACKED_NDX(n, i, j)];
+        a[i] -= a_j * *u;
+        *u += b * a[i];
+      }
+    }
+  }
+}
+
+/* The outlier check of outlier_check(), given the decorrelated innovations
+ * against the prior state. */
+static bool outlier_check_f32(nkf_f32_t *kf, const float *innov,
+                              double *k_scalar)
+{
+  u32 n = kf->state_dim;
+  if (n == 0 || kf->obs_dim == 0) {
+    *k_scalar = 1;
+    return false;
+  }
+
+  float f[MAX_STATE_DIM];
+  float g[MAX_STATE_DIM];
+  double sos = 0;
+  for (u32 i=0; i<kf->obs_dim; i++) {
+    const float *h = &kf->decor_obs_mtx[i * n];
+    u32 first = first_nonzero_f32(n, h);
+    double hph_r_ii = innovation_terms_f32(n, first, h, kf->decor_obs_cov[i],
+                                           kf->state_cov_U, kf->state_cov_D,
+                                           f, g);
+    sos += (double)innov[i] * innov[i] / hph_r_ii;
+  }
+  sos /= kf->obs_dim;
+
+  double l_sos = log(MAX(1e-10, sos));
+  *k_scalar = MIN(1, SOS_SWITCH * exp(kf->l_sos_avg - l_sos));
+  kf->l_sos_avg += (l_sos - kf->l_sos_avg) / KF_SOS_TIMESCALE;
+  return (*k_scalar < 1);
+}
+
+/** Mixed precision version of nkf_update().
+ * Does the same prediction and measurement updates, and gives the same
+ * results up to the single precision rounding of the covariance.
+ *
+ * \param kf            The KF to update
+ * \param measurements  The observations. The first (kf->state_dim) elements are
+ *                      carrier phases, and the next (kf->state_dim) are
+ *                      pseudoranges.
+ * \return              Whether the KF thought the measurement was a bad
+ *                      measurement. (true = bad)
+ */
+bool nkf_update_f32(nkf_f32_t *kf, const double *measurements)
+{
+  u32 n = kf->state_dim;
+
+  float innov[MAX_OBS_DIM];
+  prior_innovations(kf, measurements, innov);
+
+  /* Prediction update */
+  diffuse_state_f32(kf);
+
+  /* Measurement update, as incorporate_obs(). The innovation of each
+   * observation is that against the prior, less what the updates so far have
+   * already moved the state by. */
+  double k_scalar;
+  bool is_outlier = outlier_check_f32(kf, innov, &k_scalar);
+
+  float dx[MAX_STATE_DIM];
+  memset(dx, 0, n * sizeof(float));
+  float f[MAX_STATE_DIM];
+  float g[MAX_STATE_DIM];
+  for (u32 i=0; i<kf->obs_dim; i++) {
+    const float *h = &kf->decor_obs_mtx[n * i];
+    float R = kf->decor_obs_cov[i];
+    u32 first = first_nonzero_f32(n, h);
+    memset(f, 0, first * sizeof(float));
+    memset(g, 0, first * sizeof(float));
+    double alpha = innovation_terms_f32(n, first, h, R, kf->state_cov_U,
+                                        kf->state_cov_D, f, g);
+    float e = innov[i];
+    for (u32 j=first; j<n; j++) {
+      e -= h[j] * dx[j];
+    }
+    update_state_f32(kf, first, R, f, g, alpha, k_scalar, e, dx);
+  }
+
+  for (u32 j=0; j<n; j++) {
+    kf->state_mean[j] += dx[j];
+  }
+  return is_outlier;
+}
+
+/** \} */
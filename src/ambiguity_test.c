@@ -24,7 +24,7 @@
 #include "observation.h"
 #include "amb_kf.h"
 #include "lambda.h"
-#include "memory_pool.h"
+#include "hypothesis_store.h"
 #include "printing_utils.h"
 #include "filter_utils.h"
 #include "sats_management.h"
@@ -34,6 +34,50 @@
 #define NUM_SEARCH_STDS 5
 #define LOG_PROB_RAT_THRESHOLD -90
 #define SINGLE_OBS_CHISQ_THRESHOLD 20
+/** Number of slots in the hash index over the hypothesis pool, the smallest
+ * power of two at least twice MAX_HYPOTHESES. */
+#define HYPOTHESIS_INDEX_SIZE 2048
+/** Magnitude of the pool's log likelihood offset beyond which it is folded
+ * back into the individual log likelihoods, see hypothesis_store_normalize().
+ */
+#define LL_OFFSET_LIMIT 256
+/** Largest share of the pool's probability that may be dropped so that
+ * inclusion fits its budget, see ambiguity_sat_inclusion(). */
+#define INCLUSION_MAX_DROPPED_PROB 1e-6
+/** Number of hypotheses whose quadratic terms are evaluated per batch, see
+ * factored_quadratic_terms(). */
+#define QUAD_TERM_BATCH_SIZE 32
+/** Number of rows of the factored residual space taken per matrix product
+ * in factored_quadratic_terms(), between checks against the bounds. */
+#define QUAD_TERM_ROW_BLOCK 4
+/** Precision of the per hypothesis likelihood evaluation of
+ * test_ambiguities(), see factor_quadratic_expansion(). */
+#ifdef LIBSWIFTNAV_FILTER_F32
+typedef float quad_real_t;
+#define QUAD_GEMM cblas_sgemm
+#else
+typedef double quad_real_t;
+#define QUAD_GEMM cblas_dgemm
+#endif
+#if HYPOTHESIS_INDEX_SIZE < 2 * MAX_HYPOTHESES
+#error "HYPOTHESIS_INDEX_SIZE too small for MAX_HYPOTHESES"
+#endif
+/** Size in bytes of the pool's ambiguity buffer. The pool is delta encoded
+ * and normally takes a byte per ambiguity, see hypothesis_store_init(); this
+ * leaves room for MAX_HYPOTHESES at up to two bytes per ambiguity, and for
+ * half as many at four. Embedded builds can trade it off against
+ * MAX_HYPOTHESES. */
+#ifndef HYPOTHESIS_N_BUFF_SIZE
+#define HYPOTHESIS_N_BUFF_SIZE \
+  (MAX_HYPOTHESES * HYPOTHESIS_STORE_MAX_DDS * sizeof(s16))
+#endif
+/** Non-zero to give the pool a second set of buffers, so that a failed
+ * satellite inclusion leaves it as it was rather than half rebuilt, see
+ * hypothesis_store_product(). Embedded builds can save the memory at the
+ * cost of an IAR reset on such failures. */
+#ifndef HYPOTHESIS_PRODUCT_ROLLBACK
+#define HYPOTHESIS_PRODUCT_ROLLBACK 1
+#endif
 
 // TODO delete?
 static void matrix_multiply_z_t(u32 n, u32 m, u32 p, const z_t *a,
@@ -47,13 +91,34 @@ static void matrix_multiply_z_t(u32 n, u32 m, u32 p, const z_t *a,
  * \{ */
 void create_empty_ambiguity_test(ambiguity_test_t *amb_test)
 {
-  static u8 pool_buff[MAX_HYPOTHESES*(sizeof(hypothesis_t) + sizeof(void *))];
-  static memory_pool_t pool;
+  static u8 N_buff[HYPOTHESIS_N_BUFF_SIZE];
+  static float ll_buff[MAX_HYPOTHESES];
+  static double cache_buff[MAX_HYPOTHESES];
+  static u32 index_buff[HYPOTHESIS_INDEX_SIZE];
+  static hypothesis_store_t pool;
   amb_test->pool = &pool;
-  memory_pool_init(amb_test->pool, MAX_HYPOTHESES, sizeof(hypothesis_t), pool_buff);
+  hypothesis_store_init(amb_test->pool, MAX_HYPOTHESES,
+                        N_buff, sizeof(N_buff), ll_buff,
+                        cache_buff, index_buff, HYPOTHESIS_INDEX_SIZE);
+#if HYPOTHESIS_PRODUCT_ROLLBACK
+  static u8 N_scratch[HYPOTHESIS_N_BUFF_SIZE];
+  static float ll_scratch[MAX_HYPOTHESES];
+  static double cache_scratch[MAX_HYPOTHESES];
+  hypothesis_store_set_scratch(amb_test->pool, N_scratch, ll_scratch,
+                               cache_scratch);
+#endif
+
+  amb_test->res_mtxs.generation = 0;
+  amb_test->res_mtxs.num_dds = 0;
+  amb_test->res_mtxs.phase_var = -1;
+  amb_test->res_mtxs.code_var = -1;
+  amb_test->inclusion_budget = DEFAULT_INCLUSION_BUDGET;
 
   amb_test->sats.num_sats = 0;
   amb_test->amb_check.initialized = 0;
+  /* The store's version starts at one, so the unanimity check starts out of
+   * date. */
+  amb_test->amb_check_version = 0;
 }
 void create_ambiguity_test(ambiguity_test_t *amb_test)
 {
@@ -63,14 +128,13 @@ void create_ambiguity_test(ambiguity_test_t *amb_test)
    * zero length N vector, i.e. no satellites. When we take the
    * product of this single element with the set of new satellites
    * we will just get a set of elements corresponding to the new sats. */
-  hypothesis_t *empty_element = (hypothesis_t *)memory_pool_add(amb_test->pool);
   /* Start with ll = 0, just for the sake of argument. */
-  empty_element->ll = 0;
+  hypothesis_store_add(amb_test->pool, NULL, 0);
 }
 
 void destroy_ambiguity_test(ambiguity_test_t *amb_test)
 {
-  memory_pool_destroy(amb_test->pool);
+  hypothesis_store_clear(amb_test->pool, 0);
 }
 
 /** Gets the hypothesis out of an ambiguity test struct, if there is only one.
@@ -84,46 +148,14 @@ void destroy_ambiguity_test(ambiguity_test_t *amb_test)
  */
 s8 get_single_hypothesis(ambiguity_test_t *amb_test, s32 *hyp_N)
 {
-  if (memory_pool_n_allocated(amb_test->pool) == 1) {
-    hypothesis_t hyp;
-    memory_pool_to_array(amb_test->pool, &hyp);
-    memcpy(hyp_N, hyp.N, (amb_test->sats.num_sats-1) * sizeof(s32));
+  if (amb_test->pool->num_hyps == 1) {
+    hypothesis_store_flush(amb_test->pool);
+    hypothesis_store_get(amb_test->pool, 0, hyp_N);
     return 0;
   }
   return -1;
 }
 
-/** A struct to be used as the x in a memory pool fold, checking set membership.
- * Used in fold_contains().
- */
-typedef struct {
-  u8 num_dds;             /**< The number of double differences in the hypotheses. */
-  s32 N[MAX_CHANNELS-1];  /**< The ambiguity vector being searched for. */
-  u8 found;               /**< Whether or not the ambiguity vector is found yet. */
-} fold_contains_t;
-
-/** A memory pool fold method to check if a hypothesis is in the pool.
- *
- * Should be used in memory_pool_fold().
- *
- * \param x    The accumulator. Contains the hypothesis and whether it's found.
- * \param elem The hypothesis being folded against (checked for match).
- */
-static void fold_contains(void *x, element_t *elem)
-{
-  fold_contains_t *acc = (fold_contains_t *) x;
-  hypothesis_t *hyp = (hypothesis_t *) elem;
-  if (acc->found == 1) {
-    return;
-  }
-  for (u8 i=0; i<acc->num_dds; i++) {
-    if (hyp->N[i] != acc->N[i]) {
-      return;
-    }
-  }
-  acc->found = 1;
-}
-
 /** Tests whether an ambiguity test has a particular hypothesis.
  *
  * \param amb_test    The test to check against.
@@ -132,47 +164,12 @@ static void fold_contains(void *x, element_t *elem)
  */
 u8 ambiguity_test_pool_contains(ambiguity_test_t *amb_test, double *ambs)
 {
-  fold_contains_t acc;
-  acc.num_dds = amb_test->sats.num_sats-1;
-  for (u8 i=0; i<acc.num_dds; i++) {
-    acc.N[i] = lround(ambs[i]);
-  }
-  acc.found = 0;
-  memory_pool_fold(amb_test->pool, (void *) &acc, &fold_contains);
-  return acc.found;
-}
-
-/** A struct to be used as the x in a memory pool fold, checking likelihood.
- * Used in fold_ll().
- */
-typedef struct {
-  u8 num_dds;             /**< The number of double differences in the hypotheses. */
-  s32 N[MAX_CHANNELS-1];  /**< The ambiguity vector being searched for. */
-  u8 found;               /**< Whether or not the ambiguity vector is found yet. */
-  double ll;              /**< The pseudo log likelihood if it's been found. */
-} fold_ll_t;
-
-/** A memory pool fold method to check a hypothesis's pseudo log likelihood.
- *
- * Should be used in memory_pool_fold().
- *
- * \param x    The accumulator. Contains the hypothesis and whether it's found.
- * \param elem The hypothesis being folded against (checked for match).
- */
-static void fold_ll(void *x, element_t *elem)
-{
-  fold_ll_t *acc = (fold_ll_t *) x;
-  hypothesis_t *hyp = (hypothesis_t *) elem;
-  if (acc->found == 1) {
-    return;
-  }
-  for (u8 i=0; i<acc->num_dds; i++) {
-    if (hyp->N[i] != acc->N[i]) {
-      return;
-    }
+  u8 num_dds = amb_test->sats.num_sats-1;
+  s32 N[num_dds];
+  for (u8 i=0; i<num_dds; i++) {
+    N[i] = lround(ambs[i]);
   }
-  acc->ll = hyp->ll;
-  acc->found = 1;
+  return hypothesis_store_find(amb_test->pool, N) >= 0;
 }
 
 /** Finds the unnormalized log likelihood of an input ambiguity
@@ -185,29 +182,17 @@ static void fold_ll(void *x, element_t *elem)
  */
 double ambiguity_test_pool_ll(ambiguity_test_t *amb_test, u8 num_ambs, double *ambs)
 {
-  fold_ll_t acc;
-  acc.num_dds = amb_test->sats.num_sats-1;
-  acc.ll = 1;
-  assert(acc.num_dds == num_ambs);
-  for (u8 i=0; i<acc.num_dds; i++) {
-    acc.N[i] = lround(ambs[i]);
-  }
-  memory_pool_fold(amb_test->pool, (void *) &acc, &fold_ll);
-  return acc.ll;
-}
-
-/** A memory pool fold method to add probabilities.
- *
- * Should be used in memory_pool_fold().
- *
- * \param x    The accumulator. Contains the sum of the probabilities thus far.
- * \param elem The hypothesis being folded against (checked for match).
- */
-static void fold_prob(void *x, element_t *elem)
-{
-  double *acc = (double *) x;
-  hypothesis_t *hyp = (hypothesis_t *) elem;
-  *acc += exp(hyp->ll);
+  u8 num_dds = amb_test->sats.num_sats-1;
+  assert(num_dds == num_ambs);
+  s32 N[num_dds];
+  for (u8 i=0; i<num_dds; i++) {
+    N[i] = lround(ambs[i]);
+  }
+  s32 ndx = hypothesis_store_find(amb_test->pool, N);
+  if (ndx < 0) {
+    return 1;
+  }
+  return hypothesis_store_ll(amb_test->pool, ndx);
 }
 
 /** Finds the probability of an input ambiguity
@@ -220,48 +205,13 @@ static void fold_prob(void *x, element_t *elem)
  */
 double ambiguity_test_pool_prob(ambiguity_test_t *amb_test, u8 num_ambs, double *ambs)
 {
-  fold_ll_t acc;
-  acc.num_dds = amb_test->sats.num_sats-1;
-  acc.ll = 1;
-  assert(acc.num_dds == num_ambs);
-  for (u8 i=0; i<acc.num_dds; i++) {
-    acc.N[i] = lround(ambs[i]);
-  }
-  memory_pool_fold(amb_test->pool, (void *) &acc, &fold_ll);
-  if (acc.ll > 0) {
+  double ll = ambiguity_test_pool_ll(amb_test, num_ambs, ambs);
+  if (ll > 0) {
     return -1;
   }
-  double prob_sum = 0;
-  memory_pool_fold(amb_test->pool, (void *) &prob_sum, &fold_prob);
-  return exp(acc.ll) / prob_sum;
-}
-
-/** A struct to be used in a memory pool fold to find the most likely hypothesis.
- * Should be used in fold_mle().
- */
-typedef struct {
-  u8 started;            /**< Whether the test has actually been started yet. */
-  double max_ll;         /**< The likelihood of the most likely hypothesis so far. */
-  u8 num_dds;            /**< The number of double differences in the hypotheses being tested. */
-  s32 N[MAX_CHANNELS-1]; /**< The most likely hypothesis so far. */
-} fold_mle_t; // fold omelette
-
-/** A memory pool fold method to find the max likelihood estimate of the ambiguities.
- *
- * Should be used in memory_pool_fold().
- *
- * \param x     The fold accumulator. Contains the MLE and supporting fields.
- * \param elem  The hypothesis to fold.
- */
-static void fold_mle(void *x, element_t *elem)
-{
-  hypothesis_t *hyp = (hypothesis_t *) elem;
-  fold_mle_t *mle = (fold_mle_t *) x;
-  if (mle->started == 0 || hyp->ll > mle->max_ll) {
-    mle->started = 1;
-    mle->max_ll = hyp->ll;
-    memcpy(mle->N, hyp->N, mle->num_dds * sizeof(s32));
-  }
+  hypothesis_store_t *pool = amb_test->pool;
+  const hypothesis_store_stats_t *stats = hypothesis_store_stats(pool);
+  return exp(ll + pool->ll_offset - stats->max_ll) / stats->sum;
 }
 
 /** Performs max likelihood estimation on an ambiguity test.
@@ -274,11 +224,43 @@ static void fold_mle(void *x, element_t *elem)
  */
 void ambiguity_test_MLE_ambs(ambiguity_test_t *amb_test, s32 *ambs)
 {
-  fold_mle_t mle;
-  mle.started = 0;
-  mle.num_dds = CLAMP_DIFF(amb_test->sats.num_sats, 1);
-  memory_pool_fold(amb_test->pool, (void *) &mle, &fold_mle);
-  memcpy(ambs, mle.N, mle.num_dds * sizeof(s32));
+  hypothesis_store_t *pool = amb_test->pool;
+  hypothesis_store_flush(pool);
+  hypothesis_store_get(pool, hypothesis_store_stats(pool)->mle, ambs);
+}
+
+/** Finds how much more likely the MLE hypothesis is than the runner up,
+ * for ratio tests on the pool.
+ *
+ * \param amb_test  The ambiguity test to examine.
+ * \return          The log likelihood ratio of the two most likely
+ *                  hypotheses, or INFINITY if there are fewer than two.
+ */
+double ambiguity_test_MLE_ratio(ambiguity_test_t *amb_test)
+{
+  const hypothesis_store_stats_t *stats = hypothesis_store_stats(amb_test->pool);
+  return (double)stats->max_ll - stats->second_ll;
+}
+
+/* Decides whether the residual matrices need rebuilding for the current
+ * geometry and noise model. Keeping them allows the pool's cached quadratic
+ * terms to be reused, see test_ambiguities(). */
+static bool residual_matrices_stale(const residual_mtxs_t *res_mtxs,
+                                    u8 num_dds, const double *DE_mtx,
+                                    double phase_var, double code_var,
+                                    double de_tolerance)
+{
+  if (res_mtxs->num_dds != num_dds ||
+      res_mtxs->phase_var != phase_var ||
+      res_mtxs->code_var != code_var) {
+    return true;
+  }
+  for (u32 i=0; i<num_dds * 3; i++) {
+    if (fabs(res_mtxs->DE_mtx[i] - DE_mtx[i]) > de_tolerance) {
+      return true;
+    }
+  }
+  return false;
 }
 
 /** Updates the IAR process with new measurements.
@@ -294,15 +276,19 @@ void ambiguity_test_MLE_ambs(ambiguity_test_t *amb_test, s32 *ambs)
  * \param ref_ecef    The ecef coordinate to pretend we are at to use relative to the sats.
  * \param phase_var   The variance of the carrier phase measurements.
  * \param code_var    The variance of the code pseudorange measurements.
+ * \param de_tolerance Largest change in any element of the DE matrix for which
+ *                    the residual matrices, and with them the pool's cached
+ *                    quadratic terms, are kept rather than rebuilt. See
+ *                    DEFAULT_DE_TOLERANCE.
  * \param amb_test    The ambiguity test to update.
  * \param state_dim   The dimension of the float state.
  * \param sdiffs      The single differenced measurements/sat positions of all sats tracked.
- * \param changed_sats Not currently used.
+ * \param changed_sats Non-zero to force the residual matrices to be rebuilt.
  *
  *  INVALIDATES unanimous ambiguities
  */
 void update_ambiguity_test(double ref_ecef[3], double phase_var, double code_var,
-                           ambiguity_test_t *amb_test, u8 state_dim, sdiff_t *sdiffs,
+                           double de_tolerance, ambiguity_test_t *amb_test, u8 state_dim, sdiff_t *sdiffs,
                            u8 changed_sats)
 {
   DEBUG_ENTRY();
@@ -326,29 +312,16 @@ void update_ambiguity_test(double ref_ecef[3], double phase_var, double code_var
     return;
   }
 
-  if (1 == 1 || changed_sats == 1) { //TODO add logic about when to update DE
-    double DE_mtx[(amb_test->sats.num_sats-1) * 3];
-    assign_de_mtx(amb_test->sats.num_sats, ambiguity_sdiffs, ref_ecef, DE_mtx);
-    double obs_cov[(amb_test->sats.num_sats-1) * (amb_test->sats.num_sats-1) * 4];
-    memset(obs_cov, 0, (amb_test->sats.num_sats-1) * (amb_test->sats.num_sats-1) * 4 * sizeof(double));
-    u8 num_dds = amb_test->sats.num_sats-1;
-    for (u8 i=0; i<num_dds; i++) {
-      for (u8 j=0; j<num_dds; j++) {
-        u8 i_ = i+num_dds;
-        u8 j_ = j+num_dds;
-        if (i==j) {
-          obs_cov[i*2*num_dds + j] = phase_var * 2;
-          obs_cov[i_*2*num_dds + j_] = code_var * 2;
-        }
-        else {
-          obs_cov[i*2*num_dds + j] = phase_var;
-          obs_cov[i_*2*num_dds + j_] = code_var;
-        }
-      }
-    }
-    // MAT_PRINTF(DE_mtx, ((u32) amb_test->sats.num_sats-1), 3);
-    // MAT_PRINTF(obs_cov, 2*num_dds, 2*num_dds);
-    init_residual_matrices(&amb_test->res_mtxs, amb_test->sats.num_sats-1, DE_mtx, obs_cov);
+  double DE_mtx[(amb_test->sats.num_sats-1) * 3];
+  assign_de_mtx(amb_test->sats.num_sats, ambiguity_sdiffs, ref_ecef, DE_mtx);
+  if (changed_sats == 1 ||
+      residual_matrices_stale(&amb_test->res_mtxs, amb_test->sats.num_sats-1,
+                              DE_mtx, phase_var, code_var, de_tolerance)) {
+    init_residual_matrices_from_vars(&amb_test->res_mtxs,
+                                     amb_test->sats.num_sats-1, DE_mtx,
+                                     phase_var, code_var);
+    amb_test->res_mtxs.phase_var = phase_var;
+    amb_test->res_mtxs.code_var = code_var;
   }
 
   test_ambiguities(amb_test, ambiguity_dd_measurements);
@@ -363,61 +336,21 @@ void update_ambiguity_test(double ref_ecef[3], double phase_var, double code_var
  */
 u32 ambiguity_test_n_hypotheses(ambiguity_test_t *amb_test)
 {
-  return memory_pool_n_allocated(amb_test->pool);
-}
-
-/** A memory pool filter to do most everything related to the estimation algorithm.
- * To be used by update_and_get_max_ll() and filter_and_renormalize().
- */
-typedef struct {
-  u8 num_dds;                                 /**< Number of ambiguities. */
-  double r_vec[2*MAX_CHANNELS-5];             /**< Transformed measurement to check hypotheses against. */
-  double max_ll;                              /**< The greatest log likelihood in the pool so far. */
-  residual_mtxs_t *res_mtxs;                  /**< Matrices necessary for testing hypotheses. */
-  unanimous_amb_check_t *unanimous_amb_check; /**< A struct to check which int ambs are agreed upon among all hyps. */
-} hyp_filter_t;
-
-/** A mapAccum styled function to update the hypothesis log-likelihoods and find the greatest LL.
- * Simultaneously performs a map, doing a Bayesian update of the log likelihoods
- * of each hypothesis, while performing a fold on those updated log likelihoods
- * to find the likelihood of the MLE hypothesis.
- *
- * If a single observation was sufficiently unlikely to come from this hypothesis, we reject
- * the hypothesis. (In addition to the accumulated relative likelihood that is filtered upon later).
- *
- * To be given to memory_pool_fold().
- *
- * \param x     Points to a hyp_filter_t containing the accumulator and everything needed for the map.
- * \param elem  The hypothesis to be mapAccum'd.
- */
-static s8 update_and_get_max_ll(void *x_, element_t *elem) {
-  hyp_filter_t *x = (hyp_filter_t *) x_;
-  hypothesis_t *hyp = (hypothesis_t *) elem;
-  double hypothesis_N[x->num_dds];
-
-  for (u8 i=0; i < x->num_dds; i++) {
-    hypothesis_N[i] = hyp->N[i];
-  }
-  double q = get_quadratic_term(x->res_mtxs, x->num_dds, hypothesis_N, x->r_vec);
-  hyp->ll += q;
-  x->max_ll = MAX(x->max_ll, hyp->ll);
-  return (abs(q) < SINGLE_OBS_CHISQ_THRESHOLD);
-  /* Doesn't appear to need a dependence on d.o.f. to be effective.
-   * We should revisit SINGLE_OBS_CHISQ_THRESHOLD when our noise model is tighter. */
+  return amb_test->pool->num_hyps;
 }
 
 /** Keeps track of which integer ambiguities are uninimously agreed upon in the pool.
  * \param num_dds   The number of DDs in each hypothesis. (Used to initialize amb_check).
- * \param hyp       The hypothesis to be checked against.
+ * \param N         The ambiguity vector of the hypothesis to be checked against.
  * \param amb_check Keeps track of which ambs are still unanimous and their values.
  */
-static void check_unanimous_ambs(u8 num_dds, hypothesis_t *hyp,
+static void check_unanimous_ambs(u8 num_dds, const s32 *N,
                                  unanimous_amb_check_t *amb_check)
 {
   if (amb_check->initialized) {
     u8 j = 0; // index in newly constructed amb_check matches
     for (u8 i = 0; i < amb_check->num_matching_ndxs; i++) {
-      if (amb_check->ambs[i] == hyp->N[amb_check->matching_ndxs[i]]) {
+      if (amb_check->ambs[i] == N[amb_check->matching_ndxs[i]]) {
         if (i != j) { //  j <= i necessarily
           amb_check->matching_ndxs[j] = amb_check->matching_ndxs[i];
           amb_check->ambs[j] = amb_check->ambs[i];
@@ -432,94 +365,325 @@ static void check_unanimous_ambs(u8 num_dds, hypothesis_t *hyp,
     for (u8 i=0; i < num_dds; i++) {
       amb_check->matching_ndxs[i] = i;
     }
-    memcpy(amb_check->ambs, hyp->N, num_dds * sizeof(s32));
+    memcpy(amb_check->ambs, N, num_dds * sizeof(s32));
   }
 }
 
-/** A combination fold/map/filter to renormalize the log likelihoods and remove unlikely hyps.
- *
- * The log likelihood of the hypotheses are filtered against a threshold.
- * Those hypotheses that make the cut are (1) normalized such that the MLE has
- * value 0, making them logs of the probability ratio against the MLE hyp,
- * and (2) checked to see if any of their integer ambiguities are unanimous
- * amongst all hypotheses in the test pool.
- *
- * The thresholding is done before the normalization for both numerical
- * stability, and so that hypotheses which are just REALLY BAD are removed,
- * even if they are the best we have. This is a kinda arbitrary choice of how
- * to do things. Maybe we should see if it has practical implications?
- *
- * This function is used by memory_pool_filter().
- *
- * \param arg     The accumulator/map/filter information
- * \param elem    The hypothesis to be mapped/filtered/folded against.
- * \return        Whether or not this hypothesis made the cut.
- */
-static s8 filter_and_renormalize(void *arg, element_t *elem) {
-  hypothesis_t *hyp = (hypothesis_t *) elem;
+void update_unanimous_ambiguities(ambiguity_test_t *amb_test)
+{
+  if (amb_test->sats.num_sats <= 1) {
+    amb_test->amb_check.num_matching_ndxs = 0;
+    return;
+  }
+  u8 num_dds = amb_test->sats.num_sats-1;
+  hypothesis_store_t *pool = amb_test->pool;
+  hypothesis_store_flush(pool);
+  if (amb_test->amb_check_version == pool->version) {
+    /* Already up to date, e.g. from test_ambiguities(). */
+    return;
+  }
+  amb_test->amb_check.initialized = 0;
 
-  u8 keep_it = (hyp->ll > LOG_PROB_RAT_THRESHOLD);
-  if (keep_it) {
-    hyp->ll -= ((hyp_filter_t *) arg)->max_ll;
+  for (u32 i=0; i<pool->num_hyps; i++) {
+    s32 N[num_dds];
+    hypothesis_store_get(pool, i, N);
+    check_unanimous_ambs(num_dds, N, &amb_test->amb_check);
   }
-  return keep_it;
+  amb_test->amb_check_version = pool->version;
 }
 
-static void _check_unanimous(void *arg, element_t *elem)
+/* Expands the quadratic term about N_ref in the pivoted Cholesky factored
+ * residual space. With R and P as in `residual_mtxs_t`,
+ * M = [null_projector; I] and r_ref = r_vec - M N_ref, the quadratic term of
+ * d = N - N_ref is -|w - A d|^2, where w = R P' r_ref and A = R P' M.
+ * Everything here is small, so with LIBSWIFTNAV_FILTER_F32 w and A are
+ * rounded to single precision for the per hypothesis evaluation. */
+static void factor_quadratic_expansion(const residual_mtxs_t *res_mtxs,
+                                       u8 num_dds, const double *r_ref,
+                                       quad_real_t *w, quad_real_t *A)
 {
-  hypothesis_t *hyp = (hypothesis_t *) elem;
-
-  check_unanimous_ambs(((hyp_filter_t *) arg)->num_dds, hyp,
-                       ((hyp_filter_t *) arg)->unanimous_amb_check);
+  u32 res_dim = res_mtxs->res_dim;
+  u8 null_dim = res_mtxs->null_space_dim;
+  const double *R = res_mtxs->half_res_cov_inv_chol;
+  for (u32 j=0; j<res_dim; j++) {
+    const double *R_j = &R[MATRIX_PACKED_NDX(res_dim, j, j)];
+    double w_j = 0;
+    double A_j[MAX_CHANNELS-1];
+    memset(A_j, 0, num_dds * sizeof(double));
+    for (u32 k=j; k<res_dim; k++) {
+      double R_jk = R_j[k - j];
+      u8 p = res_mtxs->chol_perm[k];
+      w_j += R_jk * r_ref[p];
+      if (p < null_dim) {
+        for (u8 l=0; l<num_dds; l++) {
+          A_j[l] += R_jk * res_mtxs->null_projector[p*num_dds + l];
+        }
+      } else {
+        A_j[p - null_dim] += R_jk;
+      }
+    }
+    w[j] = w_j;
+    for (u8 l=0; l<num_dds; l++) {
+      A[j*num_dds + l] = A_j[l];
+    }
+  }
 }
 
-void update_unanimous_ambiguities(ambiguity_test_t *amb_test)
+/* Evaluates the quadratic terms q = -|w - A d|^2 of a batch of `n`
+ * hypotheses, see factor_quadratic_expansion(), along with their cached parts
+ * c = |A d|^2. Row k of the `n x num_dds` matrix D is d = N - N_ref of
+ * hypothesis k, and is overwritten.
+ * The rows of A are taken heaviest first, QUAD_TERM_ROW_BLOCK at a time,
+ * each block a single matrix product over the hypotheses still being
+ * evaluated. Hypothesis k is dropped as soon as |w - A d|^2 reaches
+ * `bound[k]`, and the rest are compacted to the front of D before the next
+ * block. Returns the number of hypotheses not dropped, with their indices
+ * into the batch in `ndx`, in order, and their q and c. The sums of squares
+ * are always accumulated in double. */
+static u32 factored_quadratic_terms(u32 res_dim, u8 num_dds,
+                                    const quad_real_t *w, const quad_real_t *A,
+                                    u32 n, quad_real_t *D, const double *bound,
+                                    u32 *ndx, double *q, double *c)
 {
-  hyp_filter_t x;
-  if (amb_test->sats.num_sats <= 1) {
-    amb_test->amb_check.num_matching_ndxs = 0;
-    return;
+  /* q holds the sums |w - A d|^2 until the end. */
+  for (u32 k=0; k<n; k++) {
+    ndx[k] = k;
+    q[k] = 0;
+    c[k] = 0;
+  }
+  u32 num_left = n;
+  for (u32 j0=0; j0<res_dim && num_left > 0; j0+=QUAD_TERM_ROW_BLOCK) {
+    u32 rows = MIN(QUAD_TERM_ROW_BLOCK, res_dim - j0);
+    quad_real_t AD[QUAD_TERM_BATCH_SIZE * QUAD_TERM_ROW_BLOCK];
+    QUAD_GEMM(CblasRowMajor, CblasNoTrans, CblasTrans,
+              num_left, rows, num_dds,
+              1, D, MAX(num_dds, 1),
+              &A[j0*num_dds], MAX(num_dds, 1),
+              0, AD, rows);
+    u32 num_kept = 0;
+    for (u32 k=0; k<num_left; k++) {
+      double sum = q[k];
+      double cached = c[k];
+      for (u32 j=0; j<rows; j++) {
+        quad_real_t Ad = AD[k*rows + j];
+        quad_real_t u = w[j0 + j] - Ad;
+        sum += (double)u * u;
+        cached += (double)Ad * Ad;
+      }
+      if (sum >= bound[ndx[k]]) {
+        continue;
+      }
+      if (num_kept != k) {
+        memcpy(&D[num_kept*num_dds], &D[k*num_dds],
+               num_dds * sizeof(quad_real_t));
+        ndx[num_kept] = ndx[k];
+      }
+      q[num_kept] = sum;
+      c[num_kept] = cached;
+      num_kept++;
+    }
+    num_left = num_kept;
   }
-  x.num_dds = amb_test->sats.num_sats-1;
-  x.unanimous_amb_check = &amb_test->amb_check;
-  x.unanimous_amb_check->initialized = 0;
-
-  memory_pool_map(amb_test->pool, (void *) &x, &_check_unanimous);
+  for (u32 k=0; k<num_left; k++) {
+    q[k] = -q[k];
+  }
+  return num_left;
 }
 
 /* Updates the IAR hypothesis pool log likelihood ratios and filters them.
  *  It assumes that the observations are structured to match the amb_test sats.
  *  INVALIDATES unanimous ambiguities
+ *
+ * Each hypothesis gets a Bayesian update of its log likelihood. If a single
+ * observation was sufficiently unlikely to come from a hypothesis, we reject
+ * it. Doesn't appear to need a dependence on d.o.f. to be effective. We
+ * should revisit SINGLE_OBS_CHISQ_THRESHOLD when our noise model is tighter.
+ *
+ * The log likelihood of the remaining hypotheses are then filtered against a
+ * threshold. Those hypotheses that make the cut are normalized such that the
+ * MLE has value 0, making them logs of the probability ratio against the MLE
+ * hyp.
+ *
+ * The same pass gathers the pool's likelihood aggregates, so the MLE and
+ * probability queries that follow don't need passes of their own.
+ *
+ * The thresholding is done before the normalization for both numerical
+ * stability, and so that hypotheses which are just REALLY BAD are removed,
+ * even if they are the best we have. This is a kinda arbitrary choice of how
+ * to do things. Maybe we should see if it has practical implications?
  */
 void test_ambiguities(ambiguity_test_t *amb_test, double *dd_measurements)
 {
   DEBUG_ENTRY();
 
-  hyp_filter_t x;
-  x.num_dds = amb_test->sats.num_sats-1;
-  assign_r_vec(&amb_test->res_mtxs, x.num_dds, dd_measurements, x.r_vec);
-  x.max_ll = -1e20; // TODO get the first element, or use this as threshold to restart test
-  x.res_mtxs = &amb_test->res_mtxs;
-  x.unanimous_amb_check = &amb_test->amb_check;
-  x.unanimous_amb_check->initialized = 0;
-
-  memory_pool_filter(amb_test->pool, (void *) &x, &update_and_get_max_ll);
-  memory_pool_filter(amb_test->pool, (void *) &x, &filter_and_renormalize);
-  if (memory_pool_empty(amb_test->pool)) {
+  hypothesis_store_t *pool = amb_test->pool;
+  u8 num_dds = amb_test->sats.num_sats-1;
+  double r_vec[2*MAX_CHANNELS-5];
+  assign_r_vec(&amb_test->res_mtxs, num_dds, dd_measurements, r_vec);
+  amb_test->amb_check.initialized = 0;
+
+  /* Each hypothesis caches d' M' S M d, where d = N - N_ref,
+   * M = [null_projector; I] and S = half_res_cov_inv; this only changes when
+   * the residual matrices are rebuilt or the hypotheses themselves change.
+   * Expanding around a reference hypothesis rather than zero keeps the terms
+   * small, avoiding cancellation against the large ambiguity values. */
+  residual_mtxs_t *res_mtxs = &amb_test->res_mtxs;
+  u32 res_dim = res_mtxs->res_dim;
+  u8 null_dim = res_mtxs->null_space_dim;
+  u8 fill_cache = !pool->cache_valid ||
+                  amb_test->cache_generation != res_mtxs->generation;
+  if (fill_cache) {
+    /* A pending rebase always invalidates the cache, so it is applied in
+     * this pass, row by row, rather than in a pass of its own. */
+    memset(amb_test->cache_ref, 0, sizeof(amb_test->cache_ref));
+    if (pool->num_hyps > 0) {
+      hypothesis_store_remap_row(pool, 0, amb_test->cache_ref);
+    }
+  }
+  double N_ref[num_dds];
+  for (u8 j=0; j<num_dds; j++) {
+    N_ref[j] = amb_test->cache_ref[j];
+  }
+  double r_ref[2*MAX_CHANNELS-5];
+  assign_r_mean(res_mtxs, num_dds, N_ref, r_ref);
+  for (u32 j=0; j<res_dim; j++) {
+    r_ref[j] = r_vec[j] - r_ref[j];
+  }
+  /* With the cache filled the quadratic term is
+   *   -r_ref' S r_ref + 2 (M' S r_ref) . d - d' M' S M d
+   * leaving one dot product per hypothesis. Filling it, the full term is a
+   * sum of squares in the factored residual space, evaluated for a batch of
+   * hypotheses at a time and cut short for those being rejected. */
+  double const_term = 0;
+  double lin_coeffs[num_dds];
+  quad_real_t w[2*MAX_CHANNELS-5];
+  quad_real_t A[(2*MAX_CHANNELS-5) * (MAX_CHANNELS-1)];
+  if (fill_cache) {
+    factor_quadratic_expansion(res_mtxs, num_dds, r_ref, w, A);
+  } else {
+    double S_r[2*MAX_CHANNELS-5];
+    cblas_dspmv(CblasRowMajor, CblasUpper,
+                res_dim,
+                1, res_mtxs->half_res_cov_inv,
+                r_ref, 1,
+                0, S_r, 1);
+    for (u32 j=0; j<res_dim; j++) {
+      const_term -= r_ref[j] * S_r[j];
+    }
+    for (u8 j=0; j<num_dds; j++) {
+      lin_coeffs[j] = 2 * S_r[null_dim + j];
+    }
+    if (null_dim > 0) {
+      cblas_dgemv(CblasRowMajor, CblasTrans,
+                  null_dim, num_dds,
+                  2, res_mtxs->null_projector, num_dds,
+                  S_r, 1,
+                  1, lin_coeffs, 1);
+    }
+  }
+
+  /* Update, filter, compact and check unanimity in a single pass. The
+   * stored log likelihoods are relative to the pool's offset, so the
+   * threshold is checked against the previous normalization and the new
+   * normalization (the max over all hypotheses, rejected or not) is applied
+   * by just updating the offset. */
+  double max_ll = -1e20; // TODO get the first element, or use this as threshold to restart test
+  u32 num_kept = 0;
+  hypothesis_store_stats_t stats;
+  hypothesis_store_stats_reset(&stats);
+  /* Hypotheses are read a batch at a time. Moving one only overwrites
+   * hypotheses that have already been read, so it can be kept as it goes. */
+  for (u32 i0=0; i0<pool->num_hyps; i0+=QUAD_TERM_BATCH_SIZE) {
+    u32 n = MIN(QUAD_TERM_BATCH_SIZE, pool->num_hyps - i0);
+    s32 N[QUAD_TERM_BATCH_SIZE][MAX_CHANNELS-1];
+    u32 ndx[QUAD_TERM_BATCH_SIZE];
+    double q[QUAD_TERM_BATCH_SIZE];
+    u32 num_evaluated;
+    if (fill_cache) {
+      quad_real_t D[QUAD_TERM_BATCH_SIZE * (MAX_CHANNELS-1)];
+      double bound[QUAD_TERM_BATCH_SIZE];
+      double c[QUAD_TERM_BATCH_SIZE];
+      for (u32 k=0; k<n; k++) {
+        u32 i = i0 + k;
+        if (i > 0) {
+          hypothesis_store_remap_row(pool, i, N[k]);
+        } else {
+          memcpy(N[k], amb_test->cache_ref, num_dds * sizeof(s32));
+        }
+        for (u8 j=0; j<num_dds; j++) {
+          D[k*num_dds + j] = N[k][j] - amb_test->cache_ref[j];
+        }
+        /* Once the term is large enough to reject the hypothesis, and to
+         * keep it below the max so far, its exact value no longer matters.
+         * The max as of the start of the batch gives a looser bound. */
+        double ll = pool->ll[i];
+        bound[k] = MAX(MIN(SINGLE_OBS_CHISQ_THRESHOLD,
+                           ll - pool->ll_offset - LOG_PROB_RAT_THRESHOLD),
+                       ll - max_ll);
+      }
+      num_evaluated = factored_quadratic_terms(res_dim, num_dds, w, A, n, D,
+                                               bound, ndx, q, c);
+      for (u32 k=0; k<num_evaluated; k++) {
+        pool->cache[i0 + ndx[k]] = c[k];
+      }
+    } else {
+      for (u32 k=0; k<n; k++) {
+        hypothesis_store_get(pool, i0 + k, N[k]);
+        ndx[k] = k;
+        q[k] = const_term - pool->cache[i0 + k];
+        for (u8 j=0; j<num_dds; j++) {
+          q[k] += lin_coeffs[j] * (N[k][j] - amb_test->cache_ref[j]);
+        }
+      }
+      num_evaluated = n;
+    }
+    for (u32 k=0; k<num_evaluated; k++) {
+      u32 i = i0 + ndx[k];
+      pool->ll[i] += q[k];
+      max_ll = MAX(max_ll, pool->ll[i]);
+      if (fabs(q[k]) < SINGLE_OBS_CHISQ_THRESHOLD &&
+          pool->ll[i] - pool->ll_offset > LOG_PROB_RAT_THRESHOLD) {
+        if (num_kept != i) {
+          hypothesis_store_move(pool, num_kept, i);
+        }
+        check_unanimous_ambs(num_dds, N[ndx[k]], &amb_test->amb_check);
+        hypothesis_store_stats_add(&stats, num_kept, pool->ll[num_kept]);
+        num_kept++;
+      }
+    }
+  }
+  hypothesis_store_truncate(pool, num_kept);
+  if (fill_cache) {
+    hypothesis_store_remap_applied(pool);
+    pool->cache_valid = 1;
+    amb_test->cache_generation = res_mtxs->generation;
+  }
+  hypothesis_store_stats_commit(pool, &stats);
+  pool->ll_offset = max_ll;
+  if (fabs(pool->ll_offset) > LL_OFFSET_LIMIT) {
+    hypothesis_store_normalize(pool);
+  }
+  amb_test->amb_check_version = pool->version;
+
+  if (pool->num_hyps == 0) {
     log_debug("Ambiguity pool empty");
     /* Initialize pool with single element with num_dds = 0, i.e.
      * zero length N vector, i.e. no satellites. When we take the
      * product of this single element with the set of new satellites
      * we will just get a set of elements corresponding to the new sats. */
-    hypothesis_t *empty_element = (hypothesis_t *)memory_pool_add(amb_test->pool);
+    hypothesis_store_clear(pool, 0);
     /* Start with ll = 0, just for the sake of argument. */
-    empty_element->ll = 0;
+    hypothesis_store_add(pool, NULL, 0);
     amb_test->sats.num_sats = 0;
     amb_test->amb_check.initialized = 0;
   }
   if (DEBUG) {
-    memory_pool_map(amb_test->pool, &x.num_dds, &print_hyp);
-    printf("num_unanimous_ndxs=%u\n", x.unanimous_amb_check->num_matching_ndxs);
+    for (u32 i=0; i<pool->num_hyps; i++) {
+      s32 N[MAX_CHANNELS-1];
+      hypothesis_store_get(pool, i, N);
+      print_hyp(pool->num_dds, N, hypothesis_store_ll(pool, i));
+    }
+    printf("num_unanimous_ndxs=%u\n", amb_test->amb_check.num_matching_ndxs);
   }
 
   DEBUG_EXIT();
@@ -611,48 +775,37 @@ s8 sats_match(const ambiguity_test_t *amb_test, const u8 num_sdiffs, const sdiff
   return 1;
 }
 
-typedef struct {
-  u8 num_sats;
-  gnss_signal_t old_sids[MAX_CHANNELS];
-  gnss_signal_t new_sids[MAX_CHANNELS];
-} rebase_prns_t;
-
-static void rebase_hypothesis(void *arg, element_t *elem) //TODO make it so it doesn't have to do all these lookups every time
+/* Builds the remap taking ambiguities relative to old_sids[0] to ones
+ * relative to new_sids[0], see hypothesis_store_remap(). The sids must be
+ * the same set, with the new reference among the old non-reference ones. */
+static void rebase_remap(u8 num_sats, const gnss_signal_t *old_sids,
+                         const gnss_signal_t *new_sids, s8 *src, s8 *sub)
 {
-  rebase_prns_t *sids = (rebase_prns_t *) arg;
-  u8 num_sats = sids->num_sats;
-  gnss_signal_t *old_sids = sids->old_sids;
-  gnss_signal_t *new_sids = sids->new_sids;
-
-  hypothesis_t *hypothesis = (hypothesis_t *)elem;
-
   gnss_signal_t old_ref = old_sids[0];
   gnss_signal_t new_ref = new_sids[0];
 
-  s32 new_N[num_sats-1];
-  s32 index_of_new_ref_in_old = find_index_of_signal(num_sats-1, new_ref, &old_sids[1]);
-  assert(index_of_new_ref_in_old != -1);
+  *sub = find_index_of_signal(num_sats-1, new_ref, &old_sids[1]);
+  assert(*sub != -1);
 
-  s32 val_for_new_ref_in_old_basis = hypothesis->N[index_of_new_ref_in_old];
   for (u8 i=0; i<num_sats-1; i++) {
     gnss_signal_t new_sid = new_sids[1+i];
     if (sid_is_equal(new_sid, old_ref)) {
-      new_N[i] = - val_for_new_ref_in_old_basis;
+      /* The old reference's ambiguity relative to itself is zero. */
+      src[i] = -1;
     }
     else {
-      s32 index_of_this_sat_in_old_basis = find_index_of_signal(num_sats-1, new_sid, &old_sids[1]);
-      assert(index_of_this_sat_in_old_basis != -1);
-      new_N[i] = hypothesis->N[index_of_this_sat_in_old_basis] - val_for_new_ref_in_old_basis;
+      src[i] = find_index_of_signal(num_sats-1, new_sid, &old_sids[1]);
+      assert(src[i] != -1);
     }
   }
-  memcpy(hypothesis->N, new_N, (num_sats-1) * sizeof(s32));
 }
 
 /** Update an ambiguity test's reference satellite.
  * Given a set of sdiffs, choose a new reference that is hopefully already
  * tracked. If that's impossible, just choose a reference.
  * If the ambiguity test has the new reference, rebase the old hypotheses.
- * Otherwise trash the test and start over.
+ * Otherwise trash the test and start over. The rebase is recorded on the
+ * pool and applied during the next pass over it.
  * On return, the reference sat should be in the sdiffs.
  *
  * \param amb_test              The ambiguity test to update
@@ -681,10 +834,10 @@ u8 ambiguity_update_reference(ambiguity_test_t *amb_test, const u8 num_sdiffs, c
       gnss_signal_t new_sids[amb_test->sats.num_sats];
       memcpy(new_sids, amb_test->sats.sids, amb_test->sats.num_sats * sizeof(gnss_signal_t));
 
-      rebase_prns_t sids = {.num_sats = amb_test->sats.num_sats};
-      memcpy(sids.old_sids, old_sids, amb_test->sats.num_sats * sizeof(gnss_signal_t));
-      memcpy(sids.new_sids, new_sids, amb_test->sats.num_sats * sizeof(gnss_signal_t));
-      memory_pool_map(amb_test->pool, &sids, &rebase_hypothesis);
+      s8 src[MAX_CHANNELS-1];
+      s8 sub;
+      rebase_remap(amb_test->sats.num_sats, old_sids, new_sids, src, &sub);
+      hypothesis_store_remap(amb_test->pool, src, sub);
     }
   }
 
@@ -692,57 +845,6 @@ u8 ambiguity_update_reference(ambiguity_test_t *amb_test, const u8 num_sdiffs, c
   return changed_ref;
 }
 
-typedef struct {
-  u8 num_ndxs;
-  u8 intersection_ndxs[MAX_CHANNELS - 1];
-} intersection_ndxs_t;
-
-static s32 projection_comparator(void *arg, element_t *a, element_t *b)
-{
-  intersection_ndxs_t *intersection_struct = (intersection_ndxs_t *) arg;
-  u8 num_ndxs = intersection_struct->num_ndxs;
-  u8 *intersection_ndxs = intersection_struct->intersection_ndxs;
-
-  hypothesis_t *hyp_a = (hypothesis_t *) a;
-  hypothesis_t *hyp_b = (hypothesis_t *) b;
-
-  for (u8 i=0; i<num_ndxs; i++) {
-    u8 ndxi = intersection_ndxs[i];
-    s32 ai = hyp_a->N[ndxi];
-    s32 bi = hyp_b->N[ndxi];
-    if (ai == bi) {
-      continue;
-    }
-    if (ai < bi) {
-      return -1;
-    }
-    if (ai > bi) {
-      return 1;
-    }
-  }
-  return 0;
-}
-
-static void projection_aggregator(element_t *new_, void *x_, u32 n, element_t *elem_)
-{
-  intersection_ndxs_t *x = (intersection_ndxs_t *)x_;
-  hypothesis_t *new = (hypothesis_t *)new_;
-  hypothesis_t *elem = (hypothesis_t *)elem_;
-
-  if (n == 0) {
-    for (u8 i=0; i<x->num_ndxs; i++) {
-      u8 ndxi = x->intersection_ndxs[i];
-      new->N[i] = elem->N[ndxi];
-    }
-    new->ll = elem->ll;
-  }
-  else {
-    new->ll += log(1 + exp(elem->ll - new->ll));
-    // new->ll = MAX(new->ll, elem->ll);
-  }
-
-}
-
 u8 ambiguity_sat_projection(ambiguity_test_t *amb_test, const u8 num_dds_in_intersection, const u8 *dd_intersection_ndxs)
 {
   DEBUG_ENTRY();
@@ -754,16 +856,10 @@ u8 ambiguity_sat_projection(ambiguity_test_t *amb_test, const u8 num_dds_in_inte
     return 0;
   }
 
-  intersection_ndxs_t intersection = {.num_ndxs = num_dds_in_intersection};
-  memcpy(intersection.intersection_ndxs, dd_intersection_ndxs, num_dds_in_intersection * sizeof(u8));
-
-
-  log_info("IAR: %"PRIu32" hypotheses before projection", memory_pool_n_allocated(amb_test->pool));
-  memory_pool_group_by(amb_test->pool,
-                       &intersection, &projection_comparator,
-                       &intersection, sizeof(intersection),
-                       &projection_aggregator);
-  log_info("IAR: updates to %"PRIu32"", memory_pool_n_allocated(amb_test->pool));
+  log_info("IAR: %"PRIu32" hypotheses before projection", amb_test->pool->num_hyps);
+  hypothesis_store_project(amb_test->pool, num_dds_in_intersection,
+                           dd_intersection_ndxs);
+  log_info("IAR: updates to %"PRIu32"", amb_test->pool->num_hyps);
   log_info("After projection, num_sats = %d", num_dds_in_intersection + 1);
   gnss_signal_t work_sids[MAX_CHANNELS];
   memcpy(work_sids, amb_test->sats.sids, amb_test->sats.num_sats * sizeof(gnss_signal_t));
@@ -782,29 +878,6 @@ static void vec_plus(u8 cols, u8 rows, z_t *v, z_t *Z, z_t mult, u8 column)
     v[i] += Z[i * cols + column] * mult;
   }
 }
-static s8 increment_matrix_product(u8 len, z_t *counter, u8 vlen, z_t *Z,
-                                   z_t *v, z_t *lower_bounds, z_t *upper_bounds) {
-  if (memcmp(upper_bounds, counter, len * sizeof(z_t)) == 0) {
-    /* counter has reached upper_bound, terminate iteration. */
-    return 0;
-  }
-  for (u8 i=0; i < len; i++) {
-    u8 column = i;
-    counter[i]++;
-    vec_plus(len, vlen, v, Z, 1, column);
-    if (counter[i] > upper_bounds[i]) {
-      /* counter[i] has reached maximum, reset counter[i]
-       * to lower[i] and 'carry' to next 'digit' */
-      vec_plus(len, vlen, v, Z, -counter[i] + lower_bounds[i], column);
-      counter[i] = lower_bounds[i];
-    } else {
-      /* Incremented, so now we have the next counter value. */
-      break;
-    }
-  }
-  return 1;
-}
-
 static bool inside(u32 dim, z_t *point, z_t *lower_bounds, z_t *upper_bounds)
 {
   /* Without a slight tolerance, some cases have strange behavior because
@@ -818,40 +891,41 @@ static bool inside(u32 dim, z_t *point, z_t *lower_bounds, z_t *upper_bounds)
   return true;
 }
 
-/* Initializes x->zimage */
-static void init_intersection_count_vector(intersection_count_t *x, hypothesis_t *hyp)
+/* Initializes x->zimage for a zero counter and restarts the search of V2. */
+static void init_intersection_count_vector(intersection_count_t *x, const s32 *N)
 {
   u8 full_dim = x->old_dim + x->new_dim;
-  /* Initialize counter using lower bounds. */
-  memcpy(x->counter, x->itr_lower_bounds, x->new_dim * sizeof(z_t));
+  memset(x->counter, 0, x->new_dim * sizeof(z_t));
   z_t v0[full_dim];
-  /* Map the lower bound vector using Z2_inverse into the second half of v0. */
-  matrix_multiply_z_t(x->new_dim, x->new_dim, 1, x->Z2_inv, x->counter, v0 + x->old_dim);
-  /* Map the old hypothesis values identically into the first half of v0. */
+  /* Map the old hypothesis values identically into the first half of v0,
+   * the zero counter leaves the second half zero. */
   for (u8 i = 0; i < x->old_dim; i++) {
-    v0[i] = hyp->N[i];
+    v0[i] = N[i];
   }
+  memset(v0 + x->old_dim, 0, x->new_dim * sizeof(z_t));
   /* Decorrelate the joint vector. */
   matrix_multiply_z_t(full_dim, full_dim, 1, x->Z1, v0, x->zimage);
+  lambda_enum_reset(x->itr_search);
 }
 
-static void fold_intersection_count(void *arg, element_t *elem)
+/* Moves x->counter to the next point of V2 inside the search ellipsoid,
+ * updating x->zimage by the columns of Z for the elements that changed
+ * (usually just the first). Returns 0 once all points have been visited. */
+static s8 next_itr_point(intersection_count_t *x)
 {
-  intersection_count_t *x = (intersection_count_t *) arg;
-  hypothesis_t *hyp = (hypothesis_t *)elem;
   u8 full_dim = x->old_dim + x->new_dim;
-
-  /* Set initial image in decorrelated space */
-  init_intersection_count_vector(x, hyp);
-
-  do {
-    if (inside(full_dim, x->zimage, x->box_lower_bounds, x->box_upper_bounds)) {
-      x->intersection_size++;
+  double z[x->new_dim];
+  if (!lambda_enum_next(x->itr_search, z)) {
+    return 0;
+  }
+  for (u8 i = 0; i < x->new_dim; i++) {
+    z_t c = lround(z[i]);
+    if (c != x->counter[i]) {
+      vec_plus(x->new_dim, full_dim, x->zimage, x->Z, c - x->counter[i], i);
+      x->counter[i] = c;
     }
-  } while (0 != increment_matrix_product(
-                  x->new_dim, x->counter,
-                  full_dim, x->Z, x->zimage,
-                  x->itr_lower_bounds, x->itr_upper_bounds));
+  }
+  return 1;
 }
 
 static void round_matrix(u32 rows, u32 cols, const double *A, z_t *B)
@@ -929,10 +1003,7 @@ static s8 intersection_generate_next_hypothesis0(void *x_, u32 n)
       /* Yield current point. */
       return 1;
     }
-  } while (0 != increment_matrix_product(
-                  x->new_dim, x->counter,
-                  full_dim, x->Z, x->zimage,
-                  x->itr_lower_bounds, x->itr_upper_bounds));
+  } while (0 != next_itr_point(x));
   return 0;
 }
 
@@ -940,64 +1011,146 @@ static s8 intersection_generate_next_hypothesis0(void *x_, u32 n)
 static s8 intersection_generate_next_hypothesis1(void *x_, u32 n)
 {
   generate_hypothesis_state_t2 *g = (generate_hypothesis_state_t2 *) x_;
-  intersection_count_t *x = g->x;
-  u8 full_dim = x->old_dim + x->new_dim;
 
-  if (0 == increment_matrix_product(x->new_dim, x->counter, full_dim, x->Z, x->zimage,
-             x->itr_lower_bounds, x->itr_upper_bounds)) {
+  if (0 == next_itr_point(g->x)) {
     return 0;
   }
 
   return intersection_generate_next_hypothesis0(x_, n);
 }
 
-static s8 intersection_init(void *x, element_t *elem)
+static s8 intersection_init(void *x, const s32 *N, float ll)
 {
   generate_hypothesis_state_t2 *g = (generate_hypothesis_state_t2 *) x;
-  hypothesis_t *hyp = (hypothesis_t *)elem;
 
-  init_intersection_count_vector(g->x, hyp);
+  if (ll < g->expand_min_ll) {
+    return 0;
+  }
+  if (ll == g->expand_min_ll) {
+    if (*g->expand_num_at == 0) {
+      return 0;
+    }
+    (*g->expand_num_at)--;
+  }
+
+  init_intersection_count_vector(g->x, N);
   /* Find a valid first point. */
+  if (0 == next_itr_point(g->x)) {
+    return 0;
+  }
   return intersection_generate_next_hypothesis0(x, 0);
 }
 
-static void intersection_hypothesis_prod(element_t *new_, void *x_, u32 n, element_t *elem_)
+static void intersection_hypothesis_prod(void *x_, u32 n, const s32 *old_N, s32 *new_N)
 {
-  (void) elem_, (void) n;
+  (void) n;
   generate_hypothesis_state_t2 *s = (generate_hypothesis_state_t2 *) x_;
   intersection_count_t *x = s->x;
-  hypothesis_t *new = (hypothesis_t *) new_;
   u8 *ndxs_of_old_in_new   = s->ndxs_of_old_in_new;
   u8 *ndxs_of_added_in_new = s->ndxs_of_added_in_new;
 
-  s32 old_N[MAX_CHANNELS-1];
-  memcpy(old_N, new->N, x->old_dim * sizeof(s32));
-
   for (u8 i=0; i < x->old_dim; i++) {
-    new->N[ndxs_of_old_in_new[i]] = old_N[i];
+    new_N[ndxs_of_old_in_new[i]] = old_N[i];
   }
   for (u8 i=0; i < x->new_dim; i++) {
-    new->N[ndxs_of_added_in_new[i]] = 0;
+    new_N[ndxs_of_added_in_new[i]] = 0;
     for (u8 j=0; j < x->new_dim; j++) {
-      new->N[ndxs_of_added_in_new[i]] += s->Z_new_inv[i*x->new_dim + j] * x->counter[j];
+      new_N[ndxs_of_added_in_new[i]] += s->Z_new_inv[i*x->new_dim + j] * x->counter[j];
+    }
+  }
+  /* NOTE: the ll remains the same as the original hypothesis' ll as
+   * p := exp(ll) is invariant under a constant multiplicative factor common
+   * to all hypotheses. */
+}
+
+/* Log likelihood of a new hypothesis under the float solution, up to a
+ * constant. Used to decide which hypotheses to keep if the pool fills. */
+static double intersection_hypothesis_prior(void *x_, const s32 *new_N)
+{
+  generate_hypothesis_state_t2 *s = (generate_hypothesis_state_t2 *) x_;
+  intersection_count_t *x = s->x;
+  if (s->prior_cov_inv == NULL) {
+    return 0;
+  }
+
+  u8 full_dim = x->old_dim + x->new_dim;
+  double d[full_dim];
+  for (u8 i=0; i < x->old_dim; i++) {
+    d[i] = new_N[s->ndxs_of_old_in_new[i]] - s->prior_mean[i];
+  }
+  for (u8 i=0; i < x->new_dim; i++) {
+    d[x->old_dim + i] = new_N[s->ndxs_of_added_in_new[i]]
+                        - s->prior_mean[x->old_dim + i];
+  }
+  double quad = 0;
+  for (u8 i=0; i < full_dim; i++) {
+    double row = 0;
+    for (u8 j=0; j < full_dim; j++) {
+      row += s->prior_cov_inv[i*full_dim + j] * d[j];
     }
+    quad += d[i] * row;
   }
+  return -0.5 * quad;
 }
 
+/* Adds the x->new_dim first addible sats to the pool, expanding only its
+ * num_to_expand most likely hypotheses and dropping the rest. If the
+ * resulting hypotheses don't all fit, those most likely under the float
+ * solution (given by the state_dim x state_dim ordered_N_cov and
+ * ordered_N_mean) are kept. Returns the new number of hypotheses, or -1 if
+ * generating them failed and both the pool and the sats were left as they
+ * were. */
 static s32 add_sats(ambiguity_test_t *amb_test,
                     gnss_signal_t ref_sid, gnss_signal_t *added_sids,
-                    intersection_count_t *x)
+                    intersection_count_t *x, u8 state_dim,
+                    const double *ordered_N_cov, const double *ordered_N_mean,
+                    u32 num_to_expand)
 {
+  u8 full_dim = x->old_dim + x->new_dim;
+  double prior_cov[full_dim * full_dim];
+  double prior_cov_inv[full_dim * full_dim];
+  submatrix_ul(full_dim, full_dim, state_dim, ordered_N_cov, prior_cov);
+
   generate_hypothesis_state_t2 s;
   s.x = x;
   s.Z_new_inv = x->Z2_inv;
+  s.prior_mean = ordered_N_mean;
+  s.prior_cov_inv = NULL;
+  if (matrix_inverse(full_dim, prior_cov, prior_cov_inv) == 0) {
+    s.prior_cov_inv = prior_cov_inv;
+  }
+  /* Rather than pruning the pool up front, the hypotheses not to be expanded
+   * just produce nothing, so a failed product costs none of them. */
+  u32 num_at = 0;
+  s.expand_min_ll = -INFINITY;
+  s.expand_num_at = &num_at;
+  if (num_to_expand < amb_test->pool->num_hyps) {
+    s.expand_min_ll = hypothesis_store_most_likely_ll(amb_test->pool,
+                                                      num_to_expand, &num_at);
+  }
+  sats_management_t old_sats = amb_test->sats;
   remap_sids(amb_test, ref_sid, x->new_dim, added_sids, &s);
-  s32 count = memory_pool_product_generator(amb_test->pool, &s, MAX_HYPOTHESES, sizeof(s),
+  /* Each hypothesis yields at most the points of the V2 box, which bounds
+   * the search ellipsoid. */
+  u32 box_size = 1;
+  for (u8 i=0; i < x->new_dim; i++) {
+    box_size *= x->itr_upper_bounds[i] - x->itr_lower_bounds[i] + 1;
+  }
+  s32 count = hypothesis_store_product(amb_test->pool, full_dim,
+                  &s, sizeof(s), box_size,
                   &intersection_init,
                   &intersection_generate_next_hypothesis1,
-                  &intersection_hypothesis_prod);
-  (void) count;
-  s32 num_hyps = memory_pool_n_allocated(amb_test->pool);
+                  &intersection_hypothesis_prod,
+                  &intersection_hypothesis_prior);
+  if (count < 0 && amb_test->pool->scratch_N != NULL) {
+    /* The product was rolled back, so the pool still matches the old
+     * sats. */
+    log_warn("add_sats: hypothesis product failed (%"PRId32"), "
+             "no sats added", count);
+    amb_test->sats = old_sats;
+    return -1;
+  }
+  s32 num_hyps = amb_test->pool->num_hyps;
   log_info("IAR: updates to %"PRIu32"", num_hyps);
   log_info("add_sats. num sats: %i", amb_test->sats.num_sats);
   return num_hyps;
@@ -1017,78 +1170,73 @@ static s32 add_sats(ambiguity_test_t *amb_test,
  *  (called Z2).
  *
  *  These decorrelation matrices determine a certain range of likely
- *  ambiguities, lying inside a box in V2 (likely values for new sats) and V1
- *  (likely values for all sats considered jointly). The V1 box considers all
- *  joint correlations and gives a more accurate range of possibilities.
- *  However, we do not want to add any hypotheses which conflict on old
- *  satellites with the existing hypothesis set, so we iterate through the
- *  current hypothesis set, combining each hypothesis with a hypothesis from
- *  the V2 (new sat) box, and map it back to V1, keeping only those that lie
- *  inside the V1 box.
+ *  ambiguities, lying inside an ellipsoid in V2 (likely values for new sats)
+ *  and a box in V1 (likely values for all sats considered jointly). The V1
+ *  box considers all joint correlations and gives a more accurate range of
+ *  possibilities. However, we do not want to add any hypotheses which
+ *  conflict on old satellites with the existing hypothesis set, so we
+ *  iterate through the current hypothesis set, combining each hypothesis
+ *  with each integer point of the V2 (new sat) ellipsoid, and map it back to
+ *  V1, keeping only those that lie inside the V1 box. The V2 points are
+ *  enumerated depth first from the LDL' factors of the decorrelated
+ *  covariance (see lambda_enum_next()), so the many points of its bounding
+ *  box that lie outside the ellipsoid are never generated.
  *
- *  If too many hypotheses result to fit in memory, we repeat the calculation
- *  using fewer new sats. If it is impossible to add a sufficient number of
- *  sats to make progress towards an RTK solution (< 4 double differences
- *  total) we return without adding any.
+ *  If too many hypotheses result to fit in memory, only those most likely
+ *  under the float solution are kept (see add_sats()). If iterating over the
+ *  V2 box for every hypothesis would exceed `budget`, we repeat the
+ *  calculation using fewer new sats. If it is impossible to add a sufficient
+ *  number of sats to make progress towards an RTK solution (< 4 double
+ *  differences total) we return without adding any.
  */
 static u8 inclusion_loop_body(
        u8 num_dds_to_add,
-       memory_pool_t *pool, u8 state_dim, u8 num_addible_dds,
+       hypothesis_store_t *pool, u8 state_dim, u8 num_addible_dds,
        const double *ordered_N_cov, const double *ordered_N_mean,
        const double *addible_cov, const double *addible_mean,
-       intersection_count_t *x, u32 *full_size_return)
+       intersection_count_t *x, u32 budget,
+       u32 *full_size_return, u32 *itr_size_return)
 {
   x->new_dim = num_dds_to_add;
-  s32 current_num_hyps = memory_pool_n_allocated(pool);
-  u32 max_num_hyps = memory_pool_n_elements(pool);
+  s32 current_num_hyps = pool->num_hyps;
+  u32 max_num_hyps = pool->max_hyps;
 
   u8 num_current_dds = x->old_dim;
   u8 full_dim = num_current_dds + num_dds_to_add;
 
-  /* TODO(dsk) tune this constant.
-   * This determines how many hypotheses will be examined by the intersection
-   * memory_pool fold below. */
-  u32 max_iteration_size = 10000;
-
   /* Calculate the two decorrelation matrices and their related matrices. */
   u32 full_size =
     float_to_decor(ordered_N_cov, ordered_N_mean,
         state_dim, full_dim,
-        x->box_lower_bounds, x->box_upper_bounds, x->Z1, x->Z1_inv);
+        x->box_lower_bounds, x->box_upper_bounds, x->Z1, x->Z1_inv, NULL);
 
 
   /* Useful for debugging. */
   *full_size_return = full_size;
 
-  u32 box_size =
+  u32 itr_size =
     float_to_decor(addible_cov, addible_mean,
       num_addible_dds, num_dds_to_add,
-      x->itr_lower_bounds, x->itr_upper_bounds, x->Z2, x->Z2_inv);
+      x->itr_lower_bounds, x->itr_upper_bounds, x->Z2, x->Z2_inv,
+      x->itr_search);
+  *itr_size_return = itr_size;
 
   compute_Z(num_current_dds, num_dds_to_add, x->Z1, x->Z2_inv, x->Z);
 
+  if ((u64)itr_size * current_num_hyps > budget) {
+    /* Can't add sats for this value of num_dds_to_add. */
+    return 0;
+  }
+
   if (full_size <= max_num_hyps) {
-    log_debug("BRANCH 1: num dds: %i. full size: %"PRIu32", itr size: %"PRIu32"", num_dds_to_add, full_size, box_size);
+    log_debug("BRANCH 1: num dds: %i. full size: %"PRIu32", itr size: %"PRIu32"", num_dds_to_add, full_size, itr_size);
     /* The hypotheses generated for these double-differences fit. */
-    return 1;
-  } else if (box_size * current_num_hyps <= max_iteration_size) {
-    log_debug("BRANCH 2: num dds: %i. full size: %"PRIu32", itr size: %"PRIu32"", num_dds_to_add, full_size, box_size);
-
-    x->intersection_size = 0;
-
-    /* Do intersection */
-    memory_pool_fold(pool, (void *)x, &fold_intersection_count);
-
-    log_debug("intersection size: %i", x->intersection_size);
-
-    if (x->intersection_size < max_num_hyps) {
-      /* The hypotheses generated for these double-differences fit. */
-      return 1;
-    }
+  } else {
+    log_debug("BRANCH 2: num dds: %i. full size: %"PRIu32", itr size: %"PRIu32"", num_dds_to_add, full_size, itr_size);
+    /* Cheap enough to generate; if they don't all fit, add_sats() keeps
+     * the most likely. */
   }
-
-  /* Can't add sats for this value of num_dds_to_add. */
-  return 0;
+  return 1;
 }
 
 /** Perform the inclusion step of adding satellites to the amb test (as we can).
@@ -1102,7 +1250,8 @@ static u8 inclusion_loop_body(
  *                                the float filter and the amb_test last timestep.
  * \param float_sats              The sats for the KF.
  * \param float_mean              The KF estimate
- * \param float_cov_U             The KF covariance U (from UDU decomposition)
+ * \param float_cov_U             The KF covariance U (from UDU decomposition),
+ *                                packed by rows
  * \param float_cov_D             The KF covariance D (from UDU decomposition)
  * \returns 0 if we didn't change amb_test's sats
  *          1 if we changed the sats, but don't need to start over.
@@ -1124,7 +1273,7 @@ u8 ambiguity_sat_inclusion(ambiguity_test_t *amb_test, const u8 num_dds_in_inter
   gnss_signal_t float_sids[float_sats->num_sats];
   double N_mean[state_dim];
 
-  matrix_reconstruct_udu(state_dim, float_cov_U, float_cov_D, float_cov);
+  matrix_reconstruct_udu_packed(state_dim, float_cov_U, float_cov_D, float_cov);
   memcpy(float_sids, float_sats->sids, float_sats->num_sats * sizeof(gnss_signal_t));
   memcpy(N_mean, float_mean, (float_sats->num_sats-1) * sizeof(double));
 
@@ -1212,6 +1361,7 @@ u8 ambiguity_sat_inclusion(ambiguity_test_t *amb_test, const u8 num_dds_in_inter
   z_t Z2[num_addible_dds * num_addible_dds];
   z_t Z2_inv[num_addible_dds * num_addible_dds];
   z_t Z1_Z2_inv[state_dim * num_addible_dds];
+  lambda_enum_t itr_search;
 
   intersection_count_t x;
   x.new_dim = num_addible_dds;
@@ -1228,17 +1378,37 @@ u8 ambiguity_sat_inclusion(ambiguity_test_t *amb_test, const u8 num_dds_in_inter
   x.Z2 = Z2;
   x.Z1_inv = Z1_inv;
   x.Z2_inv = Z2_inv;
+  x.itr_search = &itr_search;
 
   u32 full_size = 0;
+  u32 itr_size = 0;
 
   /* Check to see if min_dds_to_add will not fit. If so, don't bother
    * iterating through all the sats below. */
   u8 fits = inclusion_loop_body(
       min_dds_to_add, amb_test->pool, state_dim, num_addible_dds,
       N_cov_ordered, N_mean_ordered, addible_float_cov, addible_float_mean,
-      &x, &full_size);
+      &x, amb_test->inclusion_budget, &full_size, &itr_size);
   if (fits == 0) {
-    return 0;
+    /* Expanding every hypothesis is over budget. If the few that fit in it
+     * hold practically all the probability, expand just those; the rest
+     * would be pruned soon anyway. Otherwise wait for the pool to
+     * concentrate. */
+    u32 num_to_expand = itr_size ? amb_test->inclusion_budget / itr_size : 0;
+    if (num_to_expand == 0 ||
+        hypothesis_store_top_prob(amb_test->pool, num_to_expand) <
+          1 - INCLUSION_MAX_DROPPED_PROB) {
+      log_debug("BRANCH 3: over budget. itr size: %"PRIu32"", itr_size);
+      return 0;
+    }
+    log_debug("BRANCH 4: expanding the %"PRIu32" most likely hypotheses",
+              num_to_expand);
+    s32 num_hyps = add_sats(amb_test, ref_sid, new_dd_sids, &x, state_dim,
+                            N_cov_ordered, N_mean_ordered, num_to_expand);
+    if (num_hyps < 0) {
+      return 0;
+    }
+    return num_hyps == 0 ? 2 : 1;
   }
 
   /* Try to add as many dds to the IAR as possible; return 0 if no amount fits. */
@@ -1249,13 +1419,17 @@ u8 ambiguity_sat_inclusion(ambiguity_test_t *amb_test, const u8 num_dds_in_inter
     u8 fits = inclusion_loop_body(
         num_dds_to_add, amb_test->pool, state_dim, num_addible_dds,
         N_cov_ordered, N_mean_ordered, addible_float_cov, addible_float_mean,
-        &x, &full_size);
+        &x, amb_test->inclusion_budget, &full_size, &itr_size);
 
     if (fits == 1) {
       /* Sats should be added. The struct x contains new_dim, the correct
        * number to add, along with the matrices needed to do so . */
-      s32 num_hyps = add_sats(amb_test, ref_sid, new_dd_sids, &x);
-      if (num_hyps == 0) {
+      s32 num_hyps = add_sats(amb_test, ref_sid, new_dd_sids, &x, state_dim,
+                              N_cov_ordered, N_mean_ordered,
+                              amb_test->pool->num_hyps);
+      if (num_hyps < 0) {
+        return 0;
+      } else if (num_hyps == 0) {
         return 2;
       } else {
         return 1;
@@ -1267,95 +1441,18 @@ u8 ambiguity_sat_inclusion(ambiguity_test_t *amb_test, const u8 num_dds_in_inter
   return 0;
 }
 
-/* TODO(dsk) remove dead code. */
-u8 ambiguity_sat_inclusion_old(ambiguity_test_t *amb_test, u8 num_dds_in_intersection,
-                               sats_management_t *float_sats, double *float_mean,
-                               double *float_cov_U, double *float_cov_D)
-{
-  DEBUG_ENTRY();
-
-  if (float_sats->num_sats <= num_dds_in_intersection + 1 || float_sats->num_sats < 2) {
-    log_debug("no need for inclusion");
-    DEBUG_EXIT();
-    return 0;
-  }
-
-  u32 state_dim = float_sats->num_sats-1;
-  double float_cov[state_dim * state_dim];
-  matrix_reconstruct_udu(state_dim, float_cov_U, float_cov_D, float_cov);
-  gnss_signal_t float_sids[float_sats->num_sats];
-  memcpy(float_sids, float_sats->sids, float_sats->num_sats * sizeof(gnss_signal_t));
-  double N_mean[float_sats->num_sats-1];
-  memcpy(N_mean, float_mean, (float_sats->num_sats-1) * sizeof(double));
-  /* After this block, float_prns will have the correct reference,
-   * as will N_cov and N_mean */
-  if (amb_test->sats.num_sats >= 2 &&
-      !sid_is_equal(amb_test->sats.sids[0], float_sats->sids[0])) {
-    gnss_signal_t old_sids[float_sats->num_sats];
-    memcpy(old_sids, float_sats->sids, float_sats->num_sats * sizeof(gnss_signal_t));
-    set_reference_sat_of_sids(amb_test->sats.sids[0], float_sats->num_sats, float_sids);
-    rebase_mean_N(N_mean, float_sats->num_sats, old_sids, float_sids);
-    rebase_covariance_sigma(float_cov, float_sats->num_sats, old_sids, float_sids);
-  }
-  double N_cov[(float_sats->num_sats-1) * (float_sats->num_sats-1)];
-  memcpy(N_cov, float_cov, state_dim * state_dim * sizeof(double)); //TODO we can just use N_cov throughout
-
-  /* First get all the prns we might add and their covariances. */
-  u8 i = 1;
-  u8 j = 1;
-  u8 num_addible_dds = 0;
-  u8 ndxs_of_new_dds_in_float[MAX_CHANNELS-1];
-  gnss_signal_t new_dd_sids[MAX_CHANNELS-1];
-  while (j < float_sats->num_sats) {
-    if (i < amb_test->sats.num_sats &&
-        sid_is_equal(amb_test->sats.sids[i], float_sids[j])) {
-      i++;
-      j++;
-    } else { //else float_sats[j] is a new one
-      ndxs_of_new_dds_in_float[num_addible_dds] = j-1;
-      new_dd_sids[num_addible_dds] = float_sids[j];
-      num_addible_dds++;
-      j++;
-    }
-  }
-
-  double addible_float_cov[num_addible_dds * num_addible_dds];
-  double addible_float_mean[num_addible_dds];
-  for (i=0; i < num_addible_dds; i++) {
-    for (j=0; j < num_addible_dds; j++) {
-      addible_float_cov[i*num_addible_dds + j] =
-        N_cov[ndxs_of_new_dds_in_float[i]*(float_sats->num_sats-1) + ndxs_of_new_dds_in_float[j]];
-    }
-    addible_float_mean[i] = N_mean[ndxs_of_new_dds_in_float[i]];
-  }
-
-  /* Find the largest set of sats we can add */
-  z_t Z_inv[num_addible_dds * num_addible_dds];
-  z_t lower_bounds[num_addible_dds];
-  z_t upper_bounds[num_addible_dds];
-  u8 num_dds_to_add;
-  s8 add_any_sats = determine_sats_addition(amb_test,
-                                            addible_float_cov, num_addible_dds, addible_float_mean,
-                                            lower_bounds, upper_bounds, &num_dds_to_add,
-                                            Z_inv);
-  if (add_any_sats == 1) {
-    add_sats_old(amb_test, float_sids[0], num_dds_to_add, new_dd_sids, lower_bounds, upper_bounds, Z_inv);
-    log_debug("adding sats");
-    DEBUG_EXIT();
-    return 1;
-  } else {
-    log_debug("not adding sats");
-    DEBUG_EXIT();
-    return 0;
-  }
-}
-
+/* Decorrelates the first num_dds_to_add float ambiguities and bounds their
+ * likely values in the decorrelated space by a box NUM_SEARCH_STDS standard
+ * deviations wide each way. If search is given it is also set up to
+ * enumerate the integer points inside the ellipsoid of the same radius, and
+ * the number of points returned is the lesser of the size of the box and an
+ * upper bound on how many it yields. */
 z_t float_to_decor(const double *addible_float_cov,
                    const double *addible_float_mean,
                    u8 num_addible_dds,
                    u8 num_dds_to_add,
                    z_t *lower_bounds, z_t *upper_bounds,
-                   z_t *Z, z_t *Z_inv)
+                   z_t *Z, z_t *Z_inv, lambda_enum_t *search)
 {
   u8 dim = num_dds_to_add;
   double Z_[dim * dim];
@@ -1373,7 +1470,12 @@ z_t float_to_decor(const double *addible_float_cov,
     }
   }
 
-  lambda_reduction(num_dds_to_add, added_float_cov, Z_);
+  if (search) {
+    lambda_enum_init(search, num_dds_to_add, addible_float_mean,
+                     added_float_cov, NUM_SEARCH_STDS * NUM_SEARCH_STDS, Z_);
+  } else {
+    lambda_reduction(num_dds_to_add, added_float_cov, Z_);
+  }
 
   double decor_float_cov_diag[num_dds_to_add];
 
@@ -1405,6 +1507,15 @@ z_t float_to_decor(const double *addible_float_cov,
     lower_bounds[i] = lround(floor(decor_float_mean[i] - search_distance));
     new_hyp_set_cardinality *= upper_bounds[i] - lower_bounds[i] + 1;
   }
+  if (search) {
+    /* Only the points inside the ellipsoid will be generated. Its volume
+     * undercounts them when it is thin compared to the integer grid, so
+     * take a bound that can't. */
+    double bound = floor(lambda_enum_bound(search));
+    if (bound < new_hyp_set_cardinality) {
+      new_hyp_set_cardinality = MAX(bound, 1);
+    }
+  }
 
   if (Z_inv) {
     round_matrix(dim, dim, Z_, Z);
@@ -1415,44 +1526,6 @@ z_t float_to_decor(const double *addible_float_cov,
   return new_hyp_set_cardinality;
 }
 
-/* TODO(dsk) remove this function. */
-s8 determine_sats_addition(ambiguity_test_t *amb_test,
-                           double *float_N_cov, u8 num_float_dds, double *float_N_mean,
-                           z_t *lower_bounds, z_t *upper_bounds, u8 *num_dds_to_add,
-                           z_t *Z_inv)
-{
-  u8 num_current_dds = CLAMP_DIFF(amb_test->sats.num_sats, 1);
-  /* num_current_dds + min_dds_to_add = 4,
-   * so that we have a nullspace projector. */
-  u8 min_dds_to_add = MAX(1, 4 - num_current_dds);
-
-  u32 max_new_hyps_cardinality;
-  s32 current_num_hyps = memory_pool_n_allocated(amb_test->pool);
-  u32 max_num_hyps = memory_pool_n_elements(amb_test->pool);
-  if (current_num_hyps <= 0) {
-    max_new_hyps_cardinality = max_num_hyps;
-  } else {
-    max_new_hyps_cardinality = max_num_hyps / current_num_hyps;
-  }
-
-  *num_dds_to_add = num_float_dds;
-  z_t Z[num_float_dds * num_float_dds];
-  while (*num_dds_to_add >= min_dds_to_add) {
-    u32 new_hyp_set_cardinality = float_to_decor(float_N_cov,
-                                                 float_N_mean,
-                                                 num_float_dds,
-                                                 *num_dds_to_add,
-                                                 lower_bounds, upper_bounds, Z, Z_inv);
-    if (new_hyp_set_cardinality <= max_new_hyps_cardinality) {
-      return 1;
-    }
-    else {
-      *num_dds_to_add -= 1;
-    }
-  }
-  return -1;
-}
-
 /** Add/drop satellites from the ambiguity test, changing reference if needed.
  * Does the structural change on the satellite set, dropping sats if they
  * aren't in the sdiffs anymore. We add new sats if we can fit them, and if the
@@ -1467,7 +1540,7 @@ s8 determine_sats_addition(ambiguity_test_t *amb_test,
  *                            cov.
  * \param float_mean          The KF state estimate.
  * \param float_cov_U         The KF state estimate covariance U in UDU
- *                            decompositon.
+ *                            decompositon, packed by rows.
  * \param float_cov_D         The KF state estimate covariance D in UDU
  *                            decompositon.
  * \param is_bad_measurement  Whether we should trust this measurement.
@@ -1582,154 +1655,80 @@ u8 find_indices_of_intersection_sats(const ambiguity_test_t *amb_test, const u8
   return k;
 }
 
-/* TODO(dsk) remove dead code. */
-typedef struct {
-  z_t upper_bounds[MAX_CHANNELS-1];
-  z_t lower_bounds[MAX_CHANNELS-1];
-  z_t counter[MAX_CHANNELS-1];
-  u8 ndxs_of_old_in_new[MAX_CHANNELS-1];
-  u8 ndxs_of_added_in_new[MAX_CHANNELS-1];
-  u8 num_added_dds;
-  u8 num_old_dds;
-  z_t Z_inv[(MAX_CHANNELS-1) * (MAX_CHANNELS-1)];
-} generate_hypothesis_state_t;
-
-static s8 generate_next_hypothesis(void *x_, u32 n)
+/* Fills in the pivoted Cholesky factor of the residual covariance inverse.
+ * Pivoting on the largest remaining diagonal element puts the most heavily
+ * weighted directions of the residual first. */
+static void factor_residual_covariance_inverse(residual_mtxs_t *res_mtxs)
 {
-  (void) n;
-  generate_hypothesis_state_t *x = (generate_hypothesis_state_t *)x_;
-
-  if (memcmp(x->upper_bounds, x->counter, x->num_added_dds * sizeof(z_t)) == 0) {
-    /* counter has reached upper_bound, terminate iteration. */
-    return 0;
+  integer res_dim = res_mtxs->res_dim;
+  if (res_dim == 0) {
+    return;
   }
-
-  for (u8 i=0; i<x->num_added_dds; i++) {
-    x->counter[i]++;
-    if (x->counter[i] > x->upper_bounds[i]) {
-      /* counter[i] has reached maximum, reset counter[i]
-       * to lower[i] and 'carry' to next 'digit' */
-      x->counter[i] = x->lower_bounds[i];
-    } else {
-      /* Incremented, so now we have the next counter value. */
-      break;
-    }
+  double chol[res_dim * res_dim];
+  matrix_unpack_upper(res_dim, res_mtxs->half_res_cov_inv, chol);
+  /* Lower in column major, so upper here, as in
+   * assign_residual_covariance_inverse(). */
+  char uplo = 'L';
+  integer piv[res_dim];
+  integer rank;
+  double tol = -1;
+  double work[2 * res_dim];
+  integer info;
+  dpstrf_(&uplo, &res_dim, chol, &res_dim, piv, &rank, &tol, work, &info);
+  if (info != 0) {
+    log_warn("Residual covariance inverse has rank %d of %d",
+             (int)rank, (int)res_dim);
   }
-
-  return 1;
+  for (u8 i=0; i < res_dim; i++) {
+    res_mtxs->chol_perm[i] = piv[i] - 1;
+  }
+  matrix_pack_upper(res_dim, chol, res_mtxs->half_res_cov_inv_chol);
 }
 
-static void hypothesis_prod(element_t *new_, void *x_, u32 n, element_t *elem_)
+/* Sets up everything in the residual matrices that only depends on the
+ * geometry. */
+static void init_residual_geometry(residual_mtxs_t *res_mtxs, u8 num_dds,
+                                   double *DE_mtx)
 {
-  (void) elem_;
-  (void) n;
-  generate_hypothesis_state_t *x = (generate_hypothesis_state_t *)x_;
-  hypothesis_t *new = (hypothesis_t *) new_;
-
-  u8 *ndxs_of_old_in_new = x->ndxs_of_old_in_new;
-  u8 *ndxs_of_added_in_new = x->ndxs_of_added_in_new;
-
-  s32 old_N[MAX_CHANNELS-1];
-  memcpy(old_N, new->N, x->num_old_dds * sizeof(z_t));
-
-  for (u8 i=0; i < x->num_old_dds; i++) {
-    new->N[ndxs_of_old_in_new[i]] = old_N[i];
-  }
-  for (u8 i=0; i<x->num_added_dds; i++) {
-    new->N[ndxs_of_added_in_new[i]] = 0;
-    for (u8 j=0; j<x->num_added_dds; j++) {
-      new->N[ndxs_of_added_in_new[i]] += x->Z_inv[i*x->num_added_dds + j] * x->counter[j];
-    }
-  }
-
-  /* NOTE: new->ll remains the same as elem->ll as p := exp(ll) is invariant under a
-   * constant multiplicative factor common to all hypotheses. TODO: reference^2 document (currently lives in page 3/5.6/2014 of ian's notebook) */
+  res_mtxs->res_dim = num_dds + CLAMP_DIFF(num_dds, 3);
+  res_mtxs->null_space_dim = CLAMP_DIFF(num_dds, 3);
+  res_mtxs->generation++;
+  res_mtxs->num_dds = num_dds;
+  memcpy(res_mtxs->DE_mtx, DE_mtx, num_dds * 3 * sizeof(double));
+  res_mtxs->phase_var = -1;
+  res_mtxs->code_var = -1;
+  assign_phase_obs_null_basis(num_dds, DE_mtx, res_mtxs->null_projector);
 }
 
-/* TODO(dsk) remove dead code. */
-static s8 no_init(void *x, element_t *elem) {
-  (void) x; (void) elem;
-  return 1;
-}
-void add_sats_old(ambiguity_test_t *amb_test,
-                  gnss_signal_t ref_sid,
-                  u32 num_added_dds, gnss_signal_t *added_sids,
-                  z_t *lower_bounds, z_t *upper_bounds,
-                  z_t *Z_inv)
+void init_residual_matrices(residual_mtxs_t *res_mtxs, u8 num_dds, double *DE_mtx, double *obs_cov)
 {
-  /* Make a generator that iterates over the new hypotheses. */
-  generate_hypothesis_state_t x0;
-  memcpy(x0.upper_bounds, upper_bounds, num_added_dds * sizeof(z_t));
-  memcpy(x0.lower_bounds, lower_bounds, num_added_dds * sizeof(z_t));
-  memcpy(x0.counter, lower_bounds, num_added_dds * sizeof(z_t));
-
-  x0.num_added_dds = num_added_dds;
-  x0.num_old_dds = CLAMP_DIFF(amb_test->sats.num_sats, 1);
-
-  /* Construct the mapping from the old prn indices into the new,
-   * and from the added prn indices into the new. */
-  u8 i = 0;
-  u8 j = 0;
-  u8 k = 0;
-  gnss_signal_t old_sids[x0.num_old_dds];
-  memcpy(old_sids, &amb_test->sats.sids[1], x0.num_old_dds * sizeof(gnss_signal_t));
-  while (k < x0.num_old_dds + num_added_dds) { //TODO should this be one less, since its just DDs?
-    if (j == x0.num_added_dds ||
-        ((sid_compare(old_sids[i], added_sids[j]) < 0) && i != x0.num_old_dds)) {
-      x0.ndxs_of_old_in_new[i] = k;
-      amb_test->sats.sids[k+1] = old_sids[i];
-      i++;
-      k++;
-    } else if (i == x0.num_old_dds ||
-               (sid_compare(old_sids[i], added_sids[j]) > 0)) {
-      x0.ndxs_of_added_in_new[j] = k;
-      amb_test->sats.sids[k+1] = added_sids[j];
-      j++;
-      k++;
-    } else {
-      log_error("add_sats_old: impossible condition reached.");
-      printf("old_prns = [");
-      for (u8 ii=0; ii < x0.num_old_dds; ii++) {
-        printf("%d, ",old_sids[ii].sat);
-      }
-      printf("]\n");
-      printf("added_sids = [");
-      for (u8 jj=0; jj < x0.num_old_dds; jj++) {
-        printf("%d, ", added_sids[jj].sat);
-      }
-      printf("]\n");
-      break;
-    }
-  }
-  amb_test->sats.sids[0] = ref_sid;
-  amb_test->sats.num_sats = k+1;
-
-  if (x0.num_old_dds == 0 && memory_pool_n_allocated(amb_test->pool) == 0) {
-    hypothesis_t *empty_element = (hypothesis_t *)memory_pool_add(amb_test->pool); // only in init
-    /* Start with ll = 0, just for the sake of argument. */
-    empty_element->ll = 0; // only in init
-  }
-
-  log_info("IAR: %"PRIu32" hypotheses before inclusion", memory_pool_n_allocated(amb_test->pool));
-  if (DEBUG) {
-    memory_pool_map(amb_test->pool, &x0.num_old_dds, &print_hyp);
-  }
-  memcpy(x0.Z_inv, Z_inv, num_added_dds * num_added_dds * sizeof(z_t));
-  /* Take the product of our current hypothesis state with the generator, recorrelating the new ones as we go. */
-  memory_pool_product_generator(amb_test->pool, &x0, MAX_HYPOTHESES, sizeof(x0),
-                                &no_init, &generate_next_hypothesis, &hypothesis_prod);
-  log_info("IAR: updates to %"PRIu32"", memory_pool_n_allocated(amb_test->pool));
-  if (DEBUG) {
-    memory_pool_map(amb_test->pool, &k, &print_hyp);
-  }
+  init_residual_geometry(res_mtxs, num_dds, DE_mtx);
+  u32 res_dim = res_mtxs->res_dim;
+  double r_cov_inv[res_dim * res_dim];
+  assign_residual_covariance_inverse(num_dds, obs_cov, res_mtxs->null_projector, r_cov_inv);
+  matrix_pack_upper(res_dim, r_cov_inv, res_mtxs->half_res_cov_inv);
+  factor_residual_covariance_inverse(res_mtxs);
 }
 
-void init_residual_matrices(residual_mtxs_t *res_mtxs, u8 num_dds, double *DE_mtx, double *obs_cov)
+/** As init_residual_matrices(), for the DD observation covariance of
+ * independent single differences, see
+ * assign_residual_covariance_inverse_from_vars().
+ *
+ * \param res_mtxs  The residual matrices to initialize.
+ * \param num_dds   Number of double differenced ambiguities.
+ * \param DE_mtx    The `num_dds x 3` DE matrix.
+ * \param phase_var Variance of the single differenced carrier phases.
+ * \param code_var  Variance of the single differenced pseudoranges.
+ */
+void init_residual_matrices_from_vars(residual_mtxs_t *res_mtxs, u8 num_dds,
+                                      double *DE_mtx, double phase_var,
+                                      double code_var)
 {
-  res_mtxs->res_dim = num_dds + CLAMP_DIFF(num_dds, 3);
-  res_mtxs->null_space_dim = CLAMP_DIFF(num_dds, 3);
-  assign_phase_obs_null_basis(num_dds, DE_mtx, res_mtxs->null_projector);
-  assign_residual_covariance_inverse(num_dds, obs_cov, res_mtxs->null_projector, res_mtxs->half_res_cov_inv);
+  init_residual_geometry(res_mtxs, num_dds, DE_mtx);
+  assign_residual_covariance_inverse_from_vars(num_dds, phase_var, code_var,
+                                               res_mtxs->null_projector,
+                                               res_mtxs->half_res_cov_inv);
+  factor_residual_covariance_inverse(res_mtxs);
 }
 
 void assign_residual_covariance_inverse(u8 num_dds, double *obs_cov, double *q, double *r_cov_inv) //TODO make this more efficient (e.g. via page 3/6.2-3/2014 of ian's notebook)
@@ -1788,6 +1787,76 @@ void assign_residual_covariance_inverse(u8 num_dds, double *obs_cov, double *q,
   // MAT_PRINTF(r_cov_inv, res_dim, res_dim);
 }
 
+/** Assigns what assign_residual_covariance_inverse() does, for the DD
+ * observation covariance of independent single differences,
+ *   ( phase_var * (I + 1*1^T)   0                        )
+ *   ( 0                         code_var * (I + 1*1^T)   )
+ * in closed form, rather than by a dense product and factorization.
+ *
+ * The residual covariance has the blocks given in get_kf_matrices() in
+ * amb_kf.c. Inverting it blockwise, with c = code_var / lambda^2,
+ * s = phase_var + c, a = q * 1, b = q^T * a and k = 1 + a^T * a, gives
+ *   ( s / (phase_var * c) * (I - a*a^T / k)   -(q - a*b^T / k) / c )
+ *   ( ...    (I - 1*1^T / (n+1)) / s + phase_var / (s * c) * (q^T*q - b*b^T / k) )
+ * of which this assigns half, packed by rows (see matrix_pack_upper()).
+ *
+ * \param num_dds   Number of double differenced ambiguities, n.
+ * \param phase_var Variance of the single differenced carrier phases.
+ * \param code_var  Variance of the single differenced pseudoranges.
+ * \param q         Null basis with orthonormal rows, as from
+ *                  assign_phase_obs_null_basis().
+ * \param r_cov_inv Output half inverse residual covariance, packed.
+ */
+void assign_residual_covariance_inverse_from_vars(u8 num_dds, double phase_var,
+                                                  double code_var,
+                                                  const double *q,
+                                                  double *r_cov_inv)
+{
+  u8 null_dim = CLAMP_DIFF(num_dds, 3);
+  u32 res_dim = num_dds + null_dim;
+  double c = code_var / (GPS_L1_LAMBDA_NO_VAC * GPS_L1_LAMBDA_NO_VAC);
+  double s = phase_var + c;
+
+  double a[MAX_CHANNELS-4];
+  double k = 1;
+  for (u8 i=0; i<null_dim; i++) {
+    a[i] = 0;
+    for (u8 j=0; j<num_dds; j++) {
+      a[i] += q[i*num_dds + j];
+    }
+    k += a[i] * a[i];
+  }
+  double b[MAX_CHANNELS-1];
+  for (u8 j=0; j<num_dds; j++) {
+    b[j] = 0;
+    for (u8 i=0; i<null_dim; i++) {
+      b[j] += q[i*num_dds + j] * a[i];
+    }
+  }
+
+  for (u8 i=0; i<null_dim; i++) {
+    for (u8 j=i; j<null_dim; j++) {
+      r_cov_inv[MATRIX_PACKED_NDX(res_dim, i, j)] =
+        0.5 * s / (phase_var * c) * ((i == j) - a[i] * a[j] / k);
+    }
+    for (u8 j=0; j<num_dds; j++) {
+      r_cov_inv[MATRIX_PACKED_NDX(res_dim, i, null_dim + j)] =
+        -0.5 / c * (q[i*num_dds + j] - a[i] * b[j] / k);
+    }
+  }
+  for (u8 i=0; i<num_dds; i++) {
+    for (u8 j=i; j<num_dds; j++) {
+      double qtq = 0;
+      for (u8 l=0; l<null_dim; l++) {
+        qtq += q[l*num_dds + i] * q[l*num_dds + j];
+      }
+      r_cov_inv[MATRIX_PACKED_NDX(res_dim, null_dim + i, null_dim + j)] =
+        0.5 * (((i == j) - 1.0 / (num_dds + 1)) / s +
+               phase_var / (s * c) * (qtq - b[i] * b[j] / k));
+    }
+  }
+}
+
 void assign_r_vec(residual_mtxs_t *res_mtxs, u8 num_dds, double *dd_measurements, double *r_vec)
 {
   cblas_dgemv(CblasRowMajor, CblasNoTrans,
@@ -1823,9 +1892,9 @@ double get_quadratic_term(residual_mtxs_t *res_mtxs, u8 num_dds, double *hypothe
   }
   // VEC_PRINTF(r, res_mtxs->res_dim);
   double half_sig_dot_r[res_mtxs->res_dim];
-  cblas_dsymv(CblasRowMajor, CblasUpper,
+  cblas_dspmv(CblasRowMajor, CblasUpper,
                  res_mtxs->res_dim,
-                 1, res_mtxs->half_res_cov_inv, res_mtxs->res_dim,
+                 1, res_mtxs->half_res_cov_inv,
                  r, 1,
                  0, half_sig_dot_r, 1);
   // VEC_PRINTF(half_sig_dot_r, res_mtxs->res_dim);
@@ -1836,16 +1905,59 @@ double get_quadratic_term(residual_mtxs_t *res_mtxs, u8 num_dds, double *hypothe
   return quad_term;
 }
 
-void print_hyp(void *arg, element_t *elem)
+/** Evaluates get_quadratic_term(), giving up as soon as the result is known
+ * to be at most `-bound`.
+ * The residual is weighted through the pivoted Cholesky factor of the
+ * residual covariance inverse, which turns the quadratic form into a running
+ * sum of squares whose heaviest terms come first. A hypothesis that is going
+ * to be rejected usually overshoots the bound within the first few.
+ *
+ * \param res_mtxs   Residual matrices, see init_residual_matrices().
+ * \param num_dds    Length of the hypothesis.
+ * \param hypothesis The ambiguity vector to evaluate.
+ * \param r_vec      The residual vector of the measurement, see assign_r_vec().
+ * \param bound      Magnitude of the quadratic term beyond which its exact
+ *                   value isn't needed.
+ * \return The quadratic term if it is greater than `-bound`, otherwise a
+ *         value between it and `-bound`.
+ */
+double get_quadratic_term_bounded(const residual_mtxs_t *res_mtxs, u8 num_dds,
+                                  const double *hypothesis,
+                                  const double *r_vec, double bound)
 {
-  u8 num_dds = *( (u8 *) arg );
+  u32 res_dim = res_mtxs->res_dim;
+  u8 null_dim = res_mtxs->null_space_dim;
+  const double *R = res_mtxs->half_res_cov_inv_chol;
+
+  /* The residual is r_vec - [Q; I] hypothesis. */
+  double r[2*MAX_CHANNELS-5];
+  for (u8 i=0; i<null_dim; i++) {
+    r[i] = r_vec[i] - vector_dot(num_dds, &res_mtxs->null_projector[i*num_dds],
+                                 hypothesis);
+  }
+  for (u8 i=0; i<num_dds; i++) {
+    r[null_dim + i] = r_vec[null_dim + i] - hypothesis[i];
+  }
+
+  double sum = 0;
+  for (u32 j=0; j<res_dim && sum < bound; j++) {
+    const double *R_j = &R[MATRIX_PACKED_NDX(res_dim, j, j)];
+    double u = 0;
+    for (u32 k=j; k<res_dim; k++) {
+      u += R_j[k - j] * r[res_mtxs->chol_perm[k]];
+    }
+    sum += u * u;
+  }
+  return -sum;
+}
 
-  hypothesis_t *hyp = (hypothesis_t *)elem;
+void print_hyp(u8 num_dds, const s32 *N, float ll)
+{
   printf("[");
   for (u8 i=0; i< num_dds; i++) {
-    printf("%"PRId32", ", hyp->N[i]);
+    printf("%"PRId32", ", N[i]);
   }
-  printf("]: %f\n", hyp->ll);
+  printf("]: %f\n", ll);
 }
 
 /** Prints a s64 valued matrix.
@@ -15,6 +15,7 @@
 #include <assert.h>
 #include "logging.h"
 #include "amb_kf.h"
+#include "amb_kf_f32.h"
 #include "baseline.h"
 #include "observation.h"
 #include "dgnss_management.h"
@@ -23,9 +24,22 @@
 #include "ambiguity_test.h"
 
 nkf_t nkf;
+#ifdef LIBSWIFTNAV_FILTER_F32
+/* The mixed precision filter doing the updates of `nkf`, see dgnss_update().
+ * Its state is copied back to `nkf` after every update, and only needs to be
+ * converted from it again once `nkf` has been changed some other way. */
+static nkf_f32_t nkf_f32;
+static bool nkf_f32_state_valid;
+#endif
 sats_management_t sats_management;
 ambiguity_test_t ambiguity_test;
 
+/* Snapshot buffers, see dgnss_snapshot_acquire(). */
+static dgnss_snapshot_t snapshots[DGNSS_SNAPSHOT_SLOTS];
+static u32 snapshot_readers[DGNSS_SNAPSHOT_SLOTS];
+static u32 snapshot_current;
+static u32 snapshot_epoch;
+
 dgnss_settings_t dgnss_settings = {
   .phase_var_test = DEFAULT_PHASE_VAR_TEST,
   .code_var_test = DEFAULT_CODE_VAR_TEST,
@@ -34,6 +48,7 @@ dgnss_settings_t dgnss_settings = {
   .amb_drift_var = DEFAULT_AMB_DRIFT_VAR,
   .amb_init_var = DEFAULT_AMB_INIT_VAR,
   .new_int_var = DEFAULT_NEW_INT_VAR,
+  .de_tolerance = DEFAULT_DE_TOLERANCE,
 };
 
 void dgnss_set_settings(double phase_var_test, double code_var_test,
@@ -128,6 +143,9 @@ void dgnss_init(u8 num_sats, sdiff_t *sdiffs, double receiver_ecef[3])
     dgnss_settings.amb_init_var,
     num_sats, corrected_sdiffs, dd_measurements, receiver_ecef
   );
+#ifdef LIBSWIFTNAV_FILTER_F32
+  nkf_f32_state_valid = false;
+#endif
 
   DEBUG_EXIT();
 }
@@ -150,6 +168,9 @@ void dgnss_rebase_ref(u8 num_sdiffs, sdiff_t *sdiffs, double receiver_ecef[3], g
   else if (sats_management_code == NEW_REF) {
     /* do everything related to changing the reference sat here */
     rebase_nkf(&nkf, sats_management.num_sats, &old_sids[0], &sats_management.sids[0]);
+#ifdef LIBSWIFTNAV_FILTER_F32
+    nkf_f32_state_valid = false;
+#endif
   }
 }
 
@@ -233,6 +254,9 @@ static void dgnss_update_sats(u8 num_sdiffs, double receiver_ecef[3],
     }
 
     update_sats_sats_management(&sats_management, num_sdiffs-1, &sdiffs_with_ref_first[1]);
+#ifdef LIBSWIFTNAV_FILTER_F32
+    nkf_f32_state_valid = false;
+#endif
   }
   else {
     set_nkf_matrices(
@@ -245,6 +269,51 @@ static void dgnss_update_sats(u8 num_sdiffs, double receiver_ecef[3],
   DEBUG_EXIT();
 }
 
+/** Publish the current float filter and IAR state as a new snapshot.
+ * Called by the (single) thread running dgnss_update(). The snapshot is
+ * written into a buffer no reader holds and then made current with a single
+ * atomic store, so the publisher never waits on readers. If every spare
+ * buffer is pinned by a reader the epoch is simply not published.
+ */
+static void dgnss_publish_snapshot(void)
+{
+  u32 current = __atomic_load_n(&snapshot_current, __ATOMIC_SEQ_CST);
+  u32 slot;
+  for (slot = 0; slot < DGNSS_SNAPSHOT_SLOTS; slot++) {
+    if (slot != current &&
+        __atomic_load_n(&snapshot_readers[slot], __ATOMIC_SEQ_CST) == 0) {
+      break;
+    }
+  }
+  if (slot == DGNSS_SNAPSHOT_SLOTS) {
+    log_debug("dgnss_publish_snapshot: all snapshot buffers held by readers");
+    return;
+  }
+
+  dgnss_snapshot_t *s = &snapshots[slot];
+  s->epoch = ++snapshot_epoch;
+
+  u8 num_dds = CLAMP_DIFF(sats_management.num_sats, 1);
+  s->kf_num_sats = sats_management.num_sats;
+  memcpy(s->kf_sids, sats_management.sids,
+         sats_management.num_sats * sizeof(gnss_signal_t));
+  memcpy(s->kf_mean, nkf.state_mean, num_dds * sizeof(double));
+  memcpy(s->kf_cov_U, nkf.state_cov_U,
+         MATRIX_PACKED_SIZE(num_dds) * sizeof(double));
+  memcpy(s->kf_cov_D, nkf.state_cov_D, num_dds * sizeof(double));
+
+  s->iar_num_sats = ambiguity_test.sats.num_sats;
+  memcpy(s->iar_sids, ambiguity_test.sats.sids,
+         ambiguity_test.sats.num_sats * sizeof(gnss_signal_t));
+  s->iar_num_hyps = dgnss_iar_num_hyps();
+  if (s->iar_num_hyps > 0) {
+    ambiguity_test_MLE_ambs(&ambiguity_test, s->iar_mle_ambs);
+  }
+  s->iar_amb_check = ambiguity_test.amb_check;
+
+  __atomic_store_n(&snapshot_current, slot, __ATOMIC_SEQ_CST);
+}
+
 void dgnss_update(u8 num_sats, sdiff_t *sdiffs, double receiver_ecef[3],
                   bool disable_raim, double raim_threshold)
 {
@@ -263,6 +332,7 @@ void dgnss_update(u8 num_sats, sdiff_t *sdiffs, double receiver_ecef[3],
       sats_management.sids[0] = sdiffs[0].sid;
     }
     create_ambiguity_test(&ambiguity_test);
+    dgnss_publish_snapshot();
     DEBUG_EXIT();
     return;
   }
@@ -312,7 +382,17 @@ void dgnss_update(u8 num_sats, sdiff_t *sdiffs, double receiver_ecef[3],
                      dgnss_settings.phase_var_kf, dgnss_settings.code_var_kf,
                      sats_management.num_sats, sdiffs_with_ref_first, ref_ecef);
 
+#ifdef LIBSWIFTNAV_FILTER_F32
+    nkf_matrices_to_f32(&nkf, &nkf_f32);
+    if (!nkf_f32_state_valid) {
+      nkf_state_to_f32(&nkf, &nkf_f32);
+      nkf_f32_state_valid = true;
+    }
+    is_bad_measurement = nkf_update_f32(&nkf_f32, dd_measurements);
+    nkf_state_from_f32(&nkf_f32, &nkf);
+#else
     is_bad_measurement = nkf_update(&nkf, dd_measurements);
+#endif
   }
 
   u8 changed_sats = ambiguity_update_sats(&ambiguity_test, num_sats, sdiffs,
@@ -325,12 +405,15 @@ void dgnss_update(u8 num_sats, sdiff_t *sdiffs, double receiver_ecef[3],
     update_ambiguity_test(ref_ecef,
                           dgnss_settings.phase_var_test,
                           dgnss_settings.code_var_test,
+                          dgnss_settings.de_tolerance,
                           &ambiguity_test, nkf.state_dim,
                           sdiffs, changed_sats);
   }
 
   update_unanimous_ambiguities(&ambiguity_test);
 
+  dgnss_publish_snapshot();
+
   DEBUG_EXIT();
 }
 
@@ -447,6 +530,7 @@ s8 dgnss_baseline(u8 num_sdiffs, const sdiff_t *sdiffs,
 void dgnss_reset_iar()
 {
   create_ambiguity_test(&ambiguity_test);
+  dgnss_publish_snapshot();
 }
 
 void dgnss_init_known_baseline(u8 num_sats, sdiff_t *sdiffs,
@@ -472,29 +556,16 @@ void dgnss_init_known_baseline(u8 num_sats, sdiff_t *sdiffs,
   dgnss_reset_iar();
 
   memcpy(&ambiguity_test.sats, &sats_management, sizeof(sats_management));
-  hypothesis_t *hyp = (hypothesis_t *)memory_pool_add(ambiguity_test.pool);
-  hyp->ll = 0;
-  amb_from_baseline(num_sats-1, DE, dds, b, hyp->N);
+  s32 N[num_sats-1];
+  amb_from_baseline(num_sats-1, DE, dds, b, N);
+  hypothesis_store_clear(ambiguity_test.pool, num_sats-1);
+  hypothesis_store_add(ambiguity_test.pool, N, 0);
 
-  double obs_cov[(num_sats-1) * (num_sats-1) * 4];
-  memset(obs_cov, 0, (num_sats-1) * (num_sats-1) * 4 * sizeof(double));
-  u8 num_dds = num_sats-1;
-  for (u8 i=0; i<num_dds; i++) {
-    for (u8 j=0; j<num_dds; j++) {
-      u8 i_ = i+num_dds;
-      u8 j_ = j+num_dds;
-      if (i==j) {
-        obs_cov[i*2*num_dds + j] = dgnss_settings.phase_var_test * 2;
-        obs_cov[i_*2*num_dds + j_] = dgnss_settings.code_var_test * 2;
-      }
-      else {
-        obs_cov[i*2*num_dds + j] = dgnss_settings.phase_var_test;
-        obs_cov[i_*2*num_dds + j_] = dgnss_settings.code_var_test;
-      }
-    }
-  }
+  init_residual_matrices_from_vars(&ambiguity_test.res_mtxs, num_sats-1, DE,
+                                   dgnss_settings.phase_var_test,
+                                   dgnss_settings.code_var_test);
 
-  init_residual_matrices(&ambiguity_test.res_mtxs, num_sats-1, DE, obs_cov);
+  dgnss_publish_snapshot();
 }
 
 static void measure_b(u8 state_dim, const double *state_mean,
@@ -650,7 +721,7 @@ u8 get_amb_kf_mean(double *ambs)
 u8 get_amb_kf_cov(double *cov)
 {
   u8 num_dds = CLAMP_DIFF(sats_management.num_sats, 1);
-  matrix_reconstruct_udu(num_dds, nkf.state_cov_U, nkf.state_cov_D, cov);
+  matrix_reconstruct_udu_packed(num_dds, nkf.state_cov_U, nkf.state_cov_D, cov);
   return num_dds;
 }
 
@@ -706,3 +777,65 @@ ambiguity_test_t* get_ambiguity_test(void)
 {
   return &ambiguity_test;
 }
+
+/** Get a reference to the most recently published DGNSS state snapshot.
+ * Intended for monitoring / telemetry threads which must not take locks
+ * around the real-time dgnss_update() path. The returned snapshot is
+ * immutable and stays valid until it is handed back with
+ * dgnss_snapshot_release(), regardless of how many epochs are published in
+ * the mean time. A reader only ever retries if a new epoch was published
+ * between it loading and pinning the current buffer.
+ *
+ * \return Pointer to the current snapshot, must be released with
+ *         dgnss_snapshot_release().
+ */
+const dgnss_snapshot_t *dgnss_snapshot_acquire(void)
+{
+  while (1) {
+    u32 slot = __atomic_load_n(&snapshot_current, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&snapshot_readers[slot], 1, __ATOMIC_SEQ_CST);
+    /* If the slot is still current the publisher can not be writing to it,
+     * and it won't be reused until we release it. */
+    if (__atomic_load_n(&snapshot_current, __ATOMIC_SEQ_CST) == slot) {
+      return &snapshots[slot];
+    }
+    __atomic_sub_fetch(&snapshot_readers[slot], 1, __ATOMIC_SEQ_CST);
+  }
+}
+
+/** Hand back a snapshot obtained from dgnss_snapshot_acquire().
+ *
+ * \param snapshot Snapshot to release.
+ */
+void dgnss_snapshot_release(const dgnss_snapshot_t *snapshot)
+{
+  u32 slot = snapshot - snapshots;
+  assert(slot < DGNSS_SNAPSHOT_SLOTS);
+  __atomic_sub_fetch(&snapshot_readers[slot], 1, __ATOMIC_SEQ_CST);
+}
+
+/** Copy the most recently published DGNSS state snapshot.
+ *
+ * \param snapshot Output snapshot.
+ */
+void dgnss_snapshot_read(dgnss_snapshot_t *snapshot)
+{
+  const dgnss_snapshot_t *s = dgnss_snapshot_acquire();
+  memcpy(snapshot, s, sizeof(dgnss_snapshot_t));
+  dgnss_snapshot_release(s);
+}
+
+/** Reconstruct the float filter covariance of a snapshot.
+ * Done on the reader side so that publishing stays a plain copy.
+ *
+ * \param snapshot Snapshot to read from.
+ * \param cov      Output covariance, `num_dds * num_dds`.
+ * \return         The number of DDs, num_dds.
+ */
+u8 dgnss_snapshot_kf_cov(const dgnss_snapshot_t *snapshot, double *cov)
+{
+  u8 num_dds = CLAMP_DIFF(snapshot->kf_num_sats, 1);
+  matrix_reconstruct_udu_packed(num_dds, snapshot->kf_cov_U,
+                                snapshot->kf_cov_D, cov);
+  return num_dds;
+}
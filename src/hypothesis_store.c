@@ -0,0 +1,1044 @@
+/*
+ * Copyright (C) 2015 Swift Navigation Inc.
+ * Contact: Ian Horn <ian@swift-nav.com>
+ *
+ * This source is subject to the license found in the file 'LICENSE' which must
+ * be be distributed together with this source. All other rights reserved.
+ *
+ * THIS CODE AND INFORMATION IS PROVIDED "AS IS" WITHOUT WARRANTY OF ANY KIND,
+ * EITHER EXPRESSED OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND/OR FITNESS FOR A PARTICULAR PURPOSE.
+ */
+
+#include <assert.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hypothesis_store.h"
+#include "logging.h"
+
+/** \defgroup hypothesis_store Hypothesis Store
+ * Storage for the integer ambiguity hypotheses of the IAR test.
+ *
+ * The ambiguity vectors of all hypotheses are kept in one dense row-major
+ * matrix and the log likelihoods in a separate array, so that the per-epoch
+ * update, the renormalization and the unanimity check are plain loops over
+ * contiguous memory rather than callbacks on linked list nodes. Removal is
+ * done by compaction, which preserves the order of the remaining hypotheses.
+ *
+ * The ambiguity matrix is delta encoded: each column is stored relative to a
+ * base value, in one, two or four bytes per element as the spread of the
+ * column requires. Starting at one byte, the same buffer holds up to four
+ * times as many hypotheses as a plain `s32` matrix and a traversal touches a
+ * quarter of the memory. When a value doesn't fit, the whole matrix is
+ * re-encoded in place at a wider width, which fails like any other lack of
+ * space if the wider matrix doesn't fit in the buffer. Emptying the store
+ * resets it to one byte.
+ *
+ * A hash index over the ambiguity vectors is kept alongside, so looking up a
+ * hypothesis by its ambiguities takes constant time regardless of the number
+ * of hypotheses. Operations that rewrite the stored ambiguity vectors
+ * rebuild it; code that modifies rows in place must call
+ * hypothesis_store_reindex() afterwards.
+ *
+ * Transforms of all ambiguity vectors, such as a change of reference
+ * satellite, are recorded with hypothesis_store_remap() and only applied on
+ * the next pass over the rows. Code reading rows directly must apply any
+ * pending remap first, either with hypothesis_store_flush() or as part of
+ * its own pass with hypothesis_store_remap_row().
+ *
+ * \{ */
+
+/** Initialize a hypothesis store on top of caller supplied buffers.
+ * The store starts empty with `num_dds = 0`.
+ *
+ * \param store    The store to initialize.
+ * \param max_hyps Maximum number of hypotheses to hold.
+ * \param N_buff   Buffer for the encoded ambiguity vectors.
+ * \param N_size   Size of `N_buff` in bytes. `max_hyps` ambiguity vectors
+ *                 of `n` elements fit at one byte per element once this is
+ *                 `max_hyps * n`, and at any width once it is
+ *                 `max_hyps * n * sizeof(s32)`.
+ * \param ll_buff  Buffer of `max_hyps` floats.
+ * \param cache_buff Buffer of `max_hyps` doubles for the per-hypothesis
+ *                   cache, or NULL if no cache is needed.
+ * \param index_buff Buffer of `index_size` u32s for the hash index.
+ * \param index_size Number of hash index slots, must be a power of two
+ *                   greater than `max_hyps`. About twice `max_hyps` keeps
+ *                   probe sequences short.
+ */
+void hypothesis_store_init(hypothesis_store_t *store, u32 max_hyps,
+                           void *N_buff, u32 N_size, float *ll_buff,
+                           double *cache_buff, u32 *index_buff,
+                           u32 index_size)
+{
+  assert(index_size > max_hyps);
+  assert((index_size & (index_size - 1)) == 0);
+  store->max_hyps = max_hyps;
+  store->N = N_buff;
+  store->N_size = N_size;
+  store->ll = ll_buff;
+  store->cache = cache_buff;
+  store->index = index_buff;
+  store->index_size = index_size;
+  store->version = 0;
+  store->stats.version = 0;
+  store->scratch_N = NULL;
+  store->scratch_ll = NULL;
+  store->scratch_cache = NULL;
+  hypothesis_store_clear(store, 0);
+}
+
+/** Give the store scratch buffers, making hypothesis_store_product()
+ * transactional: the product is built in the scratch buffers, which then
+ * swap roles with the store's own only if it succeeds.
+ *
+ * \param store      The store to give them to.
+ * \param N_buff     Buffer of the same size as the store's `N_buff`.
+ * \param ll_buff    Buffer of `max_hyps` floats.
+ * \param cache_buff Buffer of `max_hyps` doubles, or NULL if the store has
+ *                   no cache.
+ */
+void hypothesis_store_set_scratch(hypothesis_store_t *store, void *N_buff,
+                                  float *ll_buff, double *cache_buff)
+{
+  assert((cache_buff == NULL) == (store->cache == NULL));
+  store->scratch_N = N_buff;
+  store->scratch_ll = ll_buff;
+  store->scratch_cache = cache_buff;
+}
+
+/** Remove all hypotheses and set the ambiguity vector length.
+ *
+ * \param store   The store to clear.
+ * \param num_dds Length of the ambiguity vectors subsequently added.
+ */
+void hypothesis_store_clear(hypothesis_store_t *store, u8 num_dds)
+{
+  store->num_hyps = 0;
+  store->num_dds = num_dds;
+  store->width = 1;
+  store->cache_valid = 0;
+  store->ll_offset = 0;
+  store->version++;
+  store->remap_pending = 0;
+  memset(store->index, 0, store->index_size * sizeof(u32));
+}
+
+/* Gets a pointer to the encoded ambiguity vector of hypothesis `i`. */
+static u8 *row_data(const hypothesis_store_t *store, u32 i)
+{
+  return &store->N[i * store->num_dds * store->width];
+}
+
+/* Encodes an ambiguity vector, which must be representable. */
+static void encode_row(u8 *data, u8 width, const s32 *base, u8 num_dds,
+                       const s32 *N)
+{
+  switch (width) {
+  case 1:
+    for (u8 k = 0; k < num_dds; k++) {
+      ((s8 *)data)[k] = N[k] - base[k];
+    }
+    break;
+  case 2:
+    for (u8 k = 0; k < num_dds; k++) {
+      s16 d = N[k] - base[k];
+      memcpy(&data[k * sizeof(s16)], &d, sizeof(s16));
+    }
+    break;
+  default:
+    memcpy(data, N, num_dds * sizeof(s32));
+    break;
+  }
+}
+
+/* Checks whether `N[k] - base[k]` fits in `width` bytes for every k. */
+static bool row_fits(u8 width, const s32 *base, u8 num_dds, const s32 *N)
+{
+  s64 max = width == 1 ? INT8_MAX : width == 2 ? INT16_MAX : INT32_MAX;
+  for (u8 k = 0; k < num_dds; k++) {
+    s64 d = (s64)N[k] - base[k];
+    if (d < -max - 1 || d > max) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/* Chooses the narrowest encoding in which every column can hold the range
+ * `[lo[k], hi[k]]`. Bases are put mid-range, leaving headroom on both sides
+ * for values added later. Returns the width. */
+static inline u8 choose_encoding(u8 num_dds, const s64 *lo, const s64 *hi,
+                                 s32 *base)
+{
+  s64 range = 0;
+  for (u8 k = 0; k < num_dds; k++) {
+    range = MAX(range, hi[k] - lo[k]);
+  }
+  u8 width = range <= UINT8_MAX ? 1 : range <= UINT16_MAX ? 2 : 4;
+  for (u8 k = 0; k < num_dds; k++) {
+    base[k] = width == 4 ? 0 : lo[k] + (hi[k] - lo[k] + 1) / 2;
+  }
+  return width;
+}
+
+/* Applies a remap to an ambiguity vector. */
+static void remap_vector(const hypothesis_store_remap_t *remap, u8 num_dds,
+                         s32 *N)
+{
+  s32 old_N[HYPOTHESIS_STORE_MAX_DDS];
+  memcpy(old_N, N, num_dds * sizeof(s32));
+  s32 sub = remap->sub >= 0 ? old_N[remap->sub] : 0;
+  for (u8 k = 0; k < num_dds; k++) {
+    N[k] = (remap->src[k] >= 0 ? old_N[remap->src[k]] : 0) - sub;
+  }
+}
+
+/* Re-encodes every hypothesis at a new width and bases, applying any pending
+ * remap on the way, and tightens the column bounds to the values stored.
+ * The caller must check the values fit and the rows fit the buffer, and
+ * must rebuild the index afterwards. */
+static void transcode(hypothesis_store_t *store, u8 width, const s32 *base)
+{
+  u8 num_dds = store->num_dds;
+  u32 n = store->num_hyps;
+  s32 lo[HYPOTHESIS_STORE_MAX_DDS];
+  s32 hi[HYPOTHESIS_STORE_MAX_DDS];
+  for (u8 k = 0; k < num_dds; k++) {
+    lo[k] = INT32_MAX;
+    hi[k] = INT32_MIN;
+  }
+
+  /* Rows grow when widening, so must then be moved back to front. */
+  bool backwards = width > store->width;
+  for (u32 j = 0; j < n; j++) {
+    u32 i = backwards ? n - 1 - j : j;
+    s32 N[HYPOTHESIS_STORE_MAX_DDS];
+    hypothesis_store_get(store, i, N);
+    if (store->remap_pending) {
+      remap_vector(&store->remap, num_dds, N);
+    }
+    encode_row(&store->N[i * num_dds * width], width, base, num_dds, N);
+    for (u8 k = 0; k < num_dds; k++) {
+      lo[k] = MIN(lo[k], N[k]);
+      hi[k] = MAX(hi[k], N[k]);
+    }
+  }
+
+  store->width = width;
+  memcpy(store->base, base, num_dds * sizeof(s32));
+  memcpy(store->lo, lo, num_dds * sizeof(s32));
+  memcpy(store->hi, hi, num_dds * sizeof(s32));
+  store->remap_pending = 0;
+}
+
+/* Writes ambiguity vector `N` to row `i`, which is either an existing row or
+ * the next one to be appended, re-encoding the store first if `N` isn't
+ * representable. Returns -1 without changing anything if the rows would take
+ * more than `limit` bytes, 1 if the store was re-encoded and the index must
+ * be rebuilt, and 0 otherwise. */
+static s8 put_row(hypothesis_store_t *store, u32 i, const s32 *N, u32 limit)
+{
+  u8 num_dds = store->num_dds;
+  if (num_dds == 0) {
+    return 0;
+  }
+  if (store->num_hyps == 0) {
+    /* Start over at the narrowest width, centred on the first row. */
+    store->width = 1;
+    memcpy(store->base, N, num_dds * sizeof(s32));
+    memcpy(store->lo, N, num_dds * sizeof(s32));
+    memcpy(store->hi, N, num_dds * sizeof(s32));
+  }
+
+  s8 ret = 0;
+  if (!row_fits(store->width, store->base, num_dds, N)) {
+    s64 lo[HYPOTHESIS_STORE_MAX_DDS];
+    s64 hi[HYPOTHESIS_STORE_MAX_DDS];
+    for (u8 k = 0; k < num_dds; k++) {
+      lo[k] = MIN(store->lo[k], N[k]);
+      hi[k] = MAX(store->hi[k], N[k]);
+    }
+    s32 base[HYPOTHESIS_STORE_MAX_DDS];
+    u8 width = choose_encoding(num_dds, lo, hi, base);
+    if (MAX(store->num_hyps, i + 1) * num_dds * width > limit) {
+      return -1;
+    }
+    log_debug("hypothesis_store: widening to %u bytes per ambiguity", width);
+    transcode(store, width, base);
+    ret = 1;
+  } else if ((i + 1) * num_dds * store->width > limit) {
+    return -1;
+  }
+
+  for (u8 k = 0; k < num_dds; k++) {
+    store->lo[k] = MIN(store->lo[k], N[k]);
+    store->hi[k] = MAX(store->hi[k], N[k]);
+  }
+  encode_row(row_data(store, i), store->width, store->base, num_dds, N);
+  return ret;
+}
+
+/* Hash of an encoded ambiguity vector, mixing each element in and finishing
+ * with the MurmurHash3 32 bit finalizer. */
+static u32 hash_row(const hypothesis_store_t *store, const u8 *data)
+{
+  u32 h = 0x811c9dc5;
+  for (u32 i = 0; i < store->num_dds * store->width; i++) {
+    h = (h ^ data[i]) * 0x9e3779b1;
+  }
+  h ^= h >> 16;
+  h *= 0x85ebca6b;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35;
+  h ^= h >> 16;
+  return h;
+}
+
+/* Finds the index slot of the first hypothesis matching the encoded vector
+ * `data`, or if there is none the empty slot at which it would be inserted.
+ */
+static u32 index_slot(const hypothesis_store_t *store, const u8 *data)
+{
+  u32 mask = store->index_size - 1;
+  u32 row_size = store->num_dds * store->width;
+  u32 slot = hash_row(store, data) & mask;
+  while (store->index[slot] != 0 &&
+         memcmp(row_data(store, store->index[slot] - 1),
+                data, row_size) != 0) {
+    slot = (slot + 1) & mask;
+  }
+  return slot;
+}
+
+/* Adds hypothesis `i` to the index, unless one with the same ambiguities
+ * is already there. Returns the index of the hypothesis now indexed. */
+static u32 index_insert(hypothesis_store_t *store, u32 i)
+{
+  u32 slot = index_slot(store, row_data(store, i));
+  if (store->index[slot] == 0) {
+    store->index[slot] = i + 1;
+  }
+  return store->index[slot] - 1;
+}
+
+/** Rebuild the hash index from the stored ambiguity vectors.
+ * Must be called after modifying rows with hypothesis_store_set().
+ *
+ * \param store The store to reindex.
+ */
+void hypothesis_store_reindex(hypothesis_store_t *store)
+{
+  store->version++;
+  memset(store->index, 0, store->index_size * sizeof(u32));
+  for (u32 i = 0; i < store->num_hyps; i++) {
+    index_insert(store, i);
+  }
+}
+
+static int float_cmp_desc(const void *a, const void *b)
+{
+  float x = *(const float *)a;
+  float y = *(const float *)b;
+  return (x < y) - (x > y);
+}
+
+/* Finds the `k`th largest stored log likelihood, for 0 < k <= num_hyps. */
+static float ll_threshold(const hypothesis_store_t *store, u32 k)
+{
+  u32 n = store->num_hyps;
+  float sorted[n];
+  memcpy(sorted, store->ll, n * sizeof(float));
+  qsort(sorted, n, sizeof(float), float_cmp_desc);
+  return sorted[k - 1];
+}
+
+/** Get the least log likelihood among the most likely hypotheses, i.e.
+ * those hypothesis_store_keep_most_likely() would keep.
+ *
+ * \param store    The store to examine.
+ * \param num_hyps Number of most likely hypotheses, at least one and at most
+ *                 `store->num_hyps`.
+ * \param num_at   Set to how many of them have exactly the returned log
+ *                 likelihood. The rest are above it.
+ * \return The least stored log likelihood among them, not including
+ *         `ll_offset`.
+ */
+float hypothesis_store_most_likely_ll(const hypothesis_store_t *store,
+                                      u32 num_hyps, u32 *num_at)
+{
+  float threshold = ll_threshold(store, num_hyps);
+  u32 num_above = 0;
+  for (u32 i = 0; i < store->num_hyps; i++) {
+    num_above += store->ll[i] > threshold;
+  }
+  *num_at = num_hyps - num_above;
+  return threshold;
+}
+
+/** Reduce the store to its most likely hypotheses, keeping their order.
+ *
+ * \param store    The store to reduce.
+ * \param num_hyps Number of hypotheses to keep.
+ */
+void hypothesis_store_keep_most_likely(hypothesis_store_t *store, u32 num_hyps)
+{
+  u32 n = store->num_hyps;
+  if (n <= num_hyps) {
+    return;
+  }
+  log_debug("hypothesis_store: dropping %"PRIu32" least likely hypotheses",
+            n - num_hyps);
+  if (num_hyps == 0) {
+    hypothesis_store_truncate(store, 0);
+    return;
+  }
+  u32 num_at;
+  float threshold = hypothesis_store_most_likely_ll(store, num_hyps, &num_at);
+  u8 keep[n];
+  for (u32 i = 0; i < n; i++) {
+    keep[i] = store->ll[i] > threshold;
+    if (store->ll[i] == threshold && num_at > 0) {
+      keep[i] = 1;
+      num_at--;
+    }
+  }
+  hypothesis_store_compact(store, keep);
+}
+
+/** Get the share of the total probability carried by the most likely
+ * hypotheses, i.e. what would be left by hypothesis_store_keep_most_likely().
+ *
+ * \param store    The store to examine.
+ * \param num_hyps Number of most likely hypotheses to count.
+ * \return Their probability as a fraction of that of all hypotheses.
+ */
+double hypothesis_store_top_prob(const hypothesis_store_t *store, u32 num_hyps)
+{
+  u32 n = store->num_hyps;
+  if (n <= num_hyps) {
+    return 1;
+  }
+  if (num_hyps == 0) {
+    return 0;
+  }
+  float threshold = ll_threshold(store, num_hyps);
+  float max_ll = threshold;
+  for (u32 i = 0; i < n; i++) {
+    max_ll = MAX(max_ll, store->ll[i]);
+  }
+  double top = 0;
+  double total = 0;
+  u32 num_at = 0;
+  for (u32 i = 0; i < n; i++) {
+    double p = exp(store->ll[i] - max_ll);
+    total += p;
+    if (store->ll[i] > threshold) {
+      top += p;
+      num_at++;
+    }
+  }
+  /* Those tied at the threshold make up the rest. */
+  top += (num_hyps - num_at) * exp(threshold - max_ll);
+  return top / total;
+}
+
+/** Append a hypothesis.
+ *
+ * \param store The store to add to.
+ * \param N     Ambiguity vector, `store->num_dds` long. May be NULL if
+ *              `store->num_dds` is zero.
+ * \param ll    Log likelihood of the hypothesis, not including `ll_offset`.
+ * \return The index of the new hypothesis or -1 if the store is full,
+ *         including if it would have to be widened to fit `N` and can't.
+ */
+s32 hypothesis_store_add(hypothesis_store_t *store, const s32 *N, float ll)
+{
+  if (store->num_hyps >= store->max_hyps) {
+    return -1;
+  }
+  hypothesis_store_flush(store);
+  u32 i = store->num_hyps;
+  s8 ret = put_row(store, i, N, store->N_size);
+  if (ret < 0) {
+    return -1;
+  }
+  store->num_hyps++;
+  store->cache_valid = 0;
+  store->version++;
+  store->ll[i] = ll + store->ll_offset;
+  if (ret > 0) {
+    hypothesis_store_reindex(store);
+  } else {
+    index_insert(store, i);
+  }
+  return i;
+}
+
+/** Find a hypothesis by its ambiguity vector.
+ * If several hypotheses share the ambiguity vector the first is returned.
+ *
+ * \param store The store to search.
+ * \param N     Ambiguity vector to look for, `store->num_dds` long.
+ * \return The index of the hypothesis or -1 if it isn't in the store.
+ */
+s32 hypothesis_store_find(hypothesis_store_t *store, const s32 *N)
+{
+  hypothesis_store_flush(store);
+  if (!row_fits(store->width, store->base, store->num_dds, N)) {
+    return -1;
+  }
+  u8 data[HYPOTHESIS_STORE_MAX_DDS * sizeof(s32)];
+  encode_row(data, store->width, store->base, store->num_dds, N);
+  u32 slot = index_slot(store, data);
+  return (s32)store->index[slot] - 1;
+}
+
+/* Marks a change to the ambiguity vectors that leaves the likelihoods and
+ * the order of the hypotheses alone, so current stats stay current. */
+static void bump_version_keeping_stats(hypothesis_store_t *store)
+{
+  u8 stats_current = store->stats.version == store->version;
+  store->version++;
+  if (stats_current) {
+    store->stats.version = store->version;
+  }
+}
+
+/** Overwrite the ambiguity vector of a hypothesis.
+ * The index is not updated, call hypothesis_store_reindex() once done.
+ *
+ * \param store The store to modify.
+ * \param i     Index of the hypothesis.
+ * \param N     New ambiguity vector, `store->num_dds` long.
+ * \return 0 on success, -1 if the store would have to be widened to fit `N`
+ *         and can't.
+ */
+s8 hypothesis_store_set(hypothesis_store_t *store, u32 i, const s32 *N)
+{
+  hypothesis_store_flush(store);
+  store->cache_valid = 0;
+  bump_version_keeping_stats(store);
+  return put_row(store, i, N, store->N_size) < 0 ? -1 : 0;
+}
+
+/** Record a transform of all ambiguity vectors, to be applied lazily.
+ * The new ambiguity vectors are `N'[i] = N[src[i]] - N[sub]` where an index
+ * of -1 stands for zero. It is composed with any remap already pending, so
+ * repeated calls between passes over the store cost nothing per hypothesis.
+ *
+ * The remapped values are bounded from the column bounds. If they might not
+ * fit the current encoding width the remap is instead applied straight away
+ * while widening the store, dropping the least likely hypotheses if the wider
+ * store doesn't fit in its buffer.
+ *
+ * \param store The store to remap.
+ * \param src   `store->num_dds` source indices.
+ * \param sub   Index of the element to subtract from all others.
+ */
+void hypothesis_store_remap(hypothesis_store_t *store, const s8 *src, s8 sub)
+{
+  u8 num_dds = store->num_dds;
+  hypothesis_store_remap_t *remap = &store->remap;
+  if (!store->remap_pending) {
+    memcpy(remap->src, src, num_dds * sizeof(s8));
+    remap->sub = sub;
+  } else {
+    /* Substituting the pending N' = N[a] - N[b] into N'' = N'[src] -
+     * N'[sub] gives another remap, since N'[-1] = 0 = N[b] - N[b]. */
+    s8 new_src[HYPOTHESIS_STORE_MAX_DDS];
+    for (u8 i = 0; i < num_dds; i++) {
+      new_src[i] = src[i] >= 0 ? remap->src[src[i]] : remap->sub;
+    }
+    remap->sub = sub >= 0 ? remap->src[sub] : remap->sub;
+    memcpy(remap->src, new_src, num_dds * sizeof(s8));
+  }
+  store->remap_pending = 1;
+  store->cache_valid = 0;
+  bump_version_keeping_stats(store);
+
+  if (store->num_hyps == 0) {
+    return;
+  }
+
+  /* Bound the remapped columns, relative to the rows as stored. */
+  s64 sub_lo = remap->sub >= 0 ? store->lo[remap->sub] : 0;
+  s64 sub_hi = remap->sub >= 0 ? store->hi[remap->sub] : 0;
+  s64 lo[HYPOTHESIS_STORE_MAX_DDS];
+  s64 hi[HYPOTHESIS_STORE_MAX_DDS];
+  for (u8 k = 0; k < num_dds; k++) {
+    s8 j = remap->src[k];
+    s64 src_lo = j >= 0 ? store->lo[j] : 0;
+    s64 src_hi = j >= 0 ? store->hi[j] : 0;
+    lo[k] = MAX(src_lo - sub_hi, INT32_MIN);
+    hi[k] = MIN(src_hi - sub_lo, INT32_MAX);
+  }
+
+  s32 base[HYPOTHESIS_STORE_MAX_DDS];
+  u8 width = choose_encoding(num_dds, lo, hi, base);
+  if (width <= store->width) {
+    /* Applied lazily at the current width. */
+    for (u8 k = 0; k < num_dds; k++) {
+      remap->base[k] = store->width == 4 ? 0 : base[k];
+      remap->lo[k] = lo[k];
+      remap->hi[k] = hi[k];
+    }
+    return;
+  }
+
+  hypothesis_store_keep_most_likely(store, store->N_size / (num_dds * width));
+  log_debug("hypothesis_store: widening to %u bytes per ambiguity", width);
+  transcode(store, width, base);
+  hypothesis_store_reindex(store);
+}
+
+/** Apply the store's pending remap, if any, to hypothesis `i`, and get its
+ * ambiguity vector. For use by traversals that fold the remap into their own
+ * pass, see hypothesis_store_remap_applied(). Until then, other hypotheses
+ * can't be read with hypothesis_store_get().
+ *
+ * \param store The store being remapped.
+ * \param i     Index of the hypothesis to remap.
+ * \param N     Output remapped ambiguity vector.
+ */
+void hypothesis_store_remap_row(hypothesis_store_t *store, u32 i, s32 *N)
+{
+  hypothesis_store_get(store, i, N);
+  if (!store->remap_pending) {
+    return;
+  }
+  remap_vector(&store->remap, store->num_dds, N);
+  encode_row(row_data(store, i), store->width, store->remap.base,
+             store->num_dds, N);
+}
+
+/** Mark the pending remap as applied and update the index.
+ * To be called after applying hypothesis_store_remap_row() to every row.
+ *
+ * \param store The store that has been remapped.
+ */
+void hypothesis_store_remap_applied(hypothesis_store_t *store)
+{
+  if (store->remap_pending) {
+    store->remap_pending = 0;
+    u32 size = store->num_dds * sizeof(s32);
+    memcpy(store->base, store->remap.base, size);
+    memcpy(store->lo, store->remap.lo, size);
+    memcpy(store->hi, store->remap.hi, size);
+    hypothesis_store_reindex(store);
+  }
+}
+
+/** Apply any pending remap to all hypotheses.
+ *
+ * \param store The store to flush.
+ */
+void hypothesis_store_flush(hypothesis_store_t *store)
+{
+  if (!store->remap_pending) {
+    return;
+  }
+  for (u32 i = 0; i < store->num_hyps; i++) {
+    s32 N[HYPOTHESIS_STORE_MAX_DDS];
+    hypothesis_store_remap_row(store, i, N);
+  }
+  hypothesis_store_remap_applied(store);
+}
+
+/** Remove hypotheses, keeping the relative order of those left.
+ *
+ * \param store The store to compact.
+ * \param keep  `store->num_hyps` flags, non-zero for hypotheses to keep.
+ * \return The number of hypotheses left.
+ */
+u32 hypothesis_store_compact(hypothesis_store_t *store, const u8 *keep)
+{
+  u32 j = 0;
+  for (u32 i = 0; i < store->num_hyps; i++) {
+    if (!keep[i]) {
+      continue;
+    }
+    if (i != j) {
+      hypothesis_store_move(store, j, i);
+    }
+    j++;
+  }
+  hypothesis_store_truncate(store, j);
+  return j;
+}
+
+/** Drop all hypotheses after the first `num_hyps`.
+ * Completes an in place compaction done with hypothesis_store_move(),
+ * updating the index if any hypotheses were removed.
+ *
+ * \param store    The store to truncate.
+ * \param num_hyps Number of hypotheses to keep.
+ */
+void hypothesis_store_truncate(hypothesis_store_t *store, u32 num_hyps)
+{
+  if (num_hyps < store->num_hyps) {
+    store->num_hyps = num_hyps;
+    hypothesis_store_reindex(store);
+  }
+}
+
+/** Fold `ll_offset` into the stored log likelihoods.
+ * The offset is allowed to grow as the likelihoods are updated, but the
+ * stored values then drift away from zero and lose precision, so this should
+ * be called whenever it gets large.
+ *
+ * \param store The store to normalize.
+ */
+void hypothesis_store_normalize(hypothesis_store_t *store)
+{
+  for (u32 i = 0; i < store->num_hyps; i++) {
+    store->ll[i] -= store->ll_offset;
+  }
+  store->stats.max_ll -= store->ll_offset;
+  store->stats.second_ll -= store->ll_offset;
+  store->ll_offset = 0;
+}
+
+/** Save likelihood aggregates gathered with hypothesis_store_stats_add()
+ * over every hypothesis, in order, as the store's current aggregates.
+ *
+ * \param store The store they were gathered from.
+ * \param stats The aggregates.
+ */
+void hypothesis_store_stats_commit(hypothesis_store_t *store,
+                                   const hypothesis_store_stats_t *stats)
+{
+  store->stats = *stats;
+  store->stats.version = store->version;
+}
+
+/** Get the likelihood aggregates of a store: its most likely hypothesis,
+ * the runner up's likelihood and the normalizer of its probabilities.
+ * These are kept by the passes that update the likelihoods, so this is
+ * normally just a read; if the store has changed since, they are gathered
+ * again.
+ *
+ * \param store The store to summarize.
+ * \return Its current aggregates.
+ */
+const hypothesis_store_stats_t *hypothesis_store_stats(hypothesis_store_t *store)
+{
+  if (store->stats.version != store->version) {
+    hypothesis_store_stats_t stats;
+    hypothesis_store_stats_reset(&stats);
+    for (u32 i = 0; i < store->num_hyps; i++) {
+      hypothesis_store_stats_add(&stats, i, store->ll[i]);
+    }
+    hypothesis_store_stats_commit(store, &stats);
+  }
+  return &store->stats;
+}
+
+/** Project the hypotheses onto a subset of their ambiguities.
+ * Each ambiguity vector is reduced to the elements at `ndxs`, then
+ * hypotheses that have become identical are merged, summing their
+ * likelihoods (i.e. marginalizing out the dropped ambiguities).
+ *
+ * \param store    The store to project.
+ * \param num_ndxs Length of the projected ambiguity vectors.
+ * \param ndxs     Indices of the ambiguities to keep.
+ * \return The number of hypotheses left.
+ */
+u32 hypothesis_store_project(hypothesis_store_t *store,
+                             u8 num_ndxs, const u8 *ndxs)
+{
+  hypothesis_store_flush(store);
+  u8 old_num_dds = store->num_dds;
+  u8 old_width = store->width;
+  u32 n = store->num_hyps;
+  store->num_dds = num_ndxs;
+  store->cache_valid = 0;
+  store->version++;
+
+  if (n == 0) {
+    return 0;
+  }
+
+  /* The projected columns keep their bounds, and may now fit a narrower
+   * encoding. */
+  s32 old_base[HYPOTHESIS_STORE_MAX_DDS];
+  memcpy(old_base, store->base, old_num_dds * sizeof(s32));
+  s64 lo[HYPOTHESIS_STORE_MAX_DDS];
+  s64 hi[HYPOTHESIS_STORE_MAX_DDS];
+  for (u8 k = 0; k < num_ndxs; k++) {
+    lo[k] = store->lo[ndxs[k]];
+    hi[k] = store->hi[ndxs[k]];
+  }
+  u8 width = choose_encoding(num_ndxs, lo, hi, store->base);
+  for (u8 k = 0; k < num_ndxs; k++) {
+    store->lo[k] = lo[k];
+    store->hi[k] = hi[k];
+  }
+  store->width = width;
+
+  /* Projected rows are never longer than the originals, so moving them to
+   * their new position front to back never overwrites an unread row. */
+  for (u32 i = 0; i < n; i++) {
+    s32 old_N[HYPOTHESIS_STORE_MAX_DDS];
+    s32 projected[HYPOTHESIS_STORE_MAX_DDS];
+    hypothesis_store_decode(&store->N[i * old_num_dds * old_width],
+                            old_width, old_base, old_num_dds, old_N);
+    for (u8 k = 0; k < num_ndxs; k++) {
+      projected[k] = old_N[ndxs[k]];
+    }
+    encode_row(row_data(store, i), width, store->base, num_ndxs, projected);
+  }
+
+  /* Merge each group of identical rows into its first member, which is the
+   * one the index holds. */
+  memset(store->index, 0, store->index_size * sizeof(u32));
+  u8 keep[n];
+  for (u32 i = 0; i < n; i++) {
+    u32 first = index_insert(store, i);
+    keep[i] = first == i;
+    if (!keep[i]) {
+      store->ll[first] += log(1 + exp(store->ll[i] - store->ll[first]));
+    }
+  }
+
+  return hypothesis_store_compact(store, keep);
+}
+
+/* Min-heap of output hypothesis indices keyed on `store->cache`, used by
+ * hypothesis_store_product() to retain the best hypotheses. */
+static void heap_sift_up(const hypothesis_store_t *store, u32 *heap, u32 k)
+{
+  while (k > 0) {
+    u32 parent = (k - 1) / 2;
+    if (store->cache[heap[parent]] <= store->cache[heap[k]]) {
+      break;
+    }
+    u32 tmp = heap[parent];
+    heap[parent] = heap[k];
+    heap[k] = tmp;
+    k = parent;
+  }
+}
+
+static void heap_sift_down(const hypothesis_store_t *store, u32 *heap,
+                           u32 size)
+{
+  u32 k = 0;
+  while (1) {
+    u32 smallest = k;
+    u32 l = 2 * k + 1;
+    u32 r = l + 1;
+    if (l < size && store->cache[heap[l]] < store->cache[heap[smallest]]) {
+      smallest = l;
+    }
+    if (r < size && store->cache[heap[r]] < store->cache[heap[smallest]]) {
+      smallest = r;
+    }
+    if (smallest == k) {
+      break;
+    }
+    u32 tmp = heap[smallest];
+    heap[smallest] = heap[k];
+    heap[k] = tmp;
+    k = smallest;
+  }
+}
+
+/** Replace each hypothesis with the hypotheses produced from it by a
+ * generator, changing the ambiguity vector length.
+ *
+ * For each existing hypothesis a working copy of `x0` is made and `init` is
+ * called with the hypothesis' ambiguity vector; if it returns non-zero,
+ * `prod` is called to write a new ambiguity vector for each point of the
+ * generator, which is then advanced with `next` until it returns zero. The
+ * new hypotheses inherit the log likelihood of the one they were produced
+ * from.
+ *
+ * If the store has scratch buffers, see hypothesis_store_set_scratch(), the
+ * new hypotheses are written to them and the buffers swapped once all are
+ * produced. On failure the store is left exactly as it was.
+ *
+ * Otherwise the product is done in place: the existing hypotheses are first
+ * moved to the back of the ambiguity buffer, each followed by its log
+ * likelihood, and the new ones written from the front, so no extra storage
+ * is needed as long as the output fits alongside the input not yet consumed.
+ * Either way the new hypotheses are encoded from scratch, starting at one
+ * byte per ambiguity, and the output is widened as needed within the space
+ * available.
+ *
+ * If `score` is given, running out of space is not an error. Instead the
+ * produced hypotheses are kept in a min-heap on their score and, once the
+ * store is full, each further hypothesis replaces the lowest scoring one if
+ * it scores higher. The store then ends up holding the best hypotheses
+ * produced, as far as the space not taken by unconsumed input allows. The
+ * scores are kept in `cache`, which must be present, and the heap in the
+ * index; both are rebuilt or invalidated afterwards. If the input together
+ * with its log likelihoods doesn't fit in the ambiguity buffer, the least
+ * likely input hypotheses are dropped first.
+ *
+ * \param store       The store to operate on.
+ * \param new_num_dds Length of the produced ambiguity vectors.
+ * \param x0          Initial generator state.
+ * \param x_size      Size of the generator state.
+ * \param max_xs      Maximum number of points produced per hypothesis.
+ * \param init        Initializes the generator state for a hypothesis, given
+ *                    its ambiguity vector and stored log likelihood, returns
+ *                    zero if it produces nothing.
+ * \param next        Advances the generator, returns zero when exhausted.
+ * \param prod        Writes the `n`th produced ambiguity vector.
+ * \param score       Scores a produced ambiguity vector, higher is better.
+ *                    NULL to fail when the store fills up.
+ * \return The number of hypotheses produced (in bounded mode, retained),
+ *         -2 if the store filled up,
+ *         -3 if a generator exceeded `max_xs` points.
+ *         On error the store is unchanged if it has scratch buffers, and
+ *         otherwise holds the hypotheses produced so far.
+ */
+s32 hypothesis_store_product(hypothesis_store_t *store, u8 new_num_dds,
+                             void *x0, size_t x_size, u32 max_xs,
+                             s8 (*init)(void *x, const s32 *N, float ll),
+                             s8 (*next)(void *x, u32 n),
+                             void (*prod)(void *x, u32 n, const s32 *N,
+                                          s32 *new_N),
+                             double (*score)(void *x, const s32 *new_N))
+{
+  assert(score == NULL || store->cache != NULL);
+  hypothesis_store_flush(store);
+
+  u8 old_num_dds = store->num_dds;
+  u8 old_width = store->width;
+  u32 old_row_size = old_num_dds * old_width;
+  u32 old_stride = old_row_size + sizeof(float);
+  s32 old_base[HYPOTHESIS_STORE_MAX_DDS];
+  memcpy(old_base, store->base, old_num_dds * sizeof(s32));
+
+  s32 ret = 0;
+  bool transactional = store->scratch_N != NULL;
+  hypothesis_store_t saved;
+  const u8 *old_rows;
+  u32 old_rows_stride;
+  u32 N_tail = store->N_size;
+  if (transactional) {
+    /* Read the input where it is and write the output to the scratch
+     * buffers. */
+    saved = *store;
+    old_rows = saved.N;
+    old_rows_stride = old_row_size;
+    store->N = saved.scratch_N;
+    store->ll = saved.scratch_ll;
+    store->cache = saved.scratch_cache;
+    store->scratch_N = saved.N;
+    store->scratch_ll = saved.ll;
+    store->scratch_cache = saved.cache;
+  } else {
+    if (store->num_hyps * old_stride > store->N_size) {
+      if (score == NULL) {
+        /* Store is full. */
+        store->num_hyps = 0;
+        ret = -2;
+      } else {
+        hypothesis_store_keep_most_likely(store, store->N_size / old_stride);
+      }
+    }
+
+    /* Moving back to front, a row's destination is never below the source
+     * of an earlier row. */
+    N_tail -= store->num_hyps * old_stride;
+    for (u32 i = store->num_hyps; i-- > 0;) {
+      u8 *dst = &store->N[N_tail + i * old_stride];
+      memmove(dst, &store->N[i * old_row_size], old_row_size);
+      memcpy(&dst[old_row_size], &store->ll[i], sizeof(float));
+    }
+    old_rows = &store->N[N_tail];
+    old_rows_stride = old_stride;
+  }
+  u32 num_old = store->num_hyps;
+
+  store->num_dds = new_num_dds;
+  store->num_hyps = 0;
+  store->cache_valid = 0;
+  /* The index is rebuilt at the end, until then it holds the heap. */
+  u32 *heap = store->index;
+  u32 num_replaced = 0;
+
+  u8 x_work[x_size];
+  for (u32 i = 0; i < num_old && ret == 0; i++) {
+    s32 N[HYPOTHESIS_STORE_MAX_DDS];
+    float ll;
+    const u8 *old_row = &old_rows[i * old_rows_stride];
+    hypothesis_store_decode(old_row, old_width, old_base, old_num_dds, N);
+    u32 N_limit = store->N_size;
+    if (transactional) {
+      ll = saved.ll[i];
+    } else {
+      memcpy(&ll, &old_row[old_row_size], sizeof(float));
+      /* Once copied out, old hypothesis i may be overwritten. */
+      N_limit = N_tail + (i + 1) * old_stride;
+    }
+
+    memcpy(x_work, x0, x_size);
+    if (!init(x_work, N, ll)) {
+      continue;
+    }
+
+    u32 x_count = 0;
+    do {
+      if (x_count > max_xs) {
+        /* Exceded maximum number of generator iterations. */
+        ret = -3;
+        break;
+      }
+      u32 n = store->num_hyps;
+      bool room = n + 1 <= store->max_hyps;
+      s32 new_N[HYPOTHESIS_STORE_MAX_DDS];
+      prod(x_work, x_count, N, new_N);
+      if (score == NULL) {
+        if (!room || put_row(store, n, new_N, N_limit) < 0) {
+          /* Store is full. */
+          ret = -2;
+          break;
+        }
+        store->ll[n] = ll;
+        store->num_hyps++;
+      } else {
+        double s = score(x_work, new_N);
+        if (room && put_row(store, n, new_N, N_limit) >= 0) {
+          store->num_hyps++;
+          store->cache[n] = s;
+          store->ll[n] = ll;
+          heap[n] = n;
+          heap_sift_up(store, heap, n);
+        } else if (n > 0 && s > store->cache[heap[0]] &&
+                   put_row(store, heap[0], new_N, N_limit) >= 0) {
+          u32 dst = heap[0];
+          store->cache[dst] = s;
+          store->ll[dst] = ll;
+          heap_sift_down(store, heap, n);
+          num_replaced++;
+        }
+      }
+      x_count++;
+    } while (next(x_work, x_count));
+  }
+
+  if (ret < 0 && transactional) {
+    log_debug("hypothesis_store_product: failed with %"PRId32", "
+              "rolling back", ret);
+    /* Only the index, which may have held the heap, needs restoring. */
+    *store = saved;
+    hypothesis_store_reindex(store);
+    store->version = saved.version;
+    return ret;
+  }
+  if (num_replaced > 0) {
+    log_debug("hypothesis_store_product: store full, "
+              "%"PRIu32" hypotheses replaced", num_replaced);
+  }
+  hypothesis_store_reindex(store);
+  return ret < 0 ? ret : (s32)store->num_hyps;
+}
+
+/** \} */
@@ -16,8 +16,6 @@
 
 #include <string.h>
 #include <math.h>
-#include <cblas.h>
-#include <clapack.h>
 
 #include "linear_algebra.h"
 #include "amb_kf.h"
@@ -32,12 +30,13 @@
 #define ROUND(x)    (floor((x)+0.5))
 #define SWAP(x,y)   do {double tmp_; tmp_=x; x=y; y=tmp_;} while (0)
 
-/* LD factorization (Q=L'*diag(D)*L) -----------------------------------------*/
-static int LD(int n, const double *Q, double *L, double *D)
+/* LD factorization (Q=L'*diag(D)*L) -----------------------------------------
+* args   : double *A        -   workspace (n x n)
+*-----------------------------------------------------------------------------*/
+static int LD(int n, const double *Q, double *L, double *D, double *A)
 {
     int i,j,k,info=0;
     double a;
-    double A[n*n];
     memset(L, 0, sizeof(double)*n*n);
     memset(D, 0, sizeof(double)*n);
 
@@ -52,9 +51,8 @@ static int LD(int n, const double *Q, double *L, double *D)
     if (info) {
         log_error("%s : LD factorization error, trying UD from Gibbs "
                   "(col major UD = LD)", __FILE__);
-        double Qcopy[n * n];
-        memcpy(Qcopy, Q, n * n * sizeof(double));
-        matrix_udu(n, Qcopy, L, D);
+        memcpy(A, Q, n * n * sizeof(double));
+        matrix_udu(n, A, L, D);
     }
     return info;
 }
@@ -104,16 +102,12 @@ static void reduction(int n, double *L, double *D, double *Z)
     }
 }
 /* modified lambda (mlambda) search (ref. [2]) -------------------------------*/
-static int search(int n, int m, const double *L, const double *D,
-                  const double *zs, double *zn, double *s)
+static int search(lambda_workspace_t *ws, int n, int m, const double *L,
+                  const double *D, const double *zs, double *zn, double *s)
 {
     int i,j,k,c,nn=0,imax=0;
     double newdist,maxdist=1E99,y;
-    double S[n*n];
-    double dist[n];
-    double zb[n];
-    double z[n];
-    double step[n];
+    double *S=ws->S,*dist=ws->dist,*zb=ws->zb,*z=ws->z,*step=ws->step;
     memset(S, 0, sizeof(double)*n*n);
 
     k=n-1; dist[k]=0.0;
@@ -169,90 +163,140 @@ static int search(int n, int m, const double *L, const double *D,
     return 0;
 }
 
-/* lambda reduction transformation ------------------------------
-* integer least-square estimation. reduction is performed by lambda (ref.[1]),
-* and search by mlambda (ref.[2]).
-* args   : int    n      I  number of float parameters
-*          double *a     I  float parameters (n x 1)
-*          double *Q     I  covariance matrix of float parameters (n x n)
-* return : status (0:ok,other:error)
-* notes  : matrix stored by column-major order (fortran convension)
+/* transposed matrix vector product (z=Z'*a) --------------------------------*/
+static void matvec_t(int n, const double *Z, const double *a, double *z)
+{
+    int i,k;
+
+    for (i=0;i<n;i++) {
+        z[i]=0.0;
+        for (k=0;k<n;k++) z[i]+=Z[k+i*n]*a[k];
+    }
+}
+/* solve transposed linear equation in place (X=Z'\X) -------------------------
+* args   : int    n,m       I   size of matrix Z,X
+*          double *Z        I   input matrix Z (n x n)
+*          double *B        -   workspace (n x n)
+*          double *X        IO  input matrix Y, output Z'\Y (n x m)
+* return : status (0:ok,>0:Z singular)
+* notes  : gaussian elimination with partial pivoting of B=Z', applied to X as
+*          it goes. the result carries rounding errors, so where Z is
+*          unimodular and Y integer the caller must round X to integers.
 *-----------------------------------------------------------------------------*/
-int lambda_reduction(int n, const double *Q, double *Z)
+static int solve_t(int n, int m, const double *Z, double *B, double *X)
+{
+    int i,j,k,c,p;
+    double l;
+
+    for (i=0;i<n;i++) for (j=0;j<n;j++) B[i+j*n]=Z[j+i*n];
+    for (k=0;k<n;k++) {
+        for (p=k,i=k+1;i<n;i++) if (fabs(B[i+k*n])>fabs(B[p+k*n])) p=i;
+        if (B[p+k*n]==0.0) return k+1;
+        if (p!=k) {
+            for (j=k;j<n;j++) SWAP(B[k+j*n],B[p+j*n]);
+            for (c=0;c<m;c++) SWAP(X[k+c*n],X[p+c*n]);
+        }
+        for (i=k+1;i<n;i++) {
+            if ((l=B[i+k*n]/B[k+k*n])==0.0) continue;
+            for (j=k+1;j<n;j++) B[i+j*n]-=l*B[k+j*n];
+            for (c=0;c<m;c++) X[i+c*n]-=l*X[k+c*n];
+        }
+    }
+    for (c=0;c<m;c++) for (i=n-1;i>=0;i--) {
+        for (j=i+1;j<n;j++) X[i+c*n]-=B[i+j*n]*X[j+c*n];
+        X[i+c*n]/=B[i+i*n];
+    }
+    return 0;
+}
+/* LD factorization and lambda reduction (Qz=Z'*Q*Z=L'*diag(D)*L) ------------*/
+static int reduce(lambda_workspace_t *ws, int n, const double *Q, double *Z)
 {
     int info;
 
-    if (n<=0) return -1;
-
-    double L[n*n];
-    double D[n];
-
-    /* L = zeros(n,n) */
-    memset(L, 0, sizeof(double)*n*n);
-
     /* Z = eye(n) */
     memset(Z, 0, sizeof(double)*n*n);
     for (int i=0; i<n; i++)
       Z[i+n*i] = 1;
 
     /* LD factorization */
-    if (!(info=LD(n,Q,L,D))) {
+    if (!(info=LD(n,Q,ws->L,ws->D,ws->A))) {
         /* lambda reduction */
-        reduction(n,L,D,Z);
+        reduction(n,ws->L,ws->D,Z);
     }
-
     return info;
 }
 
-/* multiply matrix (wrapper of blas dgemm) -------------------------------------
-* multiply matrix by matrix (C=alpha*A*B+beta*C)
-* args   : char   *tr       I  transpose flags ("N":normal,"T":transpose)
-*          int    n,k,m     I  size of (transposed) matrix A,B
-*          double alpha     I  alpha
-*          double *A,*B     I  (transposed) matrix A (n x m), B (m x k)
-*          double beta      I  beta
-*          double *C        IO matrix C (n x k)
-* return : none
+/* lambda reduction transformation with workspace -----------------------------
+* args   : lambda_workspace_t *ws IO workspace
+*          int    n      I  number of float parameters (<= LAMBDA_MAX_DIM)
+*          double *Q     I  covariance matrix of float parameters (n x n)
+*          double *Z     O  decorrelating transformation (n x n)
+* return : status (0:ok,other:error)
+* notes  : matrix stored by column-major order (fortran convension)
+*-----------------------------------------------------------------------------*/
+int lambda_reduction_ws(lambda_workspace_t *ws, int n, const double *Q,
+                        double *Z)
+{
+    if (n<=0||n>LAMBDA_MAX_DIM) return -1;
+    return reduce(ws,n,Q,Z);
+}
+
+/* lambda reduction transformation ------------------------------
+* integer least-square estimation. reduction is performed by lambda (ref.[1]),
+* and search by mlambda (ref.[2]).
+* args   : int    n      I  number of float parameters (<= LAMBDA_MAX_DIM)
+*          double *a     I  float parameters (n x 1)
+*          double *Q     I  covariance matrix of float parameters (n x n)
+* return : status (0:ok,other:error)
+* notes  : matrix stored by column-major order (fortran convension)
+*          as lambda_reduction_ws(), with a workspace on the stack
 *-----------------------------------------------------------------------------*/
-static void matmul(const char *tr, integer n, integer k, integer m, double alpha,
-                   const double *A, const double *B, double beta, double *C)
+int lambda_reduction(int n, const double *Q, double *Z)
 {
-    integer lda=tr[0]=='T'?m:n,ldb=tr[1]=='T'?k:m;
+    lambda_workspace_t ws;
 
-    dgemm_((char *)tr,(char *)tr+1,&n,&k,&m,&alpha,(double *)A,&lda,(double *)B,
-           &ldb,&beta,C,&n);
+    return lambda_reduction_ws(&ws,n,Q,Z);
 }
 
-/* solve linear equation -------------------------------------------------------
-* solve linear equation (X=A\Y or X=A'\Y)
-* args   : char   *tr       I   transpose flag ("N":normal,"T":transpose)
-*          double *A        I   input matrix A (n x n)
-*          double *Y        I   input matrix Y (n x m)
-*          int    n,m       I   size of matrix A,Y
-*          double *X        O   X=A\Y or X=A'\Y (n x m)
-* return : status (0:ok,0>:error)
-* notes  : matirix stored by column-major order (fortran convention)
-*          X can be same as Y
+/* lambda/mlambda integer least-square estimation with workspace ---------------
+* args   : lambda_workspace_t *ws IO workspace
+*          int    n      I  number of float parameters (<= LAMBDA_MAX_DIM)
+*          int    m      I  number of fixed solutions
+*          double *a     I  float parameters (n x 1)
+*          double *Q     I  covariance matrix of float parameters (n x n)
+*          double *F     O  fixed solutions (n x m)
+*          double *s     O  sum of squared residulas of fixed solutions (1 x m)
+* return : status (0:ok,other:error)
+* notes  : matrix stored by column-major order (fortran convension)
+*          no memory is used besides the workspace and the arguments, so
+*          calls with workspaces of their own are independent
 *-----------------------------------------------------------------------------*/
-static int solve(const char *tr, const double *A, const double *Y, integer n,
-                 integer m, double *X)
+int lambda_solution_ws(lambda_workspace_t *ws, int n, int m, const double *a,
+                       const double *Q, double *F, double *s)
 {
-    double B[n*n];
-    integer info;
-    integer ipiv[n];
-
-    memcpy(B, A, sizeof(double)*n*n);
-    memcpy(X, Y, sizeof(double)*n*m);
-    dgetrf_(&n,&n,B,&n,ipiv,&info);
-    if (!info) dgetrs_((char *)tr,&n,&m,B,&n,ipiv,X,&n,&info);
+    int info;
+
+    if (n<=0||n>LAMBDA_MAX_DIM||m<=0) return -1;
+
+    if (!(info=reduce(ws,n,Q,ws->Z))) {
+        matvec_t(n,ws->Z,a,ws->zs); /* zs=Z'*a */
+
+        /* mlambda search, of the decorrelated fixed solutions E into F */
+        if (!(info=search(ws,n,m,ws->L,ws->D,ws->zs,F,s))) {
+
+            /* F=Z'\E, exactly integer as Z is unimodular and E integer */
+            if (!(info=solve_t(n,m,ws->Z,ws->A,F))) {
+                for (int i=0;i<n*m;i++) F[i]=ROUND(F[i]);
+            }
+        }
+    }
     return info;
 }
 
-
 /* lambda/mlambda integer least-square estimation ------------------------------
 * integer least-square estimation. reduction is performed by lambda (ref.[1]),
 * and search by mlambda (ref.[2]).
-* args : int n I number of float parameters
+* args : int n I number of float parameters (<= LAMBDA_MAX_DIM)
 * int m I number of fixed solutions
 * double *a I float parameters (n x 1)
 * double *Q I covariance matrix of float parameters (n x n)
@@ -260,21 +304,70 @@ static int solve(const char *tr, const double *A, const double *Y, integer n,
 * double *s O sum of squared residulas of fixed solutions (1 x m)
 * return : status (0:ok,other:error)
 * notes : matrix stored by column-major order (fortran convension)
+*         as lambda_solution_ws(), with a workspace on the stack
 *-----------------------------------------------------------------------------*/
 int lambda_solution(int n, int m, const double *a, const double *Q, double *F,
                   double *s)
+{
+    lambda_workspace_t ws;
+
+    return lambda_solution_ws(&ws,n,m,a,Q,F,s);
+}
+
+/* batch lambda/mlambda integer least-square estimation ------------------------
+* solve independent problems of the same size, e.g. the float ambiguities of
+* many baselines or epochs, with one workspace. problems are stored one after
+* another, so a batch can be split between threads with a workspace each.
+* args   : lambda_workspace_t *ws IO workspace
+*          int    num    I  number of problems
+*          int    n      I  number of float parameters (<= LAMBDA_MAX_DIM)
+*          int    m      I  number of fixed solutions
+*          double *a     I  float parameters (n x num)
+*          double *Q     I  covariance matrices of float parameters (n x n x num)
+*          double *F     O  fixed solutions (n x m x num)
+*          double *s     O  sum of squared residulas of fixed solutions (m x num)
+*          int    *info  O  status of each problem (num x 1), or NULL
+* return : number of problems with an error, see lambda_solution()
+*-----------------------------------------------------------------------------*/
+int lambda_solution_batch(lambda_workspace_t *ws, int num, int n, int m,
+                          const double *a, const double *Q, double *F,
+                          double *s, int *info)
+{
+    int i,stat,nbad=0;
+
+    for (i=0;i<num;i++) {
+        stat=lambda_solution_ws(ws,n,m,a+i*n,Q+i*n*n,F+i*n*m,s+i*m);
+        if (info) info[i]=stat;
+        if (stat) nbad++;
+    }
+    return nbad;
+}
+/* ellipsoid enumeration setup ----------------------------------------------
+* decorrelate float ambiguities and set up the enumeration of all integer
+* vectors z with (z-Z'*a)'*inv(Qz)*(z-Z'*a) <= chi2, where Qz=Z'*Q*Z
+* args   : lambda_enum_t *e O enumeration state
+*          int    n      I  number of float parameters (<= LAMBDA_ENUM_MAX_DIM)
+*          double *a     I  float parameters (n x 1)
+*          double *Q     I  covariance matrix of float parameters (n x n)
+*          double chi2   I  squared radius of the ellipsoid
+*          double *Z     O  decorrelating transformation (n x n)
+* return : status (0:ok,other:error)
+* notes  : matrix stored by column-major order (fortran convension)
+*          points are visited in Schnorr-Euchner order, so each level of the
+*          search tree is cut off as soon as it leaves the ellipsoid and only
+*          points inside it are ever generated, unlike a scan of its
+*          bounding box.
+*-----------------------------------------------------------------------------*/
+int lambda_enum_init(lambda_enum_t *e, int n, const double *a,
+                     const double *Q, double chi2, double *Z)
 {
     int info;
 
-    if (n<=0||m<=0) return -1;
-    double L[n*n];
-    double D[n];
-    double Z[n*n];
-    double z[n];
-    double E[n*m];
+    if (n<=0||n>LAMBDA_ENUM_MAX_DIM) return -1;
 
-    /* L = zeros(n,n) */
-    memset(L, 0, sizeof(double)*n*n);
+    /* the search state is cleared by lambda_enum_reset(), so until then S
+     * holds L with leading dimension n, and L is the factorization's scratch */
+    double *L=e->S;
 
     /* Z = eye(n) */
     memset(Z, 0, sizeof(double)*n*n);
@@ -282,17 +375,105 @@ int lambda_solution(int n, int m, const double *a, const double *Q, double *F,
       Z[i+n*i] = 1;
 
     /* LD factorization */
-    if (!(info=LD(n,Q,L,D))) {
-
+    if (!(info=LD(n,Q,L,e->D,e->L))) {
         /* lambda reduction */
-        reduction(n,L,D,Z);
-        matmul("TN",n,1,n,1.0,Z,a,0.0,z); /* z=Z'*a */
+        reduction(n,L,e->D,Z);
+    }
+    matvec_t(n,Z,a,e->zs); /* zs=Z'*a */
 
-        /* mlambda search */
-        if (!(info=search(n,m,L,D,z,E,s))) {
+    /* repack L with the enumeration's leading dimension */
+    for (int i=0; i<n; i++) for (int j=0; j<n; j++) {
+        e->L[i+j*LAMBDA_ENUM_MAX_DIM]=L[i+j*n];
+    }
+    e->n=n;
+    e->chi2=chi2;
+    lambda_enum_reset(e);
+    return info;
+}
+/* restart ellipsoid enumeration ---------------------------------------------*/
+void lambda_enum_reset(lambda_enum_t *e)
+{
+    int k=e->n-1;
+    double y;
 
-            info=solve("T",Z,E,n,m,F); /* F=Z'\E */
+    memset(e->S,0,sizeof(e->S));
+    e->k=k; e->done=0; e->dist[k]=0.0;
+    e->zb[k]=e->zs[k];
+    e->z[k]=ROUND(e->zb[k]); y=e->zb[k]-e->z[k]; e->step[k]=SGN(y);
+}
+/* next point of ellipsoid enumeration ---------------------------------------
+* args   : lambda_enum_t *e IO enumeration state
+*          double *z     O  next integer vector inside the ellipsoid (n x 1)
+* return : 1 if a point was found, 0 once all have been visited
+* notes  : the same walk as the mlambda search, but without shrinking the
+*          ellipsoid and yielding every point found
+*-----------------------------------------------------------------------------*/
+int lambda_enum_next(lambda_enum_t *e, double *z)
+{
+    const int ld=LAMBDA_ENUM_MAX_DIM;
+    int i,k=e->k,n=e->n;
+    double newdist,y;
+
+    if (e->done) return 0;
+    for (;;) {
+        y=e->zb[k]-e->z[k];
+        newdist=e->dist[k]+y*y/e->D[k];
+        if (newdist<=e->chi2) {
+            if (k!=0) {
+                e->dist[--k]=newdist;
+                for (i=0;i<=k;i++)
+                    e->S[k+i*ld]=e->S[k+1+i*ld]+(e->z[k+1]-e->zb[k+1])*e->L[k+1+i*ld];
+                e->zb[k]=e->zs[k]+e->S[k+k*ld];
+                e->z[k]=ROUND(e->zb[k]); y=e->zb[k]-e->z[k]; e->step[k]=SGN(y);
+            }
+            else {
+                memcpy(z,e->z,sizeof(double)*n);
+                e->z[0]+=e->step[0]; e->step[0]=-e->step[0]-SGN(e->step[0]);
+                e->k=k;
+                return 1;
+            }
+        }
+        else {
+            if (k==n-1) break;
+            k++;
+            e->z[k]+=e->step[k]; e->step[k]=-e->step[k]-SGN(e->step[k]);
         }
     }
-    return info;
+    e->done=1;
+    return 0;
+}
+/* ellipsoid volume ----------------------------------------------------------
+* volume of the enumerated ellipsoid, an estimate of the number of points
+* lambda_enum_next() yields. it is an underestimate for ellipsoids that are
+* thin compared to the integer grid.
+*-----------------------------------------------------------------------------*/
+double lambda_enum_volume(const lambda_enum_t *e)
+{
+    int n=e->n;
+    double v=pow(M_PI*e->chi2,n/2.0)/tgamma(n/2.0+1.0);
+
+    for (int i=0;i<n;i++) v*=sqrt(e->D[i]);
+    return v;
+}
+/* bound on the number of points ---------------------------------------------
+* upper bound on the number of points lambda_enum_next() yields. in the
+* coordinates of the LDL' factors the ellipsoid is axis aligned with semi-axes
+* a_i=sqrt(chi2*D[i]) and the unit cubes about the integer points tile space,
+* so there are at most as many points as the volume of the ellipsoid grown by
+* the unit cube. that lies inside the ellipsoid with semi-axes a_i+sqrt(n)/2
+* scaled by sqrt(1+max(l_i)-min(l_i)), where l_i=a_i/(a_i+sqrt(n)/2).
+*-----------------------------------------------------------------------------*/
+double lambda_enum_bound(const lambda_enum_t *e)
+{
+    int n=e->n;
+    double r=sqrt(n)/2.0,v=pow(M_PI,n/2.0)/tgamma(n/2.0+1.0);
+    double lmin=1.0,lmax=0.0;
+
+    for (int i=0;i<n;i++) {
+        double a=sqrt(e->chi2*e->D[i]);
+        v*=a+r;
+        if (a/(a+r)<lmin) lmin=a/(a+r);
+        if (a/(a+r)>lmax) lmax=a/(a+r);
+    }
+    return v*pow(1.0+lmax-lmin,n/2.0);
 }
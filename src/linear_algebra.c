@@ -780,6 +780,216 @@ void matrix_reconstruct_udu(const u32 n, const double *U, const double *D, doubl
   }
 }
 
+/** Packs the upper triangle of an `n` x `n` matrix by rows.
+ * This is the layout of the packed CBLAS routines with `CblasRowMajor` and
+ * `CblasUpper`: element (i, j), i <= j, is at MATRIX_PACKED_NDX(n, i, j).
+ * It holds an upper triangular matrix, or a symmetric one, in
+ * MATRIX_PACKED_SIZE(n) elements rather than `n * n`.
+ *
+ * \param n The size of the matrix.
+ * \param M Pointer to the dense input matrix.
+ * \param P Pointer to the packed output matrix.
+ */
+void matrix_pack_upper(u32 n, const double *M, double *P)
+{
+  for (u32 i=0; i<n; i++) {
+    memcpy(&P[MATRIX_PACKED_NDX(n, i, i)], &M[i*n + i],
+           (n - i) * sizeof(double));
+  }
+}
+
+/** Unpacks an upper triangular matrix packed by rows, see
+ * matrix_pack_upper(). The lower triangle is zeroed.
+ *
+ * \param n The size of the matrix.
+ * \param P Pointer to the packed input matrix.
+ * \param M Pointer to the dense output matrix.
+ */
+void matrix_unpack_upper(u32 n, const double *P, double *M)
+{
+  for (u32 i=0; i<n; i++) {
+    memset(&M[i*n], 0, i * sizeof(double));
+    memcpy(&M[i*n + i], &P[MATRIX_PACKED_NDX(n, i, i)],
+           (n - i) * sizeof(double));
+  }
+}
+
+/** Initialise an `n` x `n` identity matrix packed by rows, see
+ * matrix_pack_upper().
+ *
+ * \param n The size of the matrix.
+ * \param P Pointer to the packed matrix.
+ */
+void matrix_eye_packed(u32 n, double *P)
+{
+  memset(P, 0, MATRIX_PACKED_SIZE(n) * sizeof(double));
+  for (u32 i=0; i<n; i++) {
+    P[MATRIX_PACKED_NDX(n, i, i)] = 1;
+  }
+}
+
+/** As matrix_udu(), with \f$U\f$ packed by rows, see matrix_pack_upper().
+ *
+ * \note The M matrix is overwritten by this function.
+ *
+ * \param n The size of the matrix.
+ * \param M Pointer to the dense input matrix.
+ * \param U Pointer to the packed upper unit triangular output matrix.
+ * \param D Pointer to the diagonal vector.
+ */
+void matrix_udu_packed(u32 n, double *M, double *U, double *D)
+{
+  double alpha, beta;
+  matrix_triu(n, M);
+  matrix_eye_packed(n, U);
+  memset(D, 0, n * sizeof(double));
+
+  for (u32 j=n; j>=2; j--) {
+    D[j - 1] = MAX(0, M[(j-1)*n + j-1]);
+    if (D[j-1] > 0) {
+      alpha = 1.0 / D[j-1];
+    } else {
+      alpha = 0.0;
+    }
+    for (u32 k=1; k<j; k++) {
+      beta = M[(k-1)*n + j-1];
+      U[MATRIX_PACKED_NDX(n, k-1, j-1)] = alpha * beta;
+      for (u32 kk = 0; kk < k; kk++) {
+        M[kk*n + k-1] = M[kk*n + k-1] - beta * U[MATRIX_PACKED_NDX(n, kk, j-1)];
+      }
+    }
+  }
+  if (n > 0) {
+    D[0] = MAX(0, M[0]);
+  }
+}
+
+/** As matrix_reconstruct_udu(), with \f$U\f$ packed by rows, see
+ * matrix_pack_upper().
+ *
+ * \param n The size of the matrix.
+ * \param U Pointer to the packed upper unit triangular input matrix.
+ * \param D Pointer to the diagonal vector.
+ * \param M Pointer to the dense output matrix.
+ */
+void matrix_reconstruct_udu_packed(const u32 n, const double *U,
+                                   const double *D, double *M)
+{
+  for (u32 i=0; i<n; i++) {
+    const double *U_i = &U[MATRIX_PACKED_NDX(n, i, i)];
+    for (u32 k=i; k<n; k++) {
+      const double *U_k = &U[MATRIX_PACKED_NDX(n, k, k)];
+      double m = 0;
+      for (u32 j=k; j<n; j++) {
+        m += U_i[j - i] * D[j] * U_k[j - k];
+      }
+      M[i*n + k] = m;
+      M[k*n + i] = m;
+    }
+  }
+}
+
+/** Rank one update of a \f$U D U^{T}\f$ decomposition, with \f$U\f$ packed by
+ * rows (see matrix_pack_upper()), to that of \f$U D U^{T} + c a a^{T}\f$.
+ * This is the Agee-Turner algorithm, as described in Gibbs [1]. It only
+ * touches the columns of \f$U\f$ up to the last nonzero element of \f$a\f$,
+ * so an update with a sparse \f$a\f$ (e.g. a unit vector) is cheap.
+ *
+ * Columns where \f$D\f$ stays zero are left as they are, following the zero
+ * convention of matrix_udu().
+ *
+ * \note The a vector is overwritten by this function.
+ *
+ * References:
+ *   -# Gibbs, Bruce P. "Advanced Kalman Filtering, Least-Squares, and Modeling."
+ *      John C. Wiley & Sons, Inc., 2011.
+ *
+ * \param n The size of the matrix.
+ * \param U Pointer to the packed upper unit triangular matrix, updated in
+ *          place.
+ * \param D Pointer to the diagonal vector, updated in place.
+ * \param c The non-negative scale of the update.
+ * \param a Pointer to the update vector.
+ */
+void matrix_udu_rank_one_packed(u32 n, double *U, double *D, double c,
+                                double *a)
+{
+  u32 last = n;
+  while (last > 0 && a[last-1] == 0) {
+    last--;
+  }
+
+  for (u32 j=last; j-- > 0 && c > 0;) {
+    double a_j = a[j];
+    double d = D[j] + c * a_j * a_j;
+    double b = 0;
+    if (d > 0) {
+      b = c * a_j / d;
+      c *= D[j] / d;
+    }
+    D[j] = d;
+    for (u32 i=0; i<j; i++) {
+      double *u = &U[MATRIX_PACKED_NDX(n, i, j)];
+      a[i] -= a_j * *u;
+      *u += b * a[i];
+    }
+  }
+}
+
+/** Performs the \f$U D U^{T}\f$ decomposition, with \f$U\f$ packed by rows
+ * (see matrix_pack_upper()), of \f$W D_W W^{T}\f$ directly from its factors.
+ * This is Thornton's modified weighted Gram-Schmidt orthogonalization, as
+ * described in Gibbs [1], and avoids forming (and then factoring) the
+ * product. \f$W\f$ needn't be square, so e.g. a transformed \f$U\f$ can be
+ * refactored, or columns added for extra diagonal terms.
+ *
+ * Columns where \f$D\f$ is zero are set to those of the identity, following
+ * matrix_udu().
+ *
+ * \note The W matrix is overwritten by this function.
+ *
+ * References:
+ *   -# Gibbs, Bruce P. "Advanced Kalman Filtering, Least-Squares, and Modeling."
+ *      John C. Wiley & Sons, Inc., 2011.
+ *
+ * \param n The number of rows of W, and the size of the output.
+ * \param m The number of columns of W.
+ * \param W Pointer to the `n` x `m` input matrix.
+ * \param D_W Pointer to the non-negative diagonal of \f$D_W\f$, length `m`.
+ * \param U Pointer to the packed upper unit triangular output matrix.
+ * \param D Pointer to the diagonal output vector, mustn't alias `D_W`.
+ */
+void matrix_mwgs_udu_packed(u32 n, u32 m, double *W, const double *D_W,
+                            double *U, double *D)
+{
+  matrix_eye_packed(n, U);
+
+  for (u32 j=n; j-- > 0;) {
+    const double *w_j = &W[j*m];
+    double d = 0;
+    for (u32 k=0; k<m; k++) {
+      d += D_W[k] * w_j[k] * w_j[k];
+    }
+    if (d <= 0) {
+      D[j] = 0;
+      continue;
+    }
+    D[j] = d;
+
+    for (u32 i=0; i<j; i++) {
+      double *w_i = &W[i*m];
+      double u = 0;
+      for (u32 k=0; k<m; k++) {
+        u += D_W[k] * w_i[k] * w_j[k];
+      }
+      u /= d;
+      U[MATRIX_PACKED_NDX(n, i, j)] = u;
+      for (u32 k=0; k<m; k++) {
+        w_i[k] -= u * w_j[k];
+      }
+    }
+  }
+}
 
 /** Add a matrix to a scaled matrix.
  *  Add two matrices: \f$ C := A + \gamma B \f$, where \f$ A \f$, \f$
@@ -16,40 +16,64 @@
 
 #include "memory_pool.h"
 
-inline static size_t calc_node_size(size_t element_size)
+inline static element_t *get_elem_n(memory_pool_t *pool, u32 n)
 {
-  return element_size + sizeof(memory_pool_node_hdr_t);
+  return pool->pool + pool->element_size * n;
 }
 
-inline static node_t *get_node_n(memory_pool_t *pool, node_t *head, u32 n)
+/** Index of the first allocated element, allocated elements occupy the end of
+ * the pool buffer. */
+inline static u32 first_allocated(memory_pool_t *pool)
 {
-  return (node_t *)((u8 *)head + calc_node_size(pool->element_size) * n);
+  return pool->n_elements - pool->n_allocated;
+}
+
+static void swap_elems(memory_pool_t *pool, u32 i, u32 j)
+{
+  u8 tmp[pool->element_size];
+  memcpy(tmp, get_elem_n(pool, i), pool->element_size);
+  memcpy(get_elem_n(pool, i), get_elem_n(pool, j), pool->element_size);
+  memcpy(get_elem_n(pool, j), tmp, pool->element_size);
+}
+
+/** Reverse the order of elements `a` to `b - 1`. */
+static void reverse_elems(memory_pool_t *pool, u32 a, u32 b)
+{
+  while (b > a + 1) {
+    swap_elems(pool, a, b - 1);
+    a++;
+    b--;
+  }
 }
 
 /** \defgroup memory_pool Functional Memory Pool
  * Simple fixed size memory pool collection supporting functional operations.
  *
  * The functional memory pool container is both a memory pool handling
- * allocation of fixed size 'elements' and a container type that arranges
- * allocated elements in a linked list, exposing functional style primitives
- * such as map and fold that operate over the container. Elements can be
- * removed from the container and released back to the pool with a filter
- * operation.
+ * allocation of fixed size 'elements' and a container type that keeps
+ * allocated elements contiguous in the pool buffer, exposing functional style
+ * primitives such as map and fold that operate over the container. Elements
+ * can be removed from the container and released back to the pool with a
+ * filter operation, which compacts the remaining elements.
+ *
+ * The allocated elements occupy the end of the buffer and new elements are
+ * added in front of them, so that the collection is traversed from the most
+ * recently added element by a linear scan.
  *
- * Allocation and deallocation from the pool are guaranteed constant time and
- * map and fold are O(N).
+ * Allocation from the pool is guaranteed constant time and map, fold and
+ * filter are O(N).
  *
  * \{ */
 
 /** Create a new memory pool.
  * Creates a new memory pool containing a maximum of `n_elements` elements of
  * size `element_size`. This function calles malloc() to reserve space for a
- * ::memory_pool_t struct and for the memory pool itself. Each element stored
- * in the memory pool has an overhead of one pointer size so the total space
- * used for the pool will be:
+ * ::memory_pool_t struct and for the memory pool itself. Elements are stored
+ * contiguously with no per-element overhead so the total space used for the
+ * pool will be:
  *
  * ~~~
- * n_elements * (element_size + sizeof(void *))
+ * n_elements * element_size
  * ~~~
  *
  * Remember to free the pool with memory_pool_destroy(), and for embedded
@@ -68,8 +92,7 @@ memory_pool_t *memory_pool_new(u32 n_elements, size_t element_size)
   }
 
   /* Allocate memory pool */
-  size_t node_size = calc_node_size(element_size);
-  node_t *buff = (node_t *)malloc(node_size * n_elements);
+  element_t *buff = (element_t *)malloc(element_size * n_elements);
   if (!buff) {
     free(new_pool);
     return NULL;
@@ -83,12 +106,12 @@ memory_pool_t *memory_pool_new(u32 n_elements, size_t element_size)
 /** Initialise a new memory pool.
  * Initialises a new memory pool containing a maximum of `n_elements` elements
  * of size `element_size`. This function does not allocate memory and must be
- * passed a buffer of a suitable size to hold the memory pool elements. Each
- * element stored in the memory pool has an overhead of one pointer size so the
- * total space used for the pool will be:
+ * passed a buffer of a suitable size to hold the memory pool elements. Elements
+ * are stored contiguously with no per-element overhead so the total space used
+ * for the pool will be:
  *
  * ~~~
- * n_elements * (element_size + sizeof(void *))
+ * n_elements * element_size
  * ~~~
  *
  * Remember to free the pool with memory_pool_destroy(), and for embedded
@@ -112,26 +135,13 @@ s8 memory_pool_init(memory_pool_t *new_pool, u32 n_elements,
   new_pool->element_size = element_size;
 
   /* Setup memory pool buffer area */
-  new_pool->pool = (node_t *)buff;
+  new_pool->pool = (element_t *)buff;
   if (!new_pool->pool) {
     return -2;
   }
 
-  /* Create linked list out of all the nodes in the pool, adding them to the
-   * list of free nodes so they are ready to be allocated. */
-  new_pool->free_nodes_head = new_pool->pool;
-  node_t *current = NULL;
-  node_t *next_free = NULL;
-  /* Make linked list from last element to first,
-   * very last element points to NULL. */
-  for (s32 i=n_elements-1; i>=0; i--) {
-    current = get_node_n(new_pool, new_pool->free_nodes_head, i);
-    current->hdr.next = next_free;
-    next_free = current;
-  }
-
-  /* No nodes currently allocated. */
-  new_pool->allocated_nodes_head = NULL;
+  /* No elements currently allocated. */
+  new_pool->n_allocated = 0;
 
   return 0;
 }
@@ -150,51 +160,25 @@ void memory_pool_destroy(memory_pool_t *pool)
 
 /** Calculates the number of free (unallocated) elements remaining in the
  * collection.
- * This operation is O(N) in the number of free elements.
+ * This operation is O(1).
  *
  * \param pool Pointer to a memory pool
- * \returns Number of free elements or `< 0` on an error.
+ * \returns Number of free elements.
  */
 s32 memory_pool_n_free(memory_pool_t *pool)
 {
-  u32 count = 0;
-
-  node_t *p = pool->free_nodes_head;
-  while (p && count <= pool->n_elements) {
-    p = p->hdr.next;
-    count++;
-  }
-
-  if (count == pool->n_elements && p)
-    /* The list of free elements is larger than the pool,
-     * something has gone horribly wrong. */
-    return -1;
-
-  return count;
+  return pool->n_elements - pool->n_allocated;
 }
 
 /** Calculates the number of elements already allocated in the collection.
- * This operation is O(N) in the number of allocated elements.
+ * This operation is O(1).
  *
  * \param pool Pointer to a memory pool
- * \returns Number of allocated elements or `< 0` on an error.
+ * \returns Number of allocated elements.
  */
 s32 memory_pool_n_allocated(memory_pool_t *pool)
 {
-  u32 count = 0;
-
-  node_t *p = pool->allocated_nodes_head;
-  while (p && count <= pool->n_elements) {
-    p = p->hdr.next;
-    count++;
-  }
-
-  if (count == pool->n_elements && p)
-    /* The list of free elements is larger than the pool,
-     * something has gone horribly wrong. */
-    return -1;
-
-  return count;
+  return pool->n_allocated;
 }
 
 /** Check if the memory pool is empty.
@@ -205,7 +189,7 @@ s32 memory_pool_n_allocated(memory_pool_t *pool)
  */
 u8 memory_pool_empty(memory_pool_t *pool)
 {
-  return (pool->allocated_nodes_head == NULL);
+  return (pool->n_allocated == 0);
 }
 
 /** Basic getter method for memory_pool_t's n_elements field.
@@ -224,51 +208,34 @@ u32 memory_pool_n_elements(memory_pool_t *pool)
  *
  * \param pool Pointer to a memory pool
  * \param array Array to which the elements will be written
- * \return Number of elements written to the array or `< 0` on an error.
+ * \return Number of elements written to the array.
  */
 s32 memory_pool_to_array(memory_pool_t *pool, void *array)
 {
-  u32 count = 0;
-
-  node_t *p = pool->allocated_nodes_head;
-  while (p && count <= pool->n_elements) {
-    memcpy((u8 *)array + count*pool->element_size, p->elem, pool->element_size);
-    p = p->hdr.next;
-    count++;
-  }
-
-  if (count == pool->n_elements && p)
-    /* The list of free elements is larger than the pool,
-     * something has gone horribly wrong. */
-    return -1;
-
-  return count;
+  memcpy(array, get_elem_n(pool, first_allocated(pool)),
+         pool->n_allocated * pool->element_size);
+  return pool->n_allocated;
 }
 
 /** Adds an element to a collection.
- * Allocates and element from the pool and adds it to the collection of
- * elements, then returns a pointer to the new element.
+ * Allocates and element from the pool and adds it to the front of the
+ * collection of elements, then returns a pointer to the new element.
+ *
+ * The element stays where it is until the collection is next filtered, sorted
+ * or otherwise rearranged, after which the pointer must not be used.
  *
  * \param pool Pointer to a memory pool
  * \return A pointer to the new element or NULL if the pool is full.
  */
 element_t *memory_pool_add(memory_pool_t *pool)
 {
-  /* Take the head of the list of free nodes, insert it as the head of the
-   * allocated nodes and return a pointer to the node's element. */
-
-  if (!pool->free_nodes_head) {
-    /* free_nodes_head is NULL, no free nodes available, pool is full. */
+  if (pool->n_allocated == pool->n_elements) {
+    /* No free elements available, pool is full. */
     return NULL;
   }
 
-  node_t *new_node = pool->free_nodes_head;
-  pool->free_nodes_head = new_node->hdr.next;
-
-  new_node->hdr.next = pool->allocated_nodes_head;
-  pool->allocated_nodes_head = new_node;
-
-  return new_node->elem;
+  pool->n_allocated++;
+  return get_elem_n(pool, first_allocated(pool));
 }
 
 /** Map a function across all elements allocated in the collection.
@@ -276,25 +243,17 @@ element_t *memory_pool_add(memory_pool_t *pool)
  * \param pool Pointer to a memory pool
  * \param arg Arbitrary argument passed through to the function f
  * \param f Pointer to a function that does an in-place update of an element.
- * \return Number of elements mapped across or `< 0` on an error.
+ * \return Number of elements mapped across.
  */
 s32 memory_pool_map(memory_pool_t *pool, void *arg, void (*f)(void *arg, element_t *elem))
 {
-  u32 count = 0;
-
-  node_t *p = pool->allocated_nodes_head;
-  while (p && count <= pool->n_elements) {
-    (*f)(arg, p->elem);
-    p = p->hdr.next;
-    count++;
+  element_t *end = get_elem_n(pool, pool->n_elements);
+  for (element_t *p = get_elem_n(pool, first_allocated(pool)); p < end;
+       p += pool->element_size) {
+    (*f)(arg, p);
   }
 
-  if (count == pool->n_elements && p)
-    /* The list of elements is larger than the pool,
-     * something has gone horribly wrong. */
-    return -1;
-
-  return count;
+  return pool->n_allocated;
 }
 
 /** Calculate a fold reduction on the collection, optionally applying a map at
@@ -305,26 +264,18 @@ s32 memory_pool_map(memory_pool_t *pool, void *arg, void (*f)(void *arg, element
  * \param f Pointer to a function that does an in-place update of an
  *          accumulator state given an element and optionally updates that
  *          element in-place.
- * \return Number of elements folded or `< 0` on an error.
+ * \return Number of elements folded.
  */
 s32 memory_pool_fold(memory_pool_t *pool, void *x0,
                      void (*f)(void *x, element_t *elem))
 {
-  u32 count = 0;
-
-  node_t *p = pool->allocated_nodes_head;
-  while (p && count <= pool->n_elements) {
-    (*f)(x0, p->elem);
-    p = p->hdr.next;
-    count++;
+  element_t *end = get_elem_n(pool, pool->n_elements);
+  for (element_t *p = get_elem_n(pool, first_allocated(pool)); p < end;
+       p += pool->element_size) {
+    (*f)(x0, p);
   }
 
-  if (count == pool->n_elements && p)
-    /* The list of elements is larger than the pool,
-     * something has gone horribly wrong. */
-    return -1;
-
-  return count;
+  return pool->n_allocated;
 }
 
 /** Calculate a double valued fold reduction on the collection, optionally
@@ -340,14 +291,12 @@ s32 memory_pool_fold(memory_pool_t *pool, void *x0,
 double memory_pool_dfold(memory_pool_t *pool, double x0,
                          double (*f)(double x, element_t *elem))
 {
-  u32 count = 0;
   double x = x0;
 
-  node_t *p = pool->allocated_nodes_head;
-  while (p && count <= pool->n_elements) {
-    x = (*f)(x, p->elem);
-    p = p->hdr.next;
-    count++;
+  element_t *end = get_elem_n(pool, pool->n_elements);
+  for (element_t *p = get_elem_n(pool, first_allocated(pool)); p < end;
+       p += pool->element_size) {
+    x = (*f)(x, p);
   }
 
   return x;
@@ -366,14 +315,12 @@ double memory_pool_dfold(memory_pool_t *pool, double x0,
 float memory_pool_ffold(memory_pool_t *pool, float x0,
                         float (*f)(float x, element_t *elem))
 {
-  u32 count = 0;
   float x = x0;
 
-  node_t *p = pool->allocated_nodes_head;
-  while (p && count <= pool->n_elements) {
-    x = (*f)(x, p->elem);
-    p = p->hdr.next;
-    count++;
+  element_t *end = get_elem_n(pool, pool->n_elements);
+  for (element_t *p = get_elem_n(pool, first_allocated(pool)); p < end;
+       p += pool->element_size) {
+    x = (*f)(x, p);
   }
 
   return x;
@@ -392,14 +339,12 @@ float memory_pool_ffold(memory_pool_t *pool, float x0,
 s32 memory_pool_ifold(memory_pool_t *pool, s32 x0,
                       s32 (*f)(s32 x, element_t *elem))
 {
-  u32 count = 0;
   s32 x = x0;
 
-  node_t *p = pool->allocated_nodes_head;
-  while (p && count <= pool->n_elements) {
-    x = (*f)(x, p->elem);
-    p = p->hdr.next;
-    count++;
+  element_t *end = get_elem_n(pool, pool->n_elements);
+  for (element_t *p = get_elem_n(pool, first_allocated(pool)); p < end;
+       p += pool->element_size) {
+    x = (*f)(x, p);
   }
 
   return x;
@@ -407,96 +352,283 @@ s32 memory_pool_ifold(memory_pool_t *pool, s32 x0,
 
 /** Filter elements in the collection, returning filtered out elements back to
  * the pool.
+ * The kept elements are compacted in a single pass, preserving their order.
  *
  * \param pool Pointer to a memory pool
  * \param arg Arbitrary argument passed through to the function f
  * \param f Pointer to a function that takes an element and returns `0` to
  *          discard that element or `!=0` to keep that element.
- * \return Number of elements in the filtered collection or `< 0` on an error.
+ * \return Number of elements in the filtered collection.
  */
 s32 memory_pool_filter(memory_pool_t *pool, void *arg, s8 (*f)(void *arg, element_t *elem))
 {
+  u32 first = first_allocated(pool);
   u32 count = 0;
 
-  /* Construct a fake 'previous' node for the head of the list, this eliminates
-   * special cases for the beginning of the list. */
-  node_t fake_head_node_prev = {
-    .hdr = {
-      .next = pool->allocated_nodes_head,
-    },
-  };
-
-  node_t *p_prev = &fake_head_node_prev;
-  node_t *p = pool->allocated_nodes_head;
-
-  while (p && count <= pool->n_elements) {
-    if ((*f)(arg, p->elem)) {
-      /* Keep element, move along.. */
-      p_prev = p;
-      p = p->hdr.next;
+  for (u32 i=first; i<pool->n_elements; i++) {
+    element_t *elem = get_elem_n(pool, i);
+    if ((*f)(arg, elem)) {
+      /* Keep element, moving it down over any dropped ones. */
+      if (first + count != i) {
+        memcpy(get_elem_n(pool, first + count), elem, pool->element_size);
+      }
       count++;
-    } else {
-      /* Drop this element from the list */
-      p_prev->hdr.next = p->hdr.next;
-      /* and return its node to the pool. */
-      p->hdr.next = pool->free_nodes_head;
-      pool->free_nodes_head = p;
-      p = p_prev->hdr.next;
     }
   }
 
-  /* Use our fake previous node to update the head pointer. */
-  pool->allocated_nodes_head = fake_head_node_prev.hdr.next;
-
-  if (count == pool->n_elements && p)
-    /* The list of elements is larger than the pool,
-     * something has gone horribly wrong. */
-    return -1;
+  /* Move the kept elements back to the end of the buffer. */
+  memmove(get_elem_n(pool, pool->n_elements - count), get_elem_n(pool, first),
+          count * pool->element_size);
+  pool->n_allocated = count;
 
   return count;
 }
 
 /** Remove all elements from the collection and return them all back to the pool.
- * This function is O(n) in the number of currently allocated nodes.
+ * This function is O(1).
  *
  * \param pool Pointer to a memory pool
  */
 s32 memory_pool_clear(memory_pool_t *pool)
 {
-  u32 count = 0;
-  node_t *p = pool->allocated_nodes_head;
+  pool->n_allocated = 0;
+  return 0;
+}
 
-  if (!p) {
-    /* If allocated_nodes_head is NULL then the pool was already empty. */
-    return 0;
+/** Start a resumable operation on the collection.
+ * A resumable operation visits at most a given number of elements per call,
+ * so that a large collection can be processed over several calls, e.g. one
+ * per scheduler tick. The cursor records where the next call carries on from.
+ *
+ * \param pool Pointer to a memory pool
+ * \param cursor Cursor to initialize
+ */
+void memory_pool_cursor_init(memory_pool_t *pool, memory_pool_cursor_t *cursor)
+{
+  cursor->n_remaining = pool->n_allocated;
+  cursor->n_kept = 0;
+}
+
+static s32 visit_resume(memory_pool_t *pool, memory_pool_cursor_t *cursor,
+                        u32 max_elems, void *x,
+                        void (*f)(void *x, element_t *elem))
+{
+  if (cursor->n_remaining > pool->n_allocated) {
+    return -1;
   }
 
-  while (p->hdr.next && count <= pool->n_elements) {
-    p = p->hdr.next;
-    count++;
+  u32 n = MIN(cursor->n_remaining, max_elems);
+  element_t *p = get_elem_n(pool, pool->n_elements - cursor->n_remaining);
+  for (u32 i = 0; i < n; i++, p += pool->element_size) {
+    (*f)(x, p);
   }
+  cursor->n_remaining -= n;
+
+  return cursor->n_remaining;
+}
+
+/** Resumable version of memory_pool_map(), mapping across at most `max_elems`
+ * further elements in collection order.
+ *
+ * Elements added to the collection between calls are not visited. Any other
+ * modification of the collection invalidates the cursor.
+ *
+ * \param pool Pointer to a memory pool
+ * \param cursor Cursor from memory_pool_cursor_init()
+ * \param max_elems Maximum number of elements to visit in this call
+ * \param arg Arbitrary argument passed through to the function f
+ * \param f Pointer to a function that does an in-place update of an element.
+ * \return Number of elements still to be visited, `0` once the map is
+ *         complete, or `-1` if the cursor doesn't match the collection.
+ */
+s32 memory_pool_map_resume(memory_pool_t *pool, memory_pool_cursor_t *cursor,
+                           u32 max_elems, void *arg,
+                           void (*f)(void *arg, element_t *elem))
+{
+  return visit_resume(pool, cursor, max_elems, arg, f);
+}
 
-  if (p->hdr.next) {
-    /* Failed to find the end of the allocaed nodes list. */
+/** Resumable version of memory_pool_fold(), folding at most `max_elems`
+ * further elements in collection order into the accumulator `x`.
+ *
+ * Elements added to the collection between calls are not visited. Any other
+ * modification of the collection invalidates the cursor.
+ *
+ * \param pool Pointer to a memory pool
+ * \param cursor Cursor from memory_pool_cursor_init()
+ * \param max_elems Maximum number of elements to visit in this call
+ * \param x Pointer to the accumulator state, carried between calls.
+ * \param f Pointer to a function that does an in-place update of an
+ *          accumulator state given an element and optionally updates that
+ *          element in-place.
+ * \return Number of elements still to be visited, `0` once the fold is
+ *         complete, or `-1` if the cursor doesn't match the collection.
+ */
+s32 memory_pool_fold_resume(memory_pool_t *pool, memory_pool_cursor_t *cursor,
+                            u32 max_elems, void *x,
+                            void (*f)(void *x, element_t *elem))
+{
+  return visit_resume(pool, cursor, max_elems, x, f);
+}
+
+/** Resumable version of memory_pool_filter(), filtering at most `max_elems`
+ * further elements.
+ *
+ * The elements are visited in reverse collection order, with the kept ones
+ * compacted towards the end of the buffer as they are visited, so each call
+ * does work proportional to `max_elems` only and the final order is the same
+ * as memory_pool_filter(). Elements not yet visited are left untouched, but
+ * until the filter is complete the collection must not be accessed other than
+ * through this function.
+ *
+ * \param pool Pointer to a memory pool
+ * \param cursor Cursor from memory_pool_cursor_init()
+ * \param max_elems Maximum number of elements to visit in this call
+ * \param arg Arbitrary argument passed through to the function f
+ * \param f Pointer to a function that takes an element and returns `0` to
+ *          discard that element or `!=0` to keep that element.
+ * \return Number of elements still to be visited, `0` once the filter is
+ *         complete, or `-1` if the cursor doesn't match the collection.
+ */
+s32 memory_pool_filter_resume(memory_pool_t *pool, memory_pool_cursor_t *cursor,
+                              u32 max_elems, void *arg,
+                              s8 (*f)(void *arg, element_t *elem))
+{
+  if (cursor->n_remaining + cursor->n_kept > pool->n_allocated) {
     return -1;
   }
 
-  /* p now points to the last node in the list. We can now insert the old
-   * allocated nodes list in front of the current free nodes list. */
-  p->hdr.next = pool->free_nodes_head;
-  pool->free_nodes_head = pool->allocated_nodes_head;
-  pool->allocated_nodes_head = NULL;
+  u32 first = first_allocated(pool);
+  u32 n = MIN(cursor->n_remaining, max_elems);
+  for (u32 k = 0; k < n; k++) {
+    u32 i = first + --cursor->n_remaining;
+    element_t *elem = get_elem_n(pool, i);
+    if ((*f)(arg, elem)) {
+      /* Keep element, moving it up over any dropped ones. */
+      u32 dst = pool->n_elements - ++cursor->n_kept;
+      if (dst != i) {
+        memcpy(get_elem_n(pool, dst), elem, pool->element_size);
+      }
+    }
+  }
 
-  return 0;
+  if (n > 0 && cursor->n_remaining == 0) {
+    pool->n_allocated = cursor->n_kept;
+  }
+
+  return cursor->n_remaining;
+}
+
+/* Strict ordering of elements `i` and `j` by the memory_pool_sort()
+ * comparison function. */
+static inline u8 elem_less(memory_pool_t *pool, void *arg,
+                           s32 (*cmp)(void *arg, element_t *a, element_t *b),
+                           u32 i, u32 j)
+{
+  return cmp(arg, get_elem_n(pool, i), get_elem_n(pool, j)) < 0;
+}
+
+static void insertion_sort(memory_pool_t *pool, void *arg,
+                           s32 (*cmp)(void *arg, element_t *a, element_t *b),
+                           u32 a, u32 b)
+{
+  for (u32 i = a + 1; i < b; i++) {
+    for (u32 j = i; j > a && elem_less(pool, arg, cmp, j, j - 1); j--) {
+      swap_elems(pool, j, j - 1);
+    }
+  }
+}
+
+/* Exchange the element blocks `a` to `m - 1` and `m` to `b - 1`. */
+static void rotate_elems(memory_pool_t *pool, u32 a, u32 m, u32 b)
+{
+  reverse_elems(pool, a, m);
+  reverse_elems(pool, m, b);
+  reverse_elems(pool, a, b);
+}
+
+/* Stably merge the sorted runs `a` to `m - 1` and `m` to `b - 1` in place. */
+static void sym_merge(memory_pool_t *pool, void *arg,
+                      s32 (*cmp)(void *arg, element_t *a, element_t *b),
+                      u32 a, u32 m, u32 b)
+{
+  if (m - a == 1) {
+    /* Insert the single left element after the right elements less than it. */
+    u32 i = m;
+    u32 j = b;
+    while (i < j) {
+      u32 h = i + (j - i) / 2;
+      if (elem_less(pool, arg, cmp, h, a)) {
+        i = h + 1;
+      } else {
+        j = h;
+      }
+    }
+    for (u32 k = a; k + 1 < i; k++) {
+      swap_elems(pool, k, k + 1);
+    }
+    return;
+  }
+  if (b - m == 1) {
+    /* Insert the single right element after the left elements not greater
+     * than it. */
+    u32 i = a;
+    u32 j = m;
+    while (i < j) {
+      u32 h = i + (j - i) / 2;
+      if (!elem_less(pool, arg, cmp, m, h)) {
+        i = h + 1;
+      } else {
+        j = h;
+      }
+    }
+    for (u32 k = m; k > i; k--) {
+      swap_elems(pool, k, k - 1);
+    }
+    return;
+  }
+
+  u32 mid = a + (b - a) / 2;
+  u32 n = mid + m;
+  u32 start, r;
+  if (m > mid) {
+    start = n - b;
+    r = mid;
+  } else {
+    start = a;
+    r = m;
+  }
+  u32 p = n - 1;
+  while (start < r) {
+    u32 c = start + (r - start) / 2;
+    if (!elem_less(pool, arg, cmp, p - c, c)) {
+      start = c + 1;
+    } else {
+      r = c;
+    }
+  }
+
+  u32 end = n - start;
+  if (start < m && m < end) {
+    rotate_elems(pool, start, m, end);
+  }
+  if (a < start && start < mid) {
+    sym_merge(pool, arg, cmp, a, start, mid);
+  }
+  if (mid < end && end < b) {
+    sym_merge(pool, arg, cmp, mid, end, b);
+  }
 }
 
 /** Sort the elements in a collection.
- * This is implemented as a merge sort on a linked list and has O(N log N) time
- * complexity and O(1) space complexity. The implementation is stable and has
- * no pathological cases. The worst-case running time is still O(N log N).
+ * This is implemented as an in-place merge sort on the pool buffer: runs of a
+ * few elements are insertion sorted and then merged pairwise with the
+ * SymMerge algorithm, which needs no working space beyond a single element.
+ * It makes O(N log N) comparisons and O(N log^2 N) element moves and is
+ * stable.
  *
  * Ordering is defined by a comparison function `cmp` which takes two elements
- * `a` and `b` and returns `>0` if `a` should be placed before `b`, `<0` if `b`
+ * `a` and `b` and returns `<0` if `a` should be placed before `b`, `>0` if `b`
  * should be placed before `a` and `0` if they are 'equal' and their current
  * ordering should be preserved.
  *
@@ -504,32 +636,9 @@ s32 memory_pool_clear(memory_pool_t *pool)
  * through from memory_pool_sort(), this can be used to pass a key or index to
  * sort on to a general comparison function, for example.
  *
- * This implementation is based on the excellent implementation by Simon Tatham:
- *
- * http://www.chiark.greenend.org.uk/~sgtatham/algorithms/listsort.html
- *
- * > Based on code copyright 2001 Simon Tatham.
- * >
- * > Permission is hereby granted, free of charge, to any person
- * > obtaining a copy of this software and associated documentation
- * > files (the "Software"), to deal in the Software without
- * > restriction, including without limitation the rights to use,
- * > copy, modify, merge, publish, distribute, sublicense, and/or
- * > sell copies of the Software, and to permit persons to whom the
- * > Software is furnished to do so, subject to the following
- * > conditions:
- * >
- * > The above copyright notice and this permission notice shall be
- * > included in all copies or substantial portions of the Software.
- * >
- * > THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
- * > EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
- * > OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
- * > NONINFRINGEMENT.  IN NO EVENT SHALL SIMON TATHAM BE LIABLE FOR
- * > ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
- * > CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
- * > CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
- * > SOFTWARE.
+ * References:
+ *   -# Kim, Pok-Son, and Arne Kutzner. "Stable minimum storage merging by
+ *      symmetric comparisons." Algorithms - ESA 2004, pp. 714-723.
  *
  * \param pool Pointer to a memory pool
  * \param arg Arbitrary argument passed through to the comparison function
@@ -538,74 +647,18 @@ s32 memory_pool_clear(memory_pool_t *pool)
 void memory_pool_sort(memory_pool_t *pool, void *arg,
                       s32 (*cmp)(void *arg, element_t *a, element_t *b))
 {
-  /* If collection is empty, return immediately. */
-  if (!pool->allocated_nodes_head)
-    return;
-
-  u32 insize = 1;
-
-  while (1) {
-    node_t *p = pool->allocated_nodes_head;
-    pool->allocated_nodes_head = NULL;
-    node_t *tail = NULL;
-
-    u32 nmerges = 0;  /* count number of merges we do in this pass */
-
-    while (p) {
-      nmerges++;  /* there exists a merge to be done */
-      /* step `insize' places along from p */
-      node_t *q = p;
-      u32 psize = 0;
-      for (u32 i = 0; i < insize; i++) {
-        psize++;
-        q = q->hdr.next;
-        if (!q) break;
-      }
-
-      /* if q hasn't fallen off end, we have two lists to merge */
-      u32 qsize = insize;
-
-      /* now we have two lists; merge them */
-      while (psize > 0 || (qsize > 0 && q)) {
-
-        node_t *e;
-
-        /* decide whether next element of merge comes from p or q */
-        if (psize == 0) {
-          /* p is empty; e must come from q. */
-          e = q; q = q->hdr.next; qsize--;
-        } else if (qsize == 0 || !q) {
-          /* q is empty; e must come from p. */
-          e = p; p = p->hdr.next; psize--;
-        } else if (cmp(arg, p->elem, q->elem) <= 0) {
-          /* First element of p is lower (or same);
-           * e must come from p. */
-          e = p; p = p->hdr.next; psize--;
-        } else {
-          /* First element of q is lower; e must come from q. */
-          e = q; q = q->hdr.next; qsize--;
-        }
+  const u32 run_size = 16;
+  u32 first = first_allocated(pool);
+  u32 end = pool->n_elements;
 
-        /* add the next element to the merged list */
-        if (tail) {
-          tail->hdr.next = e;
-        } else {
-          pool->allocated_nodes_head = e;
-        }
-        tail = e;
-      }
+  for (u32 a = first; a < end; a += run_size) {
+    insertion_sort(pool, arg, cmp, a, MIN(a + run_size, end));
+  }
 
-      /* now p has stepped `insize' places along, and q has too */
-      p = q;
+  for (u32 size = run_size; size < end - first; size *= 2) {
+    for (u32 a = first; a + size < end; a += 2 * size) {
+      sym_merge(pool, arg, cmp, a, a + size, MIN(a + 2 * size, end));
     }
-    tail->hdr.next = NULL;
-
-    /* If we have done only one merge, we're finished. */
-    if (nmerges <= 1)   /* allow for nmerges==0, the empty list case */
-      return;
-
-    /* Otherwise repeat, merging lists twice the size */
-    insize *= 2;
   }
 }
 
@@ -636,6 +689,10 @@ void memory_pool_sort(memory_pool_t *pool, void *arg,
  *    reset to `x0` at the start of processing each group by copying `x0` into
  *    a working area each time.
  *
+ * The aggregates are written over the groups already consumed, so the
+ * reduction needs no free space in the pool. As each aggregate is added to the
+ * front of the collection they end up in the reverse of the sorted order.
+ *
  * \param pool Pointer to a memory pool
  * \param arg Arbitrary argument passed through to the comparison function
  * \param cmp Comparison function used to define the grouping
@@ -650,57 +707,219 @@ void memory_pool_group_by(memory_pool_t *pool, void *arg,
                           void (*agg)(element_t *new, void *x, u32 n, element_t *elem))
 {
   /* If collection is empty, return immediately. */
-  if (!pool->allocated_nodes_head)
+  if (pool->n_allocated == 0)
     return;
 
-  /* First sort the existing list using the compare function. */
+  /* First sort the existing collection using the compare function. */
   memory_pool_sort(pool, arg, cmp);
 
-  /* Save the head of the unaggregated list and reset the pool head where the
-   * aggregated data will be added. */
-  node_t *old_head = pool->allocated_nodes_head;
-  pool->allocated_nodes_head = NULL;
-
   /* Allocate working area for the fold function. */
   u8 x_work[x_size];
 
-  u32 count = 0;
+  /* Working area for the aggregate, it can only be stored once its group has
+   * been consumed. */
+  u8 new_elem[pool->element_size];
 
-  node_t *p = old_head;
+  u32 first = first_allocated(pool);
+  u32 n_groups = 0;
+  u32 i = first;
 
-  while (p && count <= pool->n_elements) {
+  while (i < pool->n_elements) {
     u32 group_count = 0;
 
     /* Keep a pointer to the head of the group. */
-    node_t *group_head = p;
+    element_t *group_head = get_elem_n(pool, i);
 
     /* Re-initialize the working area. */
     if (x_size)
       memcpy(x_work, x0, x_size);
 
-    /* Create a new element to hold the aggregate of this group. */
-    element_t *new_elem = memory_pool_add(pool);
-
     /* Initialize the new element to the first element in the group. */
-    memcpy(new_elem, p->elem, pool->element_size);
+    memcpy(new_elem, group_head, pool->element_size);
 
     /* Aggregate this group. */
     do {
-      agg(new_elem, (void *)x_work, group_count, p->elem);
+      agg(new_elem, (void *)x_work, group_count, get_elem_n(pool, i));
       group_count++;
+      i++;
+    } while (i < pool->n_elements &&
+             cmp(arg, group_head, get_elem_n(pool, i)) == 0);
+
+    /* Store the aggregate at or before the head of the group just consumed. */
+    memcpy(get_elem_n(pool, first + n_groups), new_elem, pool->element_size);
+    n_groups++;
+  }
 
-      /* Store pointer to next node to process. */
-      node_t *next_p = p->hdr.next;
+  /* Put the aggregates in the order they would have been added in and move
+   * them back to the end of the buffer. */
+  reverse_elems(pool, first, first + n_groups);
+  memmove(get_elem_n(pool, pool->n_elements - n_groups),
+          get_elem_n(pool, first), n_groups * pool->element_size);
+  pool->n_allocated = n_groups;
+}
+
+/* Number of slots in the hash table of memory_pool_group_by_hash(), the
+ * smallest power of two at least twice the number of elements. */
+static u32 group_by_hash_n_slots(u32 n)
+{
+  u32 n_slots = 2;
+  while (n_slots < 2 * n) {
+    n_slots *= 2;
+  }
+  return n_slots;
+}
 
-      /* Return current node to the pool. */
-      p->hdr.next = pool->free_nodes_head;
-      pool->free_nodes_head = p;
+/* Bytes of memory_pool_group_by_hash() scratch taken by the aggregation
+ * state, rounded up so that the tables that follow are aligned. */
+static size_t group_by_hash_x_work_size(u32 n, size_t x_size)
+{
+  size_t size = n * x_size;
+  return (size + sizeof(u32) - 1) / sizeof(u32) * sizeof(u32);
+}
 
-      p = next_p;
-    } while(p && cmp(arg, group_head->elem, p->elem) == 0);
+/** Size of the scratch space memory_pool_group_by_hash() needs.
+ *
+ * \param n Number of elements in the collection to group, e.g.
+ *          memory_pool_n_elements() to cover any collection in the pool
+ * \param x_size The size in bytes of the aggregation function's argument
+ * \return Size in bytes, a multiple of `sizeof(u32)`.
+ */
+size_t memory_pool_group_by_hash_scratch_size(u32 n, size_t x_size)
+{
+  return group_by_hash_x_work_size(n, x_size) +
+         (group_by_hash_n_slots(n) + n) * sizeof(u32);
+}
 
-    count++;
+/** Perform a groupby type reduction on a collection, grouping by hash.
+ * Equivalent to memory_pool_group_by(), without sorting the collection: the
+ * elements are assigned to groups through a hash table in one pass and
+ * aggregated in a second, both linear in the number of elements.
+ *
+ * The hash function must give equal hashes for any two elements the
+ * comparison function puts in the same group, i.e. for which it evaluates to
+ * `0`. Unlike for memory_pool_group_by() the comparison function need not
+ * define an ordering, only equality.
+ *
+ * Each group is aggregated in the order its elements appear in the collection,
+ * exactly as memory_pool_group_by() would aggregate it. The aggregates are in
+ * the reverse of the order in which their groups first appear, as if each was
+ * added to the front of the collection in turn.
+ *
+ * The hash table and the per group aggregation state are kept in `scratch`,
+ * which must hold memory_pool_group_by_hash_scratch_size() bytes for the
+ * number of elements in the collection, and be aligned for `x0`.
+ *
+ * \param pool Pointer to a memory pool
+ * \param arg Arbitrary argument passed through to the hash and comparison
+ *            functions
+ * \param hash Hash function of the grouping key of an element
+ * \param cmp Comparison function, `0` for elements of the same group
+ * \param x0 Arbitrary argument passed to the aggregation function, reset to
+ *           this value on each new group.
+ * \param x_size The size in bytes of the `x0` argument
+ * \param agg The aggregation function
+ * \param scratch Scratch space, see above
+ * \param scratch_size Size of `scratch` in bytes
+ * \return Number of groups, i.e. elements in the reduced collection, or `-1`
+ *         if `scratch` is too small, in which case the collection is left
+ *         unchanged.
+ */
+s32 memory_pool_group_by_hash(memory_pool_t *pool, void *arg,
+                              u32 (*hash)(void *arg, element_t *elem),
+                              s32 (*cmp)(void *arg, element_t *a, element_t *b),
+                              void *x0, size_t x_size,
+                              void (*agg)(element_t *new, void *x, u32 n, element_t *elem),
+                              void *scratch, size_t scratch_size)
+{
+  u32 n = pool->n_allocated;
+  if (n == 0)
+    return 0;
+  if (scratch_size < memory_pool_group_by_hash_scratch_size(n, x_size))
+    return -1;
+
+  u32 first = first_allocated(pool);
+
+  /* The aggregation state of each group, then the table and the group of
+   * each element. */
+  u8 *x_work = (u8 *)scratch;
+  u32 *leaders = (u32 *)((u8 *)scratch + group_by_hash_x_work_size(n, x_size));
+  u32 n_slots = group_by_hash_n_slots(n);
+  u32 *group_of = &leaders[n_slots];
+
+  /* Open addressing table of group leaders, at most half full. */
+  u32 mask = n_slots - 1;
+  memset(leaders, 0, n_slots * sizeof(u32));
+
+  /* Assign each element to a group, numbered in order of first appearance,
+   * while the elements are all still intact for comparison. */
+  u32 n_groups = 0;
+  for (u32 i=0; i<n; i++) {
+    element_t *elem = get_elem_n(pool, first + i);
+    u32 slot = hash(arg, elem) & mask;
+    while (leaders[slot] != 0 &&
+           cmp(arg, get_elem_n(pool, first + leaders[slot] - 1), elem) != 0) {
+      slot = (slot + 1) & mask;
+    }
+    if (leaders[slot] == 0) {
+      leaders[slot] = i + 1;
+      group_of[i] = n_groups++;
+    } else {
+      group_of[i] = group_of[leaders[slot] - 1];
+    }
   }
+
+  /* Aggregate. Group `g` first appears no earlier than element `g`, and all
+   * elements before that have been aggregated already, so its aggregate can be
+   * kept in the place of element `g`. The table is no longer needed, so it
+   * holds the group counts. */
+  u32 *group_count = leaders;
+  u8 elem[pool->element_size];
+  u32 n_seen = 0;
+  for (u32 i=0; i<n; i++) {
+    u32 g = group_of[i];
+    element_t *new_elem = get_elem_n(pool, first + g);
+    if (g == n_seen) {
+      /* First element of a new group, it may be in the aggregate's place. */
+      memcpy(elem, get_elem_n(pool, first + i), pool->element_size);
+      memcpy(new_elem, elem, pool->element_size);
+      if (x_size)
+        memcpy(&x_work[g * x_size], x0, x_size);
+      group_count[g] = 0;
+      n_seen++;
+      agg(new_elem, &x_work[g * x_size], group_count[g]++, elem);
+    } else {
+      agg(new_elem, &x_work[g * x_size], group_count[g]++,
+          get_elem_n(pool, first + i));
+    }
+  }
+
+  /* Put the aggregates in the order they would have been added in and move
+   * them back to the end of the buffer. */
+  reverse_elems(pool, first, first + n_groups);
+  memmove(get_elem_n(pool, pool->n_elements - n_groups),
+          get_elem_n(pool, first), n_groups * pool->element_size);
+  pool->n_allocated = n_groups;
+
+  return n_groups;
+}
+
+/** Move the elements of a collection to the start of the buffer, in reverse
+ * order, ahead of a product.
+ * Consuming them from the last one down, the space freed by each element
+ * consumed is then adjacent to the free space the new elements are added into,
+ * so a product fits in the pool whenever it would fit with every consumed
+ * element freed.
+ *
+ * \return The number of elements to consume.
+ */
+static u32 stage_product(memory_pool_t *pool)
+{
+  u32 n_old = pool->n_allocated;
+  memmove(pool->pool, get_elem_n(pool, first_allocated(pool)),
+          n_old * pool->element_size);
+  reverse_elems(pool, 0, n_old);
+  pool->n_allocated = 0;
+  return n_old;
 }
 
 /** Cartesian product of a memory pool collection with an array.
@@ -720,48 +939,39 @@ void memory_pool_group_by(memory_pool_t *pool, void *arg,
  * \param n_xs Number of items in array `xs`
  * \param x_size The size in bytes of each item in `xs`
  * \param prod The product function
+ * \return Number of elements in the new collection, or `-2` if the pool
+ *         filled up, in which case the collection holds only the new elements
+ *         made so far.
  */
 s32 memory_pool_product(memory_pool_t *pool, void *xs, u32 n_xs, size_t x_size,
                         void (*prod)(element_t *new, void *x, u32 n_xs, u32 n, element_t *elem))
 {
-  /* Save the head of the original list and reset the pool head where the
-   * product data will be added. */
-  node_t *old_head = pool->allocated_nodes_head;
-  pool->allocated_nodes_head = NULL;
+  u32 n_old = stage_product(pool);
+
+  /* Copy of the element being consumed, its space may be reused by the new
+   * elements. */
+  u8 elem[pool->element_size];
 
   u32 count = 0;
 
-  node_t *p = old_head;
-  while (p && count <= pool->n_elements) {
-    /* Add one element to the new list for each pair of
+  for (u32 r=n_old; r-- > 0;) {
+    memcpy(elem, get_elem_n(pool, r), pool->element_size);
+
+    /* Add one element to the new collection for each pair of
      * the current element and an item in xs. */
     for (u32 i=0; i<n_xs; i++) {
-      element_t *new = memory_pool_add(pool);
-      if (!new) {
+      if (first_allocated(pool) == r) {
         /* Pool is full. */
         return -2;
       }
+      element_t *new = memory_pool_add(pool);
       /* Initialize the element to the same as the original element. */
-      memcpy(new, p->elem, pool->element_size);
-      prod(new, ((u8 *)xs + i*x_size), n_xs, i, p->elem);
+      memcpy(new, elem, pool->element_size);
+      prod(new, ((u8 *)xs + i*x_size), n_xs, i, elem);
       count++;
     }
-
-    /* Store pointer to next node to process. */
-    node_t *next_p = p->hdr.next;
-
-    /* Return current node to the pool. */
-    p->hdr.next = pool->free_nodes_head;
-    pool->free_nodes_head = p;
-
-    p = next_p;
   }
 
-  if (count == pool->n_elements && p)
-    /* The list of elements is larger than the pool,
-     * something has gone horribly wrong. */
-    return -1;
-
   return count;
 }
 
@@ -770,21 +980,23 @@ s32 memory_pool_product_generator(memory_pool_t *pool, void *x0, u32 max_xs, siz
                                   s8 (*next)(void *x, u32 n),
                                   void (*prod)(element_t *new, void *x, u32 n, element_t *elem))
 {
-  /* Save the head of the original list and reset the pool head where the
-   * product data will be added. */
-  node_t *old_head = pool->allocated_nodes_head;
-  pool->allocated_nodes_head = NULL;
+  u32 n_old = stage_product(pool);
+
+  /* Copy of the element being consumed, its space may be reused by the new
+   * elements. */
+  u8 elem[pool->element_size];
 
   u32 count = 0;
 
-  node_t *p = old_head;
-  while (p && count <= pool->n_elements) {
+  for (u32 r=n_old; r-- > 0;) {
+    memcpy(elem, get_elem_n(pool, r), pool->element_size);
+
     /* Iterate through our generator adding a new element for each pair
-     * of a generated element and the current element from the old list. */
+     * of a generated element and the current element from the old collection. */
     u8 x_work[x_size];
     memcpy(x_work, x0, x_size);
 
-    s8 not_empty = init(x_work, p->elem);
+    s8 not_empty = init(x_work, elem);
 
     u32 x_count = 0;
     /* point is false if there are no elements to produce for the current element. */
@@ -794,37 +1006,371 @@ s32 memory_pool_product_generator(memory_pool_t *pool, void *x0, u32 max_xs, siz
           /* Exceded maximum number of generator iterations. */
           return -3;
         }
-        element_t *new = memory_pool_add(pool);
-        if (!new) {
+        if (first_allocated(pool) == r) {
           /* Pool is full. */
           return -2;
         }
+        element_t *new = memory_pool_add(pool);
         /* Initialize the element to the same as the original element. */
-        memcpy(new, p->elem, pool->element_size);
-        prod(new, x_work, x_count, p->elem);
+        memcpy(new, elem, pool->element_size);
+        prod(new, x_work, x_count, elem);
         x_count++;
         count++;
       } while (next(x_work, x_count));
     }
+  }
 
-    /* Store pointer to next node to process. */
-    node_t *next_p = p->hdr.next;
+  return count;
+}
 
-    /* Return current node to the pool. */
-    p->hdr.next = pool->free_nodes_head;
-    pool->free_nodes_head = p;
+/* Parallel operations split the collection into chunks of consecutive
+ * elements. The chunks are sized from the number of elements alone, never
+ * from how they are scheduled, so the results are the same on any executor. */
+#define MEMORY_POOL_MIN_CHUNK_SIZE 32
+#define MEMORY_POOL_MAX_CHUNKS 64
+
+typedef struct {
+  memory_pool_t *pool;
+  u32 first;
+  u32 chunk_size;
+} chunking_t;
+
+/** Splits the collection into chunks.
+ * \return The number of chunks. */
+static u32 make_chunks(memory_pool_t *pool, chunking_t *chunks)
+{
+  u32 n = pool->n_allocated;
+  chunks->pool = pool;
+  chunks->first = first_allocated(pool);
+  chunks->chunk_size = MAX(MEMORY_POOL_MIN_CHUNK_SIZE,
+                           (n + MEMORY_POOL_MAX_CHUNKS - 1) / MEMORY_POOL_MAX_CHUNKS);
+  return (n + chunks->chunk_size - 1) / chunks->chunk_size;
+}
 
-    p = next_p;
+/** Index of the first element of chunk `i`, one past its last element is
+ * the first element of chunk `i + 1`. */
+static u32 chunk_start(const chunking_t *chunks, u32 i)
+{
+  return MIN(chunks->first + i * chunks->chunk_size, chunks->pool->n_elements);
+}
+
+/** Runs the tasks of a parallel operation one after the other on the calling
+ * thread, for use as a ::memory_pool_executor_t where there are no threads.
+ *
+ * \param arg Unused
+ * \param n_tasks Number of tasks
+ * \param task Function running a task
+ * \param task_arg Argument passed through to the function task
+ */
+void memory_pool_run_serial(void *arg, u32 n_tasks,
+                            void (*task)(void *task_arg, u32 i),
+                            void *task_arg)
+{
+  (void)arg;
+  for (u32 i=0; i<n_tasks; i++) {
+    task(task_arg, i);
   }
+}
 
-  if (count == pool->n_elements && p)
-    /* The list of elements is larger than the pool,
-     * something has gone horribly wrong. */
-    return -1;
+typedef struct {
+  chunking_t chunks;
+  void *arg;
+  void (*f)(void *arg, element_t *elem);
+} map_task_t;
 
-  return count;
+static void map_task(void *task_arg, u32 i)
+{
+  map_task_t *t = (map_task_t *)task_arg;
+  element_t *end = get_elem_n(t->chunks.pool, chunk_start(&t->chunks, i + 1));
+  for (element_t *p = get_elem_n(t->chunks.pool, chunk_start(&t->chunks, i));
+       p < end; p += t->chunks.pool->element_size) {
+    t->f(t->arg, p);
+  }
 }
 
-/** \} */
+/** As memory_pool_map(), with chunks of the collection mapped concurrently by
+ * an executor.
+ * The function `f` must be safe to call concurrently on different elements.
+ *
+ * \param pool Pointer to a memory pool
+ * \param exec Executor running the chunks
+ * \param arg Arbitrary argument passed through to the function f
+ * \param f Pointer to a function that does an in-place update of an element.
+ * \return Number of elements mapped across.
+ */
+s32 memory_pool_map_parallel(memory_pool_t *pool,
+                             const memory_pool_executor_t *exec, void *arg,
+                             void (*f)(void *arg, element_t *elem))
+{
+  map_task_t t = {.arg = arg, .f = f};
+  u32 n_chunks = make_chunks(pool, &t.chunks);
+  if (n_chunks > 0) {
+    exec->run(exec->arg, n_chunks, &map_task, &t);
+  }
+  return pool->n_allocated;
+}
 
+typedef struct {
+  chunking_t chunks;
+  u8 *xs;
+  size_t x_size;
+  void (*f)(void *x, element_t *elem);
+} fold_task_t;
 
+static void fold_task(void *task_arg, u32 i)
+{
+  fold_task_t *t = (fold_task_t *)task_arg;
+  void *x = &t->xs[i * t->x_size];
+  element_t *end = get_elem_n(t->chunks.pool, chunk_start(&t->chunks, i + 1));
+  for (element_t *p = get_elem_n(t->chunks.pool, chunk_start(&t->chunks, i));
+       p < end; p += t->chunks.pool->element_size) {
+    t->f(x, p);
+  }
+}
+
+/** As memory_pool_fold(), with chunks of the collection folded concurrently by
+ * an executor.
+ * Each chunk is folded into its own copy of `x0`, then the chunk accumulators
+ * are combined into `x0` in collection order, giving the same result however
+ * the chunks were scheduled. The result is that of memory_pool_fold() when
+ * `combine` is associative and `x0` is an identity of it, for example zero for
+ * a sum.
+ *
+ * The function `f` must be safe to call concurrently on different
+ * accumulators and elements.
+ *
+ * \param pool Pointer to a memory pool
+ * \param exec Executor running the chunks
+ * \param x0 Pointer to an initial accumulator state, updated with the result.
+ * \param x_size The size in bytes of the accumulator state
+ * \param f Pointer to a function that does an in-place update of an
+ *          accumulator state given an element and optionally updates that
+ *          element in-place.
+ * \param combine Pointer to a function that updates the accumulator state `x`
+ *                in-place to combine it with the state `y` of the elements
+ *                following those of `x`.
+ * \return Number of elements folded.
+ */
+s32 memory_pool_fold_parallel(memory_pool_t *pool,
+                              const memory_pool_executor_t *exec,
+                              void *x0, size_t x_size,
+                              void (*f)(void *x, element_t *elem),
+                              void (*combine)(void *x, const void *y))
+{
+  fold_task_t t = {.x_size = x_size, .f = f};
+  u32 n_chunks = make_chunks(pool, &t.chunks);
+  if (n_chunks == 0) {
+    return 0;
+  }
+
+  u8 xs[n_chunks * x_size];
+  for (u32 i=0; i<n_chunks; i++) {
+    memcpy(&xs[i * x_size], x0, x_size);
+  }
+  t.xs = xs;
+  exec->run(exec->arg, n_chunks, &fold_task, &t);
+
+  memcpy(x0, xs, x_size);
+  for (u32 i=1; i<n_chunks; i++) {
+    combine(x0, &xs[i * x_size]);
+  }
+
+  return pool->n_allocated;
+}
+
+typedef struct {
+  chunking_t chunks;
+  u32 *counts;
+  void *arg;
+  s8 (*f)(void *arg, element_t *elem);
+} filter_task_t;
+
+static void filter_task(void *task_arg, u32 i)
+{
+  filter_task_t *t = (filter_task_t *)task_arg;
+  memory_pool_t *pool = t->chunks.pool;
+  u32 start = chunk_start(&t->chunks, i);
+  u32 end = chunk_start(&t->chunks, i + 1);
+  u32 count = 0;
+
+  /* Compact the kept elements to the start of the chunk. */
+  for (u32 j=start; j<end; j++) {
+    element_t *elem = get_elem_n(pool, j);
+    if (t->f(t->arg, elem)) {
+      if (start + count != j) {
+        memcpy(get_elem_n(pool, start + count), elem, pool->element_size);
+      }
+      count++;
+    }
+  }
+  t->counts[i] = count;
+}
+
+/** As memory_pool_filter(), with chunks of the collection filtered
+ * concurrently by an executor.
+ * Each chunk is compacted on its own, then the kept elements of all the
+ * chunks are gathered, preserving their order.
+ *
+ * The function `f` must be safe to call concurrently on different elements.
+ *
+ * \param pool Pointer to a memory pool
+ * \param exec Executor running the chunks
+ * \param arg Arbitrary argument passed through to the function f
+ * \param f Pointer to a function that takes an element and returns `0` to
+ *          discard that element or `!=0` to keep that element.
+ * \return Number of elements in the filtered collection.
+ */
+s32 memory_pool_filter_parallel(memory_pool_t *pool,
+                                const memory_pool_executor_t *exec, void *arg,
+                                s8 (*f)(void *arg, element_t *elem))
+{
+  filter_task_t t = {.arg = arg, .f = f};
+  u32 n_chunks = make_chunks(pool, &t.chunks);
+  if (n_chunks == 0) {
+    return 0;
+  }
+
+  u32 counts[n_chunks];
+  t.counts = counts;
+  exec->run(exec->arg, n_chunks, &filter_task, &t);
+
+  /* Gather the kept elements at the end of the buffer, from the last chunk
+   * back, each chunk only moving up into space already vacated. */
+  u32 dest = pool->n_elements;
+  for (u32 i=n_chunks; i-- > 0;) {
+    dest -= counts[i];
+    memmove(get_elem_n(pool, dest), get_elem_n(pool, chunk_start(&t.chunks, i)),
+            counts[i] * pool->element_size);
+  }
+  pool->n_allocated = pool->n_elements - dest;
+
+  return pool->n_allocated;
+}
+
+typedef struct {
+  chunking_t chunks;
+  void *x0;
+  u32 max_xs;
+  size_t x_size;
+  s8 (*init)(void *x, element_t *elem);
+  s8 (*next)(void *x, u32 n);
+  void (*prod)(element_t *new, void *x, u32 n, element_t *elem);
+  /** Number of new elements from each chunk. */
+  u32 *counts;
+  /** Whether each chunk exceeded `max_xs` for one of its elements. */
+  u8 *exceeded;
+  /** Number of new elements from the chunks before each, once counted. */
+  u32 *offsets;
+  /** Total number of new elements, once counted. */
+  u32 total;
+} product_task_t;
+
+static void product_task(void *task_arg, u32 i)
+{
+  product_task_t *t = (product_task_t *)task_arg;
+  memory_pool_t *pool = t->chunks.pool;
+  u32 end = chunk_start(&t->chunks, i + 1);
+  u32 count = 0;
+
+  for (u32 j=chunk_start(&t->chunks, i); j<end; j++) {
+    element_t *elem = get_elem_n(pool, j);
+    u8 x_work[t->x_size];
+    memcpy(x_work, t->x0, t->x_size);
+
+    if (!t->init(x_work, elem)) {
+      continue;
+    }
+    u32 x_count = 0;
+    do {
+      if (x_count > t->max_xs) {
+        t->exceeded[i] = 1;
+        return;
+      }
+      if (t->offsets) {
+        /* New elements are placed as memory_pool_product_generator() adds
+         * them, the first made last, at the start of the buffer. */
+        element_t *new = get_elem_n(pool, t->total - 1 - t->offsets[i] - count);
+        memcpy(new, elem, pool->element_size);
+        t->prod(new, x_work, x_count, elem);
+      }
+      x_count++;
+      count++;
+    } while (t->next(x_work, x_count));
+  }
+  t->counts[i] = count;
+}
+
+/** As memory_pool_product_generator(), with chunks of the collection
+ * processed concurrently by an executor.
+ * The generator is run over every element twice, first to count the new
+ * elements and then to make them, so `init` and `next` must be deterministic.
+ * The new elements are made in the free space of the pool, in the same order
+ * as memory_pool_product_generator() would; when they don't fit alongside the
+ * original elements the product falls back to memory_pool_product_generator().
+ *
+ * The functions `init`, `next` and `prod` must be safe to call concurrently on
+ * different generator states and elements.
+ *
+ * \param pool Pointer to a memory pool
+ * \param exec Executor running the chunks
+ * \param x0 Initial generator state, copied for each element
+ * \param max_xs Maximum number of generator iterations for one element
+ * \param x_size The size in bytes of the generator state
+ * \param init Function initializing the generator state for an element,
+ *             returning `0` if it generates nothing for that element
+ * \param next Function advancing the generator state, returning `0` once done
+ * \param prod The product function
+ * \return Number of elements in the new collection, `-3` if the generator
+ *         exceeded `max_xs` iterations, leaving the collection unchanged, or
+ *         `-2` if the fallback filled the pool.
+ */
+s32 memory_pool_product_generator_parallel(memory_pool_t *pool,
+                                           const memory_pool_executor_t *exec,
+                                           void *x0, u32 max_xs, size_t x_size,
+                                           s8 (*init)(void *x, element_t *elem),
+                                           s8 (*next)(void *x, u32 n),
+                                           void (*prod)(element_t *new, void *x, u32 n, element_t *elem))
+{
+  product_task_t t = {
+    .x0 = x0, .max_xs = max_xs, .x_size = x_size,
+    .init = init, .next = next, .prod = prod,
+  };
+  u32 n_chunks = make_chunks(pool, &t.chunks);
+  if (n_chunks == 0) {
+    return 0;
+  }
+
+  u32 counts[n_chunks];
+  u8 exceeded[n_chunks];
+  u32 offsets[n_chunks];
+  memset(exceeded, 0, sizeof(exceeded));
+  t.counts = counts;
+  t.exceeded = exceeded;
+
+  /* Count the new elements. */
+  exec->run(exec->arg, n_chunks, &product_task, &t);
+  for (u32 i=0; i<n_chunks; i++) {
+    if (exceeded[i]) {
+      /* Exceded maximum number of generator iterations. */
+      return -3;
+    }
+    offsets[i] = t.total;
+    t.total += counts[i];
+  }
+
+  if (t.total > first_allocated(pool)) {
+    return memory_pool_product_generator(pool, x0, max_xs, x_size,
+                                         init, next, prod);
+  }
+
+  /* Make them, then replace the original elements with them. */
+  t.offsets = offsets;
+  exec->run(exec->arg, n_chunks, &product_task, &t);
+  memmove(get_elem_n(pool, pool->n_elements - t.total), pool->pool,
+          t.total * pool->element_size);
+  pool->n_allocated = t.total;
+
+  return t.total;
+}
+
+/** \} */
@@ -85,7 +85,7 @@ START_TEST(test_sos_innov)
   matrix_eye(2, kf.decor_obs_mtx);
   kf.decor_obs_cov[0] = 1;
   kf.decor_obs_cov[1] = 1;
-  matrix_eye(2, kf.state_cov_U);
+  matrix_eye_packed(2, kf.state_cov_U);
   kf.state_cov_D[0] = 2;
   kf.state_cov_D[1] = 3;
   kf.state_mean[0] = 1;
@@ -103,7 +103,7 @@ START_TEST(test_sos_innov)
   fail_unless(within_epsilon(get_sos_innov(&kf, obs), 1.0f/3 + 4.0f/4));
   /* Test it with a singular matrix.
      kf.state_cov = {{1,1},{1,1}} */
-  matrix_eye(2, kf.state_cov_U);
+  matrix_eye_packed(2, kf.state_cov_U);
   kf.state_cov_U[1] = 1;
   kf.state_cov_D[0] = 0;
   kf.state_cov_D[1] = 1;
@@ -120,7 +120,7 @@ START_TEST(test_sos_innov_dims)
   nkf_t kf;
   kf.decor_obs_cov[0] = 1;
   kf.decor_obs_cov[1] = 1;
-  matrix_eye(2, kf.state_cov_U);
+  matrix_eye_packed(2, kf.state_cov_U);
   kf.state_cov_D[0] = 2;
   kf.state_cov_D[1] = 3;
   kf.state_mean[0] = -1;
@@ -159,7 +159,7 @@ START_TEST(test_outlier)
   matrix_eye(2, kf.decor_obs_mtx);
   kf.decor_obs_cov[0] = 1;
   kf.decor_obs_cov[1] = 1;
-  matrix_eye(2, kf.state_cov_U);
+  matrix_eye_packed(2, kf.state_cov_U);
   kf.state_cov_D[0] = 2;
   kf.state_cov_D[1] = 3;
   kf.state_mean[0] = 1;
@@ -262,7 +262,7 @@ START_TEST(test_kf_update)
     matrix_multiply(dim, dim, dim, m, mt, p);
     matrix_transpose(dim, dim, p, p2);
     fail_unless(arr_within_epsilon(dim * dim, p, p2));
-    matrix_udu(dim, p, kf.state_cov_U, kf.state_cov_D);
+    matrix_udu_packed(dim, p, kf.state_cov_U, kf.state_cov_D);
     matrix_transpose(dim, dim, p2, p);
     memcpy(kf.state_mean, state_mean, dim * sizeof(double));
     /* Compute the factored KF update */
@@ -272,7 +272,7 @@ START_TEST(test_kf_update)
     update_kf_state(&kf, R, f, g,
                      alpha, k_scalar,
                      innov);
-    matrix_reconstruct_udu(dim, kf.state_cov_U, kf.state_cov_D, p2);
+    matrix_reconstruct_udu_packed(dim, kf.state_cov_U, kf.state_cov_D, p2);
     /* Compute the simple KF update: */
     /* S = H * P * H' + R; */
     matrix_multiply(dim, dim, 1, p, h, ph);
@@ -298,6 +298,91 @@ START_TEST(test_kf_update)
 }
 END_TEST
 
+START_TEST(test_kf_matrices)
+{
+  /* Test that the structured decorrelation of the residual covariance
+   * matches the covariance computed the slow, but naive way. */
+  seed_rng();
+  double ref_ecef[3] = {-2700000, -4300000, 3850000};
+  double lambda = GPS_L1_LAMBDA_NO_VAC;
+  for (u8 num_sdiffs = 2; num_sdiffs <= MAX_CHANNELS; num_sdiffs++) {
+    sdiff_t sdiffs[num_sdiffs];
+    for (u8 i = 0; i < num_sdiffs; i++) {
+      arr_frand(3, -2.6e7, 2.6e7, sdiffs[i].sat_pos);
+    }
+    double phase_var = frand(1e-4, 1e-2);
+    double code_var = frand(1, 100);
+
+    u8 num_dds = num_sdiffs - 1;
+    u8 c_dim = CLAMP_DIFF(num_dds, 3);
+    u8 res_dim = num_dds + c_dim;
+    double Q[MAX_CHANNELS * MAX_CHANNELS];
+    double U_inv_packed[MATRIX_PACKED_SIZE(res_dim)];
+    double U_inv[res_dim * res_dim];
+    double D[res_dim];
+    double H_prime[res_dim * num_dds];
+    get_kf_matrices(num_sdiffs, sdiffs, ref_ecef, phase_var, code_var,
+                    Q, U_inv_packed, D, H_prime);
+    matrix_unpack_upper(res_dim, U_inv_packed, U_inv);
+
+    /* Sig = Q~ * Sig_v * Q~^T, see get_kf_matrices(). */
+    double Q_tilde[res_dim * 2 * num_dds];
+    double Sig_v[4 * num_dds * num_dds];
+    memset(Q_tilde, 0, sizeof(Q_tilde));
+    memset(Sig_v, 0, sizeof(Sig_v));
+    for (u8 i = 0; i < c_dim; i++) {
+      memcpy(&Q_tilde[i * 2 * num_dds], &Q[i * num_dds],
+             num_dds * sizeof(double));
+    }
+    for (u8 i = 0; i < num_dds; i++) {
+      Q_tilde[(c_dim + i) * 2 * num_dds + i] = 1;
+      Q_tilde[(c_dim + i) * 2 * num_dds + num_dds + i] = -1 / lambda;
+      for (u8 j = 0; j < num_dds; j++) {
+        Sig_v[i * 2 * num_dds + j] = phase_var * (i == j ? 2 : 1);
+        Sig_v[(num_dds + i) * 2 * num_dds + num_dds + j] =
+          code_var * (i == j ? 2 : 1);
+      }
+    }
+    double QS[res_dim * 2 * num_dds];
+    double Q_tilde_t[2 * num_dds * res_dim];
+    double Sig[res_dim * res_dim];
+    matrix_multiply(res_dim, 2 * num_dds, 2 * num_dds, Q_tilde, Sig_v, QS);
+    matrix_transpose(res_dim, 2 * num_dds, Q_tilde, Q_tilde_t);
+    matrix_multiply(res_dim, 2 * num_dds, res_dim, QS, Q_tilde_t, Sig);
+
+    /* U^-1 * Sig * U^-T == D */
+    double US[res_dim * res_dim];
+    double U_inv_t[res_dim * res_dim];
+    double USU[res_dim * res_dim];
+    matrix_multiply(res_dim, res_dim, res_dim, U_inv, Sig, US);
+    matrix_transpose(res_dim, res_dim, U_inv, U_inv_t);
+    matrix_multiply(res_dim, res_dim, res_dim, US, U_inv_t, USU);
+    for (u8 i = 0; i < res_dim; i++) {
+      for (u8 j = 0; j < res_dim; j++) {
+        double expected = i == j ? D[i] : 0;
+        fail_unless(fabs(USU[i*res_dim + j] - expected) < 1e-9 * D[i],
+                    "U^-1 Sig U^-T (%u, %u) = %g, expected %g",
+                    i, j, USU[i*res_dim + j], expected);
+      }
+    }
+    for (u8 i = 0; i < res_dim; i++) {
+      for (u8 j = 0; j < i; j++) {
+        fail_unless(U_inv[i*res_dim + j] == 0);
+      }
+      fail_unless(U_inv[i*res_dim + i] == 1);
+    }
+
+    /* H' == U^-1 * H */
+    double H[res_dim * num_dds];
+    double UH[res_dim * num_dds];
+    memcpy(H, Q, c_dim * num_dds * sizeof(double));
+    matrix_eye(num_dds, &H[c_dim * num_dds]);
+    matrix_multiply(res_dim, res_dim, num_dds, U_inv, H, UH);
+    fail_unless(arr_within_epsilon(res_dim * num_dds, UH, H_prime));
+  }
+}
+END_TEST
+
 void assign_state_rebase_mtx(const u8 num_sats, const gnss_signal_t *old_prns,
                              const gnss_signal_t *new_prns, double *rebase_mtx);
 
@@ -344,6 +429,182 @@ START_TEST(test_rebase_state)
 }
 END_TEST
 
+/* Sets the KF state covariance to A * A^T + I for a random A, returning the
+ * dense covariance. */
+static void random_state_cov(nkf_t *kf, u8 dim, double *cov)
+{
+  double A[dim * dim];
+  double M[dim * dim];
+  arr_frand(dim * dim, -1, 1, A);
+  for (u8 i=0; i<dim; i++) {
+    for (u8 j=0; j<dim; j++) {
+      cov[i*dim + j] = i == j;
+      for (u8 k=0; k<dim; k++) {
+        cov[i*dim + j] += A[i*dim + k] * A[j*dim + k];
+      }
+    }
+  }
+  memcpy(M, cov, sizeof(M));
+  kf->state_dim = dim;
+  matrix_udu_packed(dim, M, kf->state_cov_U, kf->state_cov_D);
+}
+
+static bool state_cov_matches(const nkf_t *kf, const double *cov)
+{
+  u8 dim = kf->state_dim;
+  double cov_[dim * dim];
+  matrix_reconstruct_udu_packed(dim, kf->state_cov_U, kf->state_cov_D, cov_);
+  return arr_within_epsilon(dim * dim, cov, cov_);
+}
+
+/* The factor level covariance updates should match the same operations on
+ * the dense covariance. */
+START_TEST(test_udu_state_ops)
+{
+  seed_rng();
+  u8 dim = 5;
+  double cov[dim * dim];
+  nkf_t kf;
+
+  /* Diffusion. */
+  random_state_cov(&kf, dim, cov);
+  kf.amb_drift_var = 0.3;
+  diffuse_state(&kf);
+  for (u8 i=0; i<dim; i++) {
+    cov[i*dim + i] += 0.3;
+  }
+  fail_unless(state_cov_matches(&kf, cov), "Diffused covariance differs");
+
+  /* Rebase. */
+  gnss_signal_t prns1[] = {
+    {.sat = 2}, {.sat = 1}, {.sat = 3}, {.sat = 4}, {.sat = 5}, {.sat = 6}
+  };
+  gnss_signal_t prns2[] = {
+    {.sat = 5}, {.sat = 1}, {.sat = 2}, {.sat = 3}, {.sat = 4}, {.sat = 6}
+  };
+  random_state_cov(&kf, dim, cov);
+  rebase_covariance_udu(kf.state_cov_U, kf.state_cov_D, dim + 1, prns1, prns2);
+  rebase_covariance_sigma(cov, dim + 1, prns1, prns2);
+  fail_unless(state_cov_matches(&kf, cov), "Rebased covariance differs");
+
+  /* Projection, onto states out of their original order. */
+  random_state_cov(&kf, dim, cov);
+  u8 ndx_of_new_in_old[3] = {3, 0, 2};
+  double proj_cov[3 * 3];
+  for (u8 i=0; i<3; i++) {
+    for (u8 j=0; j<3; j++) {
+      proj_cov[i*3 + j] = cov[ndx_of_new_in_old[i]*dim + ndx_of_new_in_old[j]];
+    }
+  }
+  nkf_state_projection(&kf, dim, 3, ndx_of_new_in_old);
+  kf.state_dim = 3;
+  fail_unless(state_cov_matches(&kf, proj_cov), "Projected covariance differs");
+
+  /* Inclusion, both in and out of order. */
+  u8 ndx_of_old_in_new[2][5] = {{0, 2, 3, 5, 6}, {4, 1, 2, 6, 0}};
+  double est[7] = {0};
+  for (u8 t=0; t<2; t++) {
+    random_state_cov(&kf, dim, cov);
+    double incl_cov[7 * 7];
+    memset(incl_cov, 0, sizeof(incl_cov));
+    for (u8 i=0; i<7; i++) {
+      incl_cov[i*7 + i] = 100;
+    }
+    for (u8 i=0; i<dim; i++) {
+      for (u8 j=0; j<dim; j++) {
+        incl_cov[ndx_of_old_in_new[t][i]*7 + ndx_of_old_in_new[t][j]] =
+          cov[i*dim + j];
+      }
+    }
+    nkf_state_inclusion(&kf, dim, 7, ndx_of_old_in_new[t], est, 100);
+    kf.state_dim = 7;
+    fail_unless(state_cov_matches(&kf, incl_cov),
+                "Included covariance differs");
+  }
+}
+END_TEST
+
+/* The measurement update should match a dense, sequential Kalman update of
+ * the covariance, for an observation matrix with the structure of the
+ * decorrelated one: dense constraint rows followed by upper triangular rows.
+ */
+START_TEST(test_incorporate_obs_dense)
+{
+  seed_rng();
+  for (u8 t=0; t<10; t++) {
+    u8 dim = 6;
+    u8 constraint_dim = 3;
+    nkf_t kf;
+    double P[dim * dim];
+    random_state_cov(&kf, dim, P);
+    kf.obs_dim = dim + constraint_dim;
+    kf.l_sos_avg = frand(-6, 3);
+    arr_frand(dim, -10, 10, kf.state_mean);
+    arr_frand(kf.obs_dim, 0.5, 2, kf.decor_obs_cov);
+    arr_frand(kf.obs_dim * dim, -1, 1, kf.decor_obs_mtx);
+    for (u8 i=0; i<dim; i++) {
+      for (u8 j=0; j<i; j++) {
+        kf.decor_obs_mtx[(constraint_dim + i) * dim + j] = 0;
+      }
+      kf.decor_obs_mtx[(constraint_dim + i) * dim + i] = 1;
+    }
+    double obs[kf.obs_dim];
+    arr_frand(kf.obs_dim, -10, 10, obs);
+
+    /* Dense reference, with the same outlier scaling of the gain. */
+    double sos = 0;
+    for (u8 i=0; i<kf.obs_dim; i++) {
+      const double *h = &kf.decor_obs_mtx[i * dim];
+      double hPh = 0;
+      double innov = obs[i];
+      for (u8 j=0; j<dim; j++) {
+        innov -= h[j] * kf.state_mean[j];
+        for (u8 k=0; k<dim; k++) {
+          hPh += h[j] * P[j*dim + k] * h[k];
+        }
+      }
+      sos += innov * innov / (hPh + kf.decor_obs_cov[i]);
+    }
+    fail_unless(fabs(get_sos_innov(&kf, obs) - sos) < 1e-9 * sos,
+                "Weighted SOS differs from the dense one");
+
+    nkf_t kf_copy = kf;
+    double k_scalar;
+    bool outlier = outlier_check(&kf_copy, obs, &k_scalar);
+
+    double mean[dim];
+    memcpy(mean, kf.state_mean, sizeof(mean));
+    for (u8 i=0; i<kf.obs_dim; i++) {
+      const double *h = &kf.decor_obs_mtx[i * dim];
+      double Ph[dim];
+      double alpha = kf.decor_obs_cov[i];
+      double innov = obs[i];
+      for (u8 j=0; j<dim; j++) {
+        innov -= h[j] * mean[j];
+        Ph[j] = 0;
+        for (u8 k=0; k<dim; k++) {
+          Ph[j] += P[j*dim + k] * h[k];
+        }
+        alpha += h[j] * Ph[j];
+      }
+      for (u8 j=0; j<dim; j++) {
+        mean[j] += k_scalar * Ph[j] / alpha * innov;
+        for (u8 k=0; k<dim; k++) {
+          P[j*dim + k] -= k_scalar * Ph[j] * Ph[k] / alpha;
+        }
+      }
+    }
+
+    fail_unless(incorporate_obs(&kf, obs) == outlier);
+    fail_unless(kf.l_sos_avg == kf_copy.l_sos_avg);
+    fail_unless(arr_within_epsilon(dim, kf.state_mean, mean),
+                "Updated mean differs from the dense update");
+    fail_unless(state_cov_matches(&kf, P),
+                "Updated covariance differs from the dense update");
+  }
+}
+END_TEST
+
 Suite* amb_kf_test_suite(void)
 {
   Suite *s = suite_create("Ambiguity Kalman Filter");
@@ -356,7 +617,10 @@ Suite* amb_kf_test_suite(void)
   tcase_add_test(tc_core, test_outlier_dims);
   tcase_add_test(tc_core, test_kf_update_noop);
   tcase_add_test(tc_core, test_kf_update);
+  tcase_add_test(tc_core, test_kf_matrices);
   tcase_add_test(tc_core, test_rebase_state);
+  tcase_add_test(tc_core, test_udu_state_ops);
+  tcase_add_test(tc_core, test_incorporate_obs_dense);
   suite_add_tcase(s, tc_core);
 
   return s;
@@ -0,0 +1,244 @@
+#include <math.h>
+#include <string.h>
+
+#include <check.h>
+
+#include "amb_kf.h"
+#include "amb_kf_f32.h"
+#include "ambiguity_test.h"
+#include "constants.h"
+#include "filter_utils.h"
+#include "linear_algebra.h"
+#include "check_utils.h"
+
+/* Need static methods from ambiguity_test.c */
+#include "ambiguity_test.c"
+
+#define F32_NUM_TRIALS 20
+#define F32_NUM_EPOCHS 30
+
+/* DD carrier phases and pseudoranges of a baseline `b` for the ambiguities
+ * `N`, with some noise, so that simple_amb_measurement() gives back N. */
+static void make_dd_measurements(u8 num_dds, const double *DE, const double *N,
+                                 const double b[3], double *dd_measurements)
+{
+  for (u8 i = 0; i < num_dds; i++) {
+    double range = vector_dot(3, &DE[3*i], b);
+    dd_measurements[i + num_dds] = range + frand(-3, 3);
+    dd_measurements[i] = N[i] - range / GPS_L1_LAMBDA_NO_VAC +
+                         frand(-0.05, 0.05);
+  }
+}
+
+/* Dense U D U' of a packed U. */
+static void udu_dense(u32 n, const double *U, const double *D, double *P)
+{
+  double U_dense[n * n];
+  double UD[n * n];
+  double UT[n * n];
+  matrix_unpack_upper(n, U, U_dense);
+  for (u32 i = 0; i < n; i++) {
+    for (u32 j = 0; j < n; j++) {
+      UD[i*n + j] = U_dense[i*n + j] * D[j];
+    }
+  }
+  matrix_transpose(n, n, U_dense, UT);
+  matrix_multiply(n, n, n, UD, UT, P);
+}
+
+static void random_geometry(u8 num_sdiffs, sdiff_t *sdiffs,
+                            const double ref_ecef[3], double *DE)
+{
+  for (u8 i = 0; i < num_sdiffs; i++) {
+    arr_frand(3, -2.6e7, 2.6e7, sdiffs[i].sat_pos);
+  }
+  assign_de_mtx(num_sdiffs, sdiffs, ref_ecef, DE);
+}
+
+/* Runs the double and mixed precision filters side by side on the same
+ * measurements, with ambiguities large enough that a float couldn't hold
+ * them. The means must agree to well within their standard deviations and
+ * the covariances to single precision. */
+START_TEST(test_nkf_update_f32)
+{
+  seed_rng();
+  double ref_ecef[3] = {-2700000, -4300000, 3850000};
+  for (u32 t = 0; t < F32_NUM_TRIALS; t++) {
+    u8 num_sdiffs = 4 + t % (MAX_CHANNELS - 3);
+    u8 num_dds = num_sdiffs - 1;
+    sdiff_t sdiffs[num_sdiffs];
+    double DE[num_dds * 3];
+    random_geometry(num_sdiffs, sdiffs, ref_ecef, DE);
+
+    double N[num_dds];
+    for (u8 i = 0; i < num_dds; i++) {
+      N[i] = round(frand(-1e7, 1e7));
+    }
+    double b[3];
+    arr_frand(3, -1e3, 1e3, b);
+    double dd_measurements[2 * num_dds];
+    make_dd_measurements(num_dds, DE, N, b, dd_measurements);
+
+    nkf_t kf;
+    nkf_f32_t kf_f32;
+    set_nkf(&kf, 1e-8, 2e-3, 4, 1e3, num_sdiffs, sdiffs, dd_measurements,
+            ref_ecef);
+    nkf_to_f32(&kf, &kf_f32);
+
+    for (u32 e = 0; e < F32_NUM_EPOCHS; e++) {
+      arr_frand(3, -1e3, 1e3, b);
+      make_dd_measurements(num_dds, DE, N, b, dd_measurements);
+      /* An occasional cycle slip, to exercise the outlier scaling. */
+      if (e % 10 == 9) {
+        dd_measurements[0] += 20;
+      }
+      nkf_update(&kf, dd_measurements);
+      nkf_update_f32(&kf_f32, dd_measurements);
+      fail_unless(fabs(kf.l_sos_avg - kf_f32.l_sos_avg) < 1e-3,
+                  "Outlier filters diverged: %f vs %f",
+                  kf.l_sos_avg, kf_f32.l_sos_avg);
+    }
+
+    nkf_t kf_from_f32 = kf;
+    nkf_state_from_f32(&kf_f32, &kf_from_f32);
+    fail_unless(memcmp(kf_from_f32.decor_mtx, kf.decor_mtx,
+                       sizeof(kf.decor_mtx)) == 0,
+                "Copying the state back touched the model matrices");
+    double P[num_dds * num_dds];
+    double P_f32[num_dds * num_dds];
+    udu_dense(num_dds, kf.state_cov_U, kf.state_cov_D, P);
+    udu_dense(num_dds, kf_from_f32.state_cov_U, kf_from_f32.state_cov_D,
+              P_f32);
+    for (u8 i = 0; i < num_dds; i++) {
+      double sigma_i = sqrt(P[i*num_dds + i]);
+      fail_unless(fabs(kf.state_mean[i] - kf_from_f32.state_mean[i]) <
+                  1e-3 * sigma_i,
+                  "Means differ: %f vs %f (sigma %f)", kf.state_mean[i],
+                  kf_from_f32.state_mean[i], sigma_i);
+      for (u8 j = 0; j < num_dds; j++) {
+        double scale = sigma_i * sqrt(P[j*num_dds + j]);
+        fail_unless(fabs(P[i*num_dds + j] - P_f32[i*num_dds + j]) <
+                    1e-4 * scale,
+                    "Covariances differ: %g vs %g (scale %g)",
+                    P[i*num_dds + j], P_f32[i*num_dds + j], scale);
+      }
+    }
+  }
+}
+END_TEST
+
+/* Checks the batched factored likelihood evaluation of test_ambiguities(), in
+ * single precision when built with LIBSWIFTNAV_FILTER_F32, against the
+ * double get_quadratic_term_bounded() for ambiguities a float couldn't hold. */
+START_TEST(test_quadratic_term_f32)
+{
+  seed_rng();
+  double ref_ecef[3] = {-2700000, -4300000, 3850000};
+  for (u32 t = 0; t < F32_NUM_TRIALS; t++) {
+    u8 num_sdiffs = 4 + t % (MAX_CHANNELS - 3);
+    u8 num_dds = num_sdiffs - 1;
+    sdiff_t sdiffs[num_sdiffs];
+    double DE[num_dds * 3];
+    random_geometry(num_sdiffs, sdiffs, ref_ecef, DE);
+
+    double N[num_dds];
+    for (u8 i = 0; i < num_dds; i++) {
+      N[i] = round(frand(-1e7, 1e7));
+    }
+    double b[3];
+    arr_frand(3, -1e3, 1e3, b);
+    double dd_measurements[2 * num_dds];
+    make_dd_measurements(num_dds, DE, N, b, dd_measurements);
+
+    residual_mtxs_t res_mtxs;
+    init_residual_matrices_from_vars(&res_mtxs, num_dds, DE, 2e-3, 4);
+    double r_vec[2*MAX_CHANNELS-5];
+    assign_r_vec(&res_mtxs, num_dds, dd_measurements, r_vec);
+
+    /* Expand about a reference near, not at, the true ambiguities, as the
+     * cache reference of test_ambiguities() generally is. */
+    s32 N_ref[num_dds];
+    double N_ref_d[num_dds];
+    for (u8 i = 0; i < num_dds; i++) {
+      N_ref[i] = N[i] + round(frand(-2, 2));
+      N_ref_d[i] = N_ref[i];
+    }
+    double r_ref[2*MAX_CHANNELS-5];
+    assign_r_mean(&res_mtxs, num_dds, N_ref_d, r_ref);
+    for (u32 j = 0; j < res_mtxs.res_dim; j++) {
+      r_ref[j] = r_vec[j] - r_ref[j];
+    }
+    quad_real_t w[2*MAX_CHANNELS-5];
+    quad_real_t A[(2*MAX_CHANNELS-5)*(MAX_CHANNELS-1)];
+    factor_quadratic_expansion(&res_mtxs, num_dds, r_ref, w, A);
+
+    /* The true ambiguities and some near them, in one batch. */
+    u32 n = 10;
+    s32 hyps[n][num_dds];
+    double q[n];
+    quad_real_t D[n * num_dds];
+    double bound[n];
+    for (u32 k = 0; k < n; k++) {
+      double hyp_d[num_dds];
+      for (u8 i = 0; i < num_dds; i++) {
+        hyps[k][i] = N[i] + (k == 0 ? 0 : round(frand(-3, 3)));
+        hyp_d[i] = hyps[k][i];
+        D[k*num_dds + i] = hyps[k][i] - N_ref[i];
+      }
+      q[k] = get_quadratic_term_bounded(&res_mtxs, num_dds, hyp_d, r_vec,
+                                        INFINITY);
+      bound[k] = INFINITY;
+    }
+    u32 ndx[n];
+    double q_factored[n], c[n];
+    u32 num_evaluated = factored_quadratic_terms(res_mtxs.res_dim, num_dds,
+                                                 w, A, n, D, bound, ndx,
+                                                 q_factored, c);
+    fail_unless(num_evaluated == n, "Unbounded evaluation was cut short");
+    for (u32 k = 0; k < n; k++) {
+      fail_unless(ndx[k] == k, "Hypothesis %u out of order", k);
+      fail_unless(fabs(q[k] - q_factored[k]) < 1e-3 + 1e-5 * fabs(q[k]),
+                  "Quadratic terms differ: %f vs %f", q[k], q_factored[k]);
+    }
+
+    /* Bounding every other hypothesis cuts just those short, keeping the
+     * others in order. */
+    for (u32 k = 0; k < n; k++) {
+      for (u8 i = 0; i < num_dds; i++) {
+        D[k*num_dds + i] = hyps[k][i] - N_ref[i];
+      }
+      bound[k] = k % 2 && q[k] < 0 ? -q[k] / 2 : INFINITY;
+    }
+    num_evaluated = factored_quadratic_terms(res_mtxs.res_dim, num_dds,
+                                             w, A, n, D, bound, ndx,
+                                             q_factored, c);
+    u32 num_expected = 0;
+    for (u32 k = 0; k < n; k++) {
+      if (bound[k] < INFINITY) {
+        continue;
+      }
+      fail_unless(num_expected < num_evaluated && ndx[num_expected] == k,
+                  "Unbounded hypothesis %u not evaluated", k);
+      fail_unless(fabs(q[k] - q_factored[num_expected]) <
+                  1e-3 + 1e-5 * fabs(q[k]),
+                  "Quadratic terms differ: %f vs %f",
+                  q[k], q_factored[num_expected]);
+      num_expected++;
+    }
+    fail_unless(num_evaluated == num_expected,
+                "Bounded terms not cut short");
+  }
+}
+END_TEST
+
+Suite* amb_kf_f32_test_suite(void)
+{
+  Suite *s = suite_create("Mixed Precision Ambiguity Kalman Filter");
+
+  TCase *tc_core = tcase_create("Core");
+  tcase_add_test(tc_core, test_nkf_update_f32);
+  tcase_add_test(tc_core, test_quadratic_term_f32);
+  suite_add_tcase(s, tc_core);
+
+  return s;
+}
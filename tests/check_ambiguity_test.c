@@ -1,8 +1,10 @@
 #include <check.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 
 #include <linear_algebra.h>
+#include <amb_kf.h>
 #include <ambiguity_test.h>
 #include <printing_utils.h>
 
@@ -45,19 +47,19 @@ START_TEST(test_bad_measurements)
 
   sats_management_t float_sats = {.num_sats = 5,
                                   .sids = {{.sat = 3}, {.sat = 1}, {.sat = 2}, {.sat = 5}, {.sat = 6}}};
-  double U[16];
-  matrix_eye(4, U);
+  double U[MATRIX_PACKED_SIZE(4)];
+  matrix_eye_packed(4, U);
   double D[4] = {1, 1, 1, 1};
   double est[5] = {1, 2, 5, 6};
 
   sats_management_t amb_sats_init = {.num_sats = 5,
                                      .sids = {{.sat = 3}, {.sat = 1}, {.sat = 2}, {.sat = 4}, {.sat = 5}}};
-  hypothesis_t hyp_init = {.N = {1,2,4,5}};
+  s32 N_init[4] = {1,2,4,5};
 
   create_empty_ambiguity_test(&amb_test);
   memcpy(&amb_test.sats, &amb_sats_init, sizeof(sats_management_t));
-  hypothesis_t *hyp = (hypothesis_t *)memory_pool_add(amb_test.pool);
-  memcpy(hyp, &hyp_init, sizeof(hypothesis_t));
+  hypothesis_store_clear(amb_test.pool, 4);
+  hypothesis_store_add(amb_test.pool, N_init, 0);
   /* Test that with a good measurement, we get a projection and inclusion.
    * It should have dropped PRN 4 and include PRN 6. */
   ambiguity_update_sats(&amb_test, num_sdiffs, sdiffs, &float_sats, est, U, D, false);
@@ -70,8 +72,8 @@ START_TEST(test_bad_measurements)
   /* Reset the amb_test to what it was before ambiguity_update_sats */
   create_empty_ambiguity_test(&amb_test);
   memcpy(&amb_test.sats, &amb_sats_init, sizeof(sats_management_t));
-  hyp = (hypothesis_t *)memory_pool_add(amb_test.pool);
-  memcpy(hyp, &hyp_init, sizeof(hypothesis_t));
+  hypothesis_store_clear(amb_test.pool, 4);
+  hypothesis_store_add(amb_test.pool, N_init, 0);
   /* Test that with a bad measurement, we get (only) a projection.
    * It should have dropped PRN 4 and NOT include PRN 6. */
   ambiguity_update_sats(&amb_test, num_sdiffs, sdiffs, &float_sats, est, U, D, true);
@@ -82,11 +84,12 @@ START_TEST(test_bad_measurements)
   fail_unless(amb_test.sats.sids[3].sat == 5);
   /* And it should have dropped PRN's value from the hypothesis,
    * which should still be there and still be the only one. */
-  hyp = (hypothesis_t *) amb_test.pool->allocated_nodes_head->elem;
+  s32 N[3];
+  hypothesis_store_get(amb_test.pool, 0, N);
   fail_unless(ambiguity_test_n_hypotheses(&amb_test) == 1);
-  fail_unless(hyp->N[0] == 1);
-  fail_unless(hyp->N[1] == 2);
-  fail_unless(hyp->N[2] == 5);
+  fail_unless(N[0] == 1);
+  fail_unless(N[1] == 2);
+  fail_unless(N[2] == 5);
 }
 END_TEST
 
@@ -107,20 +110,22 @@ START_TEST(test_update_sats_rebase)
                        {.sid = {.sat = 4}, .snr = 1}};
   u8 num_sdiffs = 3;
 
-  hypothesis_t *hyp = (hypothesis_t *)memory_pool_add(amb_test.pool);
-  hyp->N[0] = 0;
-  hyp->N[1] = 1;
-  hyp->N[2] = 2;
+  s32 N_init[3] = {0, 1, 2};
+  hypothesis_store_clear(amb_test.pool, 3);
+  hypothesis_store_add(amb_test.pool, N_init, 0);
 
   sats_management_t float_sats = {.num_sats = 3};
 
   ambiguity_update_sats(&amb_test, num_sdiffs, sdiffs, &float_sats, NULL, NULL, NULL, false);
+  s32 N[3];
+  hypothesis_store_flush(amb_test.pool);
+  hypothesis_store_get(amb_test.pool, 0, N);
   fail_unless(amb_test.sats.num_sats == 3);
   fail_unless(amb_test.sats.sids[0].sat == 4);
   fail_unless(amb_test.sats.sids[1].sat == 1);
   fail_unless(amb_test.sats.sids[2].sat == 2);
-  fail_unless(hyp->N[0] == -2);
-  fail_unless(hyp->N[1] == -1);
+  fail_unless(N[0] == -2);
+  fail_unless(N[1] == -1);
 }
 END_TEST
 
@@ -139,19 +144,49 @@ START_TEST(test_ambiguity_update_reference)
                        {.sid = {.sat = 4}, .snr = 1}};
   u8 num_sdiffs = 3;
 
+  hypothesis_store_clear(amb_test.pool, amb_test.sats.num_sats-1);
   for (u32 i=0; i<3; i++) {
-    hypothesis_t *hyp = (hypothesis_t *)memory_pool_add(amb_test.pool);
-    fail_unless(hyp != 0, "Null pointer returned by memory_pool_add");
+    s32 N[amb_test.sats.num_sats-1];
     for (u8 j=0; j<amb_test.sats.num_sats-1; j++) {
-      hyp->N[j] = sizerand(5);
+      N[j] = sizerand(5);
     }
-    hyp->ll = frand(0, 1);
+    fail_unless(hypothesis_store_add(amb_test.pool, N, frand(0, 1)) >= 0,
+                "Failed to add hypothesis");
   }
 
+  s32 old_N[3][3];
+  for (u32 i=0; i<3; i++) {
+    hypothesis_store_get(amb_test.pool, i, old_N[i]);
+  }
+  gnss_signal_t old_sids[4];
+  memcpy(old_sids, amb_test.sats.sids, sizeof(old_sids));
+
   sdiff_t sdiffs_with_ref_first[4];
   ambiguity_update_reference(&amb_test, num_sdiffs, sdiffs, sdiffs_with_ref_first);
 
-  /* TODO: Check results of rebase. */
+  /* Satellite 4 has the best SNR and becomes the reference. */
+  fail_unless(amb_test.sats.sids[0].sat == 4);
+  fail_unless(amb_test.pool->remap_pending,
+              "Rebase should be deferred to the next pass over the pool");
+  hypothesis_store_flush(amb_test.pool);
+  fail_unless(amb_test.pool->num_hyps == 3);
+
+  /* The ambiguity of sat s relative to the old reference is old_N[s]
+   * (zero for the old reference itself), so relative to sat 4 it is
+   * old_N[s] - old_N[4]. */
+  for (u32 i=0; i<3; i++) {
+    s32 N[3];
+    hypothesis_store_get(amb_test.pool, i, N);
+    s32 ref_N = old_N[i][find_index_of_signal(3, old_sids[3], &old_sids[1])];
+    for (u8 j=0; j<3; j++) {
+      s8 k = find_index_of_signal(3, amb_test.sats.sids[1+j], &old_sids[1]);
+      s32 expected = (k >= 0 ? old_N[i][k] : 0) - ref_N;
+      fail_unless(N[j] == expected,
+                  "Rebased hypothesis %u differs at %u: %d vs %d",
+                  i, j, N[j], expected);
+    }
+    fail_unless(hypothesis_store_find(amb_test.pool, N) >= 0);
+  }
 }
 END_TEST
 
@@ -241,9 +276,9 @@ START_TEST(test_amb_sat_inclusion)
   double block[dim * dim];
   resize_matrix(state_dim, state_dim, dim, dim, cov_mat, block);
 
-  double u[dim * dim];
-  double d[dim * dim];
-  matrix_udu(dim, block, u, d);
+  double u[MATRIX_PACKED_SIZE(dim)];
+  double d[dim];
+  matrix_udu_packed(dim, block, u, d);
   double mean[dim];
   for (u8 i = 0; i < dim; i++) {
     mean[i] = 0;
@@ -260,26 +295,390 @@ START_TEST(test_amb_sat_inclusion)
   u16 pool_size;
   u8 flag;
 
-  pool_size = memory_pool_n_allocated(amb_test.pool);
+  pool_size = ambiguity_test_n_hypotheses(&amb_test);
   fail_unless(pool_size == 1);
 
-  /* Include. This one should succeed and add 5 sats. */
+  /* Include. The float covariance is strongly correlated, so while the box
+   * around it holds far more points than fit in the pool, the 5 sigma
+   * ellipsoid holds few enough that all the sats are added at once. */
   flag = ambiguity_sat_inclusion(&amb_test, 0, &float_sats, mean, u, d);
-  pool_size = memory_pool_n_allocated(amb_test.pool);
+  pool_size = ambiguity_test_n_hypotheses(&amb_test);
   fail_unless(flag == 1);
-  fail_unless(pool_size == 625);
+  fail_unless(pool_size > 0 && pool_size < MAX_HYPOTHESES);
+  fail_unless(amb_test.sats.num_sats == 8);
+  double zeros[7] = {0, 0, 0, 0, 0, 0, 0};
+  fail_unless(ambiguity_test_pool_contains(&amb_test, zeros),
+              "The float mean should be among the hypotheses");
+  u16 included_pool_size = pool_size;
+
+  /* Include again. There is nothing left to add. */
+  flag = ambiguity_sat_inclusion(&amb_test, 0, &float_sats, mean, u, d);
+  pool_size = ambiguity_test_n_hypotheses(&amb_test);
+  fail_unless(flag == 0);
+  fail_unless(pool_size == included_pool_size);
+}
+END_TEST
+
+START_TEST(test_amb_sat_inclusion_budget)
+{
+  /* Independent float ambiguities, sized so that the search ellipsoid of
+   * all seven is over the default budget but that of six is not. */
+  u8 dim = 7;
+  double u[MATRIX_PACKED_SIZE(dim)];
+  double d[dim];
+  double mean[dim];
+  matrix_eye_packed(dim, u);
+  for (u8 i = 0; i < dim; i++) {
+    d[i] = 0.4;
+    mean[i] = 0;
+  }
+  sats_management_t float_sats = {
+    .num_sats = dim+1,
+  };
+  for (u8 i = 0; i < dim+1; i++) {
+    float_sats.sids[i] = (gnss_signal_t){.sat = i};
+  }
+
+  ambiguity_test_t amb_test;
+  create_ambiguity_test(&amb_test);
+
+  /* Not even the first hypothesis can be expanded. */
+  amb_test.inclusion_budget = 0;
+  u8 flag = ambiguity_sat_inclusion(&amb_test, 0, &float_sats, mean, u, d);
+  fail_unless(flag == 0);
+  fail_unless(amb_test.sats.num_sats == 0);
+
+  /* Nor with a covariance small enough for the result to fit the pool. */
+  double d_small[dim];
+  for (u8 i = 0; i < dim; i++) {
+    d_small[i] = 1e-2;
+  }
+  flag = ambiguity_sat_inclusion(&amb_test, 0, &float_sats, mean, u, d_small);
+  fail_unless(flag == 0);
+  fail_unless(amb_test.sats.num_sats == 0);
 
-  /* Include again. This one should succeed and add 1 more sat. */
+  /* As many dds as the default budget allows. */
+  amb_test.inclusion_budget = DEFAULT_INCLUSION_BUDGET;
   flag = ambiguity_sat_inclusion(&amb_test, 0, &float_sats, mean, u, d);
-  pool_size = memory_pool_n_allocated(amb_test.pool);
   fail_unless(flag == 1);
-  fail_unless(pool_size == 945);
-
-  /* Include again. This one should fail. */
+  u8 num_sats = amb_test.sats.num_sats;
+  fail_unless(num_sats > 4 && num_sats < dim+1,
+              "Expected only some sats to be added, got %u", num_sats);
+  u32 pool_size = ambiguity_test_n_hypotheses(&amb_test);
+  fail_unless(pool_size > 100);
+
+  /* Expanding the whole pool is over budget, and with the probability
+   * spread out over it, nothing is added. */
+  amb_test.inclusion_budget = 100;
+  hypothesis_store_t *pool = amb_test.pool;
+  for (u32 i = 0; i < pool->num_hyps; i++) {
+    pool->ll[i] = 0;
+  }
   flag = ambiguity_sat_inclusion(&amb_test, 0, &float_sats, mean, u, d);
-  pool_size = memory_pool_n_allocated(amb_test.pool);
   fail_unless(flag == 0);
-  fail_unless(pool_size == 945);
+  fail_unless(amb_test.sats.num_sats == num_sats);
+  fail_unless(ambiguity_test_n_hypotheses(&amb_test) == pool_size);
+
+  /* Once it concentrates, the likely hypotheses are expanded. */
+  for (u32 i = 10; i < pool->num_hyps; i++) {
+    pool->ll[i] = -100;
+  }
+  flag = ambiguity_sat_inclusion(&amb_test, 0, &float_sats, mean, u, d);
+  fail_unless(flag == 1);
+  fail_unless(amb_test.sats.num_sats > num_sats);
+  pool_size = ambiguity_test_n_hypotheses(&amb_test);
+  fail_unless(pool_size > 0 && pool_size <= 100,
+              "Expected at most the budget of hypotheses, got %"PRIu32,
+              pool_size);
+}
+END_TEST
+
+/* Builds residual matrices for a random geometry and the usual DD noise
+ * model. */
+static void init_random_residual_matrices(residual_mtxs_t *res_mtxs,
+                                          u8 num_dds)
+{
+  double DE_mtx[num_dds * 3];
+  for (u8 i = 0; i < num_dds * 3; i++) {
+    DE_mtx[i] = frand(-1, 1);
+  }
+  double obs_cov[4 * num_dds * num_dds];
+  memset(obs_cov, 0, sizeof(obs_cov));
+  for (u8 i = 0; i < num_dds; i++) {
+    for (u8 j = 0; j < num_dds; j++) {
+      obs_cov[i*2*num_dds + j] = (i == j) ? 2e-4 : 1e-4;
+      obs_cov[(i+num_dds)*2*num_dds + j + num_dds] = (i == j) ? 2 : 1;
+    }
+  }
+  init_residual_matrices(res_mtxs, num_dds, DE_mtx, obs_cov);
+}
+
+/* Assure that the closed form residual covariance inverse matches the one
+ * computed from the dense DD observation covariance. */
+START_TEST(test_residual_covariance_inverse_from_vars)
+{
+  seed_rng();
+  for (u8 num_dds = 3; num_dds < MAX_CHANNELS; num_dds++) {
+    double DE_mtx[num_dds * 3];
+    arr_frand(num_dds * 3, -1, 1, DE_mtx);
+    double q[MAX_CHANNELS * MAX_CHANNELS];
+    assign_phase_obs_null_basis(num_dds, DE_mtx, q);
+
+    double phase_var = frand(1e-4, 1e-2);
+    double code_var = frand(1, 100);
+    double obs_cov[4 * num_dds * num_dds];
+    memset(obs_cov, 0, sizeof(obs_cov));
+    for (u8 i = 0; i < num_dds; i++) {
+      for (u8 j = 0; j < num_dds; j++) {
+        obs_cov[i*2*num_dds + j] = phase_var * (i == j ? 2 : 1);
+        obs_cov[(i+num_dds)*2*num_dds + j + num_dds] =
+          code_var * (i == j ? 2 : 1);
+      }
+    }
+
+    u32 res_dim = num_dds + CLAMP_DIFF(num_dds, 3);
+    double dense[res_dim * res_dim];
+    double expected[MATRIX_PACKED_SIZE(res_dim)];
+    double r_cov_inv[MATRIX_PACKED_SIZE(res_dim)];
+    assign_residual_covariance_inverse(num_dds, obs_cov, q, dense);
+    matrix_pack_upper(res_dim, dense, expected);
+    assign_residual_covariance_inverse_from_vars(num_dds, phase_var, code_var,
+                                                 q, r_cov_inv);
+    double max_elem = 0;
+    for (u32 i = 0; i < MATRIX_PACKED_SIZE(res_dim); i++) {
+      max_elem = MAX(max_elem, fabs(expected[i]));
+    }
+    for (u32 i = 0; i < MATRIX_PACKED_SIZE(res_dim); i++) {
+      fail_unless(fabs(r_cov_inv[i] - expected[i]) < 1e-9 * max_elem,
+                  "%u DDs, element %u: %g, expected %g",
+                  num_dds, i, r_cov_inv[i], expected[i]);
+    }
+  }
+}
+END_TEST
+
+/* Assure that the bounded quadratic term is exact when within the bound and
+ * otherwise lies between the exact term and the bound. */
+START_TEST(test_get_quadratic_term_bounded)
+{
+  seed_rng();
+  u8 num_dds = 6;
+  residual_mtxs_t res_mtxs;
+  init_random_residual_matrices(&res_mtxs, num_dds);
+
+  double r_vec[2 * 6];
+  for (u32 i = 0; i < res_mtxs.res_dim; i++) {
+    r_vec[i] = frand(-3, 3);
+  }
+
+  for (u32 i = 0; i < 100; i++) {
+    double hyp[6];
+    for (u8 j = 0; j < num_dds; j++) {
+      hyp[j] = rand() % 7 - 3;
+    }
+    double expected = get_quadratic_term(&res_mtxs, num_dds, hyp, r_vec);
+    double q = get_quadratic_term_bounded(&res_mtxs, num_dds, hyp, r_vec,
+                                          INFINITY);
+    fail_unless(fabs(q - expected) <= 1e-9 * MAX(1, fabs(expected)),
+                "Unbounded quadratic term %u differs: %f vs %f",
+                i, q, expected);
+
+    double bound = frand(0, 2 * fabs(expected));
+    q = get_quadratic_term_bounded(&res_mtxs, num_dds, hyp, r_vec, bound);
+    if (-expected < bound) {
+      fail_unless(fabs(q - expected) <= 1e-9 * MAX(1, fabs(expected)),
+                  "Quadratic term %u within bound %f differs: %f vs %f",
+                  i, bound, q, expected);
+    } else {
+      fail_unless(q <= -bound && q >= expected - 1e-9 * fabs(expected),
+                  "Quadratic term %u beyond bound %f: %f, exact %f",
+                  i, bound, q, expected);
+    }
+  }
+}
+END_TEST
+
+/* Assure that updating the pool from its cached quadratic terms gives the
+ * same result as evaluating each hypothesis from scratch, over several
+ * epochs sharing one set of residual matrices. */
+START_TEST(test_test_ambiguities_cached)
+{
+  seed_rng();
+  u8 num_dds = 6;
+  s32 base[6] = {100000, -50000, 7, 3000, -2, 12345};
+
+  ambiguity_test_t amb_test;
+  create_ambiguity_test(&amb_test);
+  amb_test.sats.num_sats = num_dds + 1;
+  init_random_residual_matrices(&amb_test.res_mtxs, num_dds);
+
+  u32 num_hyps = 40;
+  s32 N[40 * 6];
+  float ll[40];
+  hypothesis_store_clear(amb_test.pool, num_dds);
+  for (u32 i = 0; i < num_hyps; i++) {
+    for (u8 j = 0; j < num_dds; j++) {
+      N[i*num_dds + j] = base[j] + (i == 0 ? 0 : rand() % 3 - 1);
+    }
+    ll[i] = 0;
+    hypothesis_store_add(amb_test.pool, &N[i*num_dds], 0);
+  }
+
+  for (u8 epoch = 0; epoch < 3; epoch++) {
+    double dd_meas[2 * 6];
+    for (u8 j = 0; j < num_dds; j++) {
+      dd_meas[j] = base[j] + frand(-0.01, 0.01);
+      dd_meas[j + num_dds] = frand(-0.5, 0.5) * GPS_L1_LAMBDA_NO_VAC;
+    }
+    double r_vec[2 * 6];
+    assign_r_vec(&amb_test.res_mtxs, num_dds, dd_meas, r_vec);
+
+    /* Reference update, as in test_ambiguities(). */
+    double max_ll = -1e20;
+    u8 keep[40];
+    for (u32 i = 0; i < num_hyps; i++) {
+      double hyp[6];
+      for (u8 j = 0; j < num_dds; j++) {
+        hyp[j] = N[i*num_dds + j];
+      }
+      double q = get_quadratic_term(&amb_test.res_mtxs, num_dds, hyp, r_vec);
+      ll[i] += q;
+      max_ll = MAX(max_ll, ll[i]);
+      keep[i] = fabs(q) < 20;
+    }
+    u32 k = 0;
+    for (u32 i = 0; i < num_hyps; i++) {
+      if (keep[i] && ll[i] > -90) {
+        memcpy(&N[k*num_dds], &N[i*num_dds], num_dds * sizeof(s32));
+        ll[k++] = ll[i] - max_ll;
+      }
+    }
+    num_hyps = k;
+
+    test_ambiguities(&amb_test, dd_meas);
+
+    fail_unless(amb_test.pool->num_hyps == num_hyps,
+                "Epoch %u: %u hypotheses, expected %u",
+                epoch, amb_test.pool->num_hyps, num_hyps);
+    fail_unless(amb_test.pool->cache_valid);
+    for (u32 i = 0; i < num_hyps; i++) {
+      s32 pool_N[6];
+      hypothesis_store_get(amb_test.pool, i, pool_N);
+      fail_unless(memcmp(pool_N, &N[i*num_dds], num_dds * sizeof(s32)) == 0);
+      double pool_ll = hypothesis_store_ll(amb_test.pool, i);
+      fail_unless(fabs(pool_ll - ll[i]) < 1e-3,
+                  "Epoch %u hyp %u: ll %f, expected %f",
+                  epoch, i, pool_ll, ll[i]);
+    }
+
+    /* So should the aggregates gathered during the update. */
+    u32 mle = 0;
+    double second_ll = -INFINITY;
+    double prob_sum = 0;
+    for (u32 i = 0; i < num_hyps; i++) {
+      prob_sum += exp(ll[i]);
+      if (ll[i] > ll[mle]) {
+        mle = i;
+      }
+    }
+    for (u32 i = 0; i < num_hyps; i++) {
+      if (i != mle) {
+        second_ll = MAX(second_ll, ll[i]);
+      }
+    }
+    s32 mle_N[6];
+    ambiguity_test_MLE_ambs(&amb_test, mle_N);
+    fail_unless(memcmp(mle_N, &N[mle*num_dds], num_dds * sizeof(s32)) == 0);
+    fail_unless(fabs(ambiguity_test_MLE_ratio(&amb_test) -
+                     (ll[mle] - second_ll)) < 1e-3 ||
+                (num_hyps == 1 && isinf(ambiguity_test_MLE_ratio(&amb_test))));
+    double mle_ambs[6];
+    for (u8 j = 0; j < num_dds; j++) {
+      mle_ambs[j] = mle_N[j];
+    }
+    double prob = ambiguity_test_pool_prob(&amb_test, num_dds, mle_ambs);
+    fail_unless(fabs(prob - exp(ll[mle]) / prob_sum) < 1e-4,
+                "Epoch %u: MLE probability %f, expected %f",
+                epoch, prob, exp(ll[mle]) / prob_sum);
+
+    /* The unanimity check done during the update should match a fresh one. */
+    unanimous_amb_check_t fused = amb_test.amb_check;
+    amb_test.amb_check_version--;
+    update_unanimous_ambiguities(&amb_test);
+    fail_unless(fused.num_matching_ndxs ==
+                amb_test.amb_check.num_matching_ndxs);
+    for (u8 j = 0; j < fused.num_matching_ndxs; j++) {
+      fail_unless(fused.matching_ndxs[j] == amb_test.amb_check.matching_ndxs[j]);
+      fail_unless(fused.ambs[j] == amb_test.amb_check.ambs[j]);
+    }
+  }
+  fail_unless(num_hyps > 0, "Test should keep at least the true hypothesis");
+}
+END_TEST
+
+/* A geometry change within the DE tolerance keeps the residual matrices and
+ * with them the pool's cached quadratic terms. */
+START_TEST(test_update_ambiguity_test_de_tolerance)
+{
+  seed_rng();
+  u8 num_dds = 5;
+  s32 base[5] = {100000, -50000, 7, 3000, -2};
+  double ref_ecef[3] = {-2700000, -4300000, 3850000};
+
+  ambiguity_test_t amb_test;
+  create_ambiguity_test(&amb_test);
+  amb_test.sats.num_sats = num_dds + 1;
+  sdiff_t sdiffs[6];
+  memset(sdiffs, 0, sizeof(sdiffs));
+  for (u8 i = 0; i < num_dds + 1; i++) {
+    amb_test.sats.sids[i] = (gnss_signal_t){.sat = i + 1};
+    sdiffs[i].sid = amb_test.sats.sids[i];
+    arr_frand(3, -2.6e7, 2.6e7, sdiffs[i].sat_pos);
+    sdiffs[i].carrier_phase = i == 0 ? 0 : base[i-1];
+  }
+
+  hypothesis_store_clear(amb_test.pool, num_dds);
+  hypothesis_store_add(amb_test.pool, base, 0);
+  for (u8 j = 0; j < num_dds; j++) {
+    s32 N[5];
+    memcpy(N, base, sizeof(N));
+    N[j] += 1;
+    hypothesis_store_add(amb_test.pool, N, 0);
+  }
+
+  update_ambiguity_test(ref_ecef, DEFAULT_PHASE_VAR_TEST,
+                        DEFAULT_CODE_VAR_TEST, DEFAULT_DE_TOLERANCE,
+                        &amb_test, num_dds, sdiffs, 0);
+  u32 generation = amb_test.res_mtxs.generation;
+  fail_unless(amb_test.pool->num_hyps > 0);
+  fail_unless(amb_test.pool->cache_valid &&
+              amb_test.cache_generation == generation);
+
+  /* Moving every satellite 100 m changes DE by around 1e-5. */
+  for (u8 i = 0; i < num_dds + 1; i++) {
+    for (u8 k = 0; k < 3; k++) {
+      sdiffs[i].sat_pos[k] += frand(-100 / sqrt(3), 100 / sqrt(3));
+    }
+  }
+  update_ambiguity_test(ref_ecef, DEFAULT_PHASE_VAR_TEST,
+                        DEFAULT_CODE_VAR_TEST, DEFAULT_DE_TOLERANCE,
+                        &amb_test, num_dds, sdiffs, 0);
+  fail_unless(amb_test.res_mtxs.generation == generation,
+              "Residual matrices rebuilt for a change within tolerance");
+  fail_unless(amb_test.pool->num_hyps > 0);
+  fail_unless(amb_test.pool->cache_valid &&
+              amb_test.cache_generation == generation,
+              "Cache not reused for a change within tolerance");
+
+  /* Without a tolerance the same change rebuilds them. */
+  for (u8 i = 0; i < num_dds + 1; i++) {
+    sdiffs[i].sat_pos[0] += 100;
+  }
+  update_ambiguity_test(ref_ecef, DEFAULT_PHASE_VAR_TEST,
+                        DEFAULT_CODE_VAR_TEST, 0,
+                        &amb_test, num_dds, sdiffs, 0);
+  fail_unless(amb_test.res_mtxs.generation == generation + 1);
+  fail_unless(amb_test.cache_generation == generation + 1);
 }
 END_TEST
 
@@ -296,6 +695,11 @@ Suite* ambiguity_test_suite(void)
   //tcase_add_test(tc_core, test_update_sats_rebase);
   (void) test_update_sats_rebase;
   tcase_add_test(tc_core, test_amb_sat_inclusion);
+  tcase_add_test(tc_core, test_amb_sat_inclusion_budget);
+  tcase_add_test(tc_core, test_residual_covariance_inverse_from_vars);
+  tcase_add_test(tc_core, test_get_quadratic_term_bounded);
+  tcase_add_test(tc_core, test_test_ambiguities_cached);
+  tcase_add_test(tc_core, test_update_ambiguity_test_de_tolerance);
   suite_add_tcase(s, tc_core);
 
   return s;
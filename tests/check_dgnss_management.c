@@ -241,6 +241,71 @@ START_TEST(test_dgnss_baseline_1)
 }
 END_TEST
 
+START_TEST(test_dgnss_snapshot)
+{
+  sats_management.num_sats = 3;
+  sats_management.sids[0].sat = 1;
+  sats_management.sids[1].sat = 2;
+  sats_management.sids[2].sat = 3;
+  nkf.state_dim = 2;
+  nkf.state_mean[0] = 1;
+  nkf.state_mean[1] = 2;
+  matrix_eye_packed(2, nkf.state_cov_U);
+  nkf.state_cov_U[1] = 0.5;
+  nkf.state_cov_D[0] = 2;
+  nkf.state_cov_D[1] = 4;
+
+  dgnss_reset_iar();
+
+  const dgnss_snapshot_t *held = dgnss_snapshot_acquire();
+  u32 epoch = held->epoch;
+  fail_unless(held->kf_num_sats == 3);
+  fail_unless(held->kf_mean[1] == 2);
+  fail_unless(held->iar_num_sats == 0);
+  fail_unless(held->iar_num_hyps == 1);
+
+  double cov[4];
+  double cov_expected[4];
+  fail_unless(dgnss_snapshot_kf_cov(held, cov) == 2);
+  matrix_reconstruct_udu_packed(2, nkf.state_cov_U, nkf.state_cov_D, cov_expected);
+  fail_unless(arr_within_epsilon(4, cov, cov_expected));
+
+  /* Publishing more epochs than there are buffers must leave the held
+   * snapshot untouched. */
+  nkf.state_mean[1] = 5;
+  for (u8 i = 0; i < 2 * DGNSS_SNAPSHOT_SLOTS; i++) {
+    dgnss_reset_iar();
+  }
+  fail_unless(held->epoch == epoch);
+  fail_unless(held->kf_mean[1] == 2);
+
+  dgnss_snapshot_t latest;
+  dgnss_snapshot_read(&latest);
+  fail_unless(latest.epoch == epoch + 2 * DGNSS_SNAPSHOT_SLOTS);
+  fail_unless(latest.kf_mean[1] == 5);
+
+  /* With every buffer held, publishing is skipped rather than blocking. */
+  const dgnss_snapshot_t *others[DGNSS_SNAPSHOT_SLOTS - 1];
+  others[0] = dgnss_snapshot_acquire();
+  others[1] = dgnss_snapshot_acquire();
+  dgnss_reset_iar();
+  others[2] = dgnss_snapshot_acquire();
+  epoch = others[2]->epoch;
+  dgnss_reset_iar();
+  dgnss_reset_iar();
+  dgnss_snapshot_read(&latest);
+  fail_unless(latest.epoch == epoch + 1);
+
+  dgnss_snapshot_release(held);
+  for (u8 i = 0; i < DGNSS_SNAPSHOT_SLOTS - 1; i++) {
+    dgnss_snapshot_release(others[i]);
+  }
+  dgnss_reset_iar();
+  dgnss_snapshot_read(&latest);
+  fail_unless(latest.epoch == epoch + 2);
+}
+END_TEST
+
 Suite* dgnss_management_test_suite(void)
 {
   Suite *s = suite_create("DGNSS Management");
@@ -250,6 +315,10 @@ Suite* dgnss_management_test_suite(void)
   tcase_add_test(tc_amb_state, test_dgnss_update_ambiguity_state_2);
   suite_add_tcase(s, tc_amb_state);
 
+  TCase *tc_snapshot = tcase_create("Snapshot");
+  tcase_add_test(tc_snapshot, test_dgnss_snapshot);
+  suite_add_tcase(s, tc_snapshot);
+
   TCase *tc_baseline = tcase_create("Baseline");
   tcase_add_checked_fixture (tc_baseline, check_dgnss_baseline_setup,
                                           check_dgnss_baseline_teardown);
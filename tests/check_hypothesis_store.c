@@ -0,0 +1,577 @@
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
+
+#include <hypothesis_store.h>
+
+#include "check_utils.h"
+
+#define TEST_MAX_HYPS 20
+
+static u8 N_buff[TEST_MAX_HYPS * HYPOTHESIS_STORE_MAX_DDS * sizeof(s32)];
+static float ll_buff[TEST_MAX_HYPS];
+static double cache_buff[TEST_MAX_HYPS];
+static u32 index_buff[32];
+static hypothesis_store_t store;
+static u8 N_scratch[sizeof(N_buff)];
+static float ll_scratch[TEST_MAX_HYPS];
+static double cache_scratch[TEST_MAX_HYPS];
+
+static void store_setup(void)
+{
+  hypothesis_store_init(&store, TEST_MAX_HYPS, N_buff, sizeof(N_buff),
+                        ll_buff, cache_buff, index_buff, 32);
+  hypothesis_store_clear(&store, 3);
+  for (s32 i = 0; i < 10; i++) {
+    s32 N[3] = {i, i % 3, -i};
+    fail_unless(hypothesis_store_add(&store, N, -i) == i);
+  }
+}
+
+START_TEST(test_add_find)
+{
+  for (s32 i = 10; i < TEST_MAX_HYPS; i++) {
+    s32 N[3] = {i, 0, 0};
+    fail_unless(hypothesis_store_add(&store, N, 0) == i);
+  }
+  s32 N[3] = {1, 2, 3};
+  fail_unless(hypothesis_store_add(&store, N, 0) == -1,
+              "Adding to a full store should fail");
+
+  s32 present[3] = {4, 1, -4};
+  s32 absent[3] = {4, 1, 4};
+  fail_unless(hypothesis_store_find(&store, present) == 4);
+  fail_unless(hypothesis_store_find(&store, absent) == -1);
+}
+END_TEST
+
+START_TEST(test_compact)
+{
+  u8 keep[10];
+  for (u32 i = 0; i < 10; i++) {
+    keep[i] = i % 2;
+    store.cache[i] = 100 + i;
+  }
+  store.cache_valid = 1;
+  fail_unless(hypothesis_store_compact(&store, keep) == 5);
+  fail_unless(store.num_hyps == 5);
+  fail_unless(store.cache_valid, "Compaction should keep the cache valid");
+  for (u32 i = 0; i < 5; i++) {
+    s32 N[3];
+    hypothesis_store_get(&store, i, N);
+    s32 orig = 2*i + 1;
+    fail_unless(N[0] == orig && N[1] == orig % 3 && N[2] == -orig,
+                "Compaction should keep the order of remaining hypotheses");
+    fail_unless(store.ll[i] == -orig);
+    fail_unless(store.cache[i] == 100 + orig,
+                "Compaction should move the cache with its hypothesis");
+  }
+
+  s32 N[3] = {0, 0, 0};
+  hypothesis_store_add(&store, N, 0);
+  fail_unless(!store.cache_valid, "Adding should invalidate the cache");
+}
+END_TEST
+
+START_TEST(test_project)
+{
+  /* Keep just the middle ambiguity, leaving three groups {0, 1, 2}. */
+  u8 ndxs[1] = {1};
+  fail_unless(hypothesis_store_project(&store, 1, ndxs) == 3);
+  fail_unless(store.num_dds == 1);
+
+  u8 seen[3] = {0, 0, 0};
+  for (u32 i = 0; i < store.num_hyps; i++) {
+    s32 k;
+    hypothesis_store_get(&store, i, &k);
+    fail_unless(k >= 0 && k < 3 && !seen[k]);
+    seen[k] = 1;
+    double expected = 0;
+    for (s32 j = k; j < 10; j += 3) {
+      expected += exp(-j);
+    }
+    fail_unless(fabs(exp(store.ll[i]) - expected) < 1e-6,
+                "Merged likelihood should be the sum of the group's");
+  }
+}
+END_TEST
+
+/* Assure that every hypothesis can be found by its ambiguities after each
+ * of the operations that rearrange the store. */
+static void check_index(void)
+{
+  for (u32 i = 0; i < store.num_hyps; i++) {
+    s32 N[HYPOTHESIS_STORE_MAX_DDS];
+    s32 found_N[HYPOTHESIS_STORE_MAX_DDS];
+    hypothesis_store_get(&store, i, N);
+    s32 ndx = hypothesis_store_find(&store, N);
+    fail_unless(ndx >= 0 && ndx <= (s32)i,
+                "Hypothesis %u not found in index (got %d)", i, ndx);
+    hypothesis_store_get(&store, ndx, found_N);
+    fail_unless(memcmp(found_N, N, store.num_dds * sizeof(s32)) == 0);
+  }
+}
+
+START_TEST(test_index)
+{
+  check_index();
+
+  u8 keep[10] = {0, 1, 1, 0, 1, 0, 1, 1, 0, 1};
+  hypothesis_store_compact(&store, keep);
+  check_index();
+  s32 removed[3] = {3, 0, -3};
+  fail_unless(hypothesis_store_find(&store, removed) == -1,
+              "Removed hypotheses should leave the index");
+
+  /* Modify rows in place, as a rebase does. */
+  for (u32 i = 0; i < store.num_hyps; i++) {
+    s32 N[3];
+    hypothesis_store_get(&store, i, N);
+    N[0] += 100;
+    fail_unless(hypothesis_store_set(&store, i, N) == 0);
+  }
+  hypothesis_store_reindex(&store);
+  check_index();
+  s32 moved[3] = {101, 1, -1};
+  fail_unless(hypothesis_store_find(&store, moved) == 0);
+
+  u8 ndxs[2] = {2, 1};
+  hypothesis_store_project(&store, 2, ndxs);
+  check_index();
+
+  /* Fill up the store, including with a duplicate. */
+  s32 first[2];
+  hypothesis_store_get(&store, 0, first);
+  hypothesis_store_add(&store, first, 0);
+  for (s32 i = 0; store.num_hyps < TEST_MAX_HYPS; i++) {
+    s32 N[2] = {i, -i};
+    hypothesis_store_add(&store, N, 0);
+  }
+  check_index();
+}
+END_TEST
+
+START_TEST(test_keep_most_likely)
+{
+  store.ll[7] = 0;
+  double total = 1;
+  for (s32 i = 0; i < 10; i++) {
+    total += i == 7 ? 0 : exp(-i);
+  }
+  fail_unless(fabs(hypothesis_store_top_prob(&store, 2) - 2 / total) < 1e-6);
+  fail_unless(hypothesis_store_top_prob(&store, 10) == 1);
+  fail_unless(hypothesis_store_top_prob(&store, 0) == 0);
+
+  u32 num_at;
+  fail_unless(hypothesis_store_most_likely_ll(&store, 2, &num_at) == 0);
+  fail_unless(num_at == 2);
+  fail_unless(hypothesis_store_most_likely_ll(&store, 3, &num_at) == -1);
+  fail_unless(num_at == 1);
+
+  hypothesis_store_keep_most_likely(&store, 3);
+  fail_unless(store.num_hyps == 3);
+  s32 expected[3] = {0, 1, 7};
+  for (u32 i = 0; i < 3; i++) {
+    s32 N[3];
+    hypothesis_store_get(&store, i, N);
+    fail_unless(N[0] == expected[i],
+                "Most likely hypotheses should be kept in order");
+    fail_unless(hypothesis_store_find(&store, N) == (s32)i);
+  }
+}
+END_TEST
+
+START_TEST(test_stats)
+{
+  /* Gathered on demand, since the fixture only added hypotheses. */
+  const hypothesis_store_stats_t *stats = hypothesis_store_stats(&store);
+  double sum = 0;
+  for (s32 i = 0; i < 10; i++) {
+    sum += exp(-i);
+  }
+  fail_unless(stats->version == store.version);
+  fail_unless(stats->mle == 0);
+  fail_unless(stats->max_ll == 0);
+  fail_unless(stats->second_ll == -1);
+  fail_unless(fabs(stats->sum - sum) < 1e-6);
+
+  /* Remapping leaves the likelihoods alone, and so the stats current. */
+  s8 src[3] = {1, 0, 2};
+  hypothesis_store_remap(&store, src, -1);
+  fail_unless(store.stats.version == store.version);
+
+  /* A pass over the likelihoods gathers them as it goes. */
+  hypothesis_store_stats_t gathered;
+  hypothesis_store_stats_reset(&gathered);
+  for (u32 i = 0; i < store.num_hyps; i++) {
+    store.ll[i] = 1000 - (i == 5 ? 0 : 1 + (float)i);
+    hypothesis_store_stats_add(&gathered, i, store.ll[i]);
+  }
+  hypothesis_store_stats_commit(&store, &gathered);
+  store.ll_offset = 1000;
+  hypothesis_store_normalize(&store);
+  stats = hypothesis_store_stats(&store);
+  fail_unless(stats->mle == 5);
+  fail_unless(stats->max_ll == 0);
+  fail_unless(stats->second_ll == -1);
+
+  /* Adding hypotheses makes them stale. */
+  s32 N[3] = {50, 0, 0};
+  hypothesis_store_add(&store, N, 3);
+  fail_unless(store.stats.version != store.version);
+  fail_unless(hypothesis_store_stats(&store)->mle == 10);
+  fail_unless(hypothesis_store_stats(&store)->second_ll == 0);
+}
+END_TEST
+
+START_TEST(test_ll_offset)
+{
+  store.ll_offset = 1000;
+  fail_unless(hypothesis_store_ll(&store, 3) == -1003);
+
+  s32 N[3] = {20, 0, 0};
+  s32 ndx = hypothesis_store_add(&store, N, -2);
+  fail_unless(hypothesis_store_ll(&store, ndx) == -2,
+              "Added likelihoods should be relative to the offset");
+
+  hypothesis_store_normalize(&store);
+  fail_unless(store.ll_offset == 0);
+  fail_unless(store.ll[3] == -1003);
+  fail_unless(store.ll[ndx] == -2);
+
+  u32 version = store.version;
+  hypothesis_store_truncate(&store, store.num_hyps);
+  fail_unless(store.version == version,
+              "Truncating nothing should leave the store unchanged");
+  hypothesis_store_truncate(&store, 5);
+  fail_unless(store.num_hyps == 5 && store.version != version);
+  fail_unless(hypothesis_store_find(&store, N) == -1);
+}
+END_TEST
+
+START_TEST(test_remap)
+{
+  /* Rebase onto the first ambiguity, then swap the last two. */
+  s8 src1[3] = {-1, 1, 2};
+  hypothesis_store_remap(&store, src1, 0);
+  fail_unless(store.remap_pending && !store.cache_valid);
+  s8 src2[3] = {0, 2, 1};
+  hypothesis_store_remap(&store, src2, -1);
+
+  hypothesis_store_flush(&store);
+  fail_unless(!store.remap_pending);
+  for (s32 i = 0; i < 10; i++) {
+    s32 N[3];
+    hypothesis_store_get(&store, i, N);
+    fail_unless(N[0] == -i && N[1] == -2*i && N[2] == i % 3 - i,
+                "Remaps should compose, got (%d, %d, %d) for %d",
+                N[0], N[1], N[2], i);
+    fail_unless(store.ll[i] == -i);
+  }
+  check_index();
+
+  /* Adding flushes any pending remap first. */
+  hypothesis_store_remap(&store, src2, -1);
+  s32 N[3] = {100, 0, 0};
+  s32 ndx = hypothesis_store_add(&store, N, 0);
+  fail_unless(!store.remap_pending);
+  s32 remapped[3];
+  hypothesis_store_get(&store, 1, remapped);
+  fail_unless(remapped[1] == 0);
+  fail_unless(hypothesis_store_find(&store, N) == ndx);
+}
+END_TEST
+
+/* Assure that every hypothesis reads back as added, whatever the encoding. */
+static void check_rows(const s32 *N, u32 num_hyps)
+{
+  fail_unless(store.num_hyps == num_hyps);
+  for (u32 i = 0; i < num_hyps; i++) {
+    s32 row[HYPOTHESIS_STORE_MAX_DDS];
+    hypothesis_store_get(&store, i, row);
+    fail_unless(memcmp(row, &N[i*store.num_dds],
+                       store.num_dds * sizeof(s32)) == 0,
+                "Hypothesis %u changed by re-encoding", i);
+  }
+  check_index();
+}
+
+START_TEST(test_widen)
+{
+  s32 N[TEST_MAX_HYPS * 3];
+  hypothesis_store_clear(&store, 3);
+  for (s32 i = 0; i < 10; i++) {
+    N[3*i] = 100000 + i;
+    N[3*i + 1] = -50000 - i;
+    N[3*i + 2] = i % 3;
+    hypothesis_store_add(&store, &N[3*i], 0);
+  }
+  fail_unless(store.width == 1,
+              "Values close to each other should take a byte each");
+  check_rows(N, 10);
+
+  s32 far[3][3] = {{100300, -50000, 0},
+                   {100000, -50000, 70000},
+                   {-100000, -50000, 0}};
+  u8 widths[3] = {2, 4, 4};
+  for (u32 i = 0; i < 3; i++) {
+    memcpy(&N[3*(10 + i)], far[i], sizeof(far[i]));
+    fail_unless(hypothesis_store_add(&store, far[i], 0) == (s32)(10 + i));
+    fail_unless(store.width == widths[i], "Expected width %u, got %u",
+                widths[i], store.width);
+    check_rows(N, 11 + i);
+  }
+
+  /* Rewriting a row in place widens too. */
+  s32 huge[3] = {0, 0, 1 << 30};
+  hypothesis_store_set(&store, 0, huge);
+  hypothesis_store_reindex(&store);
+  memcpy(N, huge, sizeof(huge));
+  check_rows(N, 13);
+
+  /* Emptying the store starts over at a byte. */
+  hypothesis_store_truncate(&store, 0);
+  hypothesis_store_add(&store, far[2], 0);
+  fail_unless(store.width == 1);
+  check_rows(far[2], 1);
+}
+END_TEST
+
+START_TEST(test_widen_full)
+{
+  /* Room for 20 hypotheses at one byte per ambiguity, but only 10 at two. */
+  static u8 small_buff[TEST_MAX_HYPS * 3];
+  hypothesis_store_init(&store, TEST_MAX_HYPS, small_buff, sizeof(small_buff),
+                        ll_buff, cache_buff, index_buff, 32);
+  hypothesis_store_clear(&store, 3);
+  s32 N[TEST_MAX_HYPS * 3];
+  for (s32 i = 0; i < 10; i++) {
+    N[3*i] = i;
+    N[3*i + 1] = -i;
+    N[3*i + 2] = 0;
+    hypothesis_store_add(&store, &N[3*i], -i);
+  }
+  fail_unless(hypothesis_store_capacity(&store) == TEST_MAX_HYPS);
+
+  s32 far[3] = {1000, 0, 0};
+  fail_unless(hypothesis_store_add(&store, far, 0) == -1,
+              "Widening beyond the buffer should fail");
+  check_rows(N, 10);
+
+  /* A rebase that still fits at one byte is deferred... */
+  s8 src[3] = {-1, 1, 2};
+  hypothesis_store_remap(&store, src, 0);
+  fail_unless(store.remap_pending);
+
+  /* ...but one that doesn't is applied straight away, dropping the least
+   * likely hypothesis to make room. */
+  hypothesis_store_clear(&store, 3);
+  for (s32 i = 0; i < 11; i++) {
+    N[3*i] = i % 2 ? 127 : -128;
+    N[3*i + 1] = i % 2 ? -128 : 127;
+    N[3*i + 2] = i;
+    hypothesis_store_add(&store, &N[3*i], -i);
+  }
+  fail_unless(store.width == 1);
+  hypothesis_store_remap(&store, src, 1);
+  fail_unless(!store.remap_pending);
+  fail_unless(store.width == 2);
+  for (s32 i = 0; i < 10; i++) {
+    s32 sub = N[3*i + 1];
+    N[3*i] = -sub;
+    N[3*i + 1] = 0;
+    N[3*i + 2] -= sub;
+  }
+  check_rows(N, 10);
+}
+END_TEST
+
+typedef struct {
+  s32 count;
+  s32 n_prods;
+} prod_state_t;
+
+static s8 prod_init(void *x, const s32 *N, float ll)
+{
+  (void) ll;
+  prod_state_t *s = (prod_state_t *)x;
+  s->count = N[1] + 1;
+  return 1;
+}
+
+static s8 prod_next(void *x, u32 n)
+{
+  prod_state_t *s = (prod_state_t *)x;
+  return (s32)n < s->count;
+}
+
+static void prod_prod(void *x, u32 n, const s32 *N, s32 *new_N)
+{
+  (void) x;
+  new_N[0] = N[0];
+  new_N[1] = N[1];
+  new_N[2] = N[2];
+  new_N[3] = n;
+}
+
+START_TEST(test_product)
+{
+  u8 keep[10] = {1, 1, 1, 1, 1, 0, 0, 0, 0, 0};
+  hypothesis_store_compact(&store, keep);
+
+  /* Hypothesis i produces (i % 3) + 1 new ones, 1+2+3+1+2 = 9. */
+  prod_state_t x0 = {0, 0};
+  s32 ret = hypothesis_store_product(&store, 4, &x0, sizeof(x0), 10,
+                                     &prod_init, &prod_next, &prod_prod,
+                                     NULL);
+  fail_unless(ret == 9);
+  fail_unless(store.num_hyps == 9);
+  fail_unless(store.num_dds == 4);
+  check_index();
+
+  u32 k = 0;
+  for (s32 i = 0; i < 5; i++) {
+    for (s32 n = 0; n <= i % 3; n++, k++) {
+      s32 N[4];
+      hypothesis_store_get(&store, k, N);
+      fail_unless(N[0] == i && N[1] == i % 3 && N[2] == -i && N[3] == n);
+      fail_unless(store.ll[k] == -i);
+    }
+  }
+}
+END_TEST
+
+START_TEST(test_product_full)
+{
+  /* 10 hypotheses producing 1+2+3+1+2+3+1+2+3+1 = 19 fits, but not once
+   * each produces 3 more. */
+  prod_state_t x0 = {0, 0};
+  s32 ret = hypothesis_store_product(&store, 4, &x0, sizeof(x0), 10,
+                                     &prod_init, &prod_next, &prod_prod,
+                                     NULL);
+  fail_unless(ret == 19);
+
+  hypothesis_store_clear(&store, 3);
+  for (s32 i = 0; i < 10; i++) {
+    s32 N[3] = {i, 5, -i};
+    hypothesis_store_add(&store, N, 0);
+  }
+  ret = hypothesis_store_product(&store, 4, &x0, sizeof(x0), 10,
+                                 &prod_init, &prod_next, &prod_prod, NULL);
+  fail_unless(ret == -2);
+  fail_unless(store.num_hyps <= TEST_MAX_HYPS);
+}
+END_TEST
+
+static double prod_score(void *x, const s32 *new_N)
+{
+  (void) x;
+  return new_N[0] * 10 + new_N[3];
+}
+
+START_TEST(test_product_rollback)
+{
+  hypothesis_store_set_scratch(&store, N_scratch, ll_scratch, cache_scratch);
+
+  /* Hypotheses (i, 5, -i) each produce 6, which don't fit. */
+  for (s32 i = 0; i < 10; i++) {
+    s32 N[3] = {i, 5, -i};
+    hypothesis_store_set(&store, i, N);
+    store.cache[i] = i;
+  }
+  hypothesis_store_reindex(&store);
+  store.cache_valid = 1;
+  u32 version = store.version;
+  prod_state_t x0 = {0, 0};
+  s32 ret = hypothesis_store_product(&store, 4, &x0, sizeof(x0), 10,
+                                     &prod_init, &prod_next, &prod_prod,
+                                     NULL);
+  fail_unless(ret == -2);
+  fail_unless(store.num_hyps == 10, "Failed product should be rolled back");
+  fail_unless(store.num_dds == 3);
+  fail_unless(store.version == version);
+  fail_unless(store.cache_valid);
+  check_index();
+  for (s32 i = 0; i < 10; i++) {
+    s32 N[3] = {i, 5, -i};
+    fail_unless(hypothesis_store_find(&store, N) == i);
+    fail_unless(store.ll[i] == -i);
+    fail_unless(store.cache[i] == i);
+  }
+
+  /* One that succeeds is built in the scratch buffers and swapped in. */
+  u8 keep[10] = {1, 1, 0, 0, 0, 0, 0, 0, 0, 0};
+  hypothesis_store_compact(&store, keep);
+  ret = hypothesis_store_product(&store, 4, &x0, sizeof(x0), 10,
+                                 &prod_init, &prod_next, &prod_prod, NULL);
+  fail_unless(ret == 12);
+  fail_unless(store.N == N_scratch && store.scratch_N == N_buff);
+  fail_unless(store.ll == ll_scratch && store.scratch_ll == ll_buff);
+  check_index();
+  for (s32 k = 0; k < 12; k++) {
+    s32 N[4];
+    hypothesis_store_get(&store, k, N);
+    fail_unless(N[0] == k / 6 && N[1] == 5 && N[3] == k % 6);
+    fail_unless(store.ll[k] == -(k / 6));
+  }
+}
+END_TEST
+
+START_TEST(test_product_bounded)
+{
+  hypothesis_store_clear(&store, 3);
+  for (s32 i = 0; i < 10; i++) {
+    s32 N[3] = {i, 5, -i};
+    hypothesis_store_add(&store, N, -i);
+  }
+
+  /* 60 hypotheses are produced, only the 20 best should be kept. */
+  prod_state_t x0 = {0, 0};
+  s32 ret = hypothesis_store_product(&store, 4, &x0, sizeof(x0), 10,
+                                     &prod_init, &prod_next, &prod_prod,
+                                     &prod_score);
+  fail_unless(ret == TEST_MAX_HYPS);
+  fail_unless(store.num_hyps == TEST_MAX_HYPS);
+  check_index();
+
+  for (s32 i = 0; i < 10; i++) {
+    for (s32 n = 0; n < 6; n++) {
+      s32 N[4] = {i, 5, -i, n};
+      s32 ndx = hypothesis_store_find(&store, N);
+      if (i * 10 + n >= 64) {
+        fail_unless(ndx >= 0, "Hypothesis (%d, %d) should be kept", i, n);
+        fail_unless(store.ll[ndx] == -i);
+      } else {
+        fail_unless(ndx < 0, "Hypothesis (%d, %d) should be dropped", i, n);
+      }
+    }
+  }
+}
+END_TEST
+
+Suite* hypothesis_store_suite(void)
+{
+  Suite *s = suite_create("Hypothesis Store");
+
+  TCase *tc_core = tcase_create("Core");
+  tcase_add_checked_fixture(tc_core, store_setup, NULL);
+  tcase_add_test(tc_core, test_add_find);
+  tcase_add_test(tc_core, test_compact);
+  tcase_add_test(tc_core, test_project);
+  tcase_add_test(tc_core, test_index);
+  tcase_add_test(tc_core, test_keep_most_likely);
+  tcase_add_test(tc_core, test_stats);
+  tcase_add_test(tc_core, test_ll_offset);
+  tcase_add_test(tc_core, test_remap);
+  tcase_add_test(tc_core, test_widen);
+  tcase_add_test(tc_core, test_widen_full);
+  tcase_add_test(tc_core, test_product);
+  tcase_add_test(tc_core, test_product_full);
+  tcase_add_test(tc_core, test_product_rollback);
+  tcase_add_test(tc_core, test_product_bounded);
+  suite_add_tcase(s, tc_core);
+
+  return s;
+}
@@ -0,0 +1,307 @@
+#include <check.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <lambda.h>
+#include <linear_algebra.h>
+
+#include "check_utils.h"
+
+#define LAMBDA_NUM 10
+
+/* Squared Mahalanobis distance of z from zs under the covariance Qz. */
+static double ellipsoid_dist(u8 n, const double *Qz_inv, const double *zs,
+                             const double *z)
+{
+  double dist = 0;
+  for (u8 i = 0; i < n; i++) {
+    for (u8 j = 0; j < n; j++) {
+      dist += (z[i] - zs[i]) * Qz_inv[i*n + j] * (z[j] - zs[j]);
+    }
+  }
+  return dist;
+}
+
+/* Assure that the enumeration yields each integer point of the ellipsoid
+ * exactly once, by comparing with a scan of its bounding box. */
+START_TEST(test_lambda_enum)
+{
+  seed_rng();
+  u8 n = 3;
+  double chi2 = 9;
+  for (u32 t = 0; t < LAMBDA_NUM; t++) {
+    /* Correlated covariance Q = A A' + I/10, symmetric so the column-major
+     * convention of lambda.c doesn't matter. */
+    double A[n * n];
+    double Q[n * n];
+    double a[n];
+    arr_frand(n * n, -1, 1, A);
+    arr_frand(n, -10, 10, a);
+    for (u8 i = 0; i < n; i++) {
+      for (u8 j = 0; j < n; j++) {
+        Q[i*n + j] = i == j ? 0.1 : 0;
+        for (u8 k = 0; k < n; k++) {
+          Q[i*n + j] += A[i*n + k] * A[j*n + k];
+        }
+      }
+    }
+
+    lambda_enum_t e;
+    double Z[n * n];
+    fail_unless(lambda_enum_init(&e, n, a, Q, chi2, Z) == 0);
+
+    /* Z is column-major, so read row-major it is Z'. */
+    double QZ[n * n];
+    double Qz[n * n];
+    double Qz_inv[n * n];
+    double ZT[n * n];
+    matrix_transpose(n, n, Z, ZT);
+    matrix_multiply(n, n, n, Q, ZT, QZ);
+    matrix_multiply(n, n, n, Z, QZ, Qz);
+    fail_unless(matrix_inverse(n, Qz, Qz_inv) == 0);
+    for (u8 i = 0; i < n; i++) {
+      double zs = 0;
+      for (u8 j = 0; j < n; j++) {
+        zs += Z[i*n + j] * a[j];
+      }
+      fail_unless(fabs(zs - e.zs[i]) < 1e-9);
+    }
+
+    u32 num_points = 0;
+    double points[1000 * 3];
+    double z[n];
+    while (lambda_enum_next(&e, z)) {
+      fail_unless(num_points < 1000, "Too many points");
+      fail_unless(ellipsoid_dist(n, Qz_inv, e.zs, z) <= chi2 + 1e-9,
+                  "Point outside the ellipsoid");
+      for (u32 k = 0; k < num_points; k++) {
+        fail_unless(memcmp(&points[k*n], z, n * sizeof(double)) != 0,
+                    "Point yielded twice");
+      }
+      memcpy(&points[num_points*n], z, n * sizeof(double));
+      num_points++;
+    }
+    fail_unless(lambda_enum_next(&e, z) == 0,
+                "Exhausted enumeration should stay exhausted");
+
+    /* Count the points by scanning the bounding box. */
+    s32 lo[3];
+    s32 hi[3];
+    for (u8 i = 0; i < n; i++) {
+      double r = sqrt(chi2 * Qz[i*n + i]);
+      lo[i] = floor(e.zs[i] - r);
+      hi[i] = ceil(e.zs[i] + r);
+    }
+    u32 expected = 0;
+    for (s32 i = lo[0]; i <= hi[0]; i++) {
+      for (s32 j = lo[1]; j <= hi[1]; j++) {
+        for (s32 k = lo[2]; k <= hi[2]; k++) {
+          double p[3] = {i, j, k};
+          expected += ellipsoid_dist(n, Qz_inv, e.zs, p) <= chi2 - 1e-9;
+        }
+      }
+    }
+    fail_unless(num_points >= expected,
+                "Enumerated %u points, expected %u", num_points, expected);
+    fail_unless(num_points <= lambda_enum_bound(&e),
+                "Enumerated %u points, bound %f",
+                num_points, lambda_enum_bound(&e));
+
+    /* A reset starts over. */
+    lambda_enum_reset(&e);
+    u32 num_again = 0;
+    while (lambda_enum_next(&e, z)) {
+      num_again++;
+    }
+    fail_unless(num_again == num_points);
+  }
+}
+END_TEST
+
+/* Assure that the bound on the number of points holds for ellipsoids thin
+ * compared to the integer grid, whose volume undercounts them. */
+START_TEST(test_lambda_enum_bound)
+{
+  seed_rng();
+  u8 n = 4;
+  double chi2 = 25;
+  u32 num_undercounts = 0;
+  for (u32 t = 0; t < 10 * LAMBDA_NUM; t++) {
+    /* A needle along v, barely wide enough to hold a single point. */
+    double v[n];
+    double Q[n * n];
+    double a[n];
+    arr_frand(n, -1, 1, v);
+    arr_frand(n, -10, 10, a);
+    double width = frand(1e-4, 1e-2);
+    for (u8 i = 0; i < n; i++) {
+      for (u8 j = 0; j < n; j++) {
+        Q[i*n + j] = v[i] * v[j] + (i == j ? width : 0);
+      }
+    }
+
+    lambda_enum_t e;
+    double Z[n * n];
+    fail_unless(lambda_enum_init(&e, n, a, Q, chi2, Z) == 0);
+    u32 num_points = 0;
+    double z[n];
+    while (lambda_enum_next(&e, z)) {
+      num_points++;
+    }
+    fail_unless(num_points <= lambda_enum_bound(&e),
+                "Enumerated %u points, bound %f",
+                num_points, lambda_enum_bound(&e));
+    num_undercounts += num_points > lambda_enum_volume(&e);
+  }
+  fail_unless(num_undercounts > 0,
+              "Expected the volume to undercount some thin ellipsoids");
+}
+END_TEST
+
+/* Random covariance Q = A A' + I/10, and a float mean. */
+static void random_problem(u8 n, double *a, double *Q)
+{
+  double A[n * n];
+  arr_frand(n * n, -2, 2, A);
+  arr_frand(n, -100, 100, a);
+  for (u8 i = 0; i < n; i++) {
+    for (u8 j = 0; j < n; j++) {
+      Q[i*n + j] = i == j ? 0.1 : 0;
+      for (u8 k = 0; k < n; k++) {
+        Q[i*n + j] += A[i*n + k] * A[j*n + k];
+      }
+    }
+  }
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+/* Assure that the fixed solutions are the m integer vectors closest to the
+ * float mean, by comparing with an enumeration of the ellipsoid through the
+ * farthest of them. */
+START_TEST(test_lambda_solution)
+{
+  seed_rng();
+  u8 m = 4;
+  for (u32 t = 0; t < LAMBDA_NUM; t++) {
+    u8 n = 2 + t % (LAMBDA_MAX_DIM - 1);
+    double a[n];
+    double Q[n * n];
+    double Q_inv[n * n];
+    random_problem(n, a, Q);
+    fail_unless(matrix_inverse(n, Q, Q_inv) == 0);
+
+    double F[n * m];
+    double s[m];
+    fail_unless(lambda_solution(n, m, a, Q, F, s) == 0);
+    for (u8 k = 0; k < m; k++) {
+      for (u8 i = 0; i < n; i++) {
+        fail_unless(F[k*n + i] == round(F[k*n + i]),
+                    "Fixed solution not integer");
+      }
+      fail_unless(fabs(ellipsoid_dist(n, Q_inv, a, &F[k*n]) - s[k]) <
+                  1e-6 * (1 + s[k]),
+                  "Fixed solution doesn't match its residual");
+      fail_unless(k == 0 || s[k - 1] <= s[k], "Residuals not sorted");
+    }
+
+    lambda_enum_t e;
+    double Z[n * n];
+    double chi2 = s[m - 1] * (1 + 1e-9) + 1e-9;
+    fail_unless(lambda_enum_init(&e, n, a, Q, chi2, Z) == 0);
+    double dists[1000];
+    u32 num_points = 0;
+    double z[n];
+    double ZT[n * n];
+    double Qz[n * n];
+    double QZ[n * n];
+    double Qz_inv[n * n];
+    matrix_transpose(n, n, Z, ZT);
+    matrix_multiply(n, n, n, Q, ZT, QZ);
+    matrix_multiply(n, n, n, Z, QZ, Qz);
+    fail_unless(matrix_inverse(n, Qz, Qz_inv) == 0);
+    while (lambda_enum_next(&e, z)) {
+      fail_unless(num_points < 1000, "Too many points");
+      dists[num_points++] = ellipsoid_dist(n, Qz_inv, e.zs, z);
+    }
+    fail_unless(num_points >= m, "Enumerated %u points, expected at least %u",
+                num_points, m);
+    qsort(dists, num_points, sizeof(double), cmp_double);
+    for (u8 k = 0; k < m; k++) {
+      fail_unless(fabs(dists[k] - s[k]) < 1e-6 * (1 + s[k]),
+                  "Missed a closer integer vector: %f < %f", dists[k], s[k]);
+    }
+  }
+
+  double a[LAMBDA_MAX_DIM + 1] = {0};
+  double Q[(LAMBDA_MAX_DIM + 1) * (LAMBDA_MAX_DIM + 1)] = {0};
+  double F[(LAMBDA_MAX_DIM + 1) * m];
+  double s[m];
+  fail_unless(lambda_solution(LAMBDA_MAX_DIM + 1, m, a, Q, F, s) != 0,
+              "Problems larger than the workspace should be rejected");
+}
+END_TEST
+
+/* Assure that a batch gives the same results as solving its problems one at a
+ * time, and reports the ones that fail. */
+START_TEST(test_lambda_solution_batch)
+{
+  seed_rng();
+  u8 n = 6;
+  u8 m = 2;
+  u32 num = 8;
+  double a[num * n];
+  double Q[num * n * n];
+  for (u32 i = 0; i < num; i++) {
+    random_problem(n, &a[i*n], &Q[i*n*n]);
+  }
+  /* Not positive definite. */
+  memset(&Q[3*n*n], 0, n * n * sizeof(double));
+  for (u8 i = 0; i < n; i++) {
+    Q[3*n*n + i*n + i] = -1;
+  }
+
+  lambda_workspace_t ws;
+  double F[num * n * m];
+  double s[num * m];
+  int info[num];
+  fail_unless(lambda_solution_batch(&ws, num, n, m, a, Q, F, s, info) == 1,
+              "Expected exactly one failed problem");
+  for (u32 i = 0; i < num; i++) {
+    double F1[n * m];
+    double s1[m];
+    int info1 = lambda_solution(n, m, &a[i*n], &Q[i*n*n], F1, s1);
+    fail_unless(info[i] == info1, "Status differs for problem %u", i);
+    fail_unless((info1 != 0) == (i == 3));
+    if (info1 == 0) {
+      fail_unless(memcmp(F1, &F[i*n*m], sizeof(F1)) == 0,
+                  "Fixed solutions differ for problem %u", i);
+      fail_unless(memcmp(s1, &s[i*m], sizeof(s1)) == 0,
+                  "Residuals differ for problem %u", i);
+    }
+  }
+
+  /* The status array is optional. */
+  fail_unless(lambda_solution_batch(&ws, num, n, m, a, Q, F, s, NULL) == 1);
+}
+END_TEST
+
+Suite* lambda_suite(void)
+{
+  Suite *s = suite_create("LAMBDA");
+
+  TCase *tc_core = tcase_create("Core");
+  tcase_add_test(tc_core, test_lambda_enum);
+  tcase_add_test(tc_core, test_lambda_enum_bound);
+  tcase_add_test(tc_core, test_lambda_solution);
+  tcase_add_test(tc_core, test_lambda_solution_batch);
+  suite_add_tcase(s, tc_core);
+
+  return s;
+}
@@ -306,6 +306,63 @@ START_TEST(test_matrix_udu_3)
 }
 END_TEST
 
+START_TEST(test_matrix_udu_packed)
+{
+  u32 n = sizerand(MSIZE_MAX);
+  double M[n][n];
+  double M_orig[n][n];
+
+  for (u32 i=0; i<n; i++) {
+    for (u32 j=0; j<=i; j++) {
+      M[i][j] = M[j][i] = mrand;
+    }
+  }
+  matrix_multiply(n, n, n, (double *)M, (double *)M, (double *)M_orig);
+  memcpy(M, M_orig, n * n * sizeof(double));
+
+  double U[n][n];
+  double D[n];
+  matrix_udu(n, (double *)M, (double *)U, D);
+
+  /* Both factorizations overwrite their input. */
+  memcpy(M, M_orig, n * n * sizeof(double));
+  double U_p[MATRIX_PACKED_SIZE(n)];
+  double D_p[n];
+  matrix_udu_packed(n, (double *)M, U_p, D_p);
+
+  /* Check the packed factors are those of the dense factorization, and
+   * that unpacking restores the zero lower triangle. */
+  double U_[n][n];
+  matrix_unpack_upper(n, U_p, (double *)U_);
+  for (u32 i=0; i<n; i++) {
+    fail_unless(D_p[i] == D[i], "D[%d] differs from the dense D", i);
+    for (u32 j=0; j<n; j++) {
+      fail_unless(U_[i][j] == U[i][j],
+        "unpacked U[%d][%d] differs from the dense U", i, j);
+    }
+  }
+  double P[MATRIX_PACKED_SIZE(n)];
+  matrix_pack_upper(n, (double *)U, P);
+  for (u32 i=0; i<n; i++) {
+    for (u32 j=i; j<n; j++) {
+      fail_unless(P[MATRIX_PACKED_NDX(n, i, j)] == U[i][j],
+        "packed element (%d, %d) misplaced", i, j);
+    }
+  }
+
+  /* Check reconstructed matrix is correct. */
+  double M_[n][n];
+  matrix_reconstruct_udu_packed(n, U_p, D_p, (double *)M_);
+  for (u32 i=0; i<n; i++) {
+    for (u32 j=0; j<n; j++) {
+      fail_unless(fabs(M_orig[i][j] - M_[i][j]) < LINALG_TOL * MATRIX_MAX,
+        "reconstructed result != original matrix, delta[%d][%d] = %f",
+        i, j, fabs(M_orig[i][j] - M_[i][j]));
+    }
+  }
+}
+END_TEST
+
 START_TEST(test_matrix_reconstruct_udu)
 {
   double U[4][4] = {
@@ -336,6 +393,113 @@ START_TEST(test_matrix_reconstruct_udu)
 }
 END_TEST
 
+/* Largest absolute element of an `n` x `m` matrix. */
+static double max_abs(u32 n, u32 m, const double *M)
+{
+  double x = 0;
+  for (u32 i=0; i<n*m; i++) {
+    x = MAX(x, fabs(M[i]));
+  }
+  return x;
+}
+
+START_TEST(test_matrix_udu_rank_one_packed)
+{
+  for (u32 t=0; t<LINALG_NUM; t++) {
+    u32 n = sizerand(MSIZE_MAX);
+    double A[n][n];
+    double M[n][n];
+    for (u32 i=0; i<n; i++) {
+      for (u32 j=0; j<n; j++) {
+        A[i][j] = mrand;
+      }
+    }
+    /* M = A A^T, symmetric positive (semi)definite. */
+    for (u32 i=0; i<n; i++) {
+      for (u32 j=0; j<n; j++) {
+        M[i][j] = 0;
+        for (u32 k=0; k<n; k++) {
+          M[i][j] += A[i][k] * A[j][k];
+        }
+      }
+    }
+
+    double U[MATRIX_PACKED_SIZE(n)];
+    double D[n];
+    double M_work[n][n];
+    memcpy(M_work, M, sizeof(M));
+    matrix_udu_packed(n, (double *)M_work, U, D);
+
+    /* Update with a vector whose trailing elements are zero. */
+    double c = frand(0, 10);
+    double a[n];
+    u32 n_nonzero = sizerand(n);
+    for (u32 i=0; i<n; i++) {
+      a[i] = i < n_nonzero ? mrand : 0;
+    }
+    for (u32 i=0; i<n; i++) {
+      for (u32 j=0; j<n; j++) {
+        M[i][j] += c * a[i] * a[j];
+      }
+    }
+    matrix_udu_rank_one_packed(n, U, D, c, a);
+
+    double M_[n][n];
+    matrix_reconstruct_udu_packed(n, U, D, (double *)M_);
+    double tol = LINALG_TOL * max_abs(n, n, (double *)M);
+    for (u32 i=0; i<n; i++) {
+      for (u32 j=0; j<n; j++) {
+        fail_unless(fabs(M[i][j] - M_[i][j]) < tol,
+          "updated result != updated matrix, delta[%d][%d] = %f",
+          i, j, fabs(M[i][j] - M_[i][j]));
+      }
+    }
+  }
+}
+END_TEST
+
+START_TEST(test_matrix_mwgs_udu_packed)
+{
+  for (u32 t=0; t<LINALG_NUM; t++) {
+    u32 n = sizerand(MSIZE_MAX);
+    u32 m = sizerand(MSIZE_MAX);
+    double W[n][m];
+    double D_W[m];
+    for (u32 k=0; k<m; k++) {
+      D_W[k] = frand(0, 10);
+      for (u32 i=0; i<n; i++) {
+        W[i][k] = mrand;
+      }
+    }
+    double M[n][n];
+    for (u32 i=0; i<n; i++) {
+      for (u32 j=0; j<n; j++) {
+        M[i][j] = 0;
+        for (u32 k=0; k<m; k++) {
+          M[i][j] += W[i][k] * D_W[k] * W[j][k];
+        }
+      }
+    }
+
+    double U[MATRIX_PACKED_SIZE(n)];
+    double D[n];
+    matrix_mwgs_udu_packed(n, m, (double *)W, D_W, U, D);
+
+    double M_[n][n];
+    matrix_reconstruct_udu_packed(n, U, D, (double *)M_);
+    double tol = LINALG_TOL * max_abs(n, n, (double *)M);
+    for (u32 i=0; i<n; i++) {
+      fail_unless(D[i] >= 0, "D[%d] is negative", i);
+      for (u32 j=0; j<n; j++) {
+        fail_unless(fabs(M[i][j] - M_[i][j]) < tol,
+          "reconstructed result != W D_W W^T, delta[%d][%d] = %f",
+          i, j, fabs(M[i][j] - M_[i][j]));
+      }
+    }
+  }
+}
+END_TEST
+
 START_TEST(test_matrix_add_sc) {
   u32 i, j, t;
 
@@ -706,6 +870,9 @@ Suite* linear_algebra_suite(void) {
   tcase_add_test(tc_core, test_matrix_udu_1);
   tcase_add_test(tc_core, test_matrix_udu_2);
   tcase_add_test(tc_core, test_matrix_udu_3);
+  tcase_add_test(tc_core, test_matrix_udu_packed);
+  tcase_add_test(tc_core, test_matrix_udu_rank_one_packed);
+  tcase_add_test(tc_core, test_matrix_mwgs_udu_packed);
   tcase_add_test(tc_core, test_matrix_add_sc);
   tcase_add_test(tc_core, test_matrix_copy);
   tcase_add_test(tc_core, test_matrix_transpose);
@@ -14,6 +14,7 @@ int main(void)
   srunner_add_suite(sr, dgnss_management_test_suite());
   srunner_add_suite(sr, baseline_test_suite());
   srunner_add_suite(sr, amb_kf_test_suite());
+  srunner_add_suite(sr, amb_kf_f32_test_suite());
   srunner_add_suite(sr, observation_test_suite());
   srunner_add_suite(sr, pvt_test_suite());
   srunner_add_suite(sr, sats_management_test_suite());
@@ -21,6 +22,8 @@ int main(void)
   srunner_add_suite(sr, rtcm3_suite());
   srunner_add_suite(sr, bits_suite());
   srunner_add_suite(sr, memory_pool_suite());
+  srunner_add_suite(sr, hypothesis_store_suite());
+  srunner_add_suite(sr, lambda_suite());
   srunner_add_suite(sr, coord_system_suite());
   srunner_add_suite(sr, linear_algebra_suite());
   srunner_add_suite(sr, filter_utils_suite());
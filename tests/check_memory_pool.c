@@ -3,6 +3,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <pthread.h>
 
 #include <memory_pool.h>
 
@@ -404,6 +405,49 @@ START_TEST(test_sort)
 }
 END_TEST
 
+typedef struct {
+  s32 key;
+  s32 seq;
+} keyed_t;
+
+s32 cmp_keys(void *arg, element_t *a_, element_t *b_)
+{
+  (void)arg;
+  keyed_t *a = (keyed_t *)a_;
+  keyed_t *b = (keyed_t *)b_;
+
+  return a->key - b->key;
+}
+
+START_TEST(test_sort_stable)
+{
+  /* Enough elements for several rounds of merging runs. */
+  memory_pool_t *test_pool_keyed = memory_pool_new(300, sizeof(keyed_t));
+
+  for (u32 i=0; i<257; i++) {
+    keyed_t *k = (keyed_t *)memory_pool_add(test_pool_keyed);
+    k->key = sizerand(8);
+    k->seq = i;
+  }
+
+  memory_pool_sort(test_pool_keyed, 0, &cmp_keys);
+
+  keyed_t ks[257];
+  fail_unless(memory_pool_to_array(test_pool_keyed, ks) == 257,
+      "Sorted length does not match");
+  for (u32 i=1; i<257; i++) {
+    fail_unless(ks[i-1].key <= ks[i].key,
+        "Output of sort operation is not sorted at %d", i);
+    /* Elements are added to the front, so equal elements keep decreasing
+     * sequence numbers. */
+    fail_unless(ks[i-1].key < ks[i].key || ks[i-1].seq > ks[i].seq,
+        "Sort operation is not stable at %d", i);
+  }
+
+  memory_pool_destroy(test_pool_keyed);
+}
+END_TEST
+
 s32 group_evens(void *arg, element_t *a_, element_t *b_)
 {
   (void)arg;
@@ -550,6 +594,99 @@ START_TEST(test_groupby_2)
 }
 END_TEST
 
+u32 hash_parity(void *arg, element_t *elem)
+{
+  (void)arg;
+  return *(s32 *)elem % 2;
+}
+
+START_TEST(test_groupby_hash_1)
+{
+  s32 xs[2];
+  s32 test_xs_reduced[2] = {110, 121};
+
+  u32 scratch[memory_pool_group_by_hash_scratch_size(
+                 memory_pool_n_allocated(test_pool_seq), 0) / sizeof(u32)];
+
+  /* Too little scratch fails without touching the collection. */
+  u32 n_before = memory_pool_n_allocated(test_pool_seq);
+  s32 n = memory_pool_group_by_hash(test_pool_seq, 0, &hash_parity,
+                                    &group_evens, 0, 0, &agg_sum_s32s,
+                                    scratch, sizeof(scratch) - 1);
+  fail_unless(n == -1, "Expected failure with too little scratch, got %d", n);
+  fail_unless(memory_pool_n_allocated(test_pool_seq) == n_before,
+      "Collection changed by failed groupby");
+
+  n = memory_pool_group_by_hash(test_pool_seq, 0, &hash_parity,
+                                &group_evens, 0, 0, &agg_sum_s32s,
+                                scratch, sizeof(scratch));
+  fail_unless(n == 2, "Reduced length does not match");
+  fail_unless(memory_pool_n_allocated(test_pool_seq) == 2,
+      "Reduced length does not match");
+
+  /* The odd group appears first, so its aggregate is last. */
+  memory_pool_to_array(test_pool_seq, xs);
+  fail_unless(memcmp(xs, test_xs_reduced, sizeof(test_xs_reduced)) == 0,
+      "Output of groupby operation does not match test data");
+}
+END_TEST
+
+/* Deliberately weak, so that groups collide in the table. */
+u32 hash_N_i(void *i_, element_t *a_)
+{
+  u8 *i = (u8 *)i_;
+  hypothesis_t *a = (hypothesis_t *)a_;
+  u32 h = 0;
+  for (u8 n=0; n<a->len; n++) {
+    if (n != *i)
+      h += a->N[n];
+  }
+  return h;
+}
+
+START_TEST(test_groupby_hash_2)
+{
+  /* Group identical pools by sorting and by hashing, both should give the
+   * same aggregates. */
+  memory_pool_t *pools[2];
+  for (u32 k=0; k<2; k++) {
+    pools[k] = memory_pool_new(200, sizeof(hypothesis_t));
+    srandom(3);
+    for (u32 i=0; i<150; i++) {
+      hypothesis_t *hyp = (hypothesis_t *)memory_pool_add(pools[k]);
+      memset(hyp, 0, sizeof(hypothesis_t));
+      hyp->len = 4;
+      for (u8 j=0; j<hyp->len; j++) {
+        hyp->N[j] = sizerand(3);
+      }
+      hyp->p = frand(0, 1);
+    }
+  }
+
+  u8 col = 2;
+  memory_pool_group_by(pools[0], &col, &group_by_N_i, &col, 1, &agg_sum_p);
+  u32 scratch[memory_pool_group_by_hash_scratch_size(
+                 memory_pool_n_elements(pools[1]), 1) / sizeof(u32)];
+  s32 n = memory_pool_group_by_hash(pools[1], &col, &hash_N_i, &group_by_N_i,
+                                    &col, 1, &agg_sum_p,
+                                    scratch, sizeof(scratch));
+  fail_unless(n == memory_pool_n_allocated(pools[0]),
+      "Reduced length does not match");
+  fail_unless(n == 27, "Expected all 27 groups, got %d", n);
+
+  /* Order both the same way to compare. */
+  u8 no_col = 255;
+  hypothesis_t hyps[2][27];
+  for (u32 k=0; k<2; k++) {
+    memory_pool_sort(pools[k], &no_col, &group_by_N_i);
+    memory_pool_to_array(pools[k], hyps[k]);
+    memory_pool_destroy(pools[k]);
+  }
+  fail_unless(memcmp(hyps[0], hyps[1], sizeof(hyps[0])) == 0,
+      "Output of hash groupby does not match sorted groupby");
+}
+END_TEST
+
 void prod_N(element_t *new_, void *x_, u32 n_xs, u32 n, element_t *elem_)
 {
   (void)n;
@@ -601,6 +738,43 @@ START_TEST(test_prod)
 }
 END_TEST
 
+void prod_s32(element_t *new_, void *x_, u32 n_xs, u32 n, element_t *elem_)
+{
+  (void)n_xs; (void)n;
+  *(s32 *)new_ = *(s32 *)elem_ * 10 + *(u8 *)x_;
+}
+
+START_TEST(test_prod_full)
+{
+  /* Products reuse the space of the elements they consume, so one filling
+   * the pool exactly fits. */
+  memory_pool_t *test_pool_small = memory_pool_new(20, sizeof(s32));
+
+  for (u32 i=0; i<10; i++) {
+    *(s32 *)memory_pool_add(test_pool_small) = i;
+  }
+
+  u8 digits[2] = {1, 2};
+  s32 n = memory_pool_product(test_pool_small, digits, 2, sizeof(u8), &prod_s32);
+  fail_unless(n == 20, "Product length does not match, got %d", n);
+
+  s32 xs[20];
+  s32 test_xs[20] = {
+    2, 1, 12, 11, 22, 21, 32, 31, 42, 41,
+    52, 51, 62, 61, 72, 71, 82, 81, 92, 91
+  };
+  memory_pool_to_array(test_pool_small, xs);
+  fail_unless(memcmp(xs, test_xs, sizeof(xs)) == 0,
+      "Output of product operation does not match test data");
+
+  /* A further product cannot fit. */
+  n = memory_pool_product(test_pool_small, digits, 2, sizeof(u8), &prod_s32);
+  fail_unless(n == -2, "Overfull product should fail, got %d", n);
+
+  memory_pool_destroy(test_pool_small);
+}
+END_TEST
+
 typedef struct {
   u8 val;
   u8 n_vals;
@@ -673,6 +847,356 @@ START_TEST(test_prod_generator)
 }
 END_TEST
 
+/* Executor running tasks on `n_threads` threads, the caller being one of
+ * them, each taking the next task until none are left. */
+typedef struct {
+  void (*task)(void *task_arg, u32 i);
+  void *task_arg;
+  u32 n_tasks;
+  u32 next;
+} thread_tasks_t;
+
+static void *thread_worker(void *arg)
+{
+  thread_tasks_t *tasks = (thread_tasks_t *)arg;
+  u32 i;
+  while ((i = __atomic_fetch_add(&tasks->next, 1, __ATOMIC_SEQ_CST))
+         < tasks->n_tasks) {
+    tasks->task(tasks->task_arg, i);
+  }
+  return NULL;
+}
+
+static void run_threads(void *arg, u32 n_tasks,
+                        void (*task)(void *task_arg, u32 i), void *task_arg)
+{
+  u32 n_threads = *(u32 *)arg;
+  thread_tasks_t tasks = {
+    .task = task, .task_arg = task_arg, .n_tasks = n_tasks, .next = 0
+  };
+  pthread_t threads[n_threads];
+  for (u32 i=1; i<n_threads; i++) {
+    fail_unless(pthread_create(&threads[i], NULL, &thread_worker, &tasks) == 0);
+  }
+  thread_worker(&tasks);
+  for (u32 i=1; i<n_threads; i++) {
+    pthread_join(threads[i], NULL);
+  }
+}
+
+#define N_PARALLEL 1000
+
+/* Fills a pool with the same pseudo-random elements on each call. */
+static memory_pool_t *new_parallel_pool(u32 n_elements)
+{
+  memory_pool_t *pool = memory_pool_new(n_elements, sizeof(s32));
+  srandom(2);
+  for (u32 i=0; i<N_PARALLEL; i++) {
+    *(s32 *)memory_pool_add(pool) = sizerand(1000);
+  }
+  return pool;
+}
+
+void fsum_into(void *x, element_t *elem)
+{
+  *(float *)x += *(s32 *)elem * 0.1f;
+}
+
+void fsum_combine(void *x, const void *y)
+{
+  *(float *)x += *(const float *)y;
+}
+
+void min_max_combine(void *x, const void *y)
+{
+  min_max_t *mm = (min_max_t *)x;
+  const min_max_t *mm_y = (const min_max_t *)y;
+  mm->min = MIN(mm->min, mm_y->min);
+  mm->max = MAX(mm->max, mm_y->max);
+}
+
+START_TEST(test_parallel_fold)
+{
+  memory_pool_t *pool = new_parallel_pool(N_PARALLEL);
+  memory_pool_executor_t serial = {.run = &memory_pool_run_serial};
+
+  min_max_t mm = { .min = 1000, .max = -1000 };
+  memory_pool_fold(pool, &mm, &min_max_finder);
+  min_max_t mm_par = { .min = 1000, .max = -1000 };
+  s32 n = memory_pool_fold_parallel(pool, &serial, &mm_par, sizeof(mm_par),
+                                    &min_max_finder, &min_max_combine);
+  fail_unless(n == N_PARALLEL, "Folded length does not match");
+  fail_unless(mm_par.min == mm.min && mm_par.max == mm.max,
+      "Parallel fold does not match the sequential one");
+
+  /* Float sums depend on the order of addition, which must not depend on the
+   * number of threads. */
+  float sum = 0;
+  memory_pool_fold_parallel(pool, &serial, &sum, sizeof(sum),
+                            &fsum_into, &fsum_combine);
+  u32 n_threads[3] = {1, 3, 8};
+  for (u32 i=0; i<3; i++) {
+    memory_pool_executor_t exec = {.run = &run_threads, .arg = &n_threads[i]};
+    float sum_threads = 0;
+    memory_pool_fold_parallel(pool, &exec, &sum_threads, sizeof(sum_threads),
+                              &fsum_into, &fsum_combine);
+    fail_unless(sum_threads == sum,
+        "Fold on %d threads gave %f, expected %f", n_threads[i], sum_threads, sum);
+  }
+
+  memory_pool_destroy(pool);
+}
+END_TEST
+
+START_TEST(test_parallel_map_filter)
+{
+  memory_pool_t *pool = new_parallel_pool(N_PARALLEL);
+  memory_pool_t *pool_par = new_parallel_pool(N_PARALLEL);
+  u32 n_threads = 4;
+  memory_pool_executor_t exec = {.run = &run_threads, .arg = &n_threads};
+
+  memory_pool_map(pool, NULL, &times_two);
+  fail_unless(memory_pool_map_parallel(pool_par, &exec, NULL, &times_two)
+              == N_PARALLEL, "Mapped length does not match");
+
+  s32 n = memory_pool_filter(pool, NULL, &even);
+  fail_unless(n == N_PARALLEL, "All doubled elements should be even");
+  fail_unless(memory_pool_filter_parallel(pool_par, &exec, NULL, &even) == n,
+      "Filtered length does not match");
+
+  n = memory_pool_filter(pool, NULL, &less_than_12);
+  fail_unless(memory_pool_filter_parallel(pool_par, &exec, NULL,
+                                          &less_than_12) == n,
+      "Filtered length does not match");
+  fail_unless(n > 0 && n < N_PARALLEL);
+
+  s32 xs[N_PARALLEL];
+  s32 xs_par[N_PARALLEL];
+  memory_pool_to_array(pool, xs);
+  memory_pool_to_array(pool_par, xs_par);
+  fail_unless(memcmp(xs, xs_par, n * sizeof(s32)) == 0,
+      "Output of parallel filter operation does not match sequential one");
+
+  memory_pool_destroy(pool);
+  memory_pool_destroy(pool_par);
+}
+END_TEST
+
+s8 test_init_s32(void *x_, element_t *elem)
+{
+  test_gen_state_t *x = (test_gen_state_t *)x_;
+  x->n_vals = *(s32 *)elem % 4;
+  return x->n_vals > 0;
+}
+
+void prod_s32_gen(element_t *new_, void *x_, u32 n, element_t *elem_)
+{
+  (void)n;
+  test_gen_state_t *x = (test_gen_state_t *)x_;
+  *(s32 *)new_ = *(s32 *)elem_ * 10 + x->val;
+}
+
+START_TEST(test_parallel_prod_generator)
+{
+  u32 n_threads = 3;
+  memory_pool_executor_t exec = {.run = &run_threads, .arg = &n_threads};
+  test_gen_state_t test_gen_state = {
+    .val = 0,
+    .n_vals = 0,
+    .i = 0
+  };
+
+  /* With room for both the original and the new elements, and without so
+   * that it falls back to the sequential product. */
+  u32 sizes[2] = {4 * N_PARALLEL, 2 * N_PARALLEL};
+  for (u32 k=0; k<2; k++) {
+    memory_pool_t *pool = new_parallel_pool(sizes[k]);
+    memory_pool_t *pool_par = new_parallel_pool(sizes[k]);
+
+    s32 n = memory_pool_product_generator(pool, &test_gen_state, 100,
+                                          sizeof(test_gen_state_t),
+                                          &test_init_s32, &test_next,
+                                          &prod_s32_gen);
+    fail_unless(n > N_PARALLEL, "Product should grow the collection");
+    fail_unless(memory_pool_product_generator_parallel(
+                  pool_par, &exec, &test_gen_state, 100,
+                  sizeof(test_gen_state_t),
+                  &test_init_s32, &test_next, &prod_s32_gen) == n,
+                "Product length does not match");
+
+    s32 xs[n];
+    s32 xs_par[n];
+    memory_pool_to_array(pool, xs);
+    memory_pool_to_array(pool_par, xs_par);
+    fail_unless(memcmp(xs, xs_par, sizeof(xs)) == 0,
+        "Output of parallel product does not match sequential one");
+
+    /* Exceeding the generator limit leaves the collection as it was. */
+    fail_unless(memory_pool_product_generator_parallel(
+                  pool_par, &exec, &test_gen_state, 1,
+                  sizeof(test_gen_state_t),
+                  &test_init_s32, &test_next, &prod_s32_gen) == -3);
+    fail_unless(memory_pool_n_allocated(pool_par) == n);
+
+    memory_pool_destroy(pool);
+    memory_pool_destroy(pool_par);
+  }
+}
+END_TEST
+
+START_TEST(test_resume_map_fold)
+{
+  memory_pool_t *pool = memory_pool_new(50, sizeof(s32));
+  for (u32 i = 0; i < 22; i++) {
+    *(s32 *)memory_pool_add(pool) = i;
+  }
+
+  memory_pool_cursor_t c;
+  memory_pool_cursor_init(pool, &c);
+  min_max_t mm = { .min = 1000, .max = -1000 };
+  s32 left = 22;
+  while (left > 0) {
+    s32 r = memory_pool_fold_resume(pool, &c, 5, &mm, &min_max_finder);
+    fail_unless(r == MAX(left - 5, 0), "Unexpected number remaining");
+    left = r;
+    /* Elements added in between aren't visited. */
+    *(s32 *)memory_pool_add(pool) = 100;
+  }
+  fail_unless(memory_pool_fold_resume(pool, &c, 5, &mm, &min_max_finder) == 0);
+  fail_unless(mm.min == 0 && mm.max == 21,
+      "Resumable fold does not match");
+
+  memory_pool_map(test_pool_seq, NULL, &times_two);
+  memory_pool_cursor_init(pool, &c);
+  while (memory_pool_map_resume(pool, &c, 7, NULL, &times_two) > 0);
+  s32 xs[22];
+  s32 xs_resume[50];
+  memory_pool_to_array(test_pool_seq, xs);
+  memory_pool_to_array(pool, xs_resume);
+  fail_unless(memcmp(xs, &xs_resume[5], sizeof(xs)) == 0,
+      "Output of resumable map does not match");
+
+  memory_pool_cursor_init(pool, &c);
+  fail_unless(memory_pool_map_resume(pool, &c, 7, NULL, &times_two) == 20);
+  memory_pool_clear(pool);
+  fail_unless(memory_pool_map_resume(pool, &c, 7, NULL, &times_two) == -1,
+      "Cursor should be invalid after clearing");
+
+  memory_pool_destroy(pool);
+}
+END_TEST
+
+START_TEST(test_resume_filter)
+{
+  s32 xs[22];
+  s32 test_xs_middle[9] = {
+    15, 14, 13, 12, 11, 10, 9, 8, 7
+  };
+
+  for (u32 max_elems = 1; max_elems < 25; max_elems++) {
+    memory_pool_t *pool = memory_pool_new(50, sizeof(s32));
+    for (u32 i = 0; i < 22; i++) {
+      *(s32 *)memory_pool_add(pool) = i;
+    }
+
+    memory_pool_cursor_t c;
+    memory_pool_cursor_init(pool, &c);
+    u32 n_calls = 0;
+    while (memory_pool_filter_resume(pool, &c, max_elems, NULL,
+                                     &between_15_7) > 0) {
+      n_calls++;
+    }
+    fail_unless(n_calls + 1 == (22 + max_elems - 1) / max_elems,
+        "Unexpected number of calls");
+    fail_unless(memory_pool_n_allocated(pool) == 9,
+        "Filtered length does not match");
+    memory_pool_to_array(pool, xs);
+    fail_unless(memcmp(xs, test_xs_middle, sizeof(test_xs_middle)) == 0,
+        "Output of resumable filter does not match test data");
+
+    /* A complete filter stays complete. */
+    *(s32 *)memory_pool_add(pool) = 0;
+    fail_unless(memory_pool_filter_resume(pool, &c, max_elems, NULL,
+                                          &between_15_7) == 0);
+    fail_unless(memory_pool_n_allocated(pool) == 10);
+
+    memory_pool_destroy(pool);
+  }
+}
+END_TEST
+
+typedef struct {
+  s32 key;
+  double val;
+} typed_elem_t;
+
+MEMORY_POOL_DEFINE(typed_pool, typed_elem_t)
+
+START_TEST(test_typed)
+{
+  typed_elem_t buff[30];
+  memory_pool_t pool;
+  fail_unless(typed_pool_init(&pool, 30, buff) == 0);
+
+  for (u32 i = 0; i < 30; i++) {
+    typed_elem_t *k = typed_pool_add(&pool);
+    fail_unless(k != NULL, "Null pointer returned by typed_pool_add");
+    k->key = i;
+    k->val = 0.5 * i;
+  }
+  fail_unless(typed_pool_add(&pool) == NULL, "Pool should be full");
+  fail_unless(typed_pool_end(&pool) - typed_pool_begin(&pool) == 30);
+
+  /* Newest first, as with the generic interface. */
+  s32 i = 29;
+  double sum = 0;
+  MEMORY_POOL_FOR_EACH(typed_elem_t, k, &pool) {
+    fail_unless(k->key == i--, "Elements out of order");
+    sum += k->val;
+    k->val *= 2;
+  }
+  fail_unless(i == -1);
+  fail_unless(sum == 0.5 * 29 * 30 / 2, "Inline fold does not match");
+
+  MEMORY_POOL_FILTER(typed_elem_t, k, &pool,
+                     k->key >= 7 && k->key <= 15 && k->val == k->key);
+  fail_unless(memory_pool_n_allocated(&pool) == 9,
+      "Filtered length does not match");
+  i = 15;
+  MEMORY_POOL_FOR_EACH(typed_elem_t, k, &pool) {
+    fail_unless(k->key == i--, "Filtered elements out of order");
+  }
+
+  MEMORY_POOL_FILTER(typed_elem_t, k, &pool, k->key > 100);
+  fail_unless(memory_pool_n_allocated(&pool) == 0);
+  MEMORY_POOL_FOR_EACH(typed_elem_t, k, &pool) {
+    (void)k;
+    fail_unless(0, "Empty pool should have no elements");
+  }
+}
+END_TEST
+
+START_TEST(test_typed_generic)
+{
+  s32 n = memory_pool_filter(test_pool_seq, NULL, &less_than_12);
+  MEMORY_POOL_FILTER(s32, x, test_pool_random, *x < 12);
+
+  s32 sum = 0;
+  MEMORY_POOL_FOR_EACH(s32, x, test_pool_seq) {
+    sum += *x;
+  }
+  fail_unless(sum == memory_pool_ifold(test_pool_seq, 0, &isum));
+  fail_unless(n == 12);
+
+  s32 xs[20];
+  u32 n_random = memory_pool_n_allocated(test_pool_random);
+  memory_pool_to_array(test_pool_random, xs);
+  for (u32 i = 0; i < n_random; i++) {
+    fail_unless(xs[i] < 12, "Filtered element should be less than 12");
+  }
+}
+END_TEST
+
 Suite* memory_pool_suite(void)
 {
   Suite *s = suite_create("Memory Pools");
@@ -693,10 +1217,21 @@ Suite* memory_pool_suite(void)
   tcase_add_test(tc_core, test_filter_4);
   tcase_add_test(tc_core, test_clear);
   tcase_add_test(tc_core, test_sort);
+  tcase_add_test(tc_core, test_sort_stable);
   tcase_add_test(tc_core, test_groupby_1);
   tcase_add_test(tc_core, test_groupby_2);
+  tcase_add_test(tc_core, test_groupby_hash_1);
+  tcase_add_test(tc_core, test_groupby_hash_2);
   tcase_add_test(tc_core, test_prod);
+  tcase_add_test(tc_core, test_prod_full);
   tcase_add_test(tc_core, test_prod_generator);
+  tcase_add_test(tc_core, test_parallel_fold);
+  tcase_add_test(tc_core, test_parallel_map_filter);
+  tcase_add_test(tc_core, test_parallel_prod_generator);
+  tcase_add_test(tc_core, test_resume_map_fold);
+  tcase_add_test(tc_core, test_resume_filter);
+  tcase_add_test(tc_core, test_typed);
+  tcase_add_test(tc_core, test_typed_generic);
   suite_add_tcase(s, tc_core);
 
   return s;
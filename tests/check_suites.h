@@ -4,12 +4,15 @@
 Suite* dgnss_management_test_suite(void);
 Suite* baseline_test_suite(void);
 Suite* amb_kf_test_suite(void);
+Suite* amb_kf_f32_test_suite(void);
 Suite* observation_test_suite(void);
 Suite* pvt_test_suite(void);
 Suite* coord_system_suite(void);
 Suite* rtcm3_suite(void);
 Suite* bits_suite(void);
 Suite* memory_pool_suite(void);
+Suite* hypothesis_store_suite(void);
+Suite* lambda_suite(void);
 Suite* edc_suite(void);
 Suite* linear_algebra_suite(void);
 Suite* sats_management_test_suite(void);